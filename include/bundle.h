@@ -0,0 +1,74 @@
+#ifndef PROTON_BUNDLE_H
+#define PROTON_BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * static_bundle file, written by tools/proton_pack.c and mapped read-only
+ * by mod_static. All numbers are little-endian, all offsets from the start
+ * of the file:
+ *
+ *   header | files and their gzip variants | strings | seeds | slots | entries
+ *
+ * Paths are found with a perfect hash: the path's bucket gives a seed, and
+ * the path hashed with that seed gives its slot, which holds the entry
+ * index. A path that is not in the bundle lands on some other entry's
+ * slot (or an empty one), so the path is always compared.
+ */
+
+#define PROTON_BUNDLE_MAGIC     "PRTNBNDL"
+#define PROTON_BUNDLE_VERSION   1
+#define PROTON_BUNDLE_EMPTY     UINT32_MAX  /* slot without an entry */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nentries;
+    uint32_t nbuckets;
+    uint32_t nslots;
+    uint64_t seeds;             /* uint32_t[nbuckets] */
+    uint64_t slots;             /* uint32_t[nslots] */
+    uint64_t entries;           /* proton_bundle_entry_t[nentries] */
+    uint64_t size;              /* of the whole file */
+} proton_bundle_header_t;
+
+typedef struct {
+    uint64_t path;              /* "/css/app.css", "/" for /index.html */
+    uint64_t data;
+    uint64_t data_len;
+    uint64_t gzip;
+    uint64_t gzip_len;          /* 0 without a gzip variant */
+    uint64_t headers;           /* header lines, for the file then its gzip variant */
+    uint64_t etag;              /* quoted, as in If-None-Match */
+    uint32_t path_len;
+    uint32_t headers_len;
+    uint32_t gzip_headers_len;
+    uint32_t etag_len;
+} proton_bundle_entry_t;
+
+/* FNV-1a with a seed, then the MurmurHash3 finalizer */
+static inline uint64_t proton_bundle_hash(const char *p, size_t len, uint32_t seed) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ ((uint64_t)seed * 0x9e3779b97f4a7c15ULL);
+    
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 0x100000001b3ULL;
+    }
+    
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* The header of a mapped bundle of size bytes, NULL if it is not a valid one */
+const proton_bundle_header_t* proton_bundle_check(const char *bundle, size_t size);
+
+/* The entry of a path in a checked bundle, NULL if it has none */
+const proton_bundle_entry_t* proton_bundle_lookup(const char *bundle, size_t size,
+                                                  const char *path, size_t len);
+
+#endif /* PROTON_BUNDLE_H */
@@ -0,0 +1,57 @@
+#ifndef PROTON_CIDR_H
+#define PROTON_CIDR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "proton.h"
+#include "http.h"
+
+/*
+ * Address prefix sets compiled into a Poptrie: the top PROTON_CIDR_DIRECT
+ * bits of an address index a flat array, the rest is walked 6 bits at a
+ * time through nodes whose children and leaves are packed and found with
+ * popcount. A lookup of an IPv4 address reads the array and at most three
+ * nodes. Tables are built in the master and only read afterwards, so the
+ * workers share their pages.
+ */
+
+#define PROTON_CIDR_DIRECT      14
+#define PROTON_CIDR_NONE        0xffff  /* no prefix covers the address */
+
+/* Which prefix gives an address its value when several cover it */
+#define PROTON_CIDR_FIRST       0       /* the earliest: allow / deny */
+#define PROTON_CIDR_LONGEST     1       /* the most specific, the last of equals: geo */
+
+typedef struct proton_cidr_s proton_cidr_t;
+
+/* Rules of the family (0 rules apply to both) plus AF_UNIX ones are skipped */
+proton_cidr_t* proton_cidr_build(const proton_cidr_rule_t *rules, int nrules, int family, int mode);
+void proton_cidr_destroy(proton_cidr_t *table);
+size_t proton_cidr_memory(const proton_cidr_t *table);
+
+/* addr is 4 bytes for an AF_INET table, 16 for AF_INET6 */
+uint16_t proton_cidr_lookup(const proton_cidr_t *table, const uint8_t *addr);
+
+/* "192.168.0.0/16", "2001:db8::/32" or a single address */
+int proton_cidr_parse(const char *text, proton_cidr_rule_t *rule);
+
+/* An IPv4 or IPv6 table, a value for unix: clients and one for no match */
+typedef struct {
+    proton_cidr_t *v4;
+    proton_cidr_t *v6;
+    uint16_t unix_value;
+} proton_cidr_set_t;
+
+int proton_cidr_set_build(proton_cidr_set_t *set, const proton_cidr_rule_t *rules, int nrules, int mode);
+void proton_cidr_set_destroy(proton_cidr_set_t *set);
+
+/* The client's value; IPv4-mapped IPv6 clients are looked up as IPv4 */
+uint16_t proton_cidr_set_lookup(const proton_cidr_set_t *set, proton_http_connection_t *conn);
+
+/* geo blocks, built by the access_log module; their variables are log_format's */
+int proton_geos_init(proton_config_t *config);
+void proton_geos_cleanup(void);
+int proton_geo_find(const char *name, size_t len);
+const char* proton_geo_value(int index, proton_http_connection_t *conn);
+
+#endif /* PROTON_CIDR_H */
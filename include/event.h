@@ -8,11 +8,14 @@
 #define PROTON_EVENT_WRITE  0x02
 #define PROTON_EVENT_ERROR  0x04
 #define PROTON_EVENT_CLOSE  0x08
+#define PROTON_EVENT_EXCLUSIVE 0x10   /* wake one waiter only (shared listeners) */
 
 /* Forward declarations */
 typedef struct proton_event_s proton_event_t;
 typedef struct proton_event_loop_s proton_event_loop_t;
+typedef struct proton_timer_s proton_timer_t;
 typedef int (*proton_event_handler_t)(proton_event_t *ev);
+typedef void (*proton_timer_handler_t)(proton_timer_t *timer);
 
 /* Event structure */
 struct proton_event_s {
@@ -23,11 +26,24 @@ struct proton_event_s {
     proton_event_handler_t write_handler;
 };
 
+/* One-shot timer, deadline in proton_current_msec units */
+struct proton_timer_s {
+    uint64_t deadline;
+    int index;              /* heap slot, -1 when not armed */
+    proton_timer_handler_t handler;
+    void *data;
+};
+
 /* Event loop */
 struct proton_event_loop_s {
     int epfd;
     int max_events;
     proton_event_t **events;
+    proton_timer_t **timers;    /* min-heap */
+    int ntimers;
+    int timers_cap;
+    uint64_t wake_usec;         /* when epoll_wait last returned */
+    void **module_ctx;          /* a slot per module, see module.h */
 };
 
 /* Event loop operations */
@@ -37,6 +53,13 @@ int proton_event_del(proton_event_loop_t *loop, proton_event_t *ev);
 int proton_event_process(proton_event_loop_t *loop, int timeout);
 void proton_event_loop_destroy(proton_event_loop_t *loop);
 
+/* Timers */
+void proton_timer_init(proton_timer_t *timer, proton_timer_handler_t handler, void *data);
+int proton_timer_add(proton_event_loop_t *loop, proton_timer_t *timer, uint64_t msec);
+void proton_timer_del(proton_event_loop_t *loop, proton_timer_t *timer);
+int proton_timer_next(proton_event_loop_t *loop, int timeout);
+void proton_timer_expire(proton_event_loop_t *loop);
+
 /* Event helpers */
 proton_event_t* proton_event_create(int fd);
 void proton_event_destroy(proton_event_t *ev);
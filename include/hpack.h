@@ -0,0 +1,50 @@
+#ifndef PROTON_HPACK_H
+#define PROTON_HPACK_H
+
+#include "proton.h"
+
+/* HPACK (RFC 7541) header compression for HTTP/2 */
+
+#define PROTON_HPACK_TABLE_SIZE     4096    /* default dynamic table size */
+#define PROTON_HPACK_ENTRY_OVERHEAD 32
+
+typedef struct {
+    char *name;             /* name and value share one allocation */
+    char *value;
+    size_t name_len;
+    size_t value_len;
+} proton_hpack_entry_t;
+
+/* Dynamic table, one per direction of a connection */
+typedef struct {
+    proton_hpack_entry_t *entries;      /* ring, newest at head */
+    size_t cap;
+    size_t head;
+    size_t count;
+    size_t size;            /* bytes as HPACK counts them */
+    size_t max_size;        /* current limit */
+    size_t limit;           /* largest limit allowed by SETTINGS */
+    int update_pending;     /* encoder: announce max_size in the next block */
+    size_t update_min;      /* and the smallest size before it */
+} proton_hpack_t;
+
+/* Called for every decoded header; the strings are only valid during the call */
+typedef int (*proton_hpack_emit_t)(void *data, const char *name, size_t name_len,
+                                   const char *value, size_t value_len);
+
+void proton_hpack_init(proton_hpack_t *hp, size_t limit);
+void proton_hpack_free(proton_hpack_t *hp);
+
+/* Decode a whole header block; PROTON_ERROR is a COMPRESSION_ERROR */
+int proton_hpack_decode(proton_hpack_t *hp, const unsigned char *data, size_t len,
+                        proton_hpack_emit_t emit, void *emit_data);
+
+/* Encoder: the peer changed SETTINGS_HEADER_TABLE_SIZE */
+void proton_hpack_set_limit(proton_hpack_t *hp, size_t limit);
+
+/* Start a header block, then add each header; names must be lowercase */
+int proton_hpack_encode_begin(proton_hpack_t *hp, proton_buffer_t *out);
+int proton_hpack_encode(proton_hpack_t *hp, proton_buffer_t *out, const char *name, size_t name_len,
+                        const char *value, size_t value_len);
+
+#endif /* PROTON_HPACK_H */
@@ -1,6 +1,8 @@
 #ifndef PROTON_HTTP_H
 #define PROTON_HTTP_H
 
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "proton.h"
 #include "event.h"
 
@@ -10,23 +12,53 @@
 #define HTTP_HEAD    2
 #define HTTP_PUT     3
 #define HTTP_DELETE  4
+#define HTTP_MKCOL   5
+
+/* Connection states, counted on the scoreboard */
+#define HTTP_CONN_WAITING   0
+#define HTTP_CONN_READING   1
+#define HTTP_CONN_WRITING   2
+
+/* Request line and headers larger than this get 431 */
+#define PROTON_HTTP_HEADER_MAX  16384
 
 /* HTTP versions */
 #define HTTP_VERSION_10  0
 #define HTTP_VERSION_11  1
+#define HTTP_VERSION_20  2
 
 /* HTTP status codes */
+#define HTTP_STATUS_SWITCHING_PROTOCOLS 101
 #define HTTP_STATUS_OK                  200
+#define HTTP_STATUS_CREATED             201
+#define HTTP_STATUS_NO_CONTENT          204
+#define HTTP_STATUS_NOT_MODIFIED        304
 #define HTTP_STATUS_BAD_REQUEST         400
+#define HTTP_STATUS_FORBIDDEN           403
 #define HTTP_STATUS_NOT_FOUND           404
+#define HTTP_STATUS_METHOD_NOT_ALLOWED  405
+#define HTTP_STATUS_CONFLICT            409
+#define HTTP_STATUS_LENGTH_REQUIRED     411
+#define HTTP_STATUS_PAYLOAD_TOO_LARGE   413
+#define HTTP_STATUS_UPGRADE_REQUIRED    426
+#define HTTP_STATUS_TOO_MANY_REQUESTS   429
+#define HTTP_STATUS_HEADER_TOO_LARGE    431
 #define HTTP_STATUS_INTERNAL_ERROR      500
 #define HTTP_STATUS_NOT_IMPLEMENTED     501
+#define HTTP_STATUS_BAD_GATEWAY         502
+#define HTTP_STATUS_SERVICE_UNAVAILABLE 503
+#define HTTP_STATUS_GATEWAY_TIMEOUT     504
+#define HTTP_STATUS_INSUFFICIENT_STORAGE 507
 
 /* Forward declarations */
 typedef struct proton_http_request_s proton_http_request_t;
 typedef struct proton_http_response_s proton_http_response_t;
 typedef struct proton_http_header_s proton_http_header_t;
 typedef struct proton_http_connection_s proton_http_connection_t;
+typedef struct proton_http2_session_s proton_http2_session_t;
+typedef struct proton_http2_stream_s proton_http2_stream_t;
+typedef struct proton_ws_s proton_ws_t;
+typedef int (*proton_http_hook_t)(proton_http_connection_t *conn);
 
 /* HTTP header */
 struct proton_http_header_s {
@@ -39,12 +71,26 @@ struct proton_http_header_s {
 struct proton_http_request_s {
     int method;
     int version;
+    char *request_line;
     char *uri;
     char *query_string;
     proton_http_header_t *headers;
+    size_t header_len;          /* bytes of read_buf up to the end of headers */
+    int64_t content_length;     /* 0 without a Content-Length */
+    int chunked;
+    int body_taken;             /* a module reads the body off the connection */
+    size_t body_end;            /* where the body ends in read_buf when taken */
     char *body;
     size_t body_len;
     proton_pool_t *pool;
+    proton_location_t *location;
+    uint64_t start_msec;
+    uint64_t start_usec;        /* latency metrics and slow_request_log */
+    uint64_t parsed_usec;
+    uint64_t arrival_usec;      /* its first byte came in; overload_shedding */
+    uint64_t handler_usec;      /* the modules produced the response */
+    int phase;                  /* where the module phases stand, for resume */
+    int phase_index;
 };
 
 /* HTTP response */
@@ -53,18 +99,58 @@ struct proton_http_response_s {
     proton_http_header_t *headers;
     proton_buffer_t *body;
     int headers_sent;
+    
+    /* Header lines formatted ahead of time, e.g. by proton-pack */
+    const char *raw_headers;
+    size_t raw_headers_len;
+    
+    /* The rest of the body, sent with sendfile after the buffer; HEAD and 304 only count it */
+    int file_fd;
+    off_t file_offset;
+    size_t file_len;
 };
 
 /* HTTP connection */
 struct proton_http_connection_s {
     int fd;
+    struct sockaddr_storage sockaddr;
+    socklen_t socklen;
     proton_event_t *event;
     proton_http_request_t *request;
     proton_http_response_t *response;
     proton_buffer_t *read_buf;
     proton_buffer_t *write_buf;
     proton_pool_t *pool;
+    size_t bytes_sent;
+    uint64_t accept_usec;
+    int requests;           /* requests completed on this connection */
     int keep_alive;
+    int state;              /* HTTP_CONN_* */
+    int readable;           /* reading stopped short of EAGAIN; no new edge will say so */
+    uint64_t read_usec;     /* arrival of the last bytes read, for pipelined requests */
+    proton_timer_t timer;   /* client_header_timeout, then keepalive_timeout */
+    
+    /* Set while a module finishes the response asynchronously */
+    proton_http_hook_t read_hook;
+    proton_http_hook_t write_hook;
+    void (*close_hook)(proton_http_connection_t *conn);
+    void *module_ctx;
+    void **ctx;                     /* a slot per module, see module.h */
+    
+    proton_http2_session_t *h2;     /* the connection speaks HTTP/2 */
+    proton_http2_stream_t *stream;  /* this is one of its streams, with no socket */
+    proton_ws_t *ws;                /* upgraded to WebSocket */
+    
+    struct ssl_st *ssl;             /* accepted on an ssl listener */
+    int ssl_handshaked;
+    
+    proton_http_connection_t *prev;
+    proton_http_connection_t *next;
+    
+    /* On the idle list while keepalive waits for the next request */
+    int idle;
+    proton_http_connection_t *idle_prev;
+    proton_http_connection_t *idle_next;
 };
 
 /* HTTP request parsing */
@@ -75,16 +161,65 @@ proton_http_response_t* proton_http_response_create(void);
 int proton_http_response_set_status(proton_http_response_t *res, int status);
 int proton_http_response_add_header(proton_http_response_t *res, const char *name, const char *value);
 int proton_http_response_write(proton_http_response_t *res, const char *data, size_t len);
+int proton_http_response_send_header(proton_http_connection_t *conn, int64_t content_length);
 int proton_http_response_send(proton_http_connection_t *conn);
+int proton_http_response_send_raw(proton_http_connection_t *conn, int status, const char *data, size_t len);
+void proton_http_response_add_raw_headers(proton_http_response_t *res, const char *p, size_t len);
 void proton_http_response_destroy(proton_http_response_t *res);
 
 /* HTTP connection handling */
+void proton_http_init(proton_config_t *config);
 proton_http_connection_t* proton_http_connection_create(int fd);
 int proton_http_handle_request(proton_http_connection_t *conn);
 void proton_http_connection_close(proton_http_connection_t *conn);
+int proton_http_request_finish(proton_http_connection_t *conn);
+
+/*
+ * Body bytes still on the socket and unclaimed would be read as the next
+ * request. A module that reads the body says how much of read_buf past the
+ * header was body, and hands back what it read beyond the end.
+ */
+int proton_http_body_unread(proton_http_connection_t *conn);
+void proton_http_take_body(proton_http_connection_t *conn, size_t in_buf);
+int proton_http_unread(proton_http_connection_t *conn, const char *data, size_t len);
+void proton_http_request_done(proton_http_connection_t *conn);
+
+/* Client socket I/O, through TLS where the connection has it */
+ssize_t proton_http_recv(proton_http_connection_t *conn, void *buf, size_t len);
+ssize_t proton_http_send(proton_http_connection_t *conn, const void *buf, size_t len);
+ssize_t proton_http_sendv(proton_http_connection_t *conn, const struct iovec *iov, int iovcnt);
+
+/* Park a request while a module waits; resume continues its phases */
+void proton_http_suspend(proton_http_connection_t *conn, void *ctx,
+                         void (*cancel)(proton_http_connection_t *conn));
+int proton_http_resume(proton_http_connection_t *conn, int rc);
+
+/* Graceful shutdown: stop keepalive and close idle connections */
+void proton_http_drain(void);
+void proton_http_close_all_connections(void);
+int proton_http_connection_count(void);
+
+/* At worker_connections: close the longest idle keepalive connection */
+int proton_http_close_idle(void);
+
+/* overload_shedding: queueing delay samples, and the 503 for a request that waited too long */
+int proton_overload_init(proton_config_t *config);
+int proton_overload_sample(uint64_t delay_usec);
+int proton_overload_check(void);
+int proton_overload_shed(proton_http_connection_t *conn);
 
 /* HTTP header helpers */
 const char* proton_http_get_header(proton_http_request_t *req, const char *name);
+int proton_http_has_token(const char *value, const char *token);
 const char* proton_http_status_string(int status);
+const char* proton_http_mime_type(const char *path);
+const char* proton_http_method_string(int method);
+
+/* Access log: format compiled in the master, file and flusher per worker */
+int proton_http_log_init(proton_config_t *config);
+int proton_http_log_open(void);
+void proton_http_log_request(proton_http_connection_t *conn);
+void proton_http_log_reopen(void);
+void proton_http_log_close(void);
 
 #endif /* PROTON_HTTP_H */
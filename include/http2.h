@@ -0,0 +1,53 @@
+#ifndef PROTON_HTTP2_H
+#define PROTON_HTTP2_H
+
+#include "proton.h"
+#include "http.h"
+
+/*
+ * HTTP/2 over cleartext (h2c), by prior knowledge or Upgrade: h2c. Every
+ * stream gets a connection of its own that the modules see like an
+ * HTTP/1 one; its response goes out in HEADERS and DATA frames.
+ */
+
+#define PROTON_HTTP2_PREFACE        "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define PROTON_HTTP2_PREFACE_LEN    24
+
+/* Error codes for RST_STREAM and GOAWAY */
+#define PROTON_HTTP2_NO_ERROR           0x0
+#define PROTON_HTTP2_PROTOCOL_ERROR     0x1
+#define PROTON_HTTP2_INTERNAL_ERROR     0x2
+#define PROTON_HTTP2_FLOW_CONTROL_ERROR 0x3
+#define PROTON_HTTP2_STREAM_CLOSED      0x5
+#define PROTON_HTTP2_FRAME_SIZE_ERROR   0x6
+#define PROTON_HTTP2_REFUSED_STREAM     0x7
+#define PROTON_HTTP2_CANCEL             0x8
+#define PROTON_HTTP2_COMPRESSION_ERROR  0x9
+#define PROTON_HTTP2_ENHANCE_YOUR_CALM  0xb
+#define PROTON_HTTP2_HTTP_1_1_REQUIRED  0xd
+
+/* Does the buffer start with the client preface? PROTON_AGAIN if it may */
+int proton_http2_preface(proton_buffer_t *buf);
+
+/* Switch a connection to HTTP/2, with the preface or after the upgrade request */
+int proton_http2_start(proton_http_connection_t *conn);
+int proton_http2_upgrade(proton_http_connection_t *conn);
+
+/* Event handlers of a connection that speaks HTTP/2 */
+int proton_http2_read_handler(proton_http_connection_t *conn);
+int proton_http2_write_handler(proton_http_connection_t *conn);
+
+/* Queue the response of a stream's connection */
+int proton_http2_send_response(proton_http_connection_t *conn);
+
+/* The client connection a stream's connection belongs to */
+proton_http_connection_t* proton_http2_parent(proton_http_connection_t *conn);
+
+/* Answer a stream with RST_STREAM instead of a response */
+int proton_http2_reset_stream(proton_http_connection_t *conn, uint32_t error);
+
+/* GOAWAY and close once the open streams are done */
+void proton_http2_drain(proton_http_connection_t *conn);
+void proton_http2_destroy(proton_http_connection_t *conn);
+
+#endif /* PROTON_HTTP2_H */
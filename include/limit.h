@@ -0,0 +1,62 @@
+#ifndef PROTON_LIMIT_H
+#define PROTON_LIMIT_H
+
+#include <stdatomic.h>
+#include "proton.h"
+#include "http.h"
+
+/* Key types of a zone */
+#define PROTON_LIMIT_KEY_ADDR     0   /* client address */
+#define PROTON_LIMIT_KEY_HEADER   1   /* $http_name */
+
+/* One key's state; both words are only ever changed with CAS */
+typedef struct {
+    _Atomic uint64_t key;       /* hash of the key, 0 if free */
+    _Atomic uint64_t state;     /* 0 is the state of a key never seen */
+} proton_limit_node_t;
+
+/* Shared by all workers, mapped by the master before fork */
+typedef struct {
+    uint64_t epoch;             /* proton_current_msec at creation */
+    uint64_t mask;              /* nodes - 1 */
+    _Atomic uint64_t cursor;    /* next node to look at for expiry */
+    _Atomic uint64_t full;      /* keys that found no free node */
+    proton_limit_node_t nodes[];
+} proton_limit_shm_t;
+
+typedef struct {
+    char *name;
+    int type;                   /* PROTON_LIMIT_REQ or PROTON_LIMIT_CONN */
+    int key_type;
+    char *key_source;           /* the key as configured */
+    char *header;               /* for PROTON_LIMIT_KEY_HEADER */
+    int rate;                   /* requests per 1000 seconds */
+    proton_limit_shm_t *shm;
+    size_t shm_size;
+} proton_limit_t;
+
+/* State of a node a sweep is freeing; leave it alone */
+#define PROTON_LIMIT_EXPIRING     UINT64_MAX
+
+/* limit_req state: msec since epoch << 24 | excess in 1/1000 requests */
+#define PROTON_LIMIT_EXCESS_BITS  24
+#define PROTON_LIMIT_BURST_MAX    16000
+
+/* limit_conn state: seconds since epoch << 32 | count */
+#define PROTON_LIMIT_COUNT_MASK   0xffffffffULL
+
+/* Zones of the configuration, mapped once in the master; repeat calls do nothing */
+int proton_limits_init(proton_config_t *config);
+void proton_limits_cleanup(void);
+proton_limit_t* proton_limit_get(const char *name, int type);
+
+/* Hash of the request's key, 0 if it has none */
+uint64_t proton_limit_hash(proton_limit_t *zone, proton_http_connection_t *conn);
+
+/* The node of a key, claimed if the key is new; NULL if the zone is full */
+proton_limit_node_t* proton_limit_lookup(proton_limit_t *zone, uint64_t hash);
+
+/* Answer with the prebuilt 429, 503 or 403 page */
+int proton_limit_reject(proton_http_connection_t *conn, int status);
+
+#endif /* PROTON_LIMIT_H */
@@ -5,24 +5,94 @@
 #include "http.h"
 
 /* Module return codes */
-#define PROTON_MODULE_HANDLED   0
-#define PROTON_MODULE_DECLINED -1
+#define PROTON_MODULE_AGAIN     2   /* suspended, see below */
+#define PROTON_MODULE_OK        1   /* phase done, go on with the next phase */
+#define PROTON_MODULE_HANDLED   0   /* response is ready, skip to the log phase */
+#define PROTON_MODULE_DECLINED -1   /* not mine, try the next handler */
 #define PROTON_MODULE_ERROR    -2
 
+/* Request phases, run in this order */
+#define PROTON_PHASE_POST_READ  0
+#define PROTON_PHASE_REWRITE    1
+#define PROTON_PHASE_ACCESS     2
+#define PROTON_PHASE_CONTENT    3
+#define PROTON_PHASE_LOG        4
+#define PROTON_PHASE_MAX        5
+
+typedef int (*proton_module_handler_t)(proton_http_connection_t *conn);
+
 /* Module structure */
 typedef struct proton_module_s {
     const char *name;
     int (*init)(proton_config_t *config);
-    int (*handler)(proton_http_connection_t *conn);
+    
+    /*
+     * init runs in the master before fork; init_worker runs in each worker
+     * with its event loop, and exit_worker as the worker exits (with
+     * connections possibly still open on a fast shutdown). File
+     * descriptors, events, timers and threads of a worker are opened here,
+     * and state only the worker writes goes in the module's slot on the
+     * loop, not in memory the master set up, which each worker would fault
+     * in page by page as it copies it on write.
+     */
+    int (*init_worker)(proton_event_loop_t *loop);
+    void (*exit_worker)(proton_event_loop_t *loop);
+    
+    /*
+     * Handlers for the phases the module takes part in. If applies is set it
+     * decides per location at config time whether the handlers run there; a
+     * content handler claimed this way replaces the generic ones.
+     */
+    proton_module_handler_t phases[PROTON_PHASE_MAX];
+    int (*applies)(proton_location_t *loc, int phase);
+    
+    /* Frees the module's slot of a connection as the connection closes */
+    void (*free_conn_ctx)(proton_http_connection_t *conn, void *ctx);
+    
     void (*cleanup)(void);
+    
+    int index;              /* of its slots, set by proton_modules_init */
 } proton_module_t;
 
+/*
+ * A handler that has to wait (a timer, a backend socket, a subprocess)
+ * returns PROTON_MODULE_AGAIN instead of blocking the worker. Before that
+ * it either
+ *
+ *   - calls proton_http_suspend() and registers its own events and timers
+ *     with the worker's event loop; the connection stays parked until the
+ *     module calls proton_http_resume() with the code the handler would
+ *     have returned, and the phases go on from there; or
+ *   - takes the connection's read and write hooks, writes the response
+ *     itself and calls proton_http_request_finish() when it is out.
+ *
+ * Either way the module gets its close hook called if the connection goes
+ * away first, and must then drop its events and timers.
+ */
+
 /* Module registration */
 extern proton_module_t *proton_modules[];
 
 /* Module lifecycle */
 int proton_modules_init(proton_config_t *config);
 int proton_modules_handle_request(proton_http_connection_t *conn);
+int proton_modules_resume(proton_http_connection_t *conn, int rc);
+void proton_modules_log_request(proton_http_connection_t *conn);
 void proton_modules_cleanup(void);
 
+/* In the worker, around its event loop */
+int proton_modules_init_worker(proton_event_loop_t *loop);
+void proton_modules_exit_worker(proton_event_loop_t *loop);
+
+/*
+ * Worker-local state: a slot per module on the event loop, and one on each
+ * connection that lives as long as the connection, across its requests.
+ * Neither is shared with other workers, so neither needs locks.
+ */
+#define proton_module_loop_ctx(loop, mod)   ((loop)->module_ctx[(mod)->index])
+
+void* proton_module_conn_ctx(proton_http_connection_t *conn, proton_module_t *mod);
+int proton_module_set_conn_ctx(proton_http_connection_t *conn, proton_module_t *mod, void *ctx);
+void proton_modules_free_conn_ctx(proton_http_connection_t *conn);
+
 #endif /* PROTON_MODULE_H */
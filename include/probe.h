@@ -0,0 +1,89 @@
+#ifndef PROTON_PROBE_H
+#define PROTON_PROBE_H
+
+#include <stdint.h>
+
+/*
+ * USDT probes in the SystemTap SDT format (.note.stapsdt), usable by
+ * bpftrace, perf and SystemTap on a running server without a rebuild:
+ *
+ *   bpftrace -l 'usdt:/usr/local/bin/proton:*'
+ *   bpftrace -e 'usdt:/usr/local/bin/proton:proton:request__parsed
+ *                { printf("%d %s\n", arg0, str(arg2)); }'
+ *
+ * A probe is a single nop plus an ELF note naming where its arguments
+ * live; nothing is called and nothing is done while no tracer is
+ * attached. Arguments are all passed as signed 64-bit values. Build with
+ * -DPROTON_NO_PROBES to leave them out.
+ *
+ *   conn__accept        fd, ssl
+ *   conn__close         fd, requests served
+ *   request__parsed     fd, method, uri
+ *   handler__start      fd, uri
+ *   handler__end        fd, module result, status
+ *   response__flushed   fd, status, bytes sent, usec since the request started
+ *
+ * HTTP/2 streams report fd -1.
+ */
+
+#if (defined(__x86_64__) || defined(__aarch64__)) && !defined(PROTON_NO_PROBES)
+
+#ifdef __x86_64__
+#define PROTON_PROBE_ARG    "nor"
+#else
+#define PROTON_PROBE_ARG    "r"
+#endif
+
+#define PROTON_PROBE_ASM(name, args)                                             \
+    "990: nop\n"                                                                 \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                                \
+    ".balign 4\n"                                                                \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                           \
+    "991: .asciz \"stapsdt\"\n"                                                  \
+    "992: .balign 4\n"                                                           \
+    "993: .8byte 990b\n"                                                         \
+    ".8byte _.stapsdt.base\n"                                                    \
+    ".8byte 0\n"                                                                 \
+    ".asciz \"proton\"\n"                                                        \
+    ".asciz \"" #name "\"\n"                                                     \
+    ".asciz \"" args "\"\n"                                                      \
+    "994: .balign 4\n"                                                           \
+    ".popsection\n"                                                              \
+    ".ifndef _.stapsdt.base\n"                                                   \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"      \
+    ".weak _.stapsdt.base\n"                                                     \
+    ".hidden _.stapsdt.base\n"                                                   \
+    "_.stapsdt.base: .space 1\n"                                                 \
+    ".size _.stapsdt.base, 1\n"                                                  \
+    ".popsection\n"                                                              \
+    ".endif\n"
+
+#define PROTON_PROBE_VALUE(v)   ((uint64_t)(uintptr_t)(v))
+
+#define PROTON_PROBE2(name, v1, v2)                                              \
+    __asm__ __volatile__(PROTON_PROBE_ASM(name, "-8@%[a1] -8@%[a2]")             \
+        :: [a1] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v1)),                       \
+           [a2] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v2)))
+
+#define PROTON_PROBE3(name, v1, v2, v3)                                          \
+    __asm__ __volatile__(PROTON_PROBE_ASM(name, "-8@%[a1] -8@%[a2] -8@%[a3]")    \
+        :: [a1] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v1)),                       \
+           [a2] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v2)),                       \
+           [a3] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v3)))
+
+#define PROTON_PROBE4(name, v1, v2, v3, v4)                                      \
+    __asm__ __volatile__(PROTON_PROBE_ASM(name, "-8@%[a1] -8@%[a2] -8@%[a3] -8@%[a4]") \
+        :: [a1] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v1)),                       \
+           [a2] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v2)),                       \
+           [a3] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v3)),                       \
+           [a4] PROTON_PROBE_ARG (PROTON_PROBE_VALUE(v4)))
+
+#else
+
+#define PROTON_PROBE2(name, v1, v2)             ((void)0)
+#define PROTON_PROBE3(name, v1, v2, v3)         ((void)0)
+#define PROTON_PROBE4(name, v1, v2, v3, v4)     ((void)0)
+
+#endif
+
+#endif /* PROTON_PROBE_H */
@@ -4,7 +4,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 
 /* Version */
 #define PROTON_VERSION "0.1.0"
@@ -14,6 +16,7 @@
 #define PROTON_ERROR    -1
 #define PROTON_AGAIN    -2
 #define PROTON_DECLINED -3
+#define PROTON_DONE     -4  /* handler released the object it was called for */
 
 /* Log levels */
 #define LOG_DEBUG   0
@@ -28,15 +31,25 @@ typedef struct proton_config_s proton_config_t;
 typedef struct proton_connection_s proton_connection_t;
 
 /* Memory pool */
+typedef struct proton_pool_cleanup_s proton_pool_cleanup_t;
+
+struct proton_pool_cleanup_s {
+    void (*handler)(void *data);
+    void *data;
+    proton_pool_cleanup_t *next;
+};
+
 struct proton_pool_s {
     size_t size;
     size_t used;
     void *data;
     proton_pool_t *next;
+    proton_pool_cleanup_t *cleanup;     /* run by destroy, newest first */
 };
 
 proton_pool_t* proton_pool_create(size_t size);
 void* proton_pool_alloc(proton_pool_t *pool, size_t size);
+int proton_pool_cleanup_add(proton_pool_t *pool, void (*handler)(void *data), void *data);
 void proton_pool_destroy(proton_pool_t *pool);
 
 /* Buffer chain */
@@ -54,20 +67,246 @@ void proton_buffer_destroy(proton_buffer_t *buf);
 /* Logging */
 void proton_log_init(const char *filename, int level);
 void proton_log(int level, const char *fmt, ...);
+void proton_log_reopen(void);
 void proton_log_close(void);
 
+/* Cached time */
+extern uint64_t proton_current_msec;       /* monotonic */
+extern uint64_t proton_current_wall_msec;
+extern time_t proton_current_sec;
+extern char proton_cached_log_time[];      /* 18/Oct/2026:17:26:39 +0000 */
+extern char proton_cached_iso8601_time[];  /* 2026-10-18T17:26:39+00:00 */
+extern char proton_cached_error_log_time[]; /* 2026-10-18 17:26:39 */
+
+void proton_time_update(void);
+uint64_t proton_time_usec(void);           /* uncached, for latency metrics */
+
+/* fastcgi_param NAME value; value may refer to $variables */
+typedef struct {
+    char *name;
+    char *value;
+} proton_fastcgi_param_t;
+
+/* allow / deny rule or geo entry: an address prefix */
+typedef struct {
+    uint8_t addr[16];       /* network order, IPv4 in the first 4 bytes */
+    uint8_t family;         /* AF_INET, AF_INET6, AF_UNIX or 0 for all */
+    uint8_t len;            /* prefix length in bits */
+    uint16_t value;         /* allow / deny: 1 denies; geo: index in values */
+} proton_cidr_rule_t;
+
+/* dav_methods */
+#define PROTON_DAV_PUT      0x01
+#define PROTON_DAV_DELETE   0x02
+#define PROTON_DAV_MKCOL    0x04
+
+/* Location block, matched against the request URI by longest prefix */
+typedef struct {
+    int index;              /* position in config->locations */
+    char *prefix;
+    size_t prefix_len;
+    int exact;              /* location = /path */
+    int stub_status;
+    int metrics;
+    char *proxy_pass;               /* upstream name or host:port */
+    char *fastcgi_pass;             /* upstream name, host:port or unix:/path */
+    char *fastcgi_index;
+    proton_fastcgi_param_t *fastcgi_params;
+    int nfastcgi_params;
+    int upstream_connect_timeout;   /* msec, proxy_ and fastcgi_connect_timeout */
+    int upstream_read_timeout;      /* msec */
+    char *limit_req;                /* zone name */
+    int limit_req_burst;
+    int limit_req_nodelay;
+    char *limit_conn;               /* zone name */
+    int limit_conn_max;
+    proton_cidr_rule_t *access_rules;   /* allow / deny, first match wins */
+    int naccess_rules;
+    int dav_methods;                /* PROTON_DAV_* */
+    int64_t dav_max_size;           /* largest PUT body, 0 for no limit */
+} proton_location_t;
+
+/* Upstream group used by proxy_pass */
+#define PROTON_BALANCE_ROUND_ROBIN  0
+#define PROTON_BALANCE_LEAST_CONN   1
+#define PROTON_BALANCE_HASH         2   /* consistent, on the request URI */
+
+typedef struct {
+    char *address;          /* host:port */
+    int weight;
+    int max_fails;
+    int fail_timeout;       /* msec */
+} proton_upstream_server_t;
+
+typedef struct {
+    char *name;
+    proton_upstream_server_t *servers;
+    int nservers;
+    int balance;
+    int keepalive;          /* idle connections cached per worker */
+} proton_upstream_t;
+
+/* Shared-memory zone of limit_req_zone / limit_conn_zone */
+#define PROTON_LIMIT_REQ    0
+#define PROTON_LIMIT_CONN   1
+
+typedef struct {
+    char *name;
+    int type;
+    char *key;              /* $remote_addr, $binary_remote_addr or $http_name */
+    size_t size;            /* bytes */
+    int rate;               /* limit_req: requests per 1000 seconds */
+} proton_limit_zone_t;
+
+/* geo $name { default value; 10.0.0.0/8 value; } */
+typedef struct {
+    char *name;             /* without the $ */
+    char **values;          /* values[0] is the default, "" unless set */
+    int nvalues;
+    proton_cidr_rule_t *entries;
+    int nentries;
+} proton_geo_t;
+
+/* listen directive; the address is resolved when the sockets are opened */
+typedef struct {
+    char *address;          /* port, host:port, [v6]:port or unix:/path */
+    int backlog;
+    int ssl;
+    int ipv6only;           /* [::] listeners take IPv6 only unless off */
+    int deferred;           /* TCP_DEFER_ACCEPT: wake up when data arrives */
+    int rcvbuf;             /* 0 leaves the system default */
+    int sndbuf;
+} proton_listen_t;
+
 /* Configuration */
 struct proton_config_s {
     int worker_processes;
-    int worker_connections;
-    int listen_port;
+    int worker_connections;     /* client connections per worker */
+    proton_listen_t *listens;
+    int nlistens;
     char *error_log;
     char *access_log;
+    char *access_log_format;
+    size_t access_log_buffer;
+    int access_log_flush;       /* msec */
     char *document_root;
+    char *static_bundle;        /* proton-pack file served instead of document_root */
+    int worker_shutdown_timeout;    /* msec */
+    int keepalive_requests;     /* then the connection is closed */
+    int keepalive_timeout;      /* msec an idle keepalive connection is kept */
+    int client_header_timeout;  /* msec to send a whole request header */
+    int slow_request_log;       /* msec, 0 off */
+    int overload_target;        /* msec of queueing delay, 0 off */
+    int overload_interval;      /* msec */
+    int overload_retry_after;   /* seconds */
+    int http2;                  /* h2c by prior knowledge or Upgrade */
+    int listen_ssl;             /* some listen ... ssl */
+    char *ssl_certificate;
+    char *ssl_certificate_key;
+    size_t ssl_session_cache;   /* bytes shared by the workers, 0 off */
+    int ssl_session_timeout;    /* msec */
+    int ssl_session_tickets;
+    proton_location_t *locations;
+    int nlocations;
+    proton_upstream_t *upstreams;
+    int nupstreams;
+    proton_limit_zone_t *limit_zones;
+    int nlimit_zones;
+    proton_geo_t *geos;
+    int ngeos;
 };
 
 proton_config_t* proton_config_parse(const char *filename);
+int proton_config_validate(proton_config_t *config);
 void proton_config_destroy(proton_config_t *config);
+proton_location_t* proton_config_find_location(proton_config_t *config, const char *uri);
+
+/* Listening sockets, owned by the master and inherited by workers */
+typedef struct {
+    int fd;
+    struct sockaddr_storage sockaddr;
+    socklen_t socklen;
+    int backlog;
+    char addr_text[128];
+    int inherited;          /* passed in by a previous binary or systemd */
+    int ssl;
+    int ipv6only;
+    int deferred;
+    int rcvbuf;
+    int sndbuf;
+} proton_listening_t;
+
+extern proton_listening_t *proton_listening;
+extern int proton_nlistening;
+
+int proton_listening_inherit(void);
+int proton_listening_open(proton_config_t *config);
+void proton_listening_close(void);
+char* proton_listening_export(void);
+void proton_listening_handover(int on);
+
+/* Shared statistics scoreboard, one slot per worker */
+#define PROTON_SCOREBOARD_SLOTS 256
+
+typedef struct {
+    _Alignas(64) uint64_t accepted;
+    uint64_t handled;
+    uint64_t requests;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t responses[5];      /* 1xx .. 5xx */
+    uint64_t shed;              /* 503s of overload_shedding */
+    int64_t active;
+    int64_t reading;
+    int64_t writing;
+    pid_t pid;                  /* 0 free, -1 reserved */
+} proton_stats_t;
+
+typedef struct {
+    time_t start_sec;
+    uint64_t respawns;
+    proton_stats_t retired;     /* totals of workers that have exited */
+    proton_stats_t slots[PROTON_SCOREBOARD_SLOTS];
+} proton_scoreboard_t;
+
+extern proton_scoreboard_t *proton_scoreboard;
+extern proton_stats_t *proton_stats;    /* this worker's slot */
+
+int proton_scoreboard_init(void);
+int proton_scoreboard_acquire(void);
+void proton_scoreboard_attach(int slot);
+void proton_scoreboard_release(int slot);
+void proton_scoreboard_exited(pid_t pid);
+int proton_scoreboard_collect(proton_stats_t *total);
+
+/* Latency histograms, per worker slot and per location */
+#define PROTON_HIST_BUCKETS         96
+#define PROTON_METRICS_LOCATIONS    16      /* 0 is "no location" */
+#define PROTON_METRICS_OTHER        (PROTON_METRICS_LOCATIONS - 1)  /* locations past the rest */
+
+#define PROTON_HIST_READ        0   /* accept or first byte to request parsed */
+#define PROTON_HIST_HANDLER     1   /* module handlers */
+#define PROTON_HIST_TOTAL       2   /* request start to last byte written */
+#define PROTON_HIST_MAX         3
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;               /* usec */
+    uint64_t buckets[PROTON_HIST_BUCKETS];
+} proton_histogram_t;
+
+typedef struct {
+    proton_histogram_t hist[PROTON_METRICS_LOCATIONS][PROTON_HIST_MAX];
+} proton_metrics_t;
+
+extern proton_metrics_t *proton_metrics;    /* this worker's slot */
+
+int proton_metrics_init(void);
+void proton_metrics_attach(int slot);
+void proton_metrics_release(int slot);
+void proton_metrics_collect(proton_metrics_t *total);
+void proton_histogram_record(proton_histogram_t *h, uint64_t usec);
+uint64_t proton_histogram_bucket_upper(int index);
 
 /* Master process */
 int proton_master_process(proton_config_t *config);
@@ -78,6 +317,11 @@ int proton_worker_process(proton_config_t *config);
 /* Global state */
 extern volatile sig_atomic_t proton_quit;
 extern volatile sig_atomic_t proton_reload;
+extern volatile sig_atomic_t proton_reopen;
+extern volatile sig_atomic_t proton_shutdown;   /* graceful, SIGQUIT */
+extern volatile sig_atomic_t proton_upgrade;    /* binary upgrade, SIGUSR2 */
 extern pid_t proton_pid;
+extern const char *proton_config_file;
+extern char **proton_argv;
 
 #endif /* PROTON_H */
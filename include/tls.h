@@ -0,0 +1,36 @@
+#ifndef PROTON_TLS_H
+#define PROTON_TLS_H
+
+#include "proton.h"
+#include "http.h"
+
+/*
+ * TLS on listeners marked "ssl", with OpenSSL. The master loads the
+ * certificate and maps the session cache and ticket keys that all workers
+ * share; workers run handshakes and record I/O without blocking.
+ */
+
+/* Master, on start and reload: context, ticket keys and session cache */
+int proton_tls_init(proton_config_t *config);
+void proton_tls_cleanup(void);
+
+/* Worker: a connection accepted on an ssl listener */
+int proton_tls_accept(proton_http_connection_t *conn);
+
+/* PROTON_OK once established, PROTON_AGAIN while in progress */
+int proton_tls_handshake(proton_http_connection_t *conn);
+
+/* Did ALPN pick h2? */
+int proton_tls_alpn_h2(proton_http_connection_t *conn);
+
+/* Like read() and write(); errno is EAGAIN while the record layer waits */
+ssize_t proton_tls_recv(proton_http_connection_t *conn, void *buf, size_t len);
+ssize_t proton_tls_send(proton_http_connection_t *conn, const void *buf, size_t len);
+
+/* Bytes of a record already read and decrypted; no edge will announce them */
+size_t proton_tls_pending(proton_http_connection_t *conn);
+
+/* Send close_notify if we can and free the session state */
+void proton_tls_close(proton_http_connection_t *conn);
+
+#endif /* PROTON_TLS_H */
@@ -0,0 +1,80 @@
+#ifndef PROTON_UPSTREAM_H
+#define PROTON_UPSTREAM_H
+
+#include <sys/socket.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+
+#define PROTON_UPSTREAM_MAX_PEERS   64      /* tried peers are a bitmask */
+
+/* How a request lets go of its upstream connection */
+#define PROTON_UPSTREAM_KEEP        0       /* response complete, connection may be cached */
+#define PROTON_UPSTREAM_CLOSE       1       /* done with it, but it cannot be reused */
+#define PROTON_UPSTREAM_FAILED      2       /* counts against the peer */
+#define PROTON_UPSTREAM_STALE       3       /* cached connection was dead, peer may be tried again */
+
+typedef struct proton_upstream_group_s proton_upstream_group_t;
+typedef struct proton_upstream_idle_s proton_upstream_idle_t;
+
+typedef struct {
+    char name[128];             /* resolved address, for logs and the hash ring */
+    struct sockaddr_storage sockaddr;
+    socklen_t socklen;
+    int weight;
+    int current_weight;         /* smooth weighted round-robin */
+    int max_fails;
+    int fail_timeout;
+    int fails;
+    uint64_t fail_start;
+    uint64_t down_until;
+    int active;
+} proton_upstream_peer_t;
+
+typedef struct {
+    uint32_t hash;
+    int peer;
+} proton_upstream_point_t;
+
+/* Server group with this worker's peer state and idle connections */
+struct proton_upstream_group_s {
+    char *name;
+    proton_upstream_peer_t *peers;
+    int npeers;
+    int balance;
+    int keepalive;
+    proton_upstream_point_t *ring;
+    int nring;
+    proton_upstream_idle_t *idle;       /* most recently used first */
+    proton_upstream_idle_t *idle_tail;
+    int nidle;
+};
+
+/* One request's connection to a group; the caller owns the event handlers */
+typedef struct {
+    proton_upstream_group_t *group;
+    int peer;
+    uint64_t tried;
+    int fd;
+    proton_event_t *event;
+    int connected;
+    int reused;                 /* taken from the keepalive pool */
+    void *data;
+    proton_event_handler_t read_handler;
+    proton_event_handler_t write_handler;
+} proton_upstream_conn_t;
+
+/* Groups of the upstream blocks, resolved once at config time; repeat calls do nothing */
+int proton_upstreams_init(proton_config_t *config);
+void proton_upstreams_cleanup(void);
+
+/* A group by name, or a single-server group for an address */
+proton_upstream_group_t* proton_upstream_get(const char *target, int keepalive);
+
+/* Pick a peer not tried yet and connect, from the pool if cached is set */
+int proton_upstream_connect(proton_upstream_conn_t *uc, proton_http_request_t *req, int cached);
+int proton_upstream_test_connect(proton_upstream_conn_t *uc);
+void proton_upstream_free(proton_upstream_conn_t *uc, int state);
+const char* proton_upstream_peer_name(proton_upstream_conn_t *uc);
+
+#endif /* PROTON_UPSTREAM_H */
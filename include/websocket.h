@@ -0,0 +1,69 @@
+#ifndef PROTON_WEBSOCKET_H
+#define PROTON_WEBSOCKET_H
+
+#include "proton.h"
+#include "http.h"
+
+/*
+ * WebSocket (RFC 6455) over HTTP/1.1, with or without TLS. A content
+ * handler accepts the upgrade; the connection then carries messages for
+ * that module, and pings and the close handshake are answered here.
+ */
+
+/* Opcodes */
+#define PROTON_WS_CONTINUATION  0x0
+#define PROTON_WS_TEXT          0x1
+#define PROTON_WS_BINARY        0x2
+#define PROTON_WS_CLOSE         0x8
+#define PROTON_WS_PING          0x9
+#define PROTON_WS_PONG          0xa
+
+/* Close status codes */
+#define PROTON_WS_NORMAL_CLOSURE    1000
+#define PROTON_WS_GOING_AWAY        1001
+#define PROTON_WS_PROTOCOL_ERROR    1002
+#define PROTON_WS_INVALID_DATA      1007
+#define PROTON_WS_MESSAGE_TOO_BIG   1009
+#define PROTON_WS_INTERNAL_ERROR    1011
+
+#define PROTON_WS_MAX_MESSAGE   (1024 * 1024)   /* larger messages close with 1009 */
+
+typedef struct {
+    /*
+     * A whole text or binary message. data points into the connection's
+     * read buffer, unmasked in place, and is only valid during the call;
+     * text has been checked to be UTF-8. PROTON_ERROR closes with 1011.
+     */
+    int (*on_message)(proton_http_connection_t *conn, int opcode, const char *data, size_t len);
+    
+    /* The connection is going away; drop references to it, send nothing */
+    void (*on_close)(proton_http_connection_t *conn);
+} proton_ws_handler_t;
+
+/* Does the request ask for a WebSocket? */
+int proton_ws_is_upgrade(proton_http_request_t *req);
+
+/*
+ * In a content handler: answer the handshake and hand the connection to
+ * handler, with data in conn->module_ctx. Returns what the handler should
+ * return: PROTON_MODULE_DECLINED for a request that is no upgrade,
+ * otherwise PROTON_MODULE_HANDLED with the 101 or an error response.
+ */
+int proton_ws_accept(proton_http_connection_t *conn, const proton_ws_handler_t *handler, void *data);
+
+/* Send a message or a ping; never closes the connection under the caller */
+int proton_ws_send(proton_http_connection_t *conn, int opcode, const void *data, size_t len);
+
+/* Start the close handshake; the connection closes when the peer answers */
+int proton_ws_close(proton_http_connection_t *conn, int status, const char *reason);
+
+/* Called by the HTTP layer once the 101 is queued, and for the events after */
+int proton_ws_start(proton_http_connection_t *conn);
+int proton_ws_read_handler(proton_http_connection_t *conn);
+int proton_ws_write_handler(proton_http_connection_t *conn);
+
+/* Close with 1001 on shutdown, and free the state with the connection */
+void proton_ws_drain(proton_http_connection_t *conn);
+void proton_ws_destroy(proton_http_connection_t *conn);
+
+#endif /* PROTON_WEBSOCKET_H */
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <ctype.h>
 #include "proton.h"
+#include "cidr.h"
 
 /* Simple config parser - simplified version */
 
@@ -38,6 +39,503 @@ static int parse_int(const char *value, int default_value) {
     return atoi(value);
 }
 
+/* Parse sizes like "64k", "1m", "4g" */
+static size_t parse_size(const char *value) {
+    char *end;
+    size_t size = strtoul(value, &end, 10);
+    
+    switch (*end) {
+        case 'k': case 'K': size *= 1024; break;
+        case 'm': case 'M': size *= 1024 * 1024; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024; break;
+    }
+    
+    return size;
+}
+
+/* Parse times like "500ms", "5s", "1m" into milliseconds */
+static int parse_msec(const char *value) {
+    char *end;
+    long t = strtol(value, &end, 10);
+    
+    if (strncmp(end, "ms", 2) == 0) return t;
+    if (*end == 'm') return t * 60 * 1000;
+    if (*end == 'h') return t * 3600 * 1000;
+    return t * 1000;
+}
+
+/* Split off the next whitespace separated token */
+static char* next_token(char **p) {
+    char *s = *p;
+    while (*s && isspace((unsigned char)*s)) s++;
+    if (*s == '\0') {
+        *p = s;
+        return NULL;
+    }
+    
+    char *start = s;
+    while (*s && !isspace((unsigned char)*s)) s++;
+    if (*s) *s++ = '\0';
+    
+    *p = s;
+    return start;
+}
+
+static char* copy_value(const char *value) {
+    size_t len = strlen(value);
+    char *copy = malloc(len + 1);
+    if (copy) strcpy(copy, value);
+    return copy;
+}
+
+#define MAX_LOG_FORMATS 16
+#define MAX_INCLUDE_DEPTH 8
+
+typedef struct {
+    char *name;
+    char *format;
+} log_format_t;
+
+/* log_format name 'part' "part" ...; */
+static int parse_log_format(char *args, log_format_t *fmt) {
+    char *p = args;
+    char *name = next_token(&p);
+    if (!name) return PROTON_ERROR;
+    
+    char format[1024];
+    size_t len = 0;
+    
+    while (*p) {
+        while (*p && isspace((unsigned char)*p)) p++;
+        if (*p == '\0' || *p == ';') break;
+        
+        char quote = (*p == '\'' || *p == '"') ? *p++ : 0;
+        while (*p && (quote ? *p != quote : (!isspace((unsigned char)*p) && *p != ';'))) {
+            if (len < sizeof(format) - 1) format[len++] = *p;
+            p++;
+        }
+        if (quote && *p) p++;
+    }
+    format[len] = '\0';
+    
+    fmt->name = copy_value(name);
+    fmt->format = copy_value(format);
+    return (fmt->name && fmt->format) ? PROTON_OK : PROTON_ERROR;
+}
+
+/* location [=] /prefix { */
+static proton_location_t* add_location(proton_config_t *config, char *args) {
+    char *p = args;
+    char *prefix = next_token(&p);
+    int exact = 0;
+    
+    if (prefix && strcmp(prefix, "=") == 0) {
+        exact = 1;
+        prefix = next_token(&p);
+    }
+    
+    char *brace = next_token(&p);
+    if (!prefix || !brace || strcmp(brace, "{") != 0 || prefix[0] != '/') {
+        return NULL;
+    }
+    
+    proton_location_t *locations = realloc(config->locations,
+                                           (config->nlocations + 1) * sizeof(proton_location_t));
+    if (!locations) return NULL;
+    config->locations = locations;
+    
+    proton_location_t *loc = &locations[config->nlocations];
+    memset(loc, 0, sizeof(*loc));
+    loc->index = config->nlocations;
+    loc->upstream_connect_timeout = 5000;
+    loc->upstream_read_timeout = 60000;
+    loc->dav_max_size = 1024 * 1024;
+    loc->prefix = copy_value(prefix);
+    if (!loc->prefix) return NULL;
+    loc->prefix_len = strlen(prefix);
+    loc->exact = exact;
+    
+    config->nlocations++;
+    return loc;
+}
+
+/* listen address [ssl] [backlog=N] [ipv6only=on|off] [deferred] [rcvbuf=size] [sndbuf=size]; */
+static int add_listen(proton_config_t *config, char *args) {
+    char *p = args;
+    char *address = next_token(&p);
+    if (!address) return PROTON_ERROR;
+    
+    proton_listen_t *listens = realloc(config->listens, (config->nlistens + 1) * sizeof(proton_listen_t));
+    if (!listens) return PROTON_ERROR;
+    config->listens = listens;
+    
+    proton_listen_t *l = &listens[config->nlistens];
+    memset(l, 0, sizeof(*l));
+    l->ipv6only = 1;
+    l->address = copy_value(address);
+    if (!l->address) return PROTON_ERROR;
+    config->nlistens++;
+    
+    char *arg;
+    while ((arg = next_token(&p)) != NULL) {
+        if (strcmp(arg, "ssl") == 0) {
+            l->ssl = 1;
+            config->listen_ssl = 1;
+        } else if (strcmp(arg, "deferred") == 0) {
+            l->deferred = 1;
+        } else if (strcmp(arg, "ipv6only=on") == 0) {
+            l->ipv6only = 1;
+        } else if (strcmp(arg, "ipv6only=off") == 0) {
+            l->ipv6only = 0;
+        } else if (strncmp(arg, "backlog=", 8) == 0) {
+            l->backlog = atoi(arg + 8);
+            if (l->backlog <= 0) return PROTON_ERROR;
+        } else if (strncmp(arg, "rcvbuf=", 7) == 0) {
+            l->rcvbuf = parse_size(arg + 7);
+        } else if (strncmp(arg, "sndbuf=", 7) == 0) {
+            l->sndbuf = parse_size(arg + 7);
+        } else {
+            return PROTON_ERROR;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+/* limit_req_zone key zone=name:size rate=10r/s; / limit_conn_zone key zone=name:size; */
+static int add_limit_zone(proton_config_t *config, char *args, int type) {
+    char *p = args;
+    char *semi = strchr(p, ';');
+    if (semi) *semi = '\0';
+    
+    char *key = next_token(&p);
+    if (!key || key[0] != '$') return PROTON_ERROR;
+    
+    proton_limit_zone_t zone = { .type = type };
+    char *arg;
+    while ((arg = next_token(&p)) != NULL) {
+        if (strncmp(arg, "zone=", 5) == 0) {
+            char *colon = strchr(arg + 5, ':');
+            if (!colon || colon == arg + 5) return PROTON_ERROR;
+            *colon = '\0';
+            zone.name = arg + 5;
+            zone.size = parse_size(colon + 1);
+        } else if (strncmp(arg, "rate=", 5) == 0 && type == PROTON_LIMIT_REQ) {
+            char *end;
+            long rate = strtol(arg + 5, &end, 10);
+            if (rate <= 0) return PROTON_ERROR;
+            if (strcmp(end, "r/s") == 0) zone.rate = rate * 1000;
+            else if (strcmp(end, "r/m") == 0) zone.rate = rate * 1000 / 60;
+            else return PROTON_ERROR;
+        } else {
+            return PROTON_ERROR;
+        }
+    }
+    
+    if (!zone.name || zone.size == 0 || (type == PROTON_LIMIT_REQ && zone.rate <= 0)) {
+        return PROTON_ERROR;
+    }
+    
+    proton_limit_zone_t *zones = realloc(config->limit_zones,
+                                         (config->nlimit_zones + 1) * sizeof(proton_limit_zone_t));
+    if (!zones) return PROTON_ERROR;
+    config->limit_zones = zones;
+    
+    zone.name = copy_value(zone.name);
+    zone.key = copy_value(key);
+    if (!zone.name || !zone.key) {
+        free(zone.name);
+        free(zone.key);
+        return PROTON_ERROR;
+    }
+    
+    zones[config->nlimit_zones++] = zone;
+    return PROTON_OK;
+}
+
+/* limit_req zone=name [burst=N] [nodelay]; */
+static int parse_limit_req(proton_location_t *loc, char *args) {
+    char *p = args;
+    char *semi = strchr(p, ';');
+    if (semi) *semi = '\0';
+    
+    char *arg;
+    while ((arg = next_token(&p)) != NULL) {
+        if (strncmp(arg, "zone=", 5) == 0) {
+            free(loc->limit_req);
+            loc->limit_req = copy_value(arg + 5);
+            if (!loc->limit_req) return PROTON_ERROR;
+        } else if (strncmp(arg, "burst=", 6) == 0) {
+            loc->limit_req_burst = atoi(arg + 6);
+            if (loc->limit_req_burst < 0) return PROTON_ERROR;
+        } else if (strcmp(arg, "nodelay") == 0) {
+            loc->limit_req_nodelay = 1;
+        } else {
+            return PROTON_ERROR;
+        }
+    }
+    
+    return loc->limit_req ? PROTON_OK : PROTON_ERROR;
+}
+
+/* fastcgi_param NAME value; the value is the rest of the line */
+static int add_fastcgi_param(proton_location_t *loc, char *args) {
+    char *p = args;
+    char *semi = strrchr(p, ';');
+    if (semi) *semi = '\0';
+    
+    char *name = next_token(&p);
+    if (!name) return PROTON_ERROR;
+    
+    while (isspace((unsigned char)*p)) p++;
+    char *end = p + strlen(p);
+    while (end > p && isspace((unsigned char)end[-1])) *--end = '\0';
+    
+    proton_fastcgi_param_t *params = realloc(loc->fastcgi_params,
+                                             (loc->nfastcgi_params + 1) * sizeof(proton_fastcgi_param_t));
+    if (!params) return PROTON_ERROR;
+    loc->fastcgi_params = params;
+    
+    proton_fastcgi_param_t *param = &params[loc->nfastcgi_params];
+    param->name = copy_value(name);
+    param->value = copy_value(p);
+    if (!param->name || !param->value) {
+        free(param->name);
+        free(param->value);
+        return PROTON_ERROR;
+    }
+    
+    loc->nfastcgi_params++;
+    return PROTON_OK;
+}
+
+/* upstream name { */
+static proton_upstream_t* add_upstream(proton_config_t *config, char *args) {
+    char *p = args;
+    char *name = next_token(&p);
+    char *brace = next_token(&p);
+    if (!name || !brace || strcmp(brace, "{") != 0) return NULL;
+    
+    proton_upstream_t *upstreams = realloc(config->upstreams,
+                                           (config->nupstreams + 1) * sizeof(proton_upstream_t));
+    if (!upstreams) return NULL;
+    config->upstreams = upstreams;
+    
+    proton_upstream_t *up = &upstreams[config->nupstreams];
+    memset(up, 0, sizeof(*up));
+    up->name = copy_value(name);
+    if (!up->name) return NULL;
+    up->balance = PROTON_BALANCE_ROUND_ROBIN;
+    
+    config->nupstreams++;
+    return up;
+}
+
+/* Directives inside an upstream block */
+static int parse_upstream_line(proton_upstream_t *up, char *line) {
+    char *p = line;
+    char *semi = strchr(p, ';');
+    if (semi) *semi = '\0';
+    
+    char *directive = next_token(&p);
+    if (!directive) return PROTON_OK;
+    
+    if (strcmp(directive, "server") == 0) {
+        char *address = next_token(&p);
+        if (!address) return PROTON_ERROR;
+        
+        proton_upstream_server_t *servers = realloc(up->servers,
+                                                    (up->nservers + 1) * sizeof(proton_upstream_server_t));
+        if (!servers) return PROTON_ERROR;
+        up->servers = servers;
+        
+        proton_upstream_server_t *server = &servers[up->nservers];
+        server->address = copy_value(address);
+        if (!server->address) return PROTON_ERROR;
+        server->weight = 1;
+        server->max_fails = 1;
+        server->fail_timeout = 10000;
+        up->nservers++;
+        
+        char *arg;
+        while ((arg = next_token(&p)) != NULL) {
+            if (strncmp(arg, "weight=", 7) == 0) {
+                server->weight = atoi(arg + 7);
+            } else if (strncmp(arg, "max_fails=", 10) == 0) {
+                server->max_fails = atoi(arg + 10);
+            } else if (strncmp(arg, "fail_timeout=", 13) == 0) {
+                server->fail_timeout = parse_msec(arg + 13);
+            } else {
+                return PROTON_ERROR;
+            }
+        }
+        
+        return server->weight > 0 ? PROTON_OK : PROTON_ERROR;
+    }
+    
+    if (strcmp(directive, "least_conn") == 0) {
+        up->balance = PROTON_BALANCE_LEAST_CONN;
+        return PROTON_OK;
+    }
+    
+    if (strcmp(directive, "hash") == 0) {
+        up->balance = PROTON_BALANCE_HASH;
+        return PROTON_OK;
+    }
+    
+    if (strcmp(directive, "keepalive") == 0) {
+        char *value = next_token(&p);
+        if (!value) return PROTON_ERROR;
+        up->keepalive = atoi(value);
+        return PROTON_OK;
+    }
+    
+    return PROTON_ERROR;
+}
+
+/* Room for one more element in an array grown by doubling */
+static int grow_rules(proton_cidr_rule_t **rules, int n) {
+    if (n > 0 && (n & (n - 1)) != 0) return PROTON_OK;
+    
+    proton_cidr_rule_t *list = realloc(*rules, (n ? 2 * n : 4) * sizeof(proton_cidr_rule_t));
+    if (!list) return PROTON_ERROR;
+    *rules = list;
+    return PROTON_OK;
+}
+
+/* allow | deny address[/bits] | all | unix:; */
+static int add_access_rule(proton_location_t *loc, char *args, int deny) {
+    char *p = args;
+    char *semi = strchr(p, ';');
+    if (semi) *semi = '\0';
+    
+    char *value = next_token(&p);
+    if (!value || next_token(&p)) return PROTON_ERROR;
+    
+    proton_cidr_rule_t rule;
+    memset(&rule, 0, sizeof(rule));
+    
+    if (strcmp(value, "unix:") == 0) {
+        rule.family = AF_UNIX;
+    } else if (strcmp(value, "all") != 0 && proton_cidr_parse(value, &rule) != PROTON_OK) {
+        return PROTON_ERROR;
+    }
+    rule.value = deny;
+    
+    if (grow_rules(&loc->access_rules, loc->naccess_rules) != PROTON_OK) return PROTON_ERROR;
+    loc->access_rules[loc->naccess_rules++] = rule;
+    return PROTON_OK;
+}
+
+/* dav_methods off | PUT DELETE MKCOL ...; */
+static int parse_dav_methods(proton_location_t *loc, char *args) {
+    char *p = args;
+    char *semi = strchr(p, ';');
+    if (semi) *semi = '\0';
+    
+    int methods = 0;
+    char *name;
+    
+    while ((name = next_token(&p))) {
+        if (strcmp(name, "PUT") == 0) methods |= PROTON_DAV_PUT;
+        else if (strcmp(name, "DELETE") == 0) methods |= PROTON_DAV_DELETE;
+        else if (strcmp(name, "MKCOL") == 0) methods |= PROTON_DAV_MKCOL;
+        else if (strcmp(name, "off") != 0) return PROTON_ERROR;
+    }
+    
+    loc->dav_methods = methods;
+    return PROTON_OK;
+}
+
+/* geo $name { */
+static proton_geo_t* add_geo(proton_config_t *config, char *args) {
+    char *p = args;
+    char *name = next_token(&p);
+    char *brace = next_token(&p);
+    if (!name || name[0] != '$' || name[1] == '\0' || !brace || strcmp(brace, "{") != 0) return NULL;
+    
+    proton_geo_t *geos = realloc(config->geos, (config->ngeos + 1) * sizeof(proton_geo_t));
+    if (!geos) return NULL;
+    config->geos = geos;
+    
+    proton_geo_t *geo = &geos[config->ngeos];
+    memset(geo, 0, sizeof(*geo));
+    geo->name = copy_value(name + 1);
+    geo->values = malloc(sizeof(char*));
+    if (geo->values && (geo->values[0] = copy_value("")) != NULL) geo->nvalues = 1;
+    config->ngeos++;
+    
+    return geo->name && geo->nvalues ? geo : NULL;
+}
+
+/* Index of a geo value, added if new; the latest values are the likeliest */
+static int geo_value(proton_geo_t *geo, const char *value) {
+    for (int i = geo->nvalues - 1; i > 0; i--) {
+        if (strcmp(geo->values[i], value) == 0) return i;
+    }
+    
+    if (geo->nvalues >= PROTON_CIDR_NONE) return -1;
+    
+    if ((geo->nvalues & (geo->nvalues - 1)) == 0) {
+        char **values = realloc(geo->values, 2 * geo->nvalues * sizeof(char*));
+        if (!values) return -1;
+        geo->values = values;
+    }
+    
+    geo->values[geo->nvalues] = copy_value(value);
+    return geo->values[geo->nvalues] ? geo->nvalues++ : -1;
+}
+
+/* Directives inside a geo block: default value; address[/bits] value; */
+static int parse_geo_line(proton_geo_t *geo, char *line) {
+    char *p = line;
+    char *semi = strchr(p, ';');
+    if (semi) *semi = '\0';
+    
+    char *key = next_token(&p);
+    char *value = next_token(&p);
+    if (!key || !value || next_token(&p)) return PROTON_ERROR;
+    
+    if (strcmp(key, "default") == 0) {
+        char *copy = copy_value(value);
+        if (!copy) return PROTON_ERROR;
+        free(geo->values[0]);
+        geo->values[0] = copy;
+        return PROTON_OK;
+    }
+    
+    proton_cidr_rule_t rule;
+    if (proton_cidr_parse(key, &rule) != PROTON_OK) return PROTON_ERROR;
+    
+    int index = geo_value(geo, value);
+    if (index < 0) return PROTON_ERROR;
+    rule.value = index;
+    
+    if (grow_rules(&geo->entries, geo->nentries) != PROTON_OK) return PROTON_ERROR;
+    geo->entries[geo->nentries++] = rule;
+    return PROTON_OK;
+}
+
+/* include path; relative paths are taken from the main file's directory */
+static FILE* open_include(const char *filename, char *args) {
+    char *p = args;
+    char *semi = strchr(p, ';');
+    if (semi) *semi = '\0';
+    
+    char *path = next_token(&p);
+    if (!path) return NULL;
+    
+    char full[1024];
+    const char *slash = strrchr(filename, '/');
+    if (path[0] != '/' && slash) {
+        int n = snprintf(full, sizeof(full), "%.*s/%s", (int)(slash - filename), filename, path);
+        if (n < 0 || (size_t)n >= sizeof(full)) return NULL;
+        path = full;
+    }
+    
+    return fopen(path, "r");
+}
+
 proton_config_t* proton_config_parse(const char *filename) {
     fprintf(stderr, "[CONFIG] Parsing: %s\n", filename);
     
@@ -52,10 +550,27 @@ proton_config_t* proton_config_parse(const char *filename) {
         if (config) {
             config->worker_processes = 0; /* auto */
             config->worker_connections = 1024;
-            config->listen_port = 8080;
             config->error_log = NULL;
             config->access_log = NULL;
+            config->access_log_buffer = 64 * 1024;
+            config->access_log_flush = 1000;
             config->document_root = NULL;
+            config->worker_shutdown_timeout = 10000;
+            config->keepalive_requests = 1000;
+    config->keepalive_timeout = 75000;
+    config->client_header_timeout = 60000;
+            config->keepalive_timeout = 75000;
+            config->client_header_timeout = 60000;
+            config->overload_interval = 100;
+            config->overload_retry_after = 1;
+            config->ssl_session_timeout = 300000;
+            config->ssl_session_tickets = 1;
+            
+            char port[] = "8080";
+            if (add_listen(config, port) != PROTON_OK) {
+                proton_config_destroy(config);
+                return NULL;
+            }
         }
         return config;
     }
@@ -75,7 +590,16 @@ proton_config_t* proton_config_parse(const char *filename) {
     /* Set defaults */
     config->worker_processes = 0; /* auto */
     config->worker_connections = 1024;
-    config->listen_port = 8080;
+    config->access_log_buffer = 64 * 1024;
+    config->access_log_flush = 1000;
+    config->worker_shutdown_timeout = 10000;
+    config->keepalive_requests = 1000;
+    config->keepalive_timeout = 75000;
+    config->client_header_timeout = 60000;
+    config->overload_interval = 100;
+    config->overload_retry_after = 1;
+    config->ssl_session_timeout = 300000;
+    config->ssl_session_tickets = 1;
     
     /* Leave error_log, access_log, document_root as NULL initially */
     config->error_log = NULL;
@@ -88,15 +612,68 @@ proton_config_t* proton_config_parse(const char *filename) {
     char line[1024];
     int in_http = 0;
     int in_server = 0;
+    proton_location_t *location = NULL;
+    proton_upstream_t *upstream = NULL;
+    proton_geo_t *geo = NULL;
+    FILE *includes[MAX_INCLUDE_DEPTH];
+    int nincludes = 0;
+    log_format_t formats[MAX_LOG_FORMATS];
+    int nformats = 0;
+    char *access_log_format = NULL;
+    int failed = 0;
     
     fprintf(stderr, "[CONFIG] Entering while loop\n");
     
-    while (fgets(line, sizeof(line), fp)) {
+    while (1) {
+        if (!fgets(line, sizeof(line), fp)) {
+            /* Back to the file with the include */
+            if (nincludes == 0) break;
+            fclose(fp);
+            fp = includes[--nincludes];
+            continue;
+        }
         trim(line);
         
         /* Skip empty lines and comments */
         if (line[0] == '\0' || line[0] == '#') continue;
         
+        /* Included files are read in place, in whatever block includes them */
+        if (strncmp(line, "include", 7) == 0 && isspace((unsigned char)line[7])) {
+            FILE *include = nincludes < MAX_INCLUDE_DEPTH ? open_include(filename, line + 7) : NULL;
+            if (!include) {
+                fprintf(stderr, "Invalid include directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            includes[nincludes++] = fp;
+            fp = include;
+            continue;
+        }
+        
+        /* So do geo blocks */
+        if (geo) {
+            if (strcmp(line, "}") == 0) {
+                geo = NULL;
+            } else if (parse_geo_line(geo, line) != PROTON_OK) {
+                fprintf(stderr, "Invalid entry in geo $%s: %s\n", geo->name, line);
+                failed = 1;
+                break;
+            }
+            continue;
+        }
+        
+        /* Upstream blocks have a grammar of their own */
+        if (upstream) {
+            if (strcmp(line, "}") == 0) {
+                upstream = NULL;
+            } else if (parse_upstream_line(upstream, line) != PROTON_OK) {
+                fprintf(stderr, "Invalid directive in upstream %s: %s\n", upstream->name, line);
+                failed = 1;
+                break;
+            }
+            continue;
+        }
+        
         /* Parse directives */
         if (strncmp(line, "worker_processes", 16) == 0) {
             char *value = strchr(line, ' ');
@@ -126,7 +703,11 @@ proton_config_t* proton_config_parse(const char *filename) {
                 trim(value);
                 char *semi = strchr(value, ';');
                 if (semi) *semi = '\0';
-                config->listen_port = atoi(value);
+                if (add_listen(config, value) != PROTON_OK) {
+                    fprintf(stderr, "Invalid listen directive: %s\n", line);
+                    failed = 1;
+                    break;
+                }
             }
         }
         else if (strncmp(line, "error_log", 9) == 0) {
@@ -162,6 +743,187 @@ proton_config_t* proton_config_parse(const char *filename) {
                 fprintf(stderr, "[CONFIG] Set error_log to: %s (ptr: %p)\n", config->error_log, (void*)config->error_log);
             }
         }
+        else if (strncmp(line, "worker_shutdown_timeout", 23) == 0) {
+            char *value = strchr(line, ' ');
+            if (value) {
+                value++;
+                trim(value);
+                char *semi = strchr(value, ';');
+                if (semi) *semi = '\0';
+                config->worker_shutdown_timeout = parse_msec(value);
+            }
+        }
+        else if (strncmp(line, "keepalive_requests", 18) == 0 && isspace((unsigned char)line[18])) {
+            char *p = line + 18;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *value = next_token(&p);
+            if (!value || atoi(value) <= 0) {
+                fprintf(stderr, "Invalid keepalive_requests directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            config->keepalive_requests = atoi(value);
+        }
+        else if ((strncmp(line, "keepalive_timeout", 17) == 0 && isspace((unsigned char)line[17])) ||
+                 (strncmp(line, "client_header_timeout", 21) == 0 && isspace((unsigned char)line[21]))) {
+            int header = line[0] == 'c';
+            char *p = line + (header ? 21 : 17);
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *value = next_token(&p);
+            if (!value || parse_msec(value) <= 0) {
+                fprintf(stderr, "Invalid %s directive: %s\n", header ? "client_header_timeout" : "keepalive_timeout", line);
+                failed = 1;
+                break;
+            }
+            if (header) config->client_header_timeout = parse_msec(value);
+            else config->keepalive_timeout = parse_msec(value);
+        }
+        else if (strncmp(line, "slow_request_log", 16) == 0 && isspace((unsigned char)line[16])) {
+            char *p = line + 16;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *value = next_token(&p);
+            if (!value || (strcmp(value, "off") != 0 && !isdigit((unsigned char)*value))) {
+                fprintf(stderr, "Invalid slow_request_log directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            config->slow_request_log = strcmp(value, "off") == 0 ? 0 : parse_msec(value);
+        }
+        else if (strncmp(line, "overload_shedding", 17) == 0 && isspace((unsigned char)line[17])) {
+            /* overload_shedding target|off [interval=time] [retry_after=time]; */
+            char *p = line + 17;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *value = next_token(&p);
+            if (!value || (strcmp(value, "off") != 0 && parse_msec(value) <= 0)) {
+                fprintf(stderr, "Invalid overload_shedding directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            config->overload_target = strcmp(value, "off") == 0 ? 0 : parse_msec(value);
+            
+            char *arg;
+            while ((arg = next_token(&p)) != NULL) {
+                if (strncmp(arg, "interval=", 9) == 0 && parse_msec(arg + 9) > 0) {
+                    config->overload_interval = parse_msec(arg + 9);
+                } else if (strncmp(arg, "retry_after=", 12) == 0 && isdigit((unsigned char)arg[12])) {
+                    config->overload_retry_after = (parse_msec(arg + 12) + 999) / 1000;
+                } else {
+                    fprintf(stderr, "Invalid overload_shedding parameter: %s\n", arg);
+                    failed = 1;
+                    break;
+                }
+            }
+            if (failed) break;
+        }
+        else if (strncmp(line, "http2", 5) == 0 && isspace((unsigned char)line[5]) && in_server) {
+            char *p = line + 5;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *value = next_token(&p);
+            if (!value || (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)) {
+                fprintf(stderr, "Invalid http2 directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            config->http2 = strcmp(value, "on") == 0;
+        }
+        else if (strncmp(line, "ssl_certificate", 15) == 0 && isspace((unsigned char)line[15]) && in_server) {
+            char *p = line + 15;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *path = next_token(&p);
+            free(config->ssl_certificate);
+            config->ssl_certificate = path ? copy_value(path) : NULL;
+        }
+        else if (strncmp(line, "ssl_certificate_key", 19) == 0 && isspace((unsigned char)line[19]) && in_server) {
+            char *p = line + 19;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *path = next_token(&p);
+            free(config->ssl_certificate_key);
+            config->ssl_certificate_key = path ? copy_value(path) : NULL;
+        }
+        else if (strncmp(line, "ssl_session_cache", 17) == 0 && isspace((unsigned char)line[17])) {
+            /* ssl_session_cache off | shared:NAME:SIZE; */
+            char *p = line + 17;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *value = next_token(&p);
+            char *size = value && strncmp(value, "shared:", 7) == 0 ? strchr(value + 7, ':') : NULL;
+            if (value && strcmp(value, "off") == 0) {
+                config->ssl_session_cache = 0;
+            } else if (size && parse_size(size + 1) > 0) {
+                config->ssl_session_cache = parse_size(size + 1);
+            } else {
+                fprintf(stderr, "Invalid ssl_session_cache directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "ssl_session_timeout", 19) == 0 && isspace((unsigned char)line[19])) {
+            char *p = line + 19;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *value = next_token(&p);
+            if (value) config->ssl_session_timeout = parse_msec(value);
+        }
+        else if (strncmp(line, "ssl_session_tickets", 19) == 0 && isspace((unsigned char)line[19])) {
+            char *p = line + 19;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *value = next_token(&p);
+            if (!value || (strcmp(value, "on") != 0 && strcmp(value, "off") != 0)) {
+                fprintf(stderr, "Invalid ssl_session_tickets directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            config->ssl_session_tickets = strcmp(value, "on") == 0;
+        }
+        else if (strncmp(line, "log_format", 10) == 0 && isspace((unsigned char)line[10])) {
+            if (nformats == MAX_LOG_FORMATS || parse_log_format(line + 10, &formats[nformats]) != PROTON_OK) {
+                fprintf(stderr, "Invalid log_format directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            nformats++;
+        }
+        else if (strncmp(line, "access_log", 10) == 0 && isspace((unsigned char)line[10])) {
+            /* access_log path [format] [buffer=size] [flush=time]; */
+            char *p = line + 10;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *path = next_token(&p);
+            char *arg;
+            
+            free(config->access_log);
+            config->access_log = path ? copy_value(path) : NULL;
+            
+            while ((arg = next_token(&p)) != NULL) {
+                if (strncmp(arg, "buffer=", 7) == 0) {
+                    config->access_log_buffer = parse_size(arg + 7);
+                } else if (strncmp(arg, "flush=", 6) == 0) {
+                    config->access_log_flush = parse_msec(arg + 6);
+                } else {
+                    free(access_log_format);
+                    access_log_format = copy_value(arg);
+                }
+            }
+        }
         else if (strncmp(line, "root", 4) == 0 && in_server) {
             char *value = strchr(line, ' ');
             if (value) {
@@ -178,6 +940,185 @@ proton_config_t* proton_config_parse(const char *filename) {
                 if (config->document_root) strcpy(config->document_root, value);
             }
         }
+        else if (strncmp(line, "static_bundle", 13) == 0 && isspace((unsigned char)line[13]) && in_server) {
+            char *p = line + 13;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            char *path = next_token(&p);
+            free(config->static_bundle);
+            config->static_bundle = path && strcmp(path, "off") != 0 ? copy_value(path) : NULL;
+        }
+        else if (strncmp(line, "location", 8) == 0 && isspace((unsigned char)line[8]) && in_server) {
+            location = location ? NULL : add_location(config, line + 8);
+            if (!location) {
+                fprintf(stderr, "Invalid location directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "stub_status", 11) == 0 && location) {
+            location->stub_status = 1;
+        }
+        else if (strncmp(line, "metrics", 7) == 0 && location) {
+            location->metrics = 1;
+        }
+        else if (strncmp(line, "proxy_pass", 10) == 0 && isspace((unsigned char)line[10]) && location) {
+            char *p = line + 10;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            
+            /* proxy_pass http://name; the URI is passed on unchanged */
+            char *target = next_token(&p);
+            if (target && strncmp(target, "http://", 7) == 0) target += 7;
+            if (target) {
+                size_t len = strlen(target);
+                if (len > 0 && target[len - 1] == '/') target[len - 1] = '\0';
+            }
+            
+            if (!target || *target == '\0') {
+                fprintf(stderr, "Invalid proxy_pass directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            
+            free(location->proxy_pass);
+            location->proxy_pass = copy_value(target);
+        }
+        else if ((strncmp(line, "proxy_connect_timeout", 21) == 0 ||
+                  strncmp(line, "fastcgi_connect_timeout", 23) == 0) && location) {
+            char *p = line + (line[0] == 'p' ? 21 : 23);
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            char *value = next_token(&p);
+            if (value) location->upstream_connect_timeout = parse_msec(value);
+        }
+        else if ((strncmp(line, "proxy_read_timeout", 18) == 0 ||
+                  strncmp(line, "fastcgi_read_timeout", 20) == 0) && location) {
+            char *p = line + (line[0] == 'p' ? 18 : 20);
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            char *value = next_token(&p);
+            if (value) location->upstream_read_timeout = parse_msec(value);
+        }
+        else if (strncmp(line, "fastcgi_pass", 12) == 0 && isspace((unsigned char)line[12]) && location) {
+            char *p = line + 12;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            char *target = next_token(&p);
+            if (!target) {
+                fprintf(stderr, "Invalid fastcgi_pass directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            
+            free(location->fastcgi_pass);
+            location->fastcgi_pass = copy_value(target);
+        }
+        else if (strncmp(line, "fastcgi_index", 13) == 0 && isspace((unsigned char)line[13]) && location) {
+            char *p = line + 13;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            char *value = next_token(&p);
+            if (value) {
+                free(location->fastcgi_index);
+                location->fastcgi_index = copy_value(value);
+            }
+        }
+        else if (strncmp(line, "fastcgi_param", 13) == 0 && isspace((unsigned char)line[13]) && location) {
+            if (add_fastcgi_param(location, line + 13) != PROTON_OK) {
+                fprintf(stderr, "Invalid fastcgi_param directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "limit_req_zone", 14) == 0 && isspace((unsigned char)line[14]) && in_http) {
+            if (add_limit_zone(config, line + 14, PROTON_LIMIT_REQ) != PROTON_OK) {
+                fprintf(stderr, "Invalid limit_req_zone directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "limit_conn_zone", 15) == 0 && isspace((unsigned char)line[15]) && in_http) {
+            if (add_limit_zone(config, line + 15, PROTON_LIMIT_CONN) != PROTON_OK) {
+                fprintf(stderr, "Invalid limit_conn_zone directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "limit_req", 9) == 0 && isspace((unsigned char)line[9]) && location) {
+            if (parse_limit_req(location, line + 9) != PROTON_OK) {
+                fprintf(stderr, "Invalid limit_req directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "limit_conn", 10) == 0 && isspace((unsigned char)line[10]) && location) {
+            /* limit_conn zone number; */
+            char *p = line + 10;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            char *name = next_token(&p);
+            char *value = next_token(&p);
+            if (!name || !value || atoi(value) <= 0) {
+                fprintf(stderr, "Invalid limit_conn directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            
+            free(location->limit_conn);
+            location->limit_conn = copy_value(name);
+            location->limit_conn_max = atoi(value);
+        }
+        else if (strncmp(line, "upstream", 8) == 0 && isspace((unsigned char)line[8]) && in_http && !in_server) {
+            upstream = add_upstream(config, line + 8);
+            if (!upstream) {
+                fprintf(stderr, "Invalid upstream directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "geo", 3) == 0 && isspace((unsigned char)line[3]) && in_http && !in_server) {
+            geo = add_geo(config, line + 3);
+            if (!geo) {
+                fprintf(stderr, "Invalid geo directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "allow", 5) == 0 && isspace((unsigned char)line[5]) && location) {
+            if (add_access_rule(location, line + 5, 0) != PROTON_OK) {
+                fprintf(stderr, "Invalid allow directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "deny", 4) == 0 && isspace((unsigned char)line[4]) && location) {
+            if (add_access_rule(location, line + 4, 1) != PROTON_OK) {
+                fprintf(stderr, "Invalid deny directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "dav_methods", 11) == 0 && isspace((unsigned char)line[11]) && location) {
+            if (parse_dav_methods(location, line + 11) != PROTON_OK) {
+                fprintf(stderr, "Invalid dav_methods directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+        }
+        else if (strncmp(line, "dav_max_size", 12) == 0 && isspace((unsigned char)line[12]) && location) {
+            char *p = line + 12;
+            char *semi = strchr(p, ';');
+            if (semi) *semi = '\0';
+            char *value = next_token(&p);
+            if (!value || !isdigit((unsigned char)value[0])) {
+                fprintf(stderr, "Invalid dav_max_size directive: %s\n", line);
+                failed = 1;
+                break;
+            }
+            location->dav_max_size = parse_size(value);
+        }
         else if (strcmp(line, "http {") == 0) {
             in_http = 1;
         }
@@ -185,22 +1126,165 @@ proton_config_t* proton_config_parse(const char *filename) {
             in_server = 1;
         }
         else if (strcmp(line, "}") == 0) {
-            if (in_server) in_server = 0;
+            if (location) location = NULL;
+            else if (in_server) in_server = 0;
             else if (in_http) in_http = 0;
         }
     }
     
     fprintf(stderr, "[CONFIG] Parse loop complete, closing file\n");
+    while (nincludes > 0) {
+        fclose(fp);
+        fp = includes[--nincludes];
+    }
     fclose(fp);
+    
+    /* Resolve the access log format by name */
+    if (!failed && access_log_format && strcmp(access_log_format, "combined") != 0) {
+        int i;
+        for (i = 0; i < nformats; i++) {
+            if (strcmp(formats[i].name, access_log_format) == 0) {
+                config->access_log_format = copy_value(formats[i].format);
+                break;
+            }
+        }
+        if (i == nformats) {
+            fprintf(stderr, "Unknown log format \"%s\"\n", access_log_format);
+            failed = 1;
+        }
+    }
+    
+    for (int i = 0; i < nformats; i++) {
+        free(formats[i].name);
+        free(formats[i].format);
+    }
+    free(access_log_format);
+    
+    /* Port 8080 on all IPv4 addresses without a listen directive */
+    if (!failed && config->nlistens == 0) {
+        char port[] = "8080";
+        if (add_listen(config, port) != PROTON_OK) failed = 1;
+    }
+    
+    if (failed) {
+        proton_config_destroy(config);
+        return NULL;
+    }
+    
     fprintf(stderr, "[CONFIG] File closed, returning config at %p\n", (void*)config);
     return config;
 }
 
+int proton_config_validate(proton_config_t *config) {
+    if (!config) return PROTON_ERROR;
+    
+    if (config->worker_processes < 0) {
+        proton_log(LOG_ERROR, "Invalid worker_processes: %d", config->worker_processes);
+        return PROTON_ERROR;
+    }
+    
+    if (config->worker_connections <= 0) {
+        proton_log(LOG_ERROR, "Invalid worker_connections: %d", config->worker_connections);
+        return PROTON_ERROR;
+    }
+    
+    if (config->worker_shutdown_timeout < 0) {
+        proton_log(LOG_ERROR, "Invalid worker_shutdown_timeout");
+        return PROTON_ERROR;
+    }
+    
+    if (config->listen_ssl && (!config->ssl_certificate || !config->ssl_certificate_key)) {
+        proton_log(LOG_ERROR, "listen ssl needs ssl_certificate and ssl_certificate_key");
+        return PROTON_ERROR;
+    }
+    
+    if (config->ssl_session_timeout < 1000) {
+        proton_log(LOG_ERROR, "Invalid ssl_session_timeout");
+        return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
 void proton_config_destroy(proton_config_t *config) {
     if (!config) return;
     
     free(config->error_log);
     free(config->access_log);
+    free(config->access_log_format);
     free(config->document_root);
+    free(config->static_bundle);
+    free(config->ssl_certificate);
+    free(config->ssl_certificate_key);
+    
+    for (int i = 0; i < config->nlistens; i++) {
+        free(config->listens[i].address);
+    }
+    free(config->listens);
+    
+    for (int i = 0; i < config->nlocations; i++) {
+        free(config->locations[i].prefix);
+        free(config->locations[i].proxy_pass);
+        free(config->locations[i].fastcgi_pass);
+        free(config->locations[i].fastcgi_index);
+        for (int j = 0; j < config->locations[i].nfastcgi_params; j++) {
+            free(config->locations[i].fastcgi_params[j].name);
+            free(config->locations[i].fastcgi_params[j].value);
+        }
+        free(config->locations[i].fastcgi_params);
+        free(config->locations[i].limit_req);
+        free(config->locations[i].limit_conn);
+        free(config->locations[i].access_rules);
+    }
+    free(config->locations);
+    
+    for (int i = 0; i < config->nupstreams; i++) {
+        for (int j = 0; j < config->upstreams[i].nservers; j++) {
+            free(config->upstreams[i].servers[j].address);
+        }
+        free(config->upstreams[i].servers);
+        free(config->upstreams[i].name);
+    }
+    free(config->upstreams);
+    
+    for (int i = 0; i < config->nlimit_zones; i++) {
+        free(config->limit_zones[i].name);
+        free(config->limit_zones[i].key);
+    }
+    free(config->limit_zones);
+    
+    for (int i = 0; i < config->ngeos; i++) {
+        for (int j = 0; j < config->geos[i].nvalues; j++) {
+            free(config->geos[i].values[j]);
+        }
+        free(config->geos[i].values);
+        free(config->geos[i].entries);
+        free(config->geos[i].name);
+    }
+    free(config->geos);
+    
     free(config);
 }
+
+/* Exact matches win, otherwise the longest matching prefix */
+proton_location_t* proton_config_find_location(proton_config_t *config, const char *uri) {
+    if (!config || !uri) return NULL;
+    
+    proton_location_t *best = NULL;
+    
+    for (int i = 0; i < config->nlocations; i++) {
+        proton_location_t *loc = &config->locations[i];
+        
+        if (loc->exact) {
+            if (strcmp(uri, loc->prefix) == 0) return loc;
+            continue;
+        }
+        
+        if (strncmp(uri, loc->prefix, loc->prefix_len) == 0 &&
+            (!best || loc->prefix_len > best->prefix_len)) {
+            best = loc;
+        }
+    }
+    
+    return best;
+}
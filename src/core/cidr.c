@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proton.h"
+#include "cidr.h"
+
+/*
+ * Prefixes are turned into ranges of 128-bit keys, IPv4 addresses taking
+ * the top 32 bits, and the ranges into a sorted list of intervals that
+ * each have one value. The trie is built from that list: a subtree whose
+ * keys all fall in one interval becomes a leaf. Leaves of a node that
+ * repeat the previous leaf's value are stored once.
+ *
+ * PROTON_CIDR_DIRECT and the stride are chosen so both families end on a
+ * node boundary: 14 + 3 * 6 = 32 and 14 + 19 * 6 = 128.
+ */
+
+typedef unsigned __int128 cidr_key_t;
+
+#define CIDR_STRIDE     6
+#define CIDR_KEY_BITS   128
+#define CIDR_TOP        (CIDR_KEY_BITS - PROTON_CIDR_DIRECT)
+#define CIDR_LEAF       0x80000000u     /* direct entry holding a value */
+#define CIDR_KEY_MAX    (~(cidr_key_t)0)
+
+typedef struct {
+    uint64_t vector;        /* children that are nodes */
+    uint64_t leafvec;       /* children where a run of equal leaves starts */
+    uint32_t base0;         /* first leaf */
+    uint32_t base1;         /* first child node */
+} cidr_node_t;
+
+struct proton_cidr_s {
+    int family;
+    uint32_t direct[1 << PROTON_CIDR_DIRECT];
+    cidr_node_t *nodes;
+    uint32_t nnodes;
+    uint16_t *leaves;
+    uint32_t nleaves;
+};
+
+typedef struct {
+    cidr_key_t lo;
+    cidr_key_t hi;
+    int order;
+    uint16_t value;
+} cidr_range_t;
+
+typedef struct {
+    cidr_key_t *starts;     /* of the intervals, ascending from 0 */
+    uint16_t *values;
+    size_t n;
+    size_t cap;
+    uint32_t nodes_cap;
+    uint32_t leaves_cap;
+    proton_cidr_t *table;
+} cidr_builder_t;
+
+static cidr_key_t cidr_key(const uint8_t *addr, int family) {
+    int n = family == AF_INET ? 4 : 16;
+    cidr_key_t key = 0;
+    
+    for (int i = 0; i < n; i++) {
+        key = key << 8 | addr[i];
+    }
+    return n == 16 ? key : key << (CIDR_KEY_BITS - 8 * n);
+}
+
+static int range_cmp(const void *a, const void *b) {
+    const cidr_range_t *x = a, *y = b;
+    
+    /* Covering ranges before the ones they cover, then in rule order */
+    if (x->lo != y->lo) return x->lo < y->lo ? -1 : 1;
+    if (x->hi != y->hi) return x->hi > y->hi ? -1 : 1;
+    return x->order - y->order;
+}
+
+static int emit(cidr_builder_t *b, cidr_key_t start, uint16_t value) {
+    if (b->n > 0 && b->values[b->n - 1] == value) return PROTON_OK;
+    
+    if (b->n == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 1024;
+        cidr_key_t *starts = realloc(b->starts, cap * sizeof(cidr_key_t));
+        if (!starts) return PROTON_ERROR;
+        b->starts = starts;
+        uint16_t *values = realloc(b->values, cap * sizeof(uint16_t));
+        if (!values) return PROTON_ERROR;
+        b->values = values;
+        b->cap = cap;
+    }
+    
+    b->starts[b->n] = start;
+    b->values[b->n] = value;
+    b->n++;
+    return PROTON_OK;
+}
+
+/* Sorted ranges to intervals: a stack of the ranges covering the current key */
+static int build_intervals(cidr_builder_t *b, cidr_range_t *ranges, size_t nranges, int mode) {
+    cidr_range_t stack[CIDR_KEY_BITS + 1];
+    int top = -1;
+    cidr_key_t cur = 0;
+    int end = 0;            /* every key has its interval */
+    
+    for (size_t i = 0; i <= nranges; i++) {
+        cidr_range_t *r = i < nranges ? &ranges[i] : NULL;
+        
+        while (top >= 0 && (!r || stack[top].hi < r->lo)) {
+            if (!end && cur <= stack[top].hi && emit(b, cur, stack[top].value) != PROTON_OK) {
+                return PROTON_ERROR;
+            }
+            if (stack[top].hi == CIDR_KEY_MAX) end = 1;
+            else cur = stack[top].hi + 1;
+            top--;
+        }
+        
+        if (!r) break;
+        
+        if (cur < r->lo && emit(b, cur, top >= 0 ? stack[top].value : PROTON_CIDR_NONE) != PROTON_OK) {
+            return PROTON_ERROR;
+        }
+        cur = r->lo;
+        
+        if (top >= 0 && stack[top].lo == r->lo && stack[top].hi == r->hi) {
+            if (mode == PROTON_CIDR_LONGEST) stack[top].value = r->value;
+            continue;
+        }
+        
+        stack[++top] = *r;
+        if (mode == PROTON_CIDR_FIRST && top > 0 && stack[top - 1].order < r->order) {
+            stack[top].value = stack[top - 1].value;
+            stack[top].order = stack[top - 1].order;
+        }
+    }
+    
+    if (!end && emit(b, cur, PROTON_CIDR_NONE) != PROTON_OK) return PROTON_ERROR;
+    return PROTON_OK;
+}
+
+static int add_nodes(cidr_builder_t *b, uint32_t n, uint32_t *first) {
+    proton_cidr_t *t = b->table;
+    
+    if (t->nnodes + n > b->nodes_cap) {
+        uint32_t cap = b->nodes_cap ? b->nodes_cap : 256;
+        while (cap < t->nnodes + n) cap *= 2;
+        if (cap >= CIDR_LEAF) return PROTON_ERROR;
+        cidr_node_t *nodes = realloc(t->nodes, cap * sizeof(cidr_node_t));
+        if (!nodes) return PROTON_ERROR;
+        t->nodes = nodes;
+        b->nodes_cap = cap;
+    }
+    
+    memset(&t->nodes[t->nnodes], 0, n * sizeof(cidr_node_t));
+    *first = t->nnodes;
+    t->nnodes += n;
+    return PROTON_OK;
+}
+
+static int add_leaf(cidr_builder_t *b, uint16_t value) {
+    proton_cidr_t *t = b->table;
+    
+    if (t->nleaves == b->leaves_cap) {
+        uint32_t cap = b->leaves_cap ? b->leaves_cap * 2 : 1024;
+        uint16_t *leaves = realloc(t->leaves, cap * sizeof(uint16_t));
+        if (!leaves) return PROTON_ERROR;
+        t->leaves = leaves;
+        b->leaves_cap = cap;
+    }
+    
+    t->leaves[t->nleaves++] = value;
+    return PROTON_OK;
+}
+
+/* Fills node at, which covers the keys from base on with width bits below it */
+static int build_node(cidr_builder_t *b, uint32_t at, cidr_key_t base, int width, size_t first) {
+    int child_width = width - CIDR_STRIDE;
+    cidr_key_t span = ((cidr_key_t)1 << child_width) - 1;
+    size_t cursor[1 << CIDR_STRIDE];
+    uint64_t vector = 0, leafvec = 0;
+    uint32_t base0 = b->table->nleaves;
+    int last = -1;
+    size_t i = first;
+    
+    for (int c = 0; c < (1 << CIDR_STRIDE); c++) {
+        cidr_key_t lo = base + ((cidr_key_t)c << child_width);
+        while (i + 1 < b->n && b->starts[i + 1] <= lo) i++;
+        
+        if (i + 1 < b->n && b->starts[i + 1] <= lo + span) {
+            vector |= 1ULL << c;
+            cursor[c] = i;
+            continue;
+        }
+        
+        if (b->values[i] != last) {
+            leafvec |= 1ULL << c;
+            last = b->values[i];
+            if (add_leaf(b, b->values[i]) != PROTON_OK) return PROTON_ERROR;
+        }
+    }
+    
+    uint32_t base1 = 0;
+    if (vector && add_nodes(b, __builtin_popcountll(vector), &base1) != PROTON_OK) {
+        return PROTON_ERROR;
+    }
+    
+    cidr_node_t *node = &b->table->nodes[at];
+    node->vector = vector;
+    node->leafvec = leafvec;
+    node->base0 = base0;
+    node->base1 = base1;
+    
+    for (int c = 0; c < (1 << CIDR_STRIDE); c++) {
+        if (!(vector & (1ULL << c))) continue;
+        
+        cidr_key_t lo = base + ((cidr_key_t)c << child_width);
+        if (build_node(b, base1++, lo, child_width, cursor[c]) != PROTON_OK) return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+static int build_trie(cidr_builder_t *b) {
+    proton_cidr_t *t = b->table;
+    cidr_key_t span = ((cidr_key_t)1 << CIDR_TOP) - 1;
+    size_t i = 0;
+    
+    for (uint32_t d = 0; d < (1u << PROTON_CIDR_DIRECT); d++) {
+        cidr_key_t lo = (cidr_key_t)d << CIDR_TOP;
+        while (i + 1 < b->n && b->starts[i + 1] <= lo) i++;
+        
+        if (i + 1 == b->n || b->starts[i + 1] > lo + span) {
+            t->direct[d] = CIDR_LEAF | b->values[i];
+            continue;
+        }
+        
+        uint32_t at;
+        if (add_nodes(b, 1, &at) != PROTON_OK) return PROTON_ERROR;
+        t->direct[d] = at;
+        if (build_node(b, at, lo, CIDR_TOP, i) != PROTON_OK) return PROTON_ERROR;
+    }
+    
+    /* Give back what the doubling left over */
+    if (t->nnodes > 0) {
+        cidr_node_t *nodes = realloc(t->nodes, t->nnodes * sizeof(cidr_node_t));
+        if (nodes) t->nodes = nodes;
+    }
+    if (t->nleaves > 0) {
+        uint16_t *leaves = realloc(t->leaves, t->nleaves * sizeof(uint16_t));
+        if (leaves) t->leaves = leaves;
+    }
+    
+    return PROTON_OK;
+}
+
+proton_cidr_t* proton_cidr_build(const proton_cidr_rule_t *rules, int nrules, int family, int mode) {
+    cidr_range_t *ranges = malloc((nrules > 0 ? nrules : 1) * sizeof(cidr_range_t));
+    if (!ranges) return NULL;
+    
+    size_t nranges = 0;
+    for (int i = 0; i < nrules; i++) {
+        const proton_cidr_rule_t *rule = &rules[i];
+        if (rule->family != family && rule->family != 0) continue;
+        
+        cidr_range_t *r = &ranges[nranges++];
+        cidr_key_t host = rule->len >= CIDR_KEY_BITS ? 0 : CIDR_KEY_MAX >> rule->len;
+        
+        r->lo = rule->family ? cidr_key(rule->addr, family) & ~host : 0;
+        r->hi = r->lo | host;
+        r->order = i;
+        r->value = rule->value;
+    }
+    
+    qsort(ranges, nranges, sizeof(cidr_range_t), range_cmp);
+    
+    cidr_builder_t b;
+    memset(&b, 0, sizeof(b));
+    b.table = calloc(1, sizeof(proton_cidr_t));
+    
+    if (!b.table || build_intervals(&b, ranges, nranges, mode) != PROTON_OK || build_trie(&b) != PROTON_OK) {
+        proton_cidr_destroy(b.table);
+        b.table = NULL;
+    } else {
+        b.table->family = family;
+    }
+    
+    free(b.starts);
+    free(b.values);
+    free(ranges);
+    return b.table;
+}
+
+void proton_cidr_destroy(proton_cidr_t *table) {
+    if (!table) return;
+    
+    free(table->nodes);
+    free(table->leaves);
+    free(table);
+}
+
+size_t proton_cidr_memory(const proton_cidr_t *table) {
+    if (!table) return 0;
+    return sizeof(proton_cidr_t) + table->nnodes * sizeof(cidr_node_t) + table->nleaves * sizeof(uint16_t);
+}
+
+uint16_t proton_cidr_lookup(const proton_cidr_t *table, const uint8_t *addr) {
+    cidr_key_t key = cidr_key(addr, table->family);
+    uint32_t d = table->direct[(uint32_t)(key >> CIDR_TOP)];
+    
+    if (d & CIDR_LEAF) return (uint16_t)d;
+    
+    const cidr_node_t *node = &table->nodes[d];
+    int shift = CIDR_TOP;
+    
+    while (1) {
+        shift -= CIDR_STRIDE;
+        unsigned c = (unsigned)(key >> shift) & ((1 << CIDR_STRIDE) - 1);
+        
+        /* Children and leaves up to and including c, by popcount */
+        if (!(node->vector & (1ULL << c))) {
+            return table->leaves[node->base0 + __builtin_popcountll(node->leafvec << (63 - c)) - 1];
+        }
+        node = &table->nodes[node->base1 + __builtin_popcountll(node->vector << (63 - c)) - 1];
+    }
+}
+
+int proton_cidr_parse(const char *text, proton_cidr_rule_t *rule) {
+    char addr[INET6_ADDRSTRLEN];
+    const char *slash = strchr(text, '/');
+    size_t len = slash ? (size_t)(slash - text) : strlen(text);
+    
+    if (len == 0 || len >= sizeof(addr)) return PROTON_ERROR;
+    memcpy(addr, text, len);
+    addr[len] = '\0';
+    
+    memset(rule->addr, 0, sizeof(rule->addr));
+    rule->family = strchr(addr, ':') ? AF_INET6 : AF_INET;
+    if (inet_pton(rule->family, addr, rule->addr) != 1) return PROTON_ERROR;
+    
+    int max = rule->family == AF_INET ? 32 : 128;
+    int bits = max;
+    if (slash) {
+        char *end;
+        if (!isdigit((unsigned char)slash[1])) return PROTON_ERROR;
+        long n = strtol(slash + 1, &end, 10);
+        if (*end != '\0' || n > max) return PROTON_ERROR;
+        bits = (int)n;
+    }
+    rule->len = bits;
+    
+    /* 10.1.2.3/8 is 10.0.0.0/8 */
+    for (int i = 0; i < 16; i++) {
+        int keep = bits - 8 * i;
+        if (keep <= 0) rule->addr[i] = 0;
+        else if (keep < 8) rule->addr[i] &= 0xff << (8 - keep);
+    }
+    
+    return PROTON_OK;
+}
+
+static int has_family(const proton_cidr_rule_t *rules, int nrules, int family) {
+    for (int i = 0; i < nrules; i++) {
+        if (rules[i].family == family || rules[i].family == 0) return 1;
+    }
+    return 0;
+}
+
+int proton_cidr_set_build(proton_cidr_set_t *set, const proton_cidr_rule_t *rules, int nrules, int mode) {
+    memset(set, 0, sizeof(*set));
+    set->unix_value = PROTON_CIDR_NONE;
+    
+    for (int i = 0; i < nrules; i++) {
+        if (rules[i].family != AF_UNIX && rules[i].family != 0) continue;
+        set->unix_value = rules[i].value;
+        if (mode == PROTON_CIDR_FIRST) break;
+    }
+    
+    /* A family without rules needs no table */
+    if (has_family(rules, nrules, AF_INET)) {
+        set->v4 = proton_cidr_build(rules, nrules, AF_INET, mode);
+        if (!set->v4) return PROTON_ERROR;
+    }
+    
+    if (has_family(rules, nrules, AF_INET6)) {
+        set->v6 = proton_cidr_build(rules, nrules, AF_INET6, mode);
+        if (!set->v6) {
+            proton_cidr_set_destroy(set);
+            return PROTON_ERROR;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+void proton_cidr_set_destroy(proton_cidr_set_t *set) {
+    proton_cidr_destroy(set->v4);
+    proton_cidr_destroy(set->v6);
+    set->v4 = NULL;
+    set->v6 = NULL;
+}
+
+uint16_t proton_cidr_set_lookup(const proton_cidr_set_t *set, proton_http_connection_t *conn) {
+    const struct sockaddr_storage *ss = &conn->sockaddr;
+    
+    if (ss->ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*)ss;
+        return set->v4 ? proton_cidr_lookup(set->v4, (const uint8_t*)&sin->sin_addr) : PROTON_CIDR_NONE;
+    }
+    
+    if (ss->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)ss;
+        const uint8_t *addr = sin6->sin6_addr.s6_addr;
+        
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            return set->v4 ? proton_cidr_lookup(set->v4, addr + 12) : PROTON_CIDR_NONE;
+        }
+        return set->v6 ? proton_cidr_lookup(set->v6, addr) : PROTON_CIDR_NONE;
+    }
+    
+    return set->unix_value;
+}
@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "proton.h"
+
+/*
+ * Listening sockets are owned by the master. Workers inherit them across
+ * fork(), and a new binary inherits them across exec() through the
+ * PROTON_LISTEN_FDS environment variable ("fd;fd;..."). Sockets passed by
+ * systemd socket activation (LISTEN_FDS/LISTEN_PID) are adopted the same way.
+ * Whenever the configuration is applied, inherited or already open sockets
+ * whose address matches a listen directive are reused, with the backlog
+ * and buffer sizes of the directive.
+ *
+ * Unix socket files are replaced when opened, made accessible to everyone
+ * (restrict the directory instead) and removed again when closed, unless
+ * they came from outside or were handed to a new binary.
+ */
+
+#define LISTEN_BACKLOG      128
+#define SD_LISTEN_FDS_START 3
+
+proton_listening_t *proton_listening = NULL;
+int proton_nlistening = 0;
+
+/* Sockets passed to a new binary stay where they are when we exit */
+static int handed_over = 0;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int set_cloexec(int fd, int on) {
+    int flags = fcntl(fd, F_GETFD, 0);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFD, on ? (flags | FD_CLOEXEC) : (flags & ~FD_CLOEXEC));
+}
+
+static int sockaddr_equal(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) return 0;
+    
+    if (a->ss_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in*)a;
+        const struct sockaddr_in *y = (const struct sockaddr_in*)b;
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    
+    if (a->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6*)a;
+        const struct sockaddr_in6 *y = (const struct sockaddr_in6*)b;
+        return x->sin6_port == y->sin6_port &&
+               memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+    }
+    
+    if (a->ss_family == AF_UNIX) {
+        const struct sockaddr_un *x = (const struct sockaddr_un*)a;
+        const struct sockaddr_un *y = (const struct sockaddr_un*)b;
+        return strncmp(x->sun_path, y->sun_path, sizeof(x->sun_path)) == 0;
+    }
+    
+    return 0;
+}
+
+static void format_addr(proton_listening_t *ls) {
+    char host[INET6_ADDRSTRLEN] = "?";
+    int port = 0;
+    
+    if (ls->sockaddr.ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)&ls->sockaddr;
+        inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+        port = ntohs(sin->sin_port);
+        snprintf(ls->addr_text, sizeof(ls->addr_text), "%s:%d", host, port);
+    } else if (ls->sockaddr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&ls->sockaddr;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+        port = ntohs(sin6->sin6_port);
+        snprintf(ls->addr_text, sizeof(ls->addr_text), "[%s]:%d", host, port);
+    } else if (ls->sockaddr.ss_family == AF_UNIX) {
+        struct sockaddr_un *sun = (struct sockaddr_un*)&ls->sockaddr;
+        snprintf(ls->addr_text, sizeof(ls->addr_text), "unix:%.*s",
+                 (int)sizeof(sun->sun_path), sun->sun_path);
+    } else {
+        snprintf(ls->addr_text, sizeof(ls->addr_text), "fd:%d", ls->fd);
+    }
+}
+
+/* "8080", "*:8080", "127.0.0.1:8080", "localhost:8080" or "[::1]:8080" */
+static int split_address(const char *address, char *host, size_t size, char *port) {
+    const char *colon;
+    
+    if (address[0] == '[') {
+        const char *close = strchr(address, ']');
+        if (!close || close[1] != ':') return PROTON_ERROR;
+        if ((size_t)(close - address - 1) >= size) return PROTON_ERROR;
+        memcpy(host, address + 1, close - address - 1);
+        host[close - address - 1] = '\0';
+        colon = close + 1;
+    } else if ((colon = strrchr(address, ':')) != NULL) {
+        if ((size_t)(colon - address) >= size) return PROTON_ERROR;
+        memcpy(host, address, colon - address);
+        host[colon - address] = '\0';
+        if (strcmp(host, "*") == 0) host[0] = '\0';
+    } else {
+        host[0] = '\0';
+        colon = address - 1;
+    }
+    
+    char *end;
+    long n = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || n <= 0 || n > 65535) return PROTON_ERROR;
+    snprintf(port, 8, "%ld", n);
+    
+    return PROTON_OK;
+}
+
+static proton_listening_t* add_address(proton_listening_t **list, int *n, proton_listen_t *l,
+                                       const void *sockaddr, socklen_t socklen) {
+    proton_listening_t *grown = realloc(*list, (*n + 1) * sizeof(proton_listening_t));
+    if (!grown) return NULL;
+    *list = grown;
+    
+    proton_listening_t *ls = &grown[(*n)++];
+    memset(ls, 0, sizeof(*ls));
+    memcpy(&ls->sockaddr, sockaddr, socklen);
+    ls->socklen = socklen;
+    ls->fd = -1;
+    ls->backlog = l->backlog > 0 ? l->backlog : LISTEN_BACKLOG;
+    ls->ssl = l->ssl;
+    ls->ipv6only = l->ipv6only;
+    ls->deferred = l->deferred;
+    ls->rcvbuf = l->rcvbuf;
+    ls->sndbuf = l->sndbuf;
+    format_addr(ls);
+    
+    return ls;
+}
+
+/* Every address a listen directive names; a host name may have several */
+static int resolve_listen(proton_listen_t *l, proton_listening_t **list, int *n) {
+    if (strncmp(l->address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        
+        if (l->address[5] == '\0' || strlen(l->address + 5) >= sizeof(sun.sun_path)) {
+            proton_log(LOG_ERROR, "Invalid unix socket path in \"listen %s\"", l->address);
+            return PROTON_ERROR;
+        }
+        strcpy(sun.sun_path, l->address + 5);
+        
+        return add_address(list, n, l, &sun, sizeof(sun)) ? PROTON_OK : PROTON_ERROR;
+    }
+    
+    char host[256], port[8];
+    if (split_address(l->address, host, sizeof(host), port) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Invalid address in \"listen %s\"", l->address);
+        return PROTON_ERROR;
+    }
+    
+    /* No host is every IPv4 address, as a bare port always was */
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = host[0] ? AF_UNSPEC : AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    
+    int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (err != 0) {
+        proton_log(LOG_ERROR, "Host not found in \"listen %s\": %s", l->address, gai_strerror(err));
+        return PROTON_ERROR;
+    }
+    
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (!add_address(list, n, l, ai->ai_addr, ai->ai_addrlen)) {
+            freeaddrinfo(res);
+            return PROTON_ERROR;
+        }
+    }
+    
+    freeaddrinfo(res);
+    return PROTON_OK;
+}
+
+/* Addresses the configuration asks for */
+static int config_addresses(proton_config_t *config, proton_listening_t **out) {
+    proton_listening_t *list = NULL;
+    int n = 0;
+    
+    for (int i = 0; i < config->nlistens; i++) {
+        if (resolve_listen(&config->listens[i], &list, &n) != PROTON_OK) {
+            free(list);
+            return -1;
+        }
+    }
+    
+    *out = list;
+    return n;
+}
+
+/* Options that may change on a socket that is already listening */
+static void set_options(proton_listening_t *ls) {
+    if (ls->rcvbuf > 0 && setsockopt(ls->fd, SOL_SOCKET, SO_RCVBUF, &ls->rcvbuf, sizeof(int)) < 0) {
+        proton_log(LOG_WARN, "Failed to set SO_RCVBUF on %s: %s", ls->addr_text, strerror(errno));
+    }
+    
+    if (ls->sndbuf > 0 && setsockopt(ls->fd, SOL_SOCKET, SO_SNDBUF, &ls->sndbuf, sizeof(int)) < 0) {
+        proton_log(LOG_WARN, "Failed to set SO_SNDBUF on %s: %s", ls->addr_text, strerror(errno));
+    }
+
+#ifdef TCP_DEFER_ACCEPT
+    if (ls->sockaddr.ss_family != AF_UNIX) {
+        int timeout = ls->deferred ? 1 : 0;
+        setsockopt(ls->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout));
+    }
+#endif
+}
+
+/* A stale socket file left behind would make bind() fail */
+static void remove_unix_file(proton_listening_t *ls) {
+    struct sockaddr_un *sun = (struct sockaddr_un*)&ls->sockaddr;
+    struct stat st;
+    
+    if (stat(sun->sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(sun->sun_path);
+    }
+}
+
+static void close_socket(proton_listening_t *ls) {
+    close(ls->fd);
+    
+    if (ls->sockaddr.ss_family == AF_UNIX && !ls->inherited && !handed_over) {
+        remove_unix_file(ls);
+    }
+}
+
+static int open_socket(proton_listening_t *ls) {
+    int fd = socket(ls->sockaddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        proton_log(LOG_ERROR, "Failed to create socket for %s: %s", ls->addr_text, strerror(errno));
+        return -1;
+    }
+    
+    int opt = 1;
+    if (ls->sockaddr.ss_family == AF_UNIX) {
+        remove_unix_file(ls);
+    } else if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        proton_log(LOG_ERROR, "Failed to set SO_REUSEADDR: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    /* [::] alone or alongside a listener on 0.0.0.0 of the same port */
+    if (ls->sockaddr.ss_family == AF_INET6 &&
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &ls->ipv6only, sizeof(int)) < 0) {
+        proton_log(LOG_ERROR, "Failed to set IPV6_V6ONLY: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    if (bind(fd, (struct sockaddr*)&ls->sockaddr, ls->socklen) < 0) {
+        proton_log(LOG_ERROR, "Failed to bind to %s: %s", ls->addr_text, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    if (ls->sockaddr.ss_family == AF_UNIX) {
+        struct sockaddr_un *sun = (struct sockaddr_un*)&ls->sockaddr;
+        if (chmod(sun->sun_path, 0666) < 0) {
+            proton_log(LOG_WARN, "Failed to chmod %s: %s", ls->addr_text, strerror(errno));
+        }
+    }
+    
+    if (listen(fd, ls->backlog) < 0) {
+        proton_log(LOG_ERROR, "Failed to listen on %s: %s", ls->addr_text, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+int proton_listening_open(proton_config_t *config) {
+    proton_listening_t *wanted;
+    int n = config_addresses(config, &wanted);
+    if (n < 0) return PROTON_ERROR;
+    
+    char *reused = calloc(n, 1);
+    char *kept = calloc(proton_nlistening + 1, 1);
+    if (!reused || !kept) {
+        free(reused);
+        free(kept);
+        free(wanted);
+        return PROTON_ERROR;
+    }
+    
+    /* Reuse matching sockets and open the rest; nothing changes on failure */
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < proton_nlistening; j++) {
+            if (!kept[j] && sockaddr_equal(&wanted[i].sockaddr, &proton_listening[j].sockaddr)) {
+                wanted[i].fd = proton_listening[j].fd;
+                wanted[i].inherited = proton_listening[j].inherited;
+                reused[i] = 1;
+                kept[j] = 1;
+                break;
+            }
+        }
+        
+        if (reused[i]) {
+            if (wanted[i].inherited) {
+                proton_log(LOG_INFO, "Using inherited socket %d for %s", wanted[i].fd, wanted[i].addr_text);
+            }
+            
+            /* A new backlog takes effect by listening again */
+            listen(wanted[i].fd, wanted[i].backlog);
+            set_options(&wanted[i]);
+            continue;
+        }
+        
+        wanted[i].fd = open_socket(&wanted[i]);
+        if (wanted[i].fd < 0) {
+            for (int k = 0; k < i; k++) {
+                if (!reused[k]) close_socket(&wanted[k]);
+            }
+            free(reused);
+            free(kept);
+            free(wanted);
+            return PROTON_ERROR;
+        }
+        set_options(&wanted[i]);
+        proton_log(LOG_INFO, "Listening on %s", wanted[i].addr_text);
+    }
+    
+    /* Whatever is left is no longer configured */
+    for (int j = 0; j < proton_nlistening; j++) {
+        if (!kept[j]) {
+            proton_log(LOG_INFO, "Closing listening socket %s", proton_listening[j].addr_text);
+            close_socket(&proton_listening[j]);
+        }
+    }
+    
+    free(proton_listening);
+    proton_listening = wanted;
+    proton_nlistening = n;
+    
+    free(reused);
+    free(kept);
+    return PROTON_OK;
+}
+
+void proton_listening_close(void) {
+    for (int i = 0; i < proton_nlistening; i++) {
+        close_socket(&proton_listening[i]);
+    }
+    
+    free(proton_listening);
+    proton_listening = NULL;
+    proton_nlistening = 0;
+}
+
+static int adopt_fd(proton_listening_t *ls, int fd) {
+    ls->fd = fd;
+    ls->socklen = sizeof(ls->sockaddr);
+    ls->inherited = 1;
+    
+    if (getsockname(fd, (struct sockaddr*)&ls->sockaddr, &ls->socklen) < 0) {
+        proton_log(LOG_WARN, "Ignoring inherited fd %d: %s", fd, strerror(errno));
+        return PROTON_ERROR;
+    }
+    
+    set_nonblocking(fd);
+    set_cloexec(fd, 1);
+    format_addr(ls);
+    return PROTON_OK;
+}
+
+int proton_listening_inherit(void) {
+    int fds[64];
+    int n = 0;
+    
+    /* From a previous binary during an upgrade */
+    const char *env = getenv("PROTON_LISTEN_FDS");
+    if (env) {
+        const char *p = env;
+        while (*p && n < 64) {
+            char *end;
+            long fd = strtol(p, &end, 10);
+            if (end == p) break;
+            fds[n++] = (int)fd;
+            p = (*end == ';') ? end + 1 : end;
+        }
+        unsetenv("PROTON_LISTEN_FDS");
+    }
+    
+    /* From systemd socket activation */
+    const char *pid = getenv("LISTEN_PID");
+    const char *count = getenv("LISTEN_FDS");
+    if (pid && count && atoi(pid) == getpid()) {
+        int nfds = atoi(count);
+        for (int i = 0; i < nfds && n < 64; i++) {
+            fds[n++] = SD_LISTEN_FDS_START + i;
+        }
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        unsetenv("LISTEN_FDNAMES");
+    }
+    
+    if (n == 0) return PROTON_OK;
+    
+    proton_listening = calloc(n, sizeof(proton_listening_t));
+    if (!proton_listening) return PROTON_ERROR;
+    
+    for (int i = 0; i < n; i++) {
+        proton_listening_t *ls = &proton_listening[proton_nlistening];
+        if (adopt_fd(ls, fds[i]) == PROTON_OK) {
+            proton_log(LOG_INFO, "Inherited listening socket %d (%s)", ls->fd, ls->addr_text);
+            proton_nlistening++;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+/* "PROTON_LISTEN_FDS=3;4;" for a new binary; fds are made exec-safe */
+char* proton_listening_export(void) {
+    size_t size = sizeof("PROTON_LISTEN_FDS=") + proton_nlistening * 12;
+    char *env = malloc(size);
+    if (!env) return NULL;
+    
+    size_t len = snprintf(env, size, "PROTON_LISTEN_FDS=");
+    for (int i = 0; i < proton_nlistening; i++) {
+        if (proton_listening[i].fd < 0) continue;
+        set_cloexec(proton_listening[i].fd, 0);
+        len += snprintf(env + len, size - len, "%d;", proton_listening[i].fd);
+    }
+    
+    return env;
+}
+
+/* A new binary holds the sockets now (or no longer, if it exited) */
+void proton_listening_handover(int on) {
+    handed_over = on;
+}
@@ -1,13 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <time.h>
-#include <unistd.h>
+#include <pthread.h>
 #include "proton.h"
 
 static FILE *log_file = NULL;
 static int log_level = LOG_INFO;
+static char log_path[1024];
+
+/* The access log flusher thread logs its errors too; reopen swaps log_file under it */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static const char* level_strings[] = {
     "DEBUG", "INFO", "WARN", "ERROR"
@@ -17,10 +22,12 @@ void proton_log_init(const char *filename, int level) {
     log_level = level;
     
     if (!filename || strcmp(filename, "stderr") == 0) {
+        log_path[0] = '\0';
         log_file = stderr;
         return;
     }
     
+    snprintf(log_path, sizeof(log_path), "%s", filename);
     log_file = fopen(filename, "a");
     if (!log_file) {
         fprintf(stderr, "Failed to open log file: %s\n", filename);
@@ -29,33 +36,63 @@ void proton_log_init(const char *filename, int level) {
 }
 
 void proton_log(int level, const char *fmt, ...) {
+    /* Nothing is formatted for a level that is not logged */
     if (level < log_level) return;
-    if (!log_file) log_file = stderr;
     
-    /* Get timestamp */
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    char timestamp[32];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
+    /* The event loop's cached time; formatted here only before the first update */
+    const char *timestamp = proton_cached_error_log_time;
+    char now_str[32];
+    if (proton_current_sec == 0) {
+        time_t now = time(NULL);
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        strftime(now_str, sizeof(now_str), "%Y-%m-%d %H:%M:%S", &tm_info);
+        timestamp = now_str;
+    }
+    
+    pthread_mutex_lock(&log_lock);
+    FILE *fp = log_file ? log_file : stderr;
     
     /* Print log entry */
-    fprintf(log_file, "[%s] [%s] [%d] ", 
+    fprintf(fp, "[%s] [%s] [%d] ", 
             timestamp, 
             level_strings[level], 
-            getpid());
+            (int)proton_pid);
     
     va_list args;
     va_start(args, fmt);
-    vfprintf(log_file, fmt, args);
+    vfprintf(fp, fmt, args);
     va_end(args);
     
-    fprintf(log_file, "\n");
-    fflush(log_file);
+    fprintf(fp, "\n");
+    fflush(fp);
+    pthread_mutex_unlock(&log_lock);
+}
+
+void proton_log_reopen(void) {
+    if (log_path[0] == '\0') return;
+    
+    FILE *fp = fopen(log_path, "a");
+    if (!fp) {
+        proton_log(LOG_ERROR, "Failed to reopen log file: %s", log_path);
+        return;
+    }
+    
+    pthread_mutex_lock(&log_lock);
+    FILE *old = log_file;
+    log_file = fp;
+    pthread_mutex_unlock(&log_lock);
+    
+    if (old && old != stderr) {
+        fclose(old);
+    }
 }
 
 void proton_log_close(void) {
+    pthread_mutex_lock(&log_lock);
     if (log_file && log_file != stderr) {
         fclose(log_file);
-        log_file = NULL;
     }
+    log_file = NULL;
+    pthread_mutex_unlock(&log_lock);
 }
@@ -1,33 +1,139 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <sys/signalfd.h>
 #include "proton.h"
+#include "http.h"
 #include "module.h"
+#include "tls.h"
 
-static pid_t *worker_pids = NULL;
+/* Crash loop protection: a worker that dies young is respawned with backoff */
+#define RESPAWN_STABLE_MSEC     10000   /* uptime that resets the backoff */
+#define RESPAWN_BACKOFF_MIN     100
+#define RESPAWN_BACKOFF_MAX     30000
+
+/* One slot per configured worker; the slot keeps its respawn history */
+typedef struct {
+    pid_t pid;
+    uint64_t started;       /* proton_current_msec at fork */
+    uint64_t respawn_at;    /* pending respawn, 0 if none */
+    int failures;           /* consecutive early exits */
+    unsigned int respawns;
+} worker_slot_t;
+
+static worker_slot_t *workers = NULL;
 static int num_workers = 0;
+static unsigned int total_respawns = 0;
 static proton_config_t *master_config = NULL;
 
+/* Workers of previous configurations that are still draining */
+static pid_t *retired_pids = NULL;
+static int num_retired = 0;
+
+/* New binary started by SIGUSR2 */
+static pid_t upgrade_pid = 0;
+
+/* The master takes its signals from a signalfd instead of handlers */
+static int signal_fd = -1;
+static sigset_t saved_sigmask;
+
+static int open_signalfd(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGCHLD);
+    
+    if (sigprocmask(SIG_BLOCK, &set, &saved_sigmask) < 0) {
+        proton_log(LOG_ERROR, "Failed to block signals: %s", strerror(errno));
+        return PROTON_ERROR;
+    }
+    
+    signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        proton_log(LOG_ERROR, "Failed to create signalfd: %s", strerror(errno));
+        sigprocmask(SIG_SETMASK, &saved_sigmask, NULL);
+        return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+/* Children get the signal mask back and use the regular handlers */
+static void restore_signals(void) {
+    if (signal_fd >= 0) {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+    sigprocmask(SIG_SETMASK, &saved_sigmask, NULL);
+}
+
+static void read_signals(void) {
+    struct signalfd_siginfo si;
+    
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        switch (si.ssi_signo) {
+            case SIGINT:
+            case SIGTERM:
+                proton_quit = 1;
+                break;
+            case SIGQUIT:
+                proton_shutdown = 1;
+                break;
+            case SIGHUP:
+                proton_reload = 1;
+                break;
+            case SIGUSR1:
+                proton_reopen = 1;
+                break;
+            case SIGUSR2:
+                proton_upgrade = 1;
+                break;
+            case SIGCHLD:
+                /* Reaped by the main loop */
+                break;
+        }
+    }
+}
+
 static void spawn_worker(proton_config_t *config, int worker_id) {
+    worker_slot_t *w = &workers[worker_id];
+    int slot = proton_scoreboard_acquire();
     pid_t pid = fork();
     
     if (pid < 0) {
-        proton_log(LOG_ERROR, "Failed to fork worker process");
+        proton_log(LOG_ERROR, "Failed to fork worker process: %s", strerror(errno));
+        proton_scoreboard_release(slot);
+        w->respawn_at = proton_current_msec + RESPAWN_BACKOFF_MIN;
         return;
     }
     
     if (pid == 0) {
         /* Child process - worker */
+        restore_signals();
+        proton_pid = getpid();
+        proton_scoreboard_attach(slot);
         proton_log(LOG_INFO, "Worker %d started (pid=%d)", worker_id, getpid());
         exit(proton_worker_process(config));
     }
     
     /* Parent process - master */
-    worker_pids[worker_id] = pid;
+    if (slot >= 0) proton_scoreboard->slots[slot].pid = pid;
+    
+    w->pid = pid;
+    w->started = proton_current_msec;
+    w->respawn_at = 0;
     proton_log(LOG_INFO, "Spawned worker %d (pid=%d)", worker_id, pid);
 }
 
@@ -39,9 +145,10 @@ static void spawn_workers(proton_config_t *config) {
         if (num_workers <= 0) num_workers = 1;
     }
     
-    worker_pids = calloc(num_workers, sizeof(pid_t));
-    if (!worker_pids) {
-        proton_log(LOG_ERROR, "Failed to allocate worker PID array");
+    workers = calloc(num_workers, sizeof(worker_slot_t));
+    if (!workers) {
+        proton_log(LOG_ERROR, "Failed to allocate worker slots");
+        num_workers = 0;
         return;
     }
     
@@ -50,28 +157,132 @@ static void spawn_workers(proton_config_t *config) {
     }
 }
 
-static void stop_workers(void) {
-    if (!worker_pids) return;
-    
-    /* Send SIGTERM to all workers */
+static void signal_workers(int signo) {
     for (int i = 0; i < num_workers; i++) {
-        if (worker_pids[i] > 0) {
-            proton_log(LOG_INFO, "Stopping worker %d (pid=%d)", i, worker_pids[i]);
-            kill(worker_pids[i], SIGTERM);
-        }
+        if (workers[i].pid > 0) kill(workers[i].pid, signo);
+    }
+    
+    for (int i = 0; i < num_retired; i++) {
+        kill(retired_pids[i], signo);
     }
+}
+
+static void stop_workers(int signo) {
+    if (!workers) return;
+    
+    /* SIGTERM stops workers at once, SIGQUIT lets them drain first */
+    proton_log(LOG_INFO, "Stopping %d workers (%s)", num_workers + num_retired,
+               signo == SIGQUIT ? "graceful" : "fast");
+    signal_workers(signo);
     
     /* Wait for workers to exit */
     for (int i = 0; i < num_workers; i++) {
-        if (worker_pids[i] > 0) {
+        if (workers[i].pid > 0) {
             int status;
-            waitpid(worker_pids[i], &status, 0);
+            waitpid(workers[i].pid, &status, 0);
             proton_log(LOG_INFO, "Worker %d exited", i);
         }
     }
     
-    free(worker_pids);
-    worker_pids = NULL;
+    for (int i = 0; i < num_retired; i++) {
+        int status;
+        waitpid(retired_pids[i], &status, 0);
+    }
+    
+    free(workers);
+    workers = NULL;
+    free(retired_pids);
+    retired_pids = NULL;
+    num_retired = 0;
+}
+
+/* Hand the current generation over to the retired list and let it drain */
+static void retire_workers(void) {
+    pid_t *pids = realloc(retired_pids, (num_retired + num_workers) * sizeof(pid_t));
+    if (!pids) {
+        proton_log(LOG_ERROR, "Failed to allocate retired worker array");
+        return;
+    }
+    retired_pids = pids;
+    
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i].pid > 0) {
+            kill(workers[i].pid, SIGQUIT);
+            retired_pids[num_retired++] = workers[i].pid;
+        }
+    }
+    
+    free(workers);
+    workers = NULL;
+    num_workers = 0;
+}
+
+/*
+ * The first unexpected exit is respawned at once. Exits that keep coming
+ * within RESPAWN_STABLE_MSEC of the previous start back off exponentially
+ * so a crash loop does not turn into a fork loop.
+ */
+static void worker_exited(int worker_id, int status) {
+    worker_slot_t *w = &workers[worker_id];
+    uint64_t uptime = proton_current_msec - w->started;
+    
+    if (WIFSIGNALED(status)) {
+        proton_log(LOG_WARN, "Worker %d (pid=%d) killed by signal %d after %llu ms",
+                   worker_id, w->pid, WTERMSIG(status), (unsigned long long)uptime);
+    } else {
+        proton_log(LOG_WARN, "Worker %d (pid=%d) exited with status %d after %llu ms",
+                   worker_id, w->pid, WEXITSTATUS(status), (unsigned long long)uptime);
+    }
+    
+    if (uptime >= RESPAWN_STABLE_MSEC) w->failures = 0;
+    
+    uint64_t delay = 0;
+    if (w->failures > 0) {
+        int shift = w->failures - 1 < 16 ? w->failures - 1 : 16;
+        delay = (uint64_t)RESPAWN_BACKOFF_MIN << shift;
+        if (delay > RESPAWN_BACKOFF_MAX) delay = RESPAWN_BACKOFF_MAX;
+    }
+    
+    w->pid = 0;
+    w->failures++;
+    w->respawns++;
+    total_respawns++;
+    proton_scoreboard->respawns++;
+    
+    if (delay == 0) {
+        proton_log(LOG_INFO, "Respawning worker %d (respawns=%u, total=%u)",
+                   worker_id, w->respawns, total_respawns);
+        spawn_worker(master_config, worker_id);
+        return;
+    }
+    
+    proton_log(LOG_WARN, "Worker %d failed %d times in a row, respawning in %llu ms (respawns=%u, total=%u)",
+               worker_id, w->failures, (unsigned long long)delay, w->respawns, total_respawns);
+    w->respawn_at = proton_current_msec + delay;
+}
+
+static void respawn_due_workers(void) {
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i].pid == 0 && workers[i].respawn_at &&
+            workers[i].respawn_at <= proton_current_msec) {
+            spawn_worker(master_config, i);
+        }
+    }
+}
+
+/* Sleep until a signal arrives or the next delayed respawn is due */
+static int respawn_timeout(void) {
+    int timeout = -1;
+    
+    for (int i = 0; i < num_workers; i++) {
+        if (workers[i].pid != 0 || !workers[i].respawn_at) continue;
+        
+        uint64_t at = workers[i].respawn_at;
+        int wait = at > proton_current_msec ? (int)(at - proton_current_msec) : 0;
+        if (timeout < 0 || wait < timeout) timeout = wait;
+    }
+    
+    return timeout;
 }
 
 static void reap_children(void) {
@@ -80,69 +291,246 @@ static void reap_children(void) {
     
     /* Reap any terminated child processes */
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        int found = 0;
+        
+        proton_scoreboard_exited(pid);
+        
         /* Find which worker died */
         for (int i = 0; i < num_workers; i++) {
-            if (worker_pids[i] == pid) {
-                proton_log(LOG_WARN, "Worker %d (pid=%d) died, respawning", i, pid);
-                spawn_worker(master_config, i);
+            if (workers[i].pid == pid) {
+                worker_exited(i, status);
+                found = 1;
+                break;
+            }
+        }
+        
+        if (found) continue;
+        
+        if (pid == upgrade_pid) {
+            proton_log(LOG_WARN, "New binary (pid=%d) exited with status %d", pid,
+                       WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+            upgrade_pid = 0;
+            proton_listening_handover(0);
+            continue;
+        }
+        
+        for (int i = 0; i < num_retired; i++) {
+            if (retired_pids[i] == pid) {
+                proton_log(LOG_INFO, "Old worker (pid=%d) finished draining", pid);
+                retired_pids[i] = retired_pids[--num_retired];
                 break;
             }
         }
     }
 }
 
+static int apply_config(proton_config_t *config) {
+    proton_modules_cleanup();
+    
+    if (proton_modules_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize modules");
+        return PROTON_ERROR;
+    }
+    
+    if (proton_http_log_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize access log");
+        return PROTON_ERROR;
+    }
+    
+    if (proton_tls_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize TLS");
+        return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+/*
+ * SIGHUP: parse and validate the configuration again, start a new generation
+ * of workers with it and let the old generation drain. The old workers keep
+ * serving their in-flight and keepalive requests until they are done or
+ * worker_shutdown_timeout expires. On any error the running configuration
+ * stays in place.
+ */
+static void reload_config(void) {
+    proton_log(LOG_INFO, "Reloading configuration from %s", proton_config_file);
+    
+    if (access(proton_config_file, R_OK) != 0) {
+        proton_log(LOG_ERROR, "Cannot read %s, keeping current configuration", proton_config_file);
+        return;
+    }
+    
+    proton_config_t *config = proton_config_parse(proton_config_file);
+    if (!config || proton_config_validate(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Invalid configuration, keeping current configuration");
+        proton_config_destroy(config);
+        return;
+    }
+    
+    if (apply_config(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Reload failed, keeping current configuration");
+        apply_config(master_config);
+        proton_config_destroy(config);
+        return;
+    }
+    
+    /* Sockets for addresses that are still configured are kept open */
+    if (proton_listening_open(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Cannot open listening sockets, keeping current configuration");
+        apply_config(master_config);
+        proton_config_destroy(config);
+        return;
+    }
+    
+    /* Reopen the error log if it moved */
+    const char *old_log = master_config->error_log ? master_config->error_log : "stderr";
+    const char *new_log = config->error_log ? config->error_log : "stderr";
+    int log_changed = strcmp(old_log, new_log) != 0;
+    
+    /* Swap contents so every holder of master_config sees the new values */
+    proton_config_t old = *master_config;
+    *master_config = *config;
+    *config = old;
+    proton_config_destroy(config);
+    
+    if (log_changed) {
+        proton_log_close();
+        proton_log_init(new_log, LOG_INFO);
+    }
+    
+    retire_workers();
+    spawn_workers(master_config);
+    
+    proton_log(LOG_INFO, "Configuration reloaded, %d old workers draining", num_retired);
+}
+
+/*
+ * SIGUSR2: exec the binary again with the listening sockets passed along in
+ * PROTON_LISTEN_FDS. Both generations accept on the same sockets until the
+ * old master is told to stop with SIGQUIT, so no connection is refused.
+ */
+static void upgrade_binary(void) {
+    if (upgrade_pid > 0) {
+        proton_log(LOG_WARN, "Upgrade already in progress (pid=%d)", upgrade_pid);
+        return;
+    }
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        proton_log(LOG_ERROR, "Failed to fork for upgrade");
+        return;
+    }
+    
+    if (pid == 0) {
+        restore_signals();
+        
+        char *env = proton_listening_export();
+        if (!env || putenv(env) != 0) {
+            _exit(1);
+        }
+        
+        execvp(proton_argv[0], proton_argv);
+        proton_log(LOG_ERROR, "Failed to exec %s", proton_argv[0]);
+        _exit(1);
+    }
+    
+    upgrade_pid = pid;
+    proton_listening_handover(1);
+    proton_log(LOG_INFO, "Started new binary %s (pid=%d)", proton_argv[0], pid);
+}
+
 int proton_master_process(proton_config_t *config) {
     master_config = config;
     
     proton_log(LOG_INFO, "Master process started (pid=%d)", getpid());
-    fprintf(stderr, "[MASTER] proton_quit = %d\n", proton_quit);
+    proton_time_update();
     
     /* Initialize modules */
-    fprintf(stderr, "[MASTER] Initializing modules\n");
     if (proton_modules_init(config) != PROTON_OK) {
         proton_log(LOG_ERROR, "Failed to initialize modules");
         return 1;
     }
-    fprintf(stderr, "[MASTER] Modules initialized\n");
+    
+    /* Compile the access log format once; workers open the file */
+    if (proton_http_log_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize access log");
+        return 1;
+    }
+    
+    /* Certificates are read here; workers share the ticket keys and session cache */
+    if (proton_tls_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize TLS");
+        return 1;
+    }
+    
+    /* Bind before forking so every worker shares the same sockets */
+    if (proton_listening_open(config) != PROTON_OK) {
+        return 1;
+    }
+    
+    /* Statistics shared with all workers, kept across reloads */
+    if (proton_scoreboard_init() != PROTON_OK) {
+        return 1;
+    }
+    
+    if (open_signalfd() != PROTON_OK) {
+        return 1;
+    }
     
     /* Spawn worker processes */
-    fprintf(stderr, "[MASTER] Spawning workers\n");
     spawn_workers(config);
-    fprintf(stderr, "[MASTER] Workers spawned\n");
     
-    proton_log(LOG_INFO, "Proton is ready to handle connections on port %d", config->listen_port);
-    fprintf(stderr, "[MASTER] Entering main loop, proton_quit = %d\n", proton_quit);
+    proton_log(LOG_INFO, "Proton is ready to handle connections on %d listening sockets",
+               proton_nlistening);
     
-    /* Master process main loop */
-    while (!proton_quit) {
-        fprintf(stderr, "[MASTER] In loop iteration, sleeping\n");
-        sleep(1);
-        
+    /* Master process main loop, idle until a signal or a delayed respawn */
+    while (!proton_quit && !proton_shutdown) {
         /* Check for reload signal */
         if (proton_reload) {
             proton_log(LOG_INFO, "Received reload signal");
             proton_reload = 0;
-            
-            /* In a real implementation, would:
-             * 1. Parse new config
-             * 2. Spawn new workers with new config
-             * 3. Send SIGQUIT to old workers
-             * 4. Wait for old workers to finish requests
-             */
-            proton_log(LOG_INFO, "Hot reload not yet implemented");
+            reload_config();
         }
         
-        /* Reap any dead workers */
+        /* Reopen log files and tell workers to do the same */
+        if (proton_reopen) {
+            proton_reopen = 0;
+            proton_log(LOG_INFO, "Reopening log files");
+            proton_log_reopen();
+            signal_workers(SIGUSR1);
+        }
+        
+        if (proton_upgrade) {
+            proton_upgrade = 0;
+            upgrade_binary();
+        }
+        
+        /* Reap dead workers and respawn the ones whose backoff is over */
         reap_children();
+        respawn_due_workers();
+        
+        struct pollfd pfd = { .fd = signal_fd, .events = POLLIN };
+        int n = poll(&pfd, 1, respawn_timeout());
+        if (n < 0 && errno != EINTR) {
+            proton_log(LOG_ERROR, "poll() failed: %s", strerror(errno));
+            break;
+        }
+        
+        proton_time_update();
+        if (n > 0) read_signals();
     }
     
     proton_log(LOG_INFO, "Master process shutting down");
     
     /* Stop all workers */
-    stop_workers();
+    stop_workers(proton_quit ? SIGTERM : SIGQUIT);
     
     /* Cleanup modules */
     proton_modules_cleanup();
+    proton_http_log_close();
+    proton_tls_cleanup();
+    proton_listening_close();
+    restore_signals();
     
     return 0;
 }
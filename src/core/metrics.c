@@ -0,0 +1,106 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "proton.h"
+
+/*
+ * Latency histograms. Buckets are log-linear in microseconds: values below
+ * 4us get a bucket each, above that every power of two is split into four
+ * linear sub-buckets (about 25% relative error). Recording is a clz, a shift
+ * and three increments into the worker's own slot of a shared mapping
+ * that lives next to the scoreboard and uses the same slot numbers.
+ */
+
+#define SUB_BUCKETS 4
+
+proton_metrics_t *proton_metrics_table = NULL;
+
+static proton_metrics_t metrics_sink;
+proton_metrics_t *proton_metrics = &metrics_sink;
+
+int proton_metrics_init(void) {
+    if (proton_metrics_table) return PROTON_OK;
+    
+    /* Slot PROTON_SCOREBOARD_SLOTS holds the totals of exited workers */
+    size_t size = (PROTON_SCOREBOARD_SLOTS + 1) * sizeof(proton_metrics_t);
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        proton_log(LOG_ERROR, "Failed to map metrics: %s", strerror(errno));
+        return PROTON_ERROR;
+    }
+    
+    proton_metrics_table = p;
+    return PROTON_OK;
+}
+
+void proton_metrics_attach(int slot) {
+    if (slot < 0 || !proton_metrics_table) return;
+    proton_metrics = &proton_metrics_table[slot];
+}
+
+static void merge(proton_metrics_t *dst, const proton_metrics_t *src) {
+    for (int l = 0; l < PROTON_METRICS_LOCATIONS; l++) {
+        for (int k = 0; k < PROTON_HIST_MAX; k++) {
+            const proton_histogram_t *s = &src->hist[l][k];
+            proton_histogram_t *d = &dst->hist[l][k];
+            
+            if (s->count == 0) continue;
+            
+            d->count += s->count;
+            d->sum += s->sum;
+            for (int b = 0; b < PROTON_HIST_BUCKETS; b++) {
+                d->buckets[b] += s->buckets[b];
+            }
+        }
+    }
+}
+
+/* Fold an exited worker into the retired totals and clear its slot */
+void proton_metrics_release(int slot) {
+    if (slot < 0 || !proton_metrics_table) return;
+    
+    merge(&proton_metrics_table[PROTON_SCOREBOARD_SLOTS], &proton_metrics_table[slot]);
+    memset(&proton_metrics_table[slot], 0, sizeof(proton_metrics_t));
+}
+
+/* Merge all live slots and the retired totals */
+void proton_metrics_collect(proton_metrics_t *total) {
+    memset(total, 0, sizeof(*total));
+    if (!proton_metrics_table) return;
+    
+    merge(total, &proton_metrics_table[PROTON_SCOREBOARD_SLOTS]);
+    for (int i = 0; i < PROTON_SCOREBOARD_SLOTS; i++) {
+        if (proton_scoreboard->slots[i].pid > 0) {
+            merge(total, &proton_metrics_table[i]);
+        }
+    }
+}
+
+static int bucket_index(uint64_t usec) {
+    if (usec < SUB_BUCKETS) return (int)usec;
+    
+    int exp = 63 - __builtin_clzll(usec);
+    int sub = (int)(usec >> (exp - 2)) & (SUB_BUCKETS - 1);
+    int index = SUB_BUCKETS + (exp - 2) * SUB_BUCKETS + sub;
+    
+    return index < PROTON_HIST_BUCKETS ? index : PROTON_HIST_BUCKETS - 1;
+}
+
+/* Exclusive upper bound of a bucket in microseconds */
+uint64_t proton_histogram_bucket_upper(int index) {
+    if (index < SUB_BUCKETS) return (uint64_t)index + 1;
+    
+    int exp = (index - SUB_BUCKETS) / SUB_BUCKETS + 2;
+    int sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+    
+    return (uint64_t)(SUB_BUCKETS + sub + 1) << (exp - 2);
+}
+
+void proton_histogram_record(proton_histogram_t *h, uint64_t usec) {
+    h->count++;
+    h->sum += usec;
+    h->buckets[bucket_index(usec)]++;
+}
@@ -15,6 +15,7 @@ proton_pool_t* proton_pool_create(size_t size) {
     pool->used = 0;
     pool->data = malloc(size);
     pool->next = NULL;
+    pool->cleanup = NULL;
     
     if (!pool->data) {
         free(pool);
@@ -52,7 +53,25 @@ void* proton_pool_alloc(proton_pool_t *pool, size_t size) {
     return ptr;
 }
 
+/* Release something the pool's owner holds when the pool goes away */
+int proton_pool_cleanup_add(proton_pool_t *pool, void (*handler)(void *data), void *data) {
+    proton_pool_cleanup_t *c = proton_pool_alloc(pool, sizeof(proton_pool_cleanup_t));
+    if (!c) return PROTON_ERROR;
+    
+    c->handler = handler;
+    c->data = data;
+    c->next = pool->cleanup;
+    pool->cleanup = c;
+    
+    return PROTON_OK;
+}
+
 void proton_pool_destroy(proton_pool_t *pool) {
+    /* Handlers first: their records live in the pool memory */
+    for (proton_pool_cleanup_t *c = pool ? pool->cleanup : NULL; c; c = c->next) {
+        c->handler(c->data);
+    }
+    
     while (pool) {
         proton_pool_t *next = pool->next;
         free(pool->data);
@@ -10,7 +10,12 @@
 /* Global state */
 volatile sig_atomic_t proton_quit = 0;
 volatile sig_atomic_t proton_reload = 0;
+volatile sig_atomic_t proton_reopen = 0;
+volatile sig_atomic_t proton_shutdown = 0;
+volatile sig_atomic_t proton_upgrade = 0;
 pid_t proton_pid;
+const char *proton_config_file = "proton.conf";
+char **proton_argv;
 
 /* Signal handlers */
 static void signal_handler(int signo) {
@@ -19,9 +24,18 @@ static void signal_handler(int signo) {
         case SIGTERM:
             proton_quit = 1;
             break;
+        case SIGQUIT:
+            proton_shutdown = 1;
+            break;
         case SIGHUP:
             proton_reload = 1;
             break;
+        case SIGUSR1:
+            proton_reopen = 1;
+            break;
+        case SIGUSR2:
+            proton_upgrade = 1;
+            break;
         case SIGCHLD:
             /* Child process terminated */
             break;
@@ -37,7 +51,10 @@ static void setup_signals(void) {
 
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
     sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
     sigaction(SIGCHLD, &sa, NULL);
     
     /* Ignore SIGPIPE */
@@ -52,7 +69,7 @@ static void usage(const char *prog) {
 }
 
 int main(int argc, char *argv[]) {
-    const char *config_file = "proton.conf";
+    const char *config_file = proton_config_file;
     int opt;
 
     /* Parse command line arguments */
@@ -71,6 +88,8 @@ int main(int argc, char *argv[]) {
     }
 
     proton_pid = getpid();
+    proton_config_file = config_file;
+    proton_argv = argv;
 
     printf("Proton Web Server v%s starting...\n", PROTON_VERSION);
     printf("Configuration file: %s\n", config_file);
@@ -86,6 +105,11 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    if (proton_config_validate(config) != PROTON_OK) {
+        proton_config_destroy(config);
+        return 1;
+    }
+    
     fprintf(stderr, "[MAIN] Config parsed OK, initializing logging\n");
     fprintf(stderr, "[MAIN] config->error_log ptr: %p\n", (void*)config->error_log);
 
@@ -99,6 +123,14 @@ int main(int argc, char *argv[]) {
     proton_log(LOG_INFO, "Proton v%s starting (pid=%d)", PROTON_VERSION, proton_pid);
     fprintf(stderr, "[MAIN] proton_log called\n");
     
+    /* Sockets handed over by a previous binary or systemd */
+    if (proton_listening_inherit() != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to inherit listening sockets");
+        proton_log_close();
+        proton_config_destroy(config);
+        return 1;
+    }
+    
     /* Setup signal handlers */
     fprintf(stderr, "[MAIN] Setting up signals\n");
     setup_signals();
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "proton.h"
+
+/*
+ * Shared statistics scoreboard. The master maps it once before the first
+ * fork and hands every worker a slot of its own. A worker is the only writer
+ * of its slot and updates it with plain stores, so the hot path never takes
+ * a lock or an atomic. Readers sum all slots and tolerate a torn view.
+ * When a worker goes away, the master folds its counters into the retired
+ * totals and frees the slot for the next worker.
+ */
+
+proton_scoreboard_t *proton_scoreboard = NULL;
+
+/* Workers without a slot (scoreboard full) count into a private sink */
+static proton_stats_t stats_sink;
+proton_stats_t *proton_stats = &stats_sink;
+
+int proton_scoreboard_init(void) {
+    if (proton_scoreboard) return PROTON_OK;
+    
+    void *p = mmap(NULL, sizeof(proton_scoreboard_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        proton_log(LOG_ERROR, "Failed to map scoreboard: %s", strerror(errno));
+        return PROTON_ERROR;
+    }
+    
+    proton_scoreboard = p;
+    proton_scoreboard->start_sec = proton_current_sec;
+    return proton_metrics_init();
+}
+
+/* Reserve a free slot for a worker about to be forked */
+int proton_scoreboard_acquire(void) {
+    if (!proton_scoreboard) return -1;
+    
+    for (int i = 0; i < PROTON_SCOREBOARD_SLOTS; i++) {
+        proton_stats_t *slot = &proton_scoreboard->slots[i];
+        if (slot->pid == 0) {
+            memset(slot, 0, sizeof(*slot));
+            slot->pid = -1;
+            return i;
+        }
+    }
+    
+    proton_log(LOG_WARN, "Scoreboard full, worker statistics will be lost");
+    return -1;
+}
+
+/* Called in the worker right after fork */
+void proton_scoreboard_attach(int slot) {
+    if (slot < 0) return;
+    
+    proton_stats = &proton_scoreboard->slots[slot];
+    proton_stats->pid = proton_pid;
+    proton_metrics_attach(slot);
+}
+
+void proton_scoreboard_release(int slot) {
+    if (slot < 0) return;
+    
+    proton_stats_t *s = &proton_scoreboard->slots[slot];
+    proton_stats_t *r = &proton_scoreboard->retired;
+    
+    /* Counters live on; gauges died with the worker's connections */
+    r->accepted += s->accepted;
+    r->handled += s->handled;
+    r->requests += s->requests;
+    r->bytes_in += s->bytes_in;
+    r->bytes_out += s->bytes_out;
+    r->shed += s->shed;
+    for (int i = 0; i < 5; i++) {
+        r->responses[i] += s->responses[i];
+    }
+    
+    proton_metrics_release(slot);
+    memset(s, 0, sizeof(*s));
+}
+
+void proton_scoreboard_exited(pid_t pid) {
+    if (!proton_scoreboard || pid <= 0) return;
+    
+    for (int i = 0; i < PROTON_SCOREBOARD_SLOTS; i++) {
+        if (proton_scoreboard->slots[i].pid == pid) {
+            proton_scoreboard_release(i);
+            return;
+        }
+    }
+}
+
+/* Sum of retired totals and every live worker; returns the worker count */
+int proton_scoreboard_collect(proton_stats_t *total) {
+    memset(total, 0, sizeof(*total));
+    if (!proton_scoreboard) return 0;
+    
+    *total = proton_scoreboard->retired;
+    
+    int workers = 0;
+    for (int i = 0; i < PROTON_SCOREBOARD_SLOTS; i++) {
+        proton_stats_t *s = &proton_scoreboard->slots[i];
+        if (s->pid <= 0) continue;
+        
+        workers++;
+        total->accepted += s->accepted;
+        total->handled += s->handled;
+        total->requests += s->requests;
+        total->bytes_in += s->bytes_in;
+        total->bytes_out += s->bytes_out;
+        total->shed += s->shed;
+        for (int j = 0; j < 5; j++) {
+            total->responses[j] += s->responses[j];
+        }
+        total->active += s->active;
+        total->reading += s->reading;
+        total->writing += s->writing;
+    }
+    
+    return workers;
+}
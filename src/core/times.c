@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "proton.h"
+
+/* Cached time, refreshed once per event loop iteration */
+uint64_t proton_current_msec = 0;
+uint64_t proton_current_wall_msec = 0;
+time_t proton_current_sec = 0;
+char proton_cached_log_time[64];
+char proton_cached_iso8601_time[64];
+char proton_cached_error_log_time[64];
+
+static const char *months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static void format_times(time_t sec) {
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    
+    long off = tm.tm_gmtoff / 60;
+    char sign = off < 0 ? '-' : '+';
+    if (off < 0) off = -off;
+    
+    snprintf(proton_cached_log_time, sizeof(proton_cached_log_time),
+             "%02d/%s/%d:%02d:%02d:%02d %c%02ld%02ld",
+             tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, sign, off / 60, off % 60);
+    
+    snprintf(proton_cached_iso8601_time, sizeof(proton_cached_iso8601_time),
+             "%d-%02d-%02dT%02d:%02d:%02d%c%02ld:%02ld",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, sign, off / 60, off % 60);
+    
+    /* Fixed width, so a reader in another thread never loses the terminator */
+    snprintf(proton_cached_error_log_time, sizeof(proton_cached_error_log_time),
+             "%d-%02d-%02d %02d:%02d:%02d",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+uint64_t proton_time_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void proton_time_update(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    proton_current_msec = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    
+    /* Wall clock strings only change once a second */
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    proton_current_wall_msec = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (ts.tv_sec != proton_current_sec) {
+        proton_current_sec = ts.tv_sec;
+        format_times(ts.tv_sec);
+    }
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,10 +11,15 @@
 #include "event.h"
 #include "http.h"
 #include "module.h"
+#include "tls.h"
+#include "probe.h"
 
-static int listen_fd = -1;
+static proton_event_t **listen_events = NULL;
 proton_event_loop_t *event_loop = NULL;  /* Global for event system */
 static proton_config_t *worker_config = NULL;
+static proton_timer_t shutdown_timer;
+static uint64_t refused_logged = 0;
+static int accept_paused = 0;
 
 static int set_nonblocking(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -21,66 +27,14 @@ static int set_nonblocking(int fd) {
     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-static int create_listen_socket(int port) {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        proton_log(LOG_ERROR, "Failed to create socket: %s", strerror(errno));
-        return -1;
-    }
-    
-    /* Set SO_REUSEADDR and SO_REUSEPORT for multi-worker support */
-    int opt = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        proton_log(LOG_ERROR, "Failed to set SO_REUSEADDR: %s", strerror(errno));
-        close(fd);
-        return -1;
-    }
-    
-    #ifdef SO_REUSEPORT
-    opt = 1;
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
-        proton_log(LOG_ERROR, "Failed to set SO_REUSEPORT: %s", strerror(errno));
-        close(fd);
-        return -1;
-    }
-    #endif
-    
-    /* Bind */
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(port);
-    
-    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        proton_log(LOG_ERROR, "Failed to bind to port %d: %s", port, strerror(errno));
-        close(fd);
-        return -1;
-    }
-    
-    /* Listen */
-    if (listen(fd, 128) < 0) {
-        proton_log(LOG_ERROR, "Failed to listen: %s", strerror(errno));
-        close(fd);
-        return -1;
-    }
-    
-    /* Set non-blocking */
-    if (set_nonblocking(fd) < 0) {
-        proton_log(LOG_ERROR, "Failed to set non-blocking: %s", strerror(errno));
-        close(fd);
-        return -1;
-    }
-    
-    return fd;
-}
-
 static int accept_handler(proton_event_t *ev) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
+    proton_listening_t *ls = ev->data;
+    struct sockaddr_storage client_addr;
+    socklen_t client_len;
     
     while (1) {
-        int client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
+        client_len = sizeof(client_addr);
+        int client_fd = accept(ev->fd, (struct sockaddr*)&client_addr, &client_len);
         
         if (client_fd < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -90,6 +44,24 @@ static int accept_handler(proton_event_t *ev) {
             break;
         }
         
+        proton_stats->accepted++;
+        
+        /*
+         * worker_connections is a hard limit. Room is made by closing the
+         * keepalive connection idle the longest; with none to spare the
+         * client is refused, which shows as accepted but not handled.
+         */
+        if (proton_http_connection_count() >= worker_config->worker_connections &&
+            proton_http_close_idle() != PROTON_OK) {
+            if (proton_current_msec - refused_logged >= 1000) {
+                refused_logged = proton_current_msec;
+                proton_log(LOG_WARN, "%d worker_connections are not enough, refusing connections",
+                           worker_config->worker_connections);
+            }
+            close(client_fd);
+            continue;
+        }
+        
         /* Set non-blocking */
         set_nonblocking(client_fd);
         
@@ -101,20 +73,106 @@ static int accept_handler(proton_event_t *ev) {
             continue;
         }
         
-        /* Add to event loop */
-        proton_event_add(event_loop, conn->event, PROTON_EVENT_READ);
+        memcpy(&conn->sockaddr, &client_addr, client_len);
+        conn->socklen = client_len;
+        
+        if (ls->ssl && proton_tls_accept(conn) != PROTON_OK) {
+            proton_http_connection_close(conn);
+            continue;
+        }
+        proton_stats->handled++;
+        PROTON_PROBE2(conn__accept, client_fd, ls->ssl);
+        
+        /* The handshake may wait for the socket either way */
+        proton_event_add(event_loop, conn->event,
+                         conn->ssl ? PROTON_EVENT_READ | PROTON_EVENT_WRITE : PROTON_EVENT_READ);
+    }
+    
+    return PROTON_OK;
+}
+
+static void shutdown_timer_handler(proton_timer_t *timer) {
+    (void)timer;
+    proton_log(LOG_WARN, "Shutdown timeout expired, closing %d connections",
+               proton_http_connection_count());
+    proton_http_close_all_connections();
+}
+
+static int open_listeners(void) {
+    listen_events = calloc(proton_nlistening, sizeof(proton_event_t*));
+    if (!listen_events) return PROTON_ERROR;
+    
+    /* The master's sockets are shared by every worker; wake one per connection */
+    for (int i = 0; i < proton_nlistening; i++) {
+        listen_events[i] = proton_event_create(proton_listening[i].fd);
+        if (!listen_events[i]) return PROTON_ERROR;
+        listen_events[i]->data = &proton_listening[i];
+        listen_events[i]->read_handler = accept_handler;
+        
+        if (proton_event_add(event_loop, listen_events[i],
+                             PROTON_EVENT_READ | PROTON_EVENT_EXCLUSIVE) != PROTON_OK) {
+            proton_log(LOG_ERROR, "Failed to watch %s: %s",
+                       proton_listening[i].addr_text, strerror(errno));
+            return PROTON_ERROR;
+        }
     }
     
     return PROTON_OK;
 }
 
+/*
+ * While overload_shedding finds this worker overloaded it leaves the
+ * listeners alone, so new connections wake the other workers or wait in
+ * the backlog instead of joining the queue here
+ */
+static void pause_accept(int pause) {
+    if (!listen_events || pause == accept_paused) return;
+    
+    for (int i = 0; i < proton_nlistening; i++) {
+        if (pause) {
+            proton_event_del(event_loop, listen_events[i]);
+        } else {
+            proton_event_add(event_loop, listen_events[i], PROTON_EVENT_READ | PROTON_EVENT_EXCLUSIVE);
+        }
+    }
+    
+    accept_paused = pause;
+}
+
+/* Drop our copies of the listeners; the master and other workers keep them */
+static void close_listeners(void) {
+    if (!listen_events) return;
+    
+    for (int i = 0; i < proton_nlistening; i++) {
+        if (!listen_events[i]) continue;
+        proton_event_del(event_loop, listen_events[i]);
+        proton_event_destroy(listen_events[i]);
+        close(proton_listening[i].fd);
+    }
+    
+    free(listen_events);
+    listen_events = NULL;
+}
+
+/* Stop accepting, finish in-flight requests and close keepalive connections */
+static void start_graceful_shutdown(void) {
+    proton_log(LOG_INFO, "Worker draining %d connections", proton_http_connection_count());
+    
+    /* Queued connections stay on the shared socket for the next generation */
+    close_listeners();
+    
+    proton_http_drain();
+    
+    proton_timer_init(&shutdown_timer, shutdown_timer_handler, NULL);
+    proton_timer_add(event_loop, &shutdown_timer, worker_config->worker_shutdown_timeout);
+}
+
 int proton_worker_process(proton_config_t *config) {
     worker_config = config;
+    proton_http_init(config);
     
-    /* Create listen socket (shared across workers via SO_REUSEPORT or inherited) */
-    int port = config->listen_port;
-    listen_fd = create_listen_socket(port);
-    if (listen_fd < 0) {
+    if (proton_overload_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to set up overload_shedding");
         return 1;
     }
     
@@ -123,43 +181,64 @@ int proton_worker_process(proton_config_t *config) {
     event_loop = proton_event_loop_create(max_conns);
     if (!event_loop) {
         proton_log(LOG_ERROR, "Failed to create event loop");
-        close(listen_fd);
         return 1;
     }
     
-    /* Add listen socket to event loop */
-    proton_event_t *listen_event = proton_event_create(listen_fd);
-    if (!listen_event) {
+    /* Watch the listening sockets inherited from the master */
+    if (open_listeners() != PROTON_OK) {
+        close_listeners();
         proton_event_loop_destroy(event_loop);
-        close(listen_fd);
         return 1;
     }
-    listen_event->read_handler = accept_handler;
     
-    if (proton_event_add(event_loop, listen_event, PROTON_EVENT_READ) != PROTON_OK) {
-        proton_event_destroy(listen_event);
+    /* Per-worker state of the modules, such as the access log's file and flusher */
+    if (proton_modules_init_worker(event_loop) != PROTON_OK) {
+        close_listeners();
         proton_event_loop_destroy(event_loop);
-        close(listen_fd);
         return 1;
     }
+    proton_time_update();
     
-    proton_log(LOG_INFO, "Worker ready, listening on port %d", port);
+    proton_log(LOG_INFO, "Worker ready, accepting on %d sockets", proton_nlistening);
     
     /* Event loop */
+    int draining = 0;
     while (!proton_quit) {
-        int ret = proton_event_process(event_loop, 1000); /* 1 second timeout */
+        if (proton_shutdown && !draining) {
+            draining = 1;
+            start_graceful_shutdown();
+        }
+        
+        if (draining && proton_http_connection_count() == 0) {
+            break;
+        }
+        
+        /* Paused, look again after an interval even if nothing happens */
+        int timeout = accept_paused ? config->overload_interval : 1000;
+        
+        int ret = proton_event_process(event_loop, timeout);
         if (ret < 0 && errno != EINTR) {
             proton_log(LOG_ERROR, "Event processing error: %s", strerror(errno));
             break;
         }
+        
+        if (config->overload_target && !draining) {
+            pause_accept(proton_overload_check());
+        }
+        
+        if (proton_reopen) {
+            proton_reopen = 0;
+            proton_log_reopen();
+            proton_http_log_reopen();
+        }
     }
     
     proton_log(LOG_INFO, "Worker shutting down");
     
     /* Cleanup */
-    proton_event_destroy(listen_event);
+    proton_modules_exit_worker(event_loop);
+    close_listeners();
     proton_event_loop_destroy(event_loop);
-    close(listen_fd);
     
     return 0;
 }
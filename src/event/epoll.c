@@ -7,6 +7,14 @@
 #include "proton.h"
 #include "event.h"
 
+/*
+ * A handler may close connections other than its own, whose events can still
+ * be queued in the current batch. Events destroyed while a batch is being
+ * dispatched are therefore disarmed and only freed once the batch is done.
+ */
+static proton_event_t *deferred_free = NULL;
+static int dispatching = 0;
+
 proton_event_loop_t* proton_event_loop_create(int max_events) {
     proton_event_loop_t *loop = malloc(sizeof(proton_event_loop_t));
     if (!loop) return NULL;
@@ -19,6 +27,9 @@ proton_event_loop_t* proton_event_loop_create(int max_events) {
     }
     
     loop->max_events = max_events;
+    loop->timers = NULL;
+    loop->ntimers = 0;
+    loop->timers_cap = 0;
     loop->events = calloc(max_events, sizeof(proton_event_t*));
     if (!loop->events) {
         close(loop->epfd);
@@ -39,6 +50,9 @@ int proton_event_add(proton_event_loop_t *loop, proton_event_t *ev, int events)
     if (events & PROTON_EVENT_READ) epev.events |= EPOLLIN;
     if (events & PROTON_EVENT_WRITE) epev.events |= EPOLLOUT;
     epev.events |= EPOLLET; /* Edge-triggered */
+#ifdef EPOLLEXCLUSIVE
+    if (events & PROTON_EVENT_EXCLUSIVE) epev.events |= EPOLLEXCLUSIVE;
+#endif
     
     epev.data.ptr = ev;
     ev->events = events;
@@ -68,38 +82,57 @@ int proton_event_process(proton_event_loop_t *loop, int timeout) {
     if (!loop) return PROTON_ERROR;
     
     struct epoll_event events[loop->max_events];
+    
+    /* Never sleep past the earliest timer */
+    timeout = proton_timer_next(loop, timeout);
+    
     int nfds = epoll_wait(loop->epfd, events, loop->max_events, timeout);
     
+    proton_time_update();
+    
     if (nfds < 0) {
         if (errno == EINTR) {
+            proton_timer_expire(loop);
             return 0;
         }
         return PROTON_ERROR;
     }
     
+    loop->wake_usec = proton_time_usec();
+    
     /* Process events */
+    dispatching = 1;
     for (int i = 0; i < nfds; i++) {
         proton_event_t *ev = (proton_event_t*)events[i].data.ptr;
         if (!ev) continue;
         
-        /* Handle read events */
-        if ((events[i].events & EPOLLIN) && ev->read_handler) {
-            ev->read_handler(ev);
+        uint32_t revents = events[i].events;
+        
+        /* Errors and hangups are reported to the read handler */
+        if (revents & (EPOLLERR | EPOLLHUP)) {
+            proton_log(LOG_DEBUG, "Socket error or hangup on fd %d", ev->fd);
+            revents |= EPOLLIN;
         }
         
-        /* Handle write events */
-        if ((events[i].events & EPOLLOUT) && ev->write_handler) {
-            ev->write_handler(ev);
+        /* Handle read events; the handler may have released the event */
+        if ((revents & EPOLLIN) && ev->read_handler) {
+            if (ev->read_handler(ev) == PROTON_DONE) continue;
         }
         
-        /* Handle errors */
-        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
-            proton_log(LOG_DEBUG, "Socket error or hangup on fd %d", ev->fd);
-            if (ev->read_handler) {
-                ev->read_handler(ev); /* Let handler deal with it */
-            }
+        /* Handle write events */
+        if ((revents & EPOLLOUT) && ev->write_handler) {
+            ev->write_handler(ev);
         }
     }
+    dispatching = 0;
+    
+    while (deferred_free) {
+        proton_event_t *ev = deferred_free;
+        deferred_free = ev->data;
+        free(ev);
+    }
+    
+    proton_timer_expire(loop);
     
     return nfds;
 }
@@ -111,6 +144,7 @@ void proton_event_loop_destroy(proton_event_loop_t *loop) {
         close(loop->epfd);
     }
     
+    free(loop->timers);
     free(loop->events);
     free(loop);
 }
@@ -129,7 +163,15 @@ proton_event_t* proton_event_create(int fd) {
 }
 
 void proton_event_destroy(proton_event_t *ev) {
-    if (ev) {
-        free(ev);
+    if (!ev) return;
+    
+    if (dispatching) {
+        ev->read_handler = NULL;
+        ev->write_handler = NULL;
+        ev->data = deferred_free;
+        deferred_free = ev;
+        return;
     }
+    
+    free(ev);
 }
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proton.h"
+#include "event.h"
+
+/* Timers are kept in a binary min-heap ordered by deadline */
+
+static void heap_swap(proton_event_loop_t *loop, int a, int b) {
+    proton_timer_t *tmp = loop->timers[a];
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = tmp;
+    loop->timers[a]->index = a;
+    loop->timers[b]->index = b;
+}
+
+static void heap_up(proton_event_loop_t *loop, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (loop->timers[parent]->deadline <= loop->timers[i]->deadline) break;
+        heap_swap(loop, i, parent);
+        i = parent;
+    }
+}
+
+static void heap_down(proton_event_loop_t *loop, int i) {
+    while (1) {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int min = i;
+        
+        if (left < loop->ntimers && loop->timers[left]->deadline < loop->timers[min]->deadline) min = left;
+        if (right < loop->ntimers && loop->timers[right]->deadline < loop->timers[min]->deadline) min = right;
+        if (min == i) break;
+        
+        heap_swap(loop, i, min);
+        i = min;
+    }
+}
+
+void proton_timer_init(proton_timer_t *timer, proton_timer_handler_t handler, void *data) {
+    timer->deadline = 0;
+    timer->index = -1;
+    timer->handler = handler;
+    timer->data = data;
+}
+
+int proton_timer_add(proton_event_loop_t *loop, proton_timer_t *timer, uint64_t msec) {
+    if (!loop || !timer) return PROTON_ERROR;
+    
+    /* Re-arming an active timer just moves it */
+    if (timer->index >= 0) {
+        proton_timer_del(loop, timer);
+    }
+    
+    if (loop->ntimers == loop->timers_cap) {
+        int cap = loop->timers_cap ? loop->timers_cap * 2 : 64;
+        proton_timer_t **timers = realloc(loop->timers, cap * sizeof(proton_timer_t*));
+        if (!timers) return PROTON_ERROR;
+        loop->timers = timers;
+        loop->timers_cap = cap;
+    }
+    
+    timer->deadline = proton_current_msec + msec;
+    timer->index = loop->ntimers;
+    loop->timers[loop->ntimers++] = timer;
+    heap_up(loop, timer->index);
+    
+    return PROTON_OK;
+}
+
+void proton_timer_del(proton_event_loop_t *loop, proton_timer_t *timer) {
+    if (!loop || !timer || timer->index < 0) return;
+    
+    int i = timer->index;
+    int last = --loop->ntimers;
+    
+    if (i != last) {
+        heap_swap(loop, i, last);
+        heap_down(loop, i);
+        heap_up(loop, i);
+    }
+    
+    timer->index = -1;
+}
+
+int proton_timer_next(proton_event_loop_t *loop, int timeout) {
+    if (!loop || loop->ntimers == 0) return timeout;
+    
+    uint64_t deadline = loop->timers[0]->deadline;
+    int wait = deadline > proton_current_msec ? (int)(deadline - proton_current_msec) : 0;
+    
+    return (timeout < 0 || wait < timeout) ? wait : timeout;
+}
+
+void proton_timer_expire(proton_event_loop_t *loop) {
+    while (loop->ntimers > 0 && loop->timers[0]->deadline <= proton_current_msec) {
+        proton_timer_t *timer = loop->timers[0];
+        proton_timer_del(loop, timer);
+        timer->handler(timer);
+    }
+}
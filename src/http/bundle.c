@@ -0,0 +1,50 @@
+#include <string.h>
+#include "bundle.h"
+
+/*
+ * Index checks and path lookup of a mapped static_bundle, for mod_static.
+ * The file may be damaged or truncated, so every offset is checked
+ * against its size before it is followed.
+ */
+
+static int in_bundle(size_t size, uint64_t offset, uint64_t len) {
+    return offset <= size && len <= size - offset;
+}
+
+const proton_bundle_header_t* proton_bundle_check(const char *bundle, size_t size) {
+    if (size < sizeof(proton_bundle_header_t)) return NULL;
+    
+    /* Only the index is checked here; entries are checked as they are found */
+    const proton_bundle_header_t *h = (const proton_bundle_header_t*)bundle;
+    if (memcmp(h->magic, PROTON_BUNDLE_MAGIC, 8) != 0 || h->version != PROTON_BUNDLE_VERSION ||
+        h->size != size || h->nbuckets == 0 || h->nslots == 0 ||
+        h->seeds > size || (size - h->seeds) / 4 < h->nbuckets ||
+        h->slots > size || (size - h->slots) / 4 < h->nslots ||
+        h->entries > size ||
+        (size - h->entries) / sizeof(proton_bundle_entry_t) < h->nentries) {
+        return NULL;
+    }
+    
+    return h;
+}
+
+const proton_bundle_entry_t* proton_bundle_lookup(const char *bundle, size_t size,
+                                                  const char *path, size_t len) {
+    const proton_bundle_header_t *h = (const proton_bundle_header_t*)bundle;
+    const uint32_t *seeds = (const uint32_t*)(bundle + h->seeds);
+    const uint32_t *slots = (const uint32_t*)(bundle + h->slots);
+    
+    uint32_t seed = seeds[proton_bundle_hash(path, len, 0) % h->nbuckets];
+    uint32_t index = slots[proton_bundle_hash(path, len, seed) % h->nslots];
+    if (index >= h->nentries) return NULL;
+    
+    const proton_bundle_entry_t *e = (const proton_bundle_entry_t*)(bundle + h->entries) + index;
+    if (!in_bundle(size, e->path, e->path_len) || !in_bundle(size, e->data, e->data_len) ||
+        !in_bundle(size, e->gzip, e->gzip_len) || !in_bundle(size, e->etag, e->etag_len) ||
+        !in_bundle(size, e->headers, (uint64_t)e->headers_len + e->gzip_headers_len)) {
+        return NULL;
+    }
+    
+    if (e->path_len != len || memcmp(bundle + e->path, path, len) != 0) return NULL;
+    return e;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proton.h"
+#include "http.h"
+#include "cidr.h"
+
+/*
+ * geo blocks map the client address to a value by the most specific
+ * matching prefix, for log_format:
+ *
+ *   geo $network {
+ *       default external;
+ *       10.0.0.0/8 internal;
+ *       include /etc/proton/networks.conf;
+ *   }
+ */
+
+typedef struct {
+    char *name;
+    char **values;          /* the config's, which outlives the tables */
+    proton_cidr_set_t set;
+} geo_table_t;
+
+static geo_table_t *geos = NULL;
+static int ngeos = 0;
+
+int proton_geos_init(proton_config_t *config) {
+    if (config->ngeos == 0) return PROTON_OK;
+    
+    geos = calloc(config->ngeos, sizeof(geo_table_t));
+    if (!geos) return PROTON_ERROR;
+    
+    for (int i = 0; i < config->ngeos; i++) {
+        proton_geo_t *g = &config->geos[i];
+        
+        for (int j = 0; j < i; j++) {
+            if (strcmp(config->geos[j].name, g->name) == 0) {
+                proton_log(LOG_ERROR, "Duplicate geo variable \"$%s\"", g->name);
+                return PROTON_ERROR;
+            }
+        }
+        
+        geo_table_t *geo = &geos[ngeos];
+        if (proton_cidr_set_build(&geo->set, g->entries, g->nentries, PROTON_CIDR_LONGEST) != PROTON_OK) {
+            proton_log(LOG_ERROR, "Failed to build geo \"$%s\"", g->name);
+            return PROTON_ERROR;
+        }
+        geo->name = g->name;
+        geo->values = g->values;
+        ngeos++;
+        
+        proton_log(LOG_INFO, "geo $%s: %d prefixes, %zu bytes", g->name, g->nentries,
+                   proton_cidr_memory(geo->set.v4) + proton_cidr_memory(geo->set.v6));
+    }
+    
+    return PROTON_OK;
+}
+
+void proton_geos_cleanup(void) {
+    for (int i = 0; i < ngeos; i++) {
+        proton_cidr_set_destroy(&geos[i].set);
+    }
+    free(geos);
+    geos = NULL;
+    ngeos = 0;
+}
+
+int proton_geo_find(const char *name, size_t len) {
+    for (int i = 0; i < ngeos; i++) {
+        if (strlen(geos[i].name) == len && strncmp(geos[i].name, name, len) == 0) return i;
+    }
+    return -1;
+}
+
+const char* proton_geo_value(int index, proton_http_connection_t *conn) {
+    if (index < 0 || index >= ngeos) return NULL;
+    
+    uint16_t value = proton_cidr_set_lookup(&geos[index].set, conn);
+    return geos[index].values[value == PROTON_CIDR_NONE ? 0 : value];
+}
@@ -0,0 +1,591 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proton.h"
+#include "hpack.h"
+
+/*
+ * HPACK header compression (RFC 7541): integer and string coding, the
+ * static table, one dynamic table per direction and the canonical Huffman
+ * code of appendix B. The decoder works on complete header blocks, which
+ * the HTTP/2 layer collects from HEADERS and CONTINUATION frames.
+ */
+
+#define STATIC_ENTRIES      61
+#define INT_MAX_SHIFT       28          /* integers above 2^28 are not sensible */
+#define STRING_MAX          65536       /* decoded header name or value */
+
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee, 0x3fffffff
+};
+
+static const uint8_t huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+static const struct { const char *name; const char *value; } static_table[61] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" }
+};
+
+/* Canonical decoding: codes of one length are consecutive, shorter codes first */
+static uint32_t huff_first[31];
+static uint16_t huff_count[31];
+static uint16_t huff_offset[31];
+static uint16_t huff_syms[257];
+static int huff_ready = 0;
+
+static void huffman_build(void) {
+    int n = 0;
+    
+    for (int len = 5; len <= 30; len++) {
+        huff_offset[len] = n;
+        for (int sym = 0; sym < 257; sym++) {
+            if (huffman_lens[sym] != len) continue;
+            if (huff_count[len] == 0) huff_first[len] = huffman_codes[sym];
+            huff_count[len]++;
+            huff_syms[n++] = sym;
+        }
+    }
+    
+    huff_ready = 1;
+}
+
+static int huffman_decode(const unsigned char *src, size_t len, char *dst, size_t *dst_len) {
+    uint64_t bits = 0;
+    int nbits = 0;
+    size_t out = 0;
+    
+    if (!huff_ready) huffman_build();
+    
+    for (size_t i = 0; i < len; i++) {
+        bits = (bits << 8) | src[i];
+        nbits += 8;
+        
+        while (nbits >= 5) {
+            int len_found = 0;
+            
+            for (int l = 5; l <= 30 && l <= nbits; l++) {
+                uint32_t code = (bits >> (nbits - l)) & ((1u << l) - 1);
+                if (code - huff_first[l] < huff_count[l]) {
+                    int sym = huff_syms[huff_offset[l] + code - huff_first[l]];
+                    if (sym == 256) return PROTON_ERROR;    /* EOS in the string */
+                    dst[out++] = (char)sym;
+                    nbits -= l;
+                    bits &= (1ULL << nbits) - 1;
+                    len_found = l;
+                    break;
+                }
+            }
+            
+            if (!len_found) break;
+        }
+        
+        if (nbits >= 30) return PROTON_ERROR;
+    }
+    
+    /* Padding is the most significant bits of EOS: at most 7 ones */
+    if (nbits > 7 || bits != (1ULL << nbits) - 1) return PROTON_ERROR;
+    
+    *dst_len = out;
+    return PROTON_OK;
+}
+
+static size_t huffman_length(const char *src, size_t len) {
+    uint64_t bits = 0;
+    for (size_t i = 0; i < len; i++) {
+        bits += huffman_lens[(unsigned char)src[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+static int huffman_encode(proton_buffer_t *out, const char *src, size_t len) {
+    unsigned char chunk[256];
+    size_t n = 0;
+    uint64_t bits = 0;
+    int nbits = 0;
+    
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = src[i];
+        bits = (bits << huffman_lens[c]) | huffman_codes[c];
+        nbits += huffman_lens[c];
+        
+        while (nbits >= 8) {
+            nbits -= 8;
+            chunk[n++] = (unsigned char)(bits >> nbits);
+            if (n == sizeof(chunk)) {
+                if (proton_buffer_append(out, (char*)chunk, n) != PROTON_OK) return PROTON_ERROR;
+                n = 0;
+            }
+        }
+        bits &= (1ULL << nbits) - 1;
+    }
+    
+    /* Pad with the prefix of EOS */
+    if (nbits > 0) {
+        chunk[n++] = (unsigned char)((bits << (8 - nbits)) | (0xff >> nbits));
+    }
+    
+    return n > 0 ? proton_buffer_append(out, (char*)chunk, n) : PROTON_OK;
+}
+
+/* Dynamic table */
+
+void proton_hpack_init(proton_hpack_t *hp, size_t limit) {
+    memset(hp, 0, sizeof(*hp));
+    hp->limit = limit;
+    hp->max_size = limit;
+    hp->update_min = limit;
+}
+
+static proton_hpack_entry_t* table_get(proton_hpack_t *hp, size_t i) {
+    return &hp->entries[(hp->head + i) % hp->cap];
+}
+
+static void table_evict(proton_hpack_t *hp, size_t max) {
+    while (hp->count > 0 && hp->size > max) {
+        proton_hpack_entry_t *e = table_get(hp, hp->count - 1);
+        hp->size -= e->name_len + e->value_len + PROTON_HPACK_ENTRY_OVERHEAD;
+        free(e->name);
+        hp->count--;
+    }
+}
+
+static int table_add(proton_hpack_t *hp, const char *name, size_t name_len,
+                     const char *value, size_t value_len) {
+    size_t size = name_len + value_len + PROTON_HPACK_ENTRY_OVERHEAD;
+    
+    /* Larger than the table: the table ends up empty */
+    if (size > hp->max_size) {
+        table_evict(hp, 0);
+        return PROTON_OK;
+    }
+    
+    /* Copy first; name may point into an entry about to be evicted */
+    char *copy = malloc(name_len + value_len + 2);
+    if (!copy) return PROTON_ERROR;
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    memcpy(copy + name_len + 1, value, value_len);
+    copy[name_len + 1 + value_len] = '\0';
+    
+    table_evict(hp, hp->max_size - size);
+    
+    if (hp->count == hp->cap) {
+        size_t cap = hp->cap ? hp->cap * 2 : 16;
+        proton_hpack_entry_t *entries = malloc(cap * sizeof(proton_hpack_entry_t));
+        if (!entries) {
+            free(copy);
+            return PROTON_ERROR;
+        }
+        for (size_t i = 0; i < hp->count; i++) {
+            entries[i] = *table_get(hp, i);
+        }
+        free(hp->entries);
+        hp->entries = entries;
+        hp->cap = cap;
+        hp->head = 0;
+    }
+    
+    hp->head = (hp->head + hp->cap - 1) % hp->cap;
+    proton_hpack_entry_t *e = &hp->entries[hp->head];
+    e->name = copy;
+    e->name_len = name_len;
+    e->value = copy + name_len + 1;
+    e->value_len = value_len;
+    hp->count++;
+    hp->size += size;
+    
+    return PROTON_OK;
+}
+
+void proton_hpack_free(proton_hpack_t *hp) {
+    table_evict(hp, 0);
+    free(hp->entries);
+    hp->entries = NULL;
+    hp->cap = 0;
+}
+
+/* Index 1..61 is the static table, then the dynamic table newest first */
+static int lookup(proton_hpack_t *hp, uint32_t index, const char **name, size_t *name_len,
+                  const char **value, size_t *value_len) {
+    if (index == 0) return PROTON_ERROR;
+    
+    if (index <= STATIC_ENTRIES) {
+        *name = static_table[index - 1].name;
+        *name_len = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return PROTON_OK;
+    }
+    
+    if (index - STATIC_ENTRIES - 1 >= hp->count) return PROTON_ERROR;
+    
+    proton_hpack_entry_t *e = table_get(hp, index - STATIC_ENTRIES - 1);
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return PROTON_OK;
+}
+
+/* Decoder */
+
+typedef struct {
+    char *data;
+    size_t cap;
+} scratch_t;
+
+static int scratch_reserve(scratch_t *s, size_t need) {
+    if (need <= s->cap) return PROTON_OK;
+    
+    char *data = realloc(s->data, need);
+    if (!data) return PROTON_ERROR;
+    s->data = data;
+    s->cap = need;
+    return PROTON_OK;
+}
+
+static int scratch_copy(scratch_t *s, const char *data, size_t len) {
+    if (scratch_reserve(s, len + 1) != PROTON_OK) return PROTON_ERROR;
+    memcpy(s->data, data, len);
+    return PROTON_OK;
+}
+
+static int decode_int(const unsigned char **p, const unsigned char *end, int prefix, uint32_t *out) {
+    uint32_t mask = (1u << prefix) - 1;
+    uint32_t value;
+    
+    if (*p >= end) return PROTON_ERROR;
+    value = *(*p)++ & mask;
+    if (value < mask) {
+        *out = value;
+        return PROTON_OK;
+    }
+    
+    for (int shift = 0; ; shift += 7) {
+        if (*p >= end || shift > INT_MAX_SHIFT) return PROTON_ERROR;
+        unsigned char b = *(*p)++;
+        value += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    
+    *out = value;
+    return PROTON_OK;
+}
+
+static int decode_string(const unsigned char **p, const unsigned char *end, scratch_t *s,
+                         const char **out, size_t *out_len) {
+    if (*p >= end) return PROTON_ERROR;
+    
+    int huffman = **p & 0x80;
+    uint32_t len;
+    if (decode_int(p, end, 7, &len) != PROTON_OK || len > (size_t)(end - *p) || len > STRING_MAX) {
+        return PROTON_ERROR;
+    }
+    
+    if (!huffman) {
+        *out = (const char*)*p;
+        *out_len = len;
+        *p += len;
+        return PROTON_OK;
+    }
+    
+    /* The shortest code is 5 bits */
+    if (scratch_reserve(s, (size_t)len * 8 / 5 + 1) != PROTON_OK) return PROTON_ERROR;
+    
+    if (huffman_decode(*p, len, s->data, out_len) != PROTON_OK) return PROTON_ERROR;
+    *out = s->data;
+    *p += len;
+    return PROTON_OK;
+}
+
+static int decode_block(proton_hpack_t *hp, const unsigned char *p, const unsigned char *end,
+                        proton_hpack_emit_t emit, void *emit_data, scratch_t *sn, scratch_t *sv) {
+    int headers = 0;
+    
+    while (p < end) {
+        const char *name, *value;
+        size_t name_len, value_len;
+        uint32_t index;
+        unsigned char b = *p;
+        
+        if (b & 0x80) {
+            /* Indexed header field */
+            if (decode_int(&p, end, 7, &index) != PROTON_OK) return PROTON_ERROR;
+            if (lookup(hp, index, &name, &name_len, &value, &value_len) != PROTON_OK) return PROTON_ERROR;
+        } else if ((b & 0xe0) == 0x20) {
+            /* Dynamic table size update, only ahead of the first header */
+            if (headers > 0 || decode_int(&p, end, 5, &index) != PROTON_OK || index > hp->limit) {
+                return PROTON_ERROR;
+            }
+            hp->max_size = index;
+            table_evict(hp, hp->max_size);
+            continue;
+        } else {
+            /* Literal: with incremental indexing, without, or never indexed */
+            int indexing = (b & 0xc0) == 0x40;
+            if (decode_int(&p, end, indexing ? 6 : 4, &index) != PROTON_OK) return PROTON_ERROR;
+            
+            if (index > 0) {
+                const char *entry_name, *unused;
+                size_t unused_len;
+                if (lookup(hp, index, &entry_name, &name_len, &unused, &unused_len) != PROTON_OK ||
+                    scratch_copy(sn, entry_name, name_len) != PROTON_OK) {
+                    return PROTON_ERROR;
+                }
+                /* Copied: adding the new entry may evict the one named */
+                name = sn->data;
+            } else if (decode_string(&p, end, sn, &name, &name_len) != PROTON_OK) {
+                return PROTON_ERROR;
+            }
+            
+            if (decode_string(&p, end, sv, &value, &value_len) != PROTON_OK) return PROTON_ERROR;
+            
+            if (indexing) {
+                if (table_add(hp, name, name_len, value, value_len) != PROTON_OK) return PROTON_ERROR;
+            }
+        }
+        
+        headers++;
+        if (emit(emit_data, name, name_len, value, value_len) != PROTON_OK) return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+int proton_hpack_decode(proton_hpack_t *hp, const unsigned char *data, size_t len,
+                        proton_hpack_emit_t emit, void *emit_data) {
+    scratch_t sn = { NULL, 0 };
+    scratch_t sv = { NULL, 0 };
+    
+    int ret = decode_block(hp, data, data + len, emit, emit_data, &sn, &sv);
+    
+    free(sn.data);
+    free(sv.data);
+    return ret;
+}
+
+/* Encoder */
+
+static int encode_int(proton_buffer_t *out, unsigned char first, int prefix, uint32_t value) {
+    unsigned char buf[8];
+    size_t n = 0;
+    uint32_t mask = (1u << prefix) - 1;
+    
+    if (value < mask) {
+        buf[n++] = first | value;
+    } else {
+        buf[n++] = first | mask;
+        value -= mask;
+        while (value >= 0x80) {
+            buf[n++] = (value & 0x7f) | 0x80;
+            value >>= 7;
+        }
+        buf[n++] = value;
+    }
+    
+    return proton_buffer_append(out, (char*)buf, n);
+}
+
+static int encode_string(proton_buffer_t *out, const char *s, size_t len) {
+    size_t hlen = huffman_length(s, len);
+    
+    if (hlen < len) {
+        if (encode_int(out, 0x80, 7, hlen) != PROTON_OK) return PROTON_ERROR;
+        return huffman_encode(out, s, len);
+    }
+    
+    if (encode_int(out, 0, 7, len) != PROTON_OK) return PROTON_ERROR;
+    return len > 0 ? proton_buffer_append(out, s, len) : PROTON_OK;
+}
+
+void proton_hpack_set_limit(proton_hpack_t *hp, size_t limit) {
+    /* Never use more than the default, however much the peer allows */
+    size_t max = limit < PROTON_HPACK_TABLE_SIZE ? limit : PROTON_HPACK_TABLE_SIZE;
+    
+    hp->limit = limit;
+    if (max == hp->max_size) return;
+    
+    hp->max_size = max;
+    table_evict(hp, max);
+    
+    if (!hp->update_pending || max < hp->update_min) hp->update_min = max;
+    hp->update_pending = 1;
+}
+
+int proton_hpack_encode_begin(proton_hpack_t *hp, proton_buffer_t *out) {
+    if (!hp->update_pending) return PROTON_OK;
+    hp->update_pending = 0;
+    
+    /* The smallest size since the last block first, so the peer evicts the same */
+    if (hp->update_min < hp->max_size && encode_int(out, 0x20, 5, hp->update_min) != PROTON_OK) {
+        return PROTON_ERROR;
+    }
+    return encode_int(out, 0x20, 5, hp->max_size);
+}
+
+/* Values that change with every response are not worth a table entry */
+static int volatile_header(const char *name, size_t name_len) {
+    static const char *names[] = {
+        "content-length", "date", "etag", "last-modified", "location", "content-range",
+        "expires", "age", NULL
+    };
+    
+    for (int i = 0; names[i]; i++) {
+        if (strlen(names[i]) == name_len && memcmp(name, names[i], name_len) == 0) return 1;
+    }
+    return 0;
+}
+
+int proton_hpack_encode(proton_hpack_t *hp, proton_buffer_t *out, const char *name, size_t name_len,
+                        const char *value, size_t value_len) {
+    uint32_t name_index = 0;
+    
+    for (int i = 0; i < STATIC_ENTRIES; i++) {
+        if (strlen(static_table[i].name) != name_len || memcmp(static_table[i].name, name, name_len) != 0) {
+            continue;
+        }
+        if (strlen(static_table[i].value) == value_len && memcmp(static_table[i].value, value, value_len) == 0) {
+            return encode_int(out, 0x80, 7, i + 1);
+        }
+        if (!name_index) name_index = i + 1;
+    }
+    
+    for (size_t i = 0; i < hp->count; i++) {
+        proton_hpack_entry_t *e = table_get(hp, i);
+        if (e->name_len != name_len || memcmp(e->name, name, name_len) != 0) continue;
+        if (e->value_len == value_len && memcmp(e->value, value, value_len) == 0) {
+            return encode_int(out, 0x80, 7, STATIC_ENTRIES + 1 + i);
+        }
+        if (!name_index) name_index = STATIC_ENTRIES + 1 + i;
+    }
+    
+    int never = name_len == 10 && memcmp(name, "set-cookie", 10) == 0;
+    int indexing = !never && !volatile_header(name, name_len) &&
+                   name_len + value_len + PROTON_HPACK_ENTRY_OVERHEAD <= hp->max_size / 2;
+    
+    unsigned char first = indexing ? 0x40 : never ? 0x10 : 0x00;
+    if (encode_int(out, first, indexing ? 6 : 4, name_index) != PROTON_OK) return PROTON_ERROR;
+    if (!name_index && encode_string(out, name, name_len) != PROTON_OK) return PROTON_ERROR;
+    if (encode_string(out, value, value_len) != PROTON_OK) return PROTON_ERROR;
+    
+    return indexing ? table_add(hp, name, name_len, value, value_len) : PROTON_OK;
+}
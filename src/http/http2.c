@@ -0,0 +1,1429 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+#include "http2.h"
+#include "hpack.h"
+#include "module.h"
+#include "probe.h"
+
+/*
+ * HTTP/2 framing and stream multiplexing (RFC 7540) for cleartext
+ * connections. The session reads frames from the connection's read buffer
+ * and writes frames to its write buffer; modules never touch the socket.
+ *
+ * Each stream has a connection of its own (fd -1) with a request and a
+ * response, so a stream runs through the module phases like an HTTP/1
+ * request, suspends and resumes the same way, and is logged the same way.
+ * The request body is collected before the stream is dispatched.
+ *
+ * Response bodies leave in DATA frames within the peer's flow-control
+ * windows. Streams with data to send are picked parents first, as the
+ * priority tree says, and in proportion to their weights among the rest.
+ * Streams only go away in the write path, never under a module's feet.
+ */
+
+extern proton_event_loop_t *event_loop;
+
+/* Frame types */
+#define FRAME_DATA              0x0
+#define FRAME_HEADERS           0x1
+#define FRAME_PRIORITY          0x2
+#define FRAME_RST_STREAM        0x3
+#define FRAME_SETTINGS          0x4
+#define FRAME_PUSH_PROMISE      0x5
+#define FRAME_PING              0x6
+#define FRAME_GOAWAY            0x7
+#define FRAME_WINDOW_UPDATE     0x8
+#define FRAME_CONTINUATION      0x9
+
+/* Frame flags */
+#define FLAG_END_STREAM         0x1
+#define FLAG_ACK                0x1
+#define FLAG_END_HEADERS        0x4
+#define FLAG_PADDED             0x8
+#define FLAG_PRIORITY           0x20
+
+/* Settings */
+#define SETTINGS_HEADER_TABLE_SIZE      0x1
+#define SETTINGS_ENABLE_PUSH            0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE    0x4
+#define SETTINGS_MAX_FRAME_SIZE         0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE   0x6
+
+#define FRAME_HEADER_LEN        9
+#define DEFAULT_FRAME_SIZE      16384
+#define DEFAULT_WINDOW          65535
+#define MAX_WINDOW              0x7fffffff
+#define DEFAULT_WEIGHT          16
+
+#define MAX_STREAMS             128
+#define STREAM_WINDOW           (1024 * 1024)       /* we accept per stream */
+#define CONN_WINDOW             (16 * 1024 * 1024)  /* and per connection */
+#define MAX_HEADER_LIST         65536
+#define MAX_HEADER_BLOCK        (256 * 1024)        /* compressed, with CONTINUATIONs */
+#define MAX_BODY                (8 * 1024 * 1024)   /* request body collected per stream */
+#define WRITE_HIGH              (64 * 1024)         /* DATA queued ahead of the socket */
+#define READ_CHUNK              16384
+
+#define HTTP_VERSION_STRING     "HTTP/2.0"
+
+/* Stream states as far as the client's side goes */
+#define STREAM_OPEN             0
+#define STREAM_HALF_CLOSED      1   /* client sent END_STREAM */
+
+struct proton_http2_stream_s {
+    uint32_t id;
+    int state;
+    proton_http2_session_t *session;
+    proton_http_connection_t *conn;     /* what the modules see */
+    
+    int64_t send_window;
+    int64_t recv_window;
+    int64_t content_length;             /* announced by the client, -1 if not */
+    size_t received;
+    
+    int dispatched;
+    int responded;                      /* HEADERS queued */
+    int end_sent;                       /* END_STREAM queued */
+    int reset;                          /* error code to reset with, -1 if none */
+    int error_status;                   /* answer with this instead of the modules */
+    const char *data;                   /* response body */
+    size_t data_len;
+    size_t data_sent;
+    
+    /* Priority tree */
+    proton_http2_stream_t *parent;
+    proton_http2_stream_t *children;
+    proton_http2_stream_t *sibling_prev;
+    proton_http2_stream_t *sibling_next;
+    int weight;
+    uint64_t vtime;                     /* weighted bytes sent, for fair picking */
+    
+    proton_http2_stream_t *prev;
+    proton_http2_stream_t *next;
+};
+
+struct proton_http2_session_s {
+    proton_http_connection_t *conn;
+    proton_hpack_t decoder;
+    proton_hpack_t encoder;
+    
+    proton_http2_stream_t *streams;
+    proton_http2_stream_t *roots;       /* streams that depend on no other */
+    int nstreams;
+    uint32_t last_stream_id;            /* highest stream the client opened */
+    
+    /* Header block in progress, until END_HEADERS */
+    proton_buffer_t *header_block;
+    uint32_t header_stream;
+    int header_end_stream;
+    
+    uint32_t peer_max_frame;
+    int64_t peer_initial_window;
+    int64_t send_window;
+    int64_t recv_window;
+    
+    int preface_pending;
+    int goaway_sent;
+    int goaway_received;
+    int fatal;                          /* close as soon as the GOAWAY is out */
+    uint64_t vtime;
+};
+
+/* Header decoding state of one block */
+typedef struct {
+    proton_http2_session_t *session;
+    proton_http2_stream_t *stream;      /* NULL: decode only, for the table */
+    int trailers;
+    size_t size;
+    int error;                          /* stream error found */
+    int too_large;
+    int regular_seen;
+    int have_method;
+    int have_scheme;
+    int have_path;
+} header_ctx_t;
+
+static int connection_specific(const char *name, size_t len) {
+    static const char *names[] = {
+        "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", NULL
+    };
+    
+    for (int i = 0; names[i]; i++) {
+        if (strlen(names[i]) == len && memcmp(names[i], name, len) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Frames */
+
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int send_frame(proton_http2_session_t *s, int type, int flags, uint32_t sid,
+                      const void *payload, size_t len) {
+    unsigned char h[FRAME_HEADER_LEN];
+    
+    h[0] = len >> 16;
+    h[1] = len >> 8;
+    h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    put32(h + 5, sid & MAX_WINDOW);
+    
+    proton_buffer_t *out = s->conn->write_buf;
+    if (proton_buffer_append(out, (char*)h, FRAME_HEADER_LEN) != PROTON_OK) return PROTON_ERROR;
+    return len > 0 ? proton_buffer_append(out, payload, len) : PROTON_OK;
+}
+
+static void send_rst(proton_http2_session_t *s, uint32_t sid, uint32_t error) {
+    unsigned char p[4];
+    put32(p, error);
+    send_frame(s, FRAME_RST_STREAM, 0, sid, p, 4);
+}
+
+static void send_window_update(proton_http2_session_t *s, uint32_t sid, uint32_t increment) {
+    unsigned char p[4];
+    put32(p, increment);
+    send_frame(s, FRAME_WINDOW_UPDATE, 0, sid, p, 4);
+}
+
+static void send_goaway(proton_http2_session_t *s, uint32_t error) {
+    unsigned char p[8];
+    
+    if (s->goaway_sent) return;
+    s->goaway_sent = 1;
+    
+    put32(p, s->last_stream_id);
+    put32(p + 4, error);
+    send_frame(s, FRAME_GOAWAY, 0, 0, p, 8);
+}
+
+static void send_settings(proton_http2_session_t *s) {
+    unsigned char p[12];
+    
+    p[0] = 0;
+    p[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(p + 2, MAX_STREAMS);
+    p[6] = 0;
+    p[7] = SETTINGS_INITIAL_WINDOW_SIZE;
+    put32(p + 8, STREAM_WINDOW);
+    send_frame(s, FRAME_SETTINGS, 0, 0, p, sizeof(p));
+    
+    /* The connection window is only ever raised with WINDOW_UPDATE */
+    send_window_update(s, 0, CONN_WINDOW - DEFAULT_WINDOW);
+}
+
+/* HEADERS, continued in CONTINUATION frames beyond the peer's frame size */
+static int send_header_block(proton_http2_session_t *s, uint32_t sid, proton_buffer_t *block, int end_stream) {
+    size_t off = 0;
+    int type = FRAME_HEADERS;
+    
+    do {
+        size_t len = block->len - off;
+        if (len > s->peer_max_frame) len = s->peer_max_frame;
+        
+        int flags = off + len == block->len ? FLAG_END_HEADERS : 0;
+        if (type == FRAME_HEADERS && end_stream) flags |= FLAG_END_STREAM;
+        
+        if (send_frame(s, type, flags, sid, block->data + off, len) != PROTON_OK) return PROTON_ERROR;
+        off += len;
+        type = FRAME_CONTINUATION;
+    } while (off < block->len);
+    
+    return PROTON_OK;
+}
+
+/* A connection error: tell the client and close once that is written */
+static int connection_error(proton_http2_session_t *s, uint32_t error) {
+    proton_log(LOG_WARN, "HTTP/2 connection error 0x%x", error);
+    send_goaway(s, error);
+    s->fatal = 1;
+    return PROTON_ERROR;
+}
+
+/* Write path wakes up and takes care of the rest */
+static void schedule_write(proton_http2_session_t *s) {
+    if (event_loop) {
+        proton_event_add(event_loop, s->conn->event, PROTON_EVENT_READ | PROTON_EVENT_WRITE);
+    }
+}
+
+/* Priority tree */
+
+static proton_http2_stream_t** child_list(proton_http2_session_t *s, proton_http2_stream_t *parent) {
+    return parent ? &parent->children : &s->roots;
+}
+
+static void tree_detach(proton_http2_stream_t *st) {
+    proton_http2_stream_t **list = child_list(st->session, st->parent);
+    
+    if (st->sibling_prev) st->sibling_prev->sibling_next = st->sibling_next;
+    else *list = st->sibling_next;
+    if (st->sibling_next) st->sibling_next->sibling_prev = st->sibling_prev;
+    
+    st->parent = NULL;
+    st->sibling_prev = NULL;
+    st->sibling_next = NULL;
+}
+
+static void tree_attach(proton_http2_stream_t *st, proton_http2_stream_t *parent, int exclusive) {
+    proton_http2_stream_t **list = child_list(st->session, parent);
+    
+    /* An exclusive dependency adopts all the parent's other children */
+    if (exclusive) {
+        while (*list) {
+            proton_http2_stream_t *child = *list;
+            tree_detach(child);
+            tree_attach(child, st, 0);
+        }
+    }
+    
+    st->parent = parent;
+    st->sibling_prev = NULL;
+    st->sibling_next = *list;
+    if (*list) (*list)->sibling_prev = st;
+    *list = st;
+}
+
+static int tree_is_ancestor(proton_http2_stream_t *ancestor, proton_http2_stream_t *st) {
+    for (st = st->parent; st; st = st->parent) {
+        if (st == ancestor) return 1;
+    }
+    return 0;
+}
+
+/* A stream going away hands its children to its parent */
+static void tree_remove(proton_http2_stream_t *st) {
+    proton_http2_stream_t *parent = st->parent;
+    
+    tree_detach(st);
+    while (st->children) {
+        proton_http2_stream_t *child = st->children;
+        tree_detach(child);
+        tree_attach(child, parent, 0);
+    }
+}
+
+static proton_http2_stream_t* find_stream(proton_http2_session_t *s, uint32_t sid) {
+    for (proton_http2_stream_t *st = s->streams; st; st = st->next) {
+        if (st->id == sid) return st;
+    }
+    return NULL;
+}
+
+static int set_priority(proton_http2_stream_t *st, uint32_t dep, int weight, int exclusive) {
+    if (dep == st->id) return PROTON_ERROR;
+    
+    /* A dependency on a stream not in the tree gets the default priority */
+    proton_http2_stream_t *parent = dep ? find_stream(st->session, dep) : NULL;
+    if (dep && !parent) {
+        exclusive = 0;
+        weight = DEFAULT_WEIGHT;
+    }
+    
+    /* Depending on its own descendant: the descendant moves up first */
+    if (parent && tree_is_ancestor(st, parent)) {
+        tree_detach(parent);
+        tree_attach(parent, st->parent, 0);
+    }
+    
+    tree_detach(st);
+    tree_attach(st, parent, exclusive);
+    st->weight = weight;
+    return PROTON_OK;
+}
+
+/* Streams */
+
+static proton_http_connection_t* stream_conn_create(proton_http2_stream_t *st) {
+    proton_http_connection_t *parent = st->session->conn;
+    proton_http_connection_t *conn = calloc(1, sizeof(proton_http_connection_t));
+    if (!conn) return NULL;
+    
+    conn->fd = -1;
+    memcpy(&conn->sockaddr, &parent->sockaddr, parent->socklen);
+    conn->socklen = parent->socklen;
+    conn->keep_alive = 1;
+    conn->stream = st;
+    conn->pool = proton_pool_create(4096);
+    conn->read_buf = proton_buffer_create(4096);
+    conn->response = proton_http_response_create();
+    
+    if (conn->pool) {
+        conn->request = proton_pool_alloc(conn->pool, sizeof(proton_http_request_t));
+    }
+    
+    if (!conn->request || !conn->read_buf || !conn->response) {
+        if (conn->response) proton_http_response_destroy(conn->response);
+        if (conn->read_buf) proton_buffer_destroy(conn->read_buf);
+        if (conn->pool) proton_pool_destroy(conn->pool);
+        free(conn);
+        return NULL;
+    }
+    
+    memset(conn->request, 0, sizeof(proton_http_request_t));
+    conn->request->pool = conn->pool;
+    conn->request->version = HTTP_VERSION_20;
+    conn->request->start_msec = proton_current_msec;
+    conn->request->start_usec = proton_time_usec();
+    conn->request->arrival_usec = event_loop->wake_usec;
+    conn->accept_usec = parent->accept_usec;
+    
+    return conn;
+}
+
+static proton_http2_stream_t* stream_create(proton_http2_session_t *s, uint32_t sid) {
+    proton_http2_stream_t *st = calloc(1, sizeof(proton_http2_stream_t));
+    if (!st) return NULL;
+    
+    st->id = sid;
+    st->session = s;
+    st->send_window = s->peer_initial_window;
+    st->recv_window = STREAM_WINDOW;
+    st->content_length = -1;
+    st->reset = -1;
+    st->weight = DEFAULT_WEIGHT;
+    
+    st->conn = stream_conn_create(st);
+    if (!st->conn) {
+        free(st);
+        return NULL;
+    }
+    
+    st->next = s->streams;
+    if (s->streams) s->streams->prev = st;
+    s->streams = st;
+    s->nstreams++;
+    
+    tree_attach(st, NULL, 0);
+    return st;
+}
+
+static void stream_free(proton_http2_stream_t *st) {
+    proton_http2_session_t *s = st->session;
+    proton_http_connection_t *conn = st->conn;
+    
+    /* A suspended module lets go of its timers and events */
+    if (conn->close_hook) {
+        conn->close_hook(conn);
+    }
+    proton_modules_free_conn_ctx(conn);
+    
+    tree_remove(st);
+    if (st->prev) st->prev->next = st->next;
+    else s->streams = st->next;
+    if (st->next) st->next->prev = st->prev;
+    s->nstreams--;
+    
+    proton_http_response_destroy(conn->response);
+    proton_buffer_destroy(conn->read_buf);
+    proton_pool_destroy(conn->pool);
+    free(conn);
+    free(st);
+}
+
+/* A stream error: reset it from the write path */
+static void stream_error(proton_http2_session_t *s, uint32_t sid, uint32_t error) {
+    proton_http2_stream_t *st = find_stream(s, sid);
+    
+    if (st) {
+        if (st->reset < 0) st->reset = error;
+    } else {
+        send_rst(s, sid, error);
+    }
+}
+
+/* Requests */
+
+static int set_method(proton_http_request_t *req, const char *value, size_t len) {
+    static const struct { const char *name; int method; } methods[] = {
+        { "GET", HTTP_GET }, { "POST", HTTP_POST }, { "HEAD", HTTP_HEAD },
+        { "PUT", HTTP_PUT }, { "DELETE", HTTP_DELETE }, { "MKCOL", HTTP_MKCOL },
+        { NULL, 0 }
+    };
+    
+    for (int i = 0; methods[i].name; i++) {
+        if (strlen(methods[i].name) == len && memcmp(methods[i].name, value, len) == 0) {
+            req->method = methods[i].method;
+            return PROTON_OK;
+        }
+    }
+    return PROTON_ERROR;
+}
+
+static char* pool_strndup(proton_pool_t *pool, const char *s, size_t len) {
+    char *copy = proton_pool_alloc(pool, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static int add_header(proton_http_request_t *req, const char *name, size_t name_len,
+                      const char *value, size_t value_len) {
+    proton_http_header_t *h;
+    
+    /* Cookie crumbs come back together as one header */
+    if (name_len == 6 && memcmp(name, "cookie", 6) == 0) {
+        for (h = req->headers; h; h = h->next) {
+            if (strcmp(h->name, "cookie") != 0) continue;
+            
+            size_t old = strlen(h->value);
+            char *joined = proton_pool_alloc(req->pool, old + 2 + value_len + 1);
+            if (!joined) return PROTON_ERROR;
+            memcpy(joined, h->value, old);
+            memcpy(joined + old, "; ", 2);
+            memcpy(joined + old + 2, value, value_len);
+            joined[old + 2 + value_len] = '\0';
+            h->value = joined;
+            return PROTON_OK;
+        }
+    }
+    
+    h = proton_pool_alloc(req->pool, sizeof(proton_http_header_t));
+    if (!h) return PROTON_ERROR;
+    h->name = pool_strndup(req->pool, name, name_len);
+    h->value = pool_strndup(req->pool, value, value_len);
+    if (!h->name || !h->value) return PROTON_ERROR;
+    
+    h->next = req->headers;
+    req->headers = h;
+    return PROTON_OK;
+}
+
+static int set_path(proton_http_request_t *req, const char *value, size_t len) {
+    if (len == 0 || value[0] != '/') return PROTON_ERROR;
+    
+    req->uri = pool_strndup(req->pool, value, len);
+    if (!req->uri) return PROTON_ERROR;
+    
+    char *query = strchr(req->uri, '?');
+    if (query) {
+        *query = '\0';
+        req->query_string = query + 1;
+    }
+    return PROTON_OK;
+}
+
+static int pseudo_header(header_ctx_t *hc, const char *name, size_t name_len,
+                         const char *value, size_t value_len) {
+    proton_http_request_t *req = hc->stream->conn->request;
+    
+    if (hc->regular_seen || hc->trailers) return PROTON_ERROR;
+    
+    if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+        if (hc->have_method++) return PROTON_ERROR;
+        /* Methods we do not know get 501 once the headers are in */
+        if (set_method(req, value, value_len) != PROTON_OK) hc->stream->error_status = HTTP_STATUS_NOT_IMPLEMENTED;
+        return PROTON_OK;
+    }
+    if (name_len == 7 && memcmp(name, ":scheme", 7) == 0) {
+        return hc->have_scheme++ ? PROTON_ERROR : PROTON_OK;
+    }
+    if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+        if (hc->have_path++) return PROTON_ERROR;
+        return set_path(req, value, value_len);
+    }
+    if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+        return add_header(req, "host", 4, value, value_len);
+    }
+    
+    return PROTON_ERROR;
+}
+
+static int emit_header(void *data, const char *name, size_t name_len, const char *value, size_t value_len) {
+    header_ctx_t *hc = data;
+    
+    /* Keep decoding past any trouble: the table must stay in step */
+    hc->size += name_len + value_len + PROTON_HPACK_ENTRY_OVERHEAD;
+    if (hc->size > MAX_HEADER_LIST) hc->too_large = 1;
+    if (!hc->stream || hc->error || hc->too_large) return PROTON_OK;
+    
+    if (name_len == 0) {
+        hc->error = 1;
+        return PROTON_OK;
+    }
+    for (size_t i = 0; i < name_len; i++) {
+        if (name[i] >= 'A' && name[i] <= 'Z') {
+            hc->error = 1;
+            return PROTON_OK;
+        }
+    }
+    
+    if (name[0] == ':') {
+        if (pseudo_header(hc, name, name_len, value, value_len) != PROTON_OK) hc->error = 1;
+        return PROTON_OK;
+    }
+    
+    hc->regular_seen = 1;
+    if (hc->trailers) return PROTON_OK;
+    
+    if (connection_specific(name, name_len) ||
+        (name_len == 2 && memcmp(name, "te", 2) == 0 && (value_len != 8 || memcmp(value, "trailers", 8) != 0))) {
+        hc->error = 1;
+        return PROTON_OK;
+    }
+    
+    if (name_len == 14 && memcmp(name, "content-length", 14) == 0) {
+        char digits[24];
+        char *end;
+        if (value_len == 0 || value_len >= sizeof(digits)) {
+            hc->error = 1;
+            return PROTON_OK;
+        }
+        memcpy(digits, value, value_len);
+        digits[value_len] = '\0';
+        long long length = strtoll(digits, &end, 10);
+        if (*end != '\0' || length < 0) {
+            hc->error = 1;
+            return PROTON_OK;
+        }
+        hc->stream->content_length = length;
+    }
+    
+    if (add_header(hc->stream->conn->request, name, name_len, value, value_len) != PROTON_OK) hc->error = 1;
+    return PROTON_OK;
+}
+
+/* "GET /path?query HTTP/2.0" for the access log */
+static int set_request_line(proton_http_request_t *req) {
+    const char *method = proton_http_method_string(req->method);
+    size_t len = strlen(method) + strlen(req->uri) + (req->query_string ? strlen(req->query_string) + 1 : 0) +
+                 sizeof(HTTP_VERSION_STRING) + 2;
+    
+    req->request_line = proton_pool_alloc(req->pool, len);
+    if (!req->request_line) return PROTON_ERROR;
+    
+    snprintf(req->request_line, len, "%s %s%s%s %s", method, req->uri,
+             req->query_string ? "?" : "", req->query_string ? req->query_string : "", HTTP_VERSION_STRING);
+    return PROTON_OK;
+}
+
+static void respond_error(proton_http2_stream_t *st, int status) {
+    proton_http_response_t *res = st->conn->response;
+    char body[64];
+    int len = snprintf(body, sizeof(body), "%d %s\n", status, proton_http_status_string(status));
+    
+    res->status = status;
+    res->body->len = 0;
+    proton_http_response_write(res, body, len);
+    proton_http2_send_response(st->conn);
+}
+
+/* The request is complete: run it through the modules */
+static void dispatch(proton_http2_stream_t *st) {
+    proton_http_connection_t *conn = st->conn;
+    proton_http_request_t *req = conn->request;
+    
+    st->dispatched = 1;
+    req->parsed_usec = proton_time_usec();
+    PROTON_PROBE3(request__parsed, conn->fd, req->method, req->uri);
+    
+    if (st->error_status) {
+        respond_error(st, st->error_status);
+        return;
+    }
+    
+    req->body = conn->read_buf->len > 0 ? conn->read_buf->data : NULL;
+    req->body_len = conn->read_buf->len;
+    req->header_len = 0;
+    
+    proton_http_handle_request(conn);
+}
+
+static int header_block_done(proton_http2_session_t *s, uint32_t sid) {
+    proton_http2_stream_t *st = find_stream(s, sid);
+    int end_stream = s->header_end_stream;
+    header_ctx_t hc;
+    
+    memset(&hc, 0, sizeof(hc));
+    hc.session = s;
+    
+    /* Streams refused or reset meanwhile still go through the decoder */
+    if (st && st->reset < 0) {
+        hc.stream = st;
+        hc.trailers = st->dispatched || st->received > 0 || st->conn->request->uri != NULL;
+    }
+    
+    int ret = proton_hpack_decode(&s->decoder, (unsigned char*)s->header_block->data, s->header_block->len,
+                                  emit_header, &hc);
+    s->header_block->len = 0;
+    s->header_stream = 0;
+    
+    if (ret != PROTON_OK) return connection_error(s, PROTON_HTTP2_COMPRESSION_ERROR);
+    if (!hc.stream) return PROTON_OK;
+    
+    if (hc.trailers) {
+        /* Trailers end the request; their fields are not passed on */
+        if (!end_stream || hc.error) {
+            stream_error(s, sid, PROTON_HTTP2_PROTOCOL_ERROR);
+            return PROTON_OK;
+        }
+    } else {
+        if (hc.error || !hc.have_method || !hc.have_scheme || !hc.have_path) {
+            stream_error(s, sid, PROTON_HTTP2_PROTOCOL_ERROR);
+            return PROTON_OK;
+        }
+        
+        if (hc.too_large) {
+            st->error_status = HTTP_STATUS_HEADER_TOO_LARGE;
+        }
+        
+        if (st->conn->request->uri && set_request_line(st->conn->request) != PROTON_OK) {
+            stream_error(s, sid, PROTON_HTTP2_INTERNAL_ERROR);
+            return PROTON_OK;
+        }
+        
+        /* Refused late: nothing more is read for it */
+        if (st->error_status && !end_stream) {
+            dispatch(st);
+            return PROTON_OK;
+        }
+    }
+    
+    if (end_stream) {
+        if (st->content_length >= 0 && (size_t)st->content_length != st->received) {
+            stream_error(s, sid, PROTON_HTTP2_PROTOCOL_ERROR);
+            return PROTON_OK;
+        }
+        st->state = STREAM_HALF_CLOSED;
+        if (!st->dispatched) dispatch(st);
+    }
+    
+    return PROTON_OK;
+}
+
+/* Frame handlers; PROTON_ERROR means a connection error was sent */
+
+static int strip_padding(proton_http2_session_t *s, int flags, const unsigned char **p, size_t *len) {
+    if (!(flags & FLAG_PADDED)) return PROTON_OK;
+    
+    if (*len < 1) return connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+    size_t pad = (*p)[0];
+    if (pad >= *len) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    
+    (*p)++;
+    *len -= 1 + pad;
+    return PROTON_OK;
+}
+
+static int on_headers(proton_http2_session_t *s, int flags, uint32_t sid, const unsigned char *p, size_t len) {
+    if (sid == 0 || (sid & 1) == 0) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    if (strip_padding(s, flags, &p, &len) != PROTON_OK) return PROTON_ERROR;
+    
+    uint32_t dep = 0;
+    int weight = DEFAULT_WEIGHT;
+    int exclusive = 0;
+    int has_priority = flags & FLAG_PRIORITY;
+    
+    if (has_priority) {
+        if (len < 5) return connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+        dep = get32(p) & MAX_WINDOW;
+        exclusive = p[0] >> 7;
+        weight = p[4] + 1;
+        p += 5;
+        len -= 5;
+    }
+    
+    proton_http2_stream_t *st = find_stream(s, sid);
+    
+    if (st) {
+        /* Trailers, which must end the stream */
+        if (st->state != STREAM_OPEN) {
+            stream_error(s, sid, PROTON_HTTP2_STREAM_CLOSED);
+            st = NULL;
+        }
+    } else if (sid <= s->last_stream_id) {
+        return connection_error(s, PROTON_HTTP2_STREAM_CLOSED);
+    } else {
+        s->last_stream_id = sid;
+        
+        if (s->goaway_sent) {
+            /* Not served; the headers are still decoded below */
+        } else if (s->nstreams >= MAX_STREAMS) {
+            send_rst(s, sid, PROTON_HTTP2_REFUSED_STREAM);
+        } else {
+            st = stream_create(s, sid);
+            if (!st) send_rst(s, sid, PROTON_HTTP2_REFUSED_STREAM);
+        }
+    }
+    
+    if (st && has_priority && set_priority(st, dep, weight, exclusive) != PROTON_OK) {
+        stream_error(s, sid, PROTON_HTTP2_PROTOCOL_ERROR);
+    }
+    
+    s->header_block->len = 0;
+    if (len > 0 && proton_buffer_append(s->header_block, (const char*)p, len) != PROTON_OK) {
+        return connection_error(s, PROTON_HTTP2_INTERNAL_ERROR);
+    }
+    s->header_stream = sid;
+    s->header_end_stream = flags & FLAG_END_STREAM;
+    
+    return (flags & FLAG_END_HEADERS) ? header_block_done(s, sid) : PROTON_OK;
+}
+
+static int on_continuation(proton_http2_session_t *s, int flags, uint32_t sid, const unsigned char *p, size_t len) {
+    if (sid != s->header_stream) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    
+    if (s->header_block->len + len > MAX_HEADER_BLOCK) {
+        return connection_error(s, PROTON_HTTP2_ENHANCE_YOUR_CALM);
+    }
+    if (len > 0 && proton_buffer_append(s->header_block, (const char*)p, len) != PROTON_OK) {
+        return connection_error(s, PROTON_HTTP2_INTERNAL_ERROR);
+    }
+    
+    return (flags & FLAG_END_HEADERS) ? header_block_done(s, sid) : PROTON_OK;
+}
+
+static int on_data(proton_http2_session_t *s, int flags, uint32_t sid, const unsigned char *p, size_t len) {
+    if (sid == 0) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    
+    /* Flow control counts the whole payload, padding included */
+    s->recv_window -= len;
+    if (s->recv_window < 0) return connection_error(s, PROTON_HTTP2_FLOW_CONTROL_ERROR);
+    if (s->recv_window < CONN_WINDOW / 2) {
+        send_window_update(s, 0, CONN_WINDOW - s->recv_window);
+        s->recv_window = CONN_WINDOW;
+    }
+    
+    size_t frame_len = len;
+    if (strip_padding(s, flags, &p, &len) != PROTON_OK) return PROTON_ERROR;
+    
+    proton_http2_stream_t *st = find_stream(s, sid);
+    if (!st) {
+        if (sid > s->last_stream_id) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+        send_rst(s, sid, PROTON_HTTP2_STREAM_CLOSED);
+        return PROTON_OK;
+    }
+    
+    if (st->state != STREAM_OPEN) {
+        stream_error(s, sid, PROTON_HTTP2_STREAM_CLOSED);
+        return PROTON_OK;
+    }
+    
+    st->recv_window -= frame_len;
+    if (st->recv_window < 0) {
+        stream_error(s, sid, PROTON_HTTP2_FLOW_CONTROL_ERROR);
+        return PROTON_OK;
+    }
+    
+    st->received += len;
+    if (st->content_length >= 0 && st->received > (size_t)st->content_length) {
+        stream_error(s, sid, PROTON_HTTP2_PROTOCOL_ERROR);
+        return PROTON_OK;
+    }
+    
+    if (!st->dispatched) {
+        if (st->received > MAX_BODY) {
+            /* Answer now; the rest of the body is read and dropped */
+            st->error_status = HTTP_STATUS_PAYLOAD_TOO_LARGE;
+            dispatch(st);
+        } else if (len > 0 && proton_buffer_append(st->conn->read_buf, (const char*)p, len) != PROTON_OK) {
+            stream_error(s, sid, PROTON_HTTP2_INTERNAL_ERROR);
+            return PROTON_OK;
+        }
+    }
+    
+    if (flags & FLAG_END_STREAM) {
+        if (st->content_length >= 0 && st->received != (size_t)st->content_length) {
+            stream_error(s, sid, PROTON_HTTP2_PROTOCOL_ERROR);
+            return PROTON_OK;
+        }
+        st->state = STREAM_HALF_CLOSED;
+        if (!st->dispatched) dispatch(st);
+    } else if (st->recv_window < STREAM_WINDOW / 2) {
+        send_window_update(s, sid, STREAM_WINDOW - st->recv_window);
+        st->recv_window = STREAM_WINDOW;
+    }
+    
+    return PROTON_OK;
+}
+
+static int on_priority(proton_http2_session_t *s, uint32_t sid, const unsigned char *p, size_t len) {
+    if (sid == 0) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    if (len != 5) return connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+    
+    proton_http2_stream_t *st = find_stream(s, sid);
+    if (!st) return PROTON_OK;
+    
+    if (set_priority(st, get32(p) & MAX_WINDOW, p[4] + 1, p[0] >> 7) != PROTON_OK) {
+        stream_error(s, sid, PROTON_HTTP2_PROTOCOL_ERROR);
+    }
+    return PROTON_OK;
+}
+
+static int on_rst_stream(proton_http2_session_t *s, uint32_t sid, size_t len) {
+    if (sid == 0 || sid > s->last_stream_id) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    if (len != 4) return connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+    
+    /* The client gave up on it; nothing is sent for it any more */
+    proton_http2_stream_t *st = find_stream(s, sid);
+    if (st) stream_free(st);
+    return PROTON_OK;
+}
+
+static int apply_settings(proton_http2_session_t *s, const unsigned char *p, size_t len) {
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        int id = (p[i] << 8) | p[i + 1];
+        uint32_t value = get32(p + i + 2);
+        
+        switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            proton_hpack_set_limit(&s->encoder, value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > MAX_WINDOW) return connection_error(s, PROTON_HTTP2_FLOW_CONTROL_ERROR);
+            
+            /* Applies to the open streams too, and may take them below zero */
+            int64_t delta = (int64_t)value - s->peer_initial_window;
+            for (proton_http2_stream_t *st = s->streams; st; st = st->next) {
+                st->send_window += delta;
+                if (st->send_window > MAX_WINDOW) return connection_error(s, PROTON_HTTP2_FLOW_CONTROL_ERROR);
+            }
+            s->peer_initial_window = value;
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < DEFAULT_FRAME_SIZE || value > 0xffffff) {
+                return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+            }
+            s->peer_max_frame = value;
+            break;
+        default:
+            /* Unknown settings are ignored */
+            break;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static int on_settings(proton_http2_session_t *s, int flags, uint32_t sid, const unsigned char *p, size_t len) {
+    if (sid != 0) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    
+    if (flags & FLAG_ACK) {
+        return len == 0 ? PROTON_OK : connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+    }
+    if (len % 6 != 0) return connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+    
+    if (apply_settings(s, p, len) != PROTON_OK) return PROTON_ERROR;
+    return send_frame(s, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+}
+
+static int on_ping(proton_http2_session_t *s, int flags, uint32_t sid, const unsigned char *p, size_t len) {
+    if (sid != 0) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    if (len != 8) return connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+    
+    if (flags & FLAG_ACK) return PROTON_OK;
+    return send_frame(s, FRAME_PING, FLAG_ACK, 0, p, 8);
+}
+
+static int on_goaway(proton_http2_session_t *s, uint32_t sid, size_t len) {
+    if (sid != 0) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    if (len < 8) return connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+    
+    /* No new streams will come; close once the open ones are done */
+    s->goaway_received = 1;
+    return PROTON_OK;
+}
+
+static int on_window_update(proton_http2_session_t *s, uint32_t sid, const unsigned char *p, size_t len) {
+    if (len != 4) return connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+    
+    uint32_t increment = get32(p) & MAX_WINDOW;
+    
+    if (sid == 0) {
+        if (increment == 0) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+        s->send_window += increment;
+        if (s->send_window > MAX_WINDOW) return connection_error(s, PROTON_HTTP2_FLOW_CONTROL_ERROR);
+        return PROTON_OK;
+    }
+    
+    proton_http2_stream_t *st = find_stream(s, sid);
+    if (!st) return PROTON_OK;
+    
+    if (increment == 0) {
+        stream_error(s, sid, PROTON_HTTP2_PROTOCOL_ERROR);
+        return PROTON_OK;
+    }
+    
+    st->send_window += increment;
+    if (st->send_window > MAX_WINDOW) stream_error(s, sid, PROTON_HTTP2_FLOW_CONTROL_ERROR);
+    return PROTON_OK;
+}
+
+static int process_frame(proton_http2_session_t *s, int type, int flags, uint32_t sid,
+                         const unsigned char *p, size_t len) {
+    /* A header block is not interrupted by any other frame */
+    if (s->header_stream && type != FRAME_CONTINUATION) {
+        return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    }
+    
+    switch (type) {
+    case FRAME_DATA:            return on_data(s, flags, sid, p, len);
+    case FRAME_HEADERS:         return on_headers(s, flags, sid, p, len);
+    case FRAME_PRIORITY:        return on_priority(s, sid, p, len);
+    case FRAME_RST_STREAM:      return on_rst_stream(s, sid, len);
+    case FRAME_SETTINGS:        return on_settings(s, flags, sid, p, len);
+    case FRAME_PUSH_PROMISE:    return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+    case FRAME_PING:            return on_ping(s, flags, sid, p, len);
+    case FRAME_GOAWAY:          return on_goaway(s, sid, len);
+    case FRAME_WINDOW_UPDATE:   return on_window_update(s, sid, p, len);
+    case FRAME_CONTINUATION:    return on_continuation(s, flags, sid, p, len);
+    default:                    return PROTON_OK;   /* extension frames are ignored */
+    }
+}
+
+/* Handle all complete frames in the read buffer */
+static int process_input(proton_http2_session_t *s) {
+    proton_buffer_t *in = s->conn->read_buf;
+    const unsigned char *p = (unsigned char*)in->data;
+    size_t avail = in->len;
+    int ret = PROTON_OK;
+    
+    if (s->preface_pending) {
+        size_t n = avail < PROTON_HTTP2_PREFACE_LEN ? avail : PROTON_HTTP2_PREFACE_LEN;
+        if (memcmp(p, PROTON_HTTP2_PREFACE, n) != 0) return connection_error(s, PROTON_HTTP2_PROTOCOL_ERROR);
+        if (n < PROTON_HTTP2_PREFACE_LEN) return PROTON_OK;
+        
+        p += PROTON_HTTP2_PREFACE_LEN;
+        avail -= PROTON_HTTP2_PREFACE_LEN;
+        s->preface_pending = 0;
+    }
+    
+    while (!s->fatal && avail >= FRAME_HEADER_LEN) {
+        size_t len = ((size_t)p[0] << 16) | (p[1] << 8) | p[2];
+        int type = p[3];
+        int flags = p[4];
+        uint32_t sid = get32(p + 5) & MAX_WINDOW;
+        
+        /* The client must keep to our SETTINGS_MAX_FRAME_SIZE */
+        if (len > DEFAULT_FRAME_SIZE) {
+            ret = connection_error(s, PROTON_HTTP2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (avail < FRAME_HEADER_LEN + len) break;
+        
+        ret = process_frame(s, type, flags, sid, p + FRAME_HEADER_LEN, len);
+        p += FRAME_HEADER_LEN + len;
+        avail -= FRAME_HEADER_LEN + len;
+        if (ret != PROTON_OK) break;
+    }
+    
+    /* Keep a partial frame for the next read */
+    if (avail > 0 && (char*)p != in->data) memmove(in->data, p, avail);
+    in->len = avail;
+    
+    return ret;
+}
+
+/* Write path */
+
+static int stream_sendable(proton_http2_stream_t *st) {
+    return st->responded && st->reset < 0 && st->data_sent < st->data_len && st->send_window > 0;
+}
+
+/* Ready, and no stream it depends on has anything to send */
+static proton_http2_stream_t* pick_stream(proton_http2_session_t *s) {
+    proton_http2_stream_t *best = NULL;
+    
+    for (proton_http2_stream_t *st = s->streams; st; st = st->next) {
+        if (!stream_sendable(st) || (best && st->vtime >= best->vtime)) continue;
+        
+        int blocked = 0;
+        for (proton_http2_stream_t *p = st->parent; p && !blocked; p = p->parent) {
+            blocked = stream_sendable(p);
+        }
+        if (!blocked) best = st;
+    }
+    
+    return best;
+}
+
+/* Fill the write buffer with DATA frames; returns how many were queued */
+static int produce_data(proton_http2_session_t *s) {
+    int frames = 0;
+    
+    while (s->conn->write_buf->len < WRITE_HIGH && s->send_window > 0) {
+        proton_http2_stream_t *st = pick_stream(s);
+        if (!st) break;
+        
+        size_t len = st->data_len - st->data_sent;
+        if ((int64_t)len > st->send_window) len = st->send_window;
+        if ((int64_t)len > s->send_window) len = s->send_window;
+        if (len > s->peer_max_frame) len = s->peer_max_frame;
+        
+        int end = st->data_sent + len == st->data_len;
+        if (send_frame(s, FRAME_DATA, end ? FLAG_END_STREAM : 0, st->id, st->data + st->data_sent, len) != PROTON_OK) {
+            break;
+        }
+        
+        st->data_sent += len;
+        st->send_window -= len;
+        s->send_window -= len;
+        st->conn->bytes_sent += len;
+        st->end_sent = end;
+        
+        s->vtime = st->vtime;
+        st->vtime += (uint64_t)len * 256 / st->weight;
+        frames++;
+    }
+    
+    return frames;
+}
+
+/* Let go of the streams that are done or reset */
+static void reap_streams(proton_http2_session_t *s) {
+    proton_http2_stream_t *st = s->streams;
+    
+    while (st) {
+        proton_http2_stream_t *next = st->next;
+        
+        if (st->reset >= 0) {
+            send_rst(s, st->id, st->reset);
+            stream_free(st);
+        } else if (st->end_sent) {
+            proton_http_request_done(st->conn);
+            s->conn->requests++;
+            
+            /* The response is complete; whatever else the client sends is not wanted */
+            if (st->state == STREAM_OPEN) send_rst(s, st->id, PROTON_HTTP2_NO_ERROR);
+            stream_free(st);
+        }
+        
+        st = next;
+    }
+}
+
+static int flush(proton_http2_session_t *s) {
+    proton_http_connection_t *conn = s->conn;
+    proton_buffer_t *out = conn->write_buf;
+    
+    while (1) {
+        reap_streams(s);
+        if (!s->fatal) produce_data(s);
+        
+        if (out->len == 0) {
+            if (s->fatal || ((s->goaway_sent || s->goaway_received) && s->nstreams == 0)) {
+                proton_http_connection_close(conn);
+                return PROTON_DONE;
+            }
+            return PROTON_OK;
+        }
+        
+        ssize_t n = proton_http_send(conn, out->data, out->len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROTON_OK;
+            if (errno == EINTR) continue;
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        proton_stats->bytes_out += n;
+        if ((size_t)n < out->len) memmove(out->data, out->data + n, out->len - n);
+        out->len -= n;
+    }
+}
+
+/* Entry points */
+
+int proton_http2_preface(proton_buffer_t *buf) {
+    size_t n = buf->len < PROTON_HTTP2_PREFACE_LEN ? buf->len : PROTON_HTTP2_PREFACE_LEN;
+    
+    if (memcmp(buf->data, PROTON_HTTP2_PREFACE, n) != 0) return PROTON_DECLINED;
+    return n < PROTON_HTTP2_PREFACE_LEN ? PROTON_AGAIN : PROTON_OK;
+}
+
+static proton_http2_session_t* session_create(proton_http_connection_t *conn) {
+    proton_http2_session_t *s = calloc(1, sizeof(proton_http2_session_t));
+    if (!s) return NULL;
+    
+    s->header_block = proton_buffer_create(4096);
+    if (!s->header_block) {
+        free(s);
+        return NULL;
+    }
+    
+    s->conn = conn;
+    s->peer_max_frame = DEFAULT_FRAME_SIZE;
+    s->peer_initial_window = DEFAULT_WINDOW;
+    s->send_window = DEFAULT_WINDOW;
+    s->recv_window = CONN_WINDOW;
+    s->preface_pending = 1;
+    proton_hpack_init(&s->decoder, PROTON_HPACK_TABLE_SIZE);
+    proton_hpack_init(&s->encoder, PROTON_HPACK_TABLE_SIZE);
+    
+    conn->h2 = s;
+    send_settings(s);
+    return s;
+}
+
+/* Prior knowledge: the preface is at the start of the read buffer */
+int proton_http2_start(proton_http_connection_t *conn) {
+    if (!session_create(conn)) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    
+    return proton_http2_read_handler(conn);
+}
+
+static int base64url_decode(const char *in, unsigned char *out, size_t max, size_t *out_len) {
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    
+    for (; *in && *in != '='; in++) {
+        int v;
+        char c = *in;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '-' || c == '+') v = 62;
+        else if (c == '_' || c == '/') v = 63;
+        else return PROTON_ERROR;
+        
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n == max) return PROTON_ERROR;
+            out[n++] = (acc >> bits) & 0xff;
+        }
+    }
+    
+    *out_len = n;
+    return PROTON_OK;
+}
+
+/*
+ * Upgrade: h2c on a request without a body. The request becomes stream 1
+ * and is answered over HTTP/2 after the 101. Anything else stays HTTP/1.1.
+ */
+int proton_http2_upgrade(proton_http_connection_t *conn) {
+    proton_http_request_t *req = conn->request;
+    unsigned char settings[256];
+    size_t settings_len;
+    
+    const char *upgrade = proton_http_get_header(req, "Upgrade");
+    const char *connection = proton_http_get_header(req, "Connection");
+    const char *encoded = proton_http_get_header(req, "HTTP2-Settings");
+    const char *length = proton_http_get_header(req, "Content-Length");
+    
+    if (req->version != HTTP_VERSION_11 || !upgrade || !encoded ||
+        !proton_http_has_token(upgrade, "h2c") || !proton_http_has_token(connection, "upgrade") ||
+        proton_http_get_header(req, "Transfer-Encoding") ||
+        (length && strtoull(length, NULL, 10) > 0)) {
+        return PROTON_DECLINED;
+    }
+    
+    if (base64url_decode(encoded, settings, sizeof(settings), &settings_len) != PROTON_OK ||
+        settings_len % 6 != 0) {
+        return PROTON_DECLINED;
+    }
+    
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+                                    "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    if (proton_buffer_append(conn->write_buf, switching, sizeof(switching) - 1) != PROTON_OK) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    
+    proton_http2_session_t *s = session_create(conn);
+    if (!s || apply_settings(s, settings, settings_len) != PROTON_OK) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    
+    proton_http2_stream_t *st = stream_create(s, 1);
+    if (!st) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    s->last_stream_id = 1;
+    st->state = STREAM_HALF_CLOSED;
+    
+    /* The request moves to the stream, with the pool it lives in */
+    proton_http_connection_t *sc = st->conn;
+    proton_pool_destroy(sc->pool);
+    sc->pool = conn->pool;
+    sc->request = req;
+    
+    conn->pool = proton_pool_create(4096);
+    conn->request = conn->pool ? proton_pool_alloc(conn->pool, sizeof(proton_http_request_t)) : NULL;
+    if (!conn->request) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    memset(conn->request, 0, sizeof(proton_http_request_t));
+    conn->request->pool = conn->pool;
+    
+    /* The preface and the first frames may already be here */
+    proton_buffer_t *in = conn->read_buf;
+    size_t rest = in->len - req->header_len;
+    memmove(in->data, in->data + req->header_len, rest);
+    in->len = rest;
+    
+    dispatch(st);
+    
+    if (process_input(s) != PROTON_OK) return flush(s);
+    return proton_http2_read_handler(conn);
+}
+
+int proton_http2_read_handler(proton_http_connection_t *conn) {
+    proton_http2_session_t *s = conn->h2;
+    
+    while (!s->fatal) {
+        char buf[READ_CHUNK];
+        ssize_t n = proton_http_recv(conn, buf, sizeof(buf));
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        if (n == 0) {
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        proton_stats->bytes_in += n;
+        if (proton_buffer_append(conn->read_buf, buf, n) != PROTON_OK) {
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        if (process_input(s) != PROTON_OK) break;
+    }
+    
+    /* Frames that arrived with the upgrade or the preface */
+    if (!s->fatal && conn->read_buf->len >= FRAME_HEADER_LEN) process_input(s);
+    
+    return flush(s);
+}
+
+int proton_http2_write_handler(proton_http_connection_t *conn) {
+    return flush(conn->h2);
+}
+
+int proton_http2_send_response(proton_http_connection_t *conn) {
+    proton_http2_stream_t *st = conn->stream;
+    proton_http2_session_t *s = st->session;
+    proton_http_response_t *res = conn->response;
+    char value[32];
+    
+    if (st->responded || st->reset >= 0) return PROTON_OK;
+    
+    proton_buffer_t *block = proton_buffer_create(256);
+    if (!block) {
+        st->reset = PROTON_HTTP2_INTERNAL_ERROR;
+        schedule_write(s);
+        return PROTON_ERROR;
+    }
+    
+    int len = snprintf(value, sizeof(value), "%d", res->status);
+    int ret = proton_hpack_encode_begin(&s->encoder, block);
+    if (ret == PROTON_OK) ret = proton_hpack_encode(&s->encoder, block, ":status", 7, value, len);
+    if (ret == PROTON_OK) {
+        ret = proton_hpack_encode(&s->encoder, block, "server", 6, "Proton/" PROTON_VERSION,
+                                  strlen("Proton/" PROTON_VERSION));
+    }
+    if (ret == PROTON_OK) {
+        /* HEAD and 304 may leave the length of the body they would have had */
+        len = snprintf(value, sizeof(value), "%zu", res->body->len + res->file_len);
+        ret = proton_hpack_encode(&s->encoder, block, "content-length", 14, value, len);
+    }
+    
+    /* Header names are lowercase in HTTP/2, and hop-by-hop ones do not exist */
+    for (proton_http_header_t *h = res->headers; h && ret == PROTON_OK; h = h->next) {
+        char name[256];
+        size_t name_len = strlen(h->name);
+        if (name_len == 0 || name_len >= sizeof(name)) continue;
+        
+        for (size_t i = 0; i < name_len; i++) {
+            name[i] = (h->name[i] >= 'A' && h->name[i] <= 'Z') ? h->name[i] + 32 : h->name[i];
+        }
+        if (connection_specific(name, name_len) || (name_len == 14 && memcmp(name, "content-length", 14) == 0)) {
+            continue;
+        }
+        
+        ret = proton_hpack_encode(&s->encoder, block, name, name_len, h->value, strlen(h->value));
+    }
+    
+    int end_stream = res->body->len == 0 || conn->request->method == HTTP_HEAD;
+    if (ret == PROTON_OK) ret = send_header_block(s, st->id, block, end_stream);
+    
+    if (ret != PROTON_OK) {
+        /* The encoder state is now unknown to the client */
+        connection_error(s, PROTON_HTTP2_COMPRESSION_ERROR);
+    }
+    
+    conn->bytes_sent += block->len;
+    proton_buffer_destroy(block);
+    
+    st->responded = 1;
+    st->end_sent = end_stream;
+    st->data = res->body->data;
+    st->data_len = end_stream ? 0 : res->body->len;
+    st->vtime = s->vtime;
+    res->headers_sent = 1;
+    
+    schedule_write(s);
+    return PROTON_OK;
+}
+
+proton_http_connection_t* proton_http2_parent(proton_http_connection_t *conn) {
+    return conn->stream->session->conn;
+}
+
+int proton_http2_reset_stream(proton_http_connection_t *conn, uint32_t error) {
+    proton_http2_stream_t *st = conn->stream;
+    
+    if (st->reset < 0) st->reset = error;
+    schedule_write(st->session);
+    return PROTON_OK;
+}
+
+void proton_http2_drain(proton_http_connection_t *conn) {
+    proton_http2_session_t *s = conn->h2;
+    
+    send_goaway(s, PROTON_HTTP2_NO_ERROR);
+    flush(s);
+}
+
+void proton_http2_destroy(proton_http_connection_t *conn) {
+    proton_http2_session_t *s = conn->h2;
+    if (!s) return;
+    
+    while (s->streams) {
+        stream_free(s->streams);
+    }
+    
+    proton_hpack_free(&s->decoder);
+    proton_hpack_free(&s->encoder);
+    proton_buffer_destroy(s->header_block);
+    free(s);
+    conn->h2 = NULL;
+}
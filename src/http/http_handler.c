@@ -1,23 +1,148 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
 #include "proton.h"
 #include "event.h"
 #include "http.h"
 #include "module.h"
+#include "http2.h"
+#include "tls.h"
+#include "websocket.h"
+#include "probe.h"
 
 /* Global event loop reference */
 extern proton_event_loop_t *event_loop;
 
 static int http_read_handler(proton_event_t *ev);
 static int http_write_handler(proton_event_t *ev);
+static int finish_request(proton_http_connection_t *conn);
+
+/* All open connections of this worker */
+static proton_http_connection_t *connections = NULL;
+static int nconnections = 0;
+static int draining = 0;
+
+/* Idle keepalive connections, least recently used first */
+static proton_http_connection_t *idle_head = NULL;
+static proton_http_connection_t *idle_tail = NULL;
+static proton_config_t *http_config = NULL;
+
+void proton_http_init(proton_config_t *config) {
+    http_config = config;
+}
+
+/* Keep the scoreboard gauges in step with the connection */
+static void set_state(proton_http_connection_t *conn, int state) {
+    if (conn->state == state) return;
+    
+    if (conn->state == HTTP_CONN_READING) proton_stats->reading--;
+    else if (conn->state == HTTP_CONN_WRITING) proton_stats->writing--;
+    
+    if (state == HTTP_CONN_READING) proton_stats->reading++;
+    else if (state == HTTP_CONN_WRITING) proton_stats->writing++;
+    
+    conn->state = state;
+}
+
+static void idle_add(proton_http_connection_t *conn) {
+    conn->idle = 1;
+    conn->idle_prev = idle_tail;
+    conn->idle_next = NULL;
+    if (idle_tail) idle_tail->idle_next = conn;
+    else idle_head = conn;
+    idle_tail = conn;
+}
+
+static void idle_remove(proton_http_connection_t *conn) {
+    if (!conn->idle) return;
+    
+    if (conn->idle_prev) conn->idle_prev->idle_next = conn->idle_next;
+    else idle_head = conn->idle_next;
+    if (conn->idle_next) conn->idle_next->idle_prev = conn->idle_prev;
+    else idle_tail = conn->idle_prev;
+    conn->idle = 0;
+}
+
+static proton_histogram_t* histogram(proton_http_connection_t *conn, int which) {
+    int index = 0;
+    
+    if (conn->request->location && http_config) {
+        index = conn->request->location - http_config->locations + 1;
+        if (index > PROTON_METRICS_OTHER) index = PROTON_METRICS_OTHER;
+    }
+    
+    return &proton_metrics->hist[index][which];
+}
+
+static int header_timeout(void) {
+    return http_config ? http_config->client_header_timeout : 60000;
+}
+
+static int keepalive_timeout(void) {
+    return http_config ? http_config->keepalive_timeout : 75000;
+}
+
+/* Waiting for a request header or, idle, for the next request */
+static void conn_timeout_handler(proton_timer_t *timer) {
+    proton_http_connection_t *conn = timer->data;
+    
+    /* HTTP/2 and WebSocket keep their own time */
+    if (conn->h2 || conn->ws) return;
+    
+    if (!conn->idle) {
+        proton_log(LOG_INFO, "Client timed out sending the request header");
+    }
+    proton_http_connection_close(conn);
+}
+
+/* overload_shedding stamps requests with when the kernel received them, where it can */
+static int stamps_arrival(proton_http_connection_t *conn) {
+    return http_config && http_config->overload_target && !conn->ssl;
+}
+
+/*
+ * When the oldest unread byte was received, on the proton_time_usec() clock.
+ * A TCP read reports the stamp of the newest segment it took, so peek at one.
+ */
+static uint64_t oldest_arrival(proton_http_connection_t *conn) {
+    char byte;
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = sizeof(control) };
+    
+    if (recvmsg(conn->fd, &msg, MSG_PEEK) <= 0) return event_loop->wake_usec;
+    
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS) continue;
+        
+        struct timespec stamp, now;
+        memcpy(&stamp, CMSG_DATA(c), sizeof(stamp));
+        clock_gettime(CLOCK_REALTIME, &now);
+        
+        int64_t age = (int64_t)(now.tv_sec - stamp.tv_sec) * 1000000 + (now.tv_nsec - stamp.tv_nsec) / 1000;
+        uint64_t usec = proton_time_usec();
+        if (age > 0 && (uint64_t)age < usec) return usec - age;
+    }
+    
+    return event_loop->wake_usec;
+}
 
 proton_http_connection_t* proton_http_connection_create(int fd) {
     proton_http_connection_t *conn = calloc(1, sizeof(proton_http_connection_t));
     if (!conn) return NULL;
     
+    conn->next = connections;
+    if (connections) connections->prev = conn;
+    connections = conn;
+    nconnections++;
+    proton_stats->active++;
+    
     conn->fd = fd;
     conn->pool = proton_pool_create(4096);
     conn->read_buf = proton_buffer_create(4096);
@@ -37,6 +162,8 @@ proton_http_connection_t* proton_http_connection_create(int fd) {
     }
     memset(conn->request, 0, sizeof(proton_http_request_t));
     conn->request->pool = conn->pool;
+    conn->accept_usec = proton_time_usec();
+    conn->request->start_usec = conn->accept_usec;
     
     conn->response = proton_http_response_create();
     if (!conn->response) {
@@ -55,12 +182,51 @@ proton_http_connection_t* proton_http_connection_create(int fd) {
     conn->event->read_handler = http_read_handler;
     conn->event->write_handler = http_write_handler;
     
+    proton_timer_init(&conn->timer, conn_timeout_handler, conn);
+    proton_timer_add(event_loop, &conn->timer, header_timeout());
+    
+    /* TLS connections are not known yet; the option costs them nothing */
+    if (http_config && http_config->overload_target) {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    }
+    
     return conn;
 }
 
 void proton_http_connection_close(proton_http_connection_t *conn) {
     if (!conn) return;
     
+    PROTON_PROBE2(conn__close, conn->fd, conn->requests);
+    
+    /* Let an asynchronous module release what it holds for this request */
+    if (conn->close_hook) {
+        conn->close_hook(conn);
+    }
+    
+    proton_modules_free_conn_ctx(conn);
+    
+    if (conn->prev) conn->prev->next = conn->next;
+    else connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    nconnections--;
+    idle_remove(conn);
+    proton_timer_del(event_loop, &conn->timer);
+    set_state(conn, HTTP_CONN_WAITING);
+    proton_stats->active--;
+    
+    if (conn->h2) {
+        proton_http2_destroy(conn);
+    }
+    
+    if (conn->ws) {
+        proton_ws_destroy(conn);
+    }
+    
+    if (conn->ssl) {
+        proton_tls_close(conn);
+    }
+    
     if (conn->fd >= 0) {
         close(conn->fd);
     }
@@ -88,43 +254,212 @@ void proton_http_connection_close(proton_http_connection_t *conn) {
     free(conn);
 }
 
-static int http_read_handler(proton_event_t *ev) {
-    proton_http_connection_t *conn = (proton_http_connection_t*)ev->data;
+ssize_t proton_http_recv(proton_http_connection_t *conn, void *buf, size_t len) {
+    if (conn->ssl) return proton_tls_recv(conn, buf, len);
+    return read(conn->fd, buf, len);
+}
+
+ssize_t proton_http_send(proton_http_connection_t *conn, const void *buf, size_t len) {
+    if (conn->ssl) return proton_tls_send(conn, buf, len);
+    return write(conn->fd, buf, len);
+}
+
+ssize_t proton_http_sendv(proton_http_connection_t *conn, const struct iovec *iov, int iovcnt) {
+    if (!conn->ssl) return writev(conn->fd, iov, iovcnt);
+    
+    /* Gather small pieces into one record rather than one record each */
+    char buf[16384];
+    size_t len = 0;
+    
+    for (int i = 0; i < iovcnt && len + iov[i].iov_len <= sizeof(buf); i++) {
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
     
-    /* Read data */
+    if (len == 0 && iovcnt > 0) return proton_tls_send(conn, iov[0].iov_base, iov[0].iov_len);
+    return proton_tls_send(conn, buf, len);
+}
+
+/* Finish the TLS handshake first; PROTON_DONE if the connection closed or ALPN made it HTTP/2 */
+static int tls_handshake(proton_http_connection_t *conn) {
+    int ret = proton_tls_handshake(conn);
+    if (ret == PROTON_AGAIN) return PROTON_AGAIN;
+    
+    if (ret != PROTON_OK) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    
+    if (http_config && http_config->http2 && proton_tls_alpn_h2(conn)) {
+        proton_http2_start(conn);
+        return PROTON_DONE;
+    }
+    
+    return PROTON_OK;
+}
+
+/* Enough to act on: a whole header, or the HTTP/2 preface */
+static int header_complete(proton_http_connection_t *conn) {
+    proton_buffer_t *buf = conn->read_buf;
+    
+    if (buf->len == 0) return 0;
+    if (conn->requests == 0 && http_config && http_config->http2 &&
+        proton_http2_preface(buf) == PROTON_AGAIN) {
+        return 0;
+    }
+    
+    return memmem(buf->data, buf->len, "\r\n\r\n", 4) != NULL;
+}
+
+static void header_too_large(proton_http_connection_t *conn) {
+    proton_timer_del(event_loop, &conn->timer);
+    set_state(conn, HTTP_CONN_WRITING);
+    
+    /* The request line may not even be there to parse; what follows cannot be trusted */
+    conn->keep_alive = 0;
+    conn->response->status = HTTP_STATUS_HEADER_TOO_LARGE;
+    proton_http_response_send(conn);
+}
+
+/*
+ * Read up to the end of the request header and no further: the body is
+ * for the handler to read, at its own pace. Edge-triggered, so unless the
+ * socket said EAGAIN conn->readable is set to come back for the rest.
+ * PROTON_AGAIN while the header is incomplete.
+ */
+static int read_header(proton_http_connection_t *conn) {
     char buf[4096];
-    ssize_t n = read(conn->fd, buf, sizeof(buf));
     
-    if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            return PROTON_OK;
+    while (!header_complete(conn)) {
+        if (conn->read_buf->len >= PROTON_HTTP_HEADER_MAX) {
+            header_too_large(conn);
+            return PROTON_DONE;
+        }
+        
+        /* Only a request's first bytes are peeked at for the kernel stamp; others arrived on wakeup */
+        uint64_t arrival = event_loop->wake_usec;
+        if (conn->read_buf->len == 0 && stamps_arrival(conn)) arrival = oldest_arrival(conn);
+        ssize_t n = proton_http_recv(conn, buf, sizeof(buf));
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->readable = 0;
+                return PROTON_AGAIN;
+            }
+            if (errno == EINTR) continue;
+            proton_log(LOG_ERROR, "Read error: %s", strerror(errno));
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        /* Closed, or half-closed after an incomplete request */
+        if (n == 0) {
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        proton_stats->bytes_in += n;
+        conn->read_usec = arrival;
+        
+        /* First bytes of a new request */
+        if (conn->read_buf->len == 0) {
+            idle_remove(conn);
+            conn->request->start_msec = proton_current_msec;
+            if (conn->requests > 0) conn->request->start_usec = proton_time_usec();
+            conn->request->arrival_usec = arrival;
+            set_state(conn, HTTP_CONN_READING);
+            proton_timer_add(event_loop, &conn->timer, header_timeout());
+        }
+        
+        if (proton_buffer_append(conn->read_buf, buf, n) != PROTON_OK) {
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
         }
-        proton_log(LOG_ERROR, "Read error: %s", strerror(errno));
-        proton_http_connection_close(conn);
-        return PROTON_ERROR;
     }
     
-    if (n == 0) {
-        /* Connection closed */
-        proton_http_connection_close(conn);
+    conn->readable = 1;
+    
+    /* The rest of a TLS record is decrypted already; take it while no edge is needed */
+    size_t pending;
+    while (conn->ssl && (pending = proton_tls_pending(conn)) > 0) {
+        if (pending > sizeof(buf)) pending = sizeof(buf);
+        
+        ssize_t n = proton_http_recv(conn, buf, pending);
+        if (n <= 0) break;
+        
+        proton_stats->bytes_in += n;
+        if (proton_buffer_append(conn->read_buf, buf, n) != PROTON_OK) {
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static int http_read_handler(proton_event_t *ev) {
+    proton_http_connection_t *conn = (proton_http_connection_t*)ev->data;
+    
+    if (conn->h2) {
+        return proton_http2_read_handler(conn);
+    }
+    
+    if (conn->ws) {
+        return proton_ws_read_handler(conn);
+    }
+    
+    if (conn->read_hook) {
+        return conn->read_hook(conn);
+    }
+    
+    if (conn->ssl && !conn->ssl_handshaked) {
+        int ret = tls_handshake(conn);
+        if (ret != PROTON_OK) return ret == PROTON_AGAIN ? PROTON_OK : ret;
+    }
+    
+    /* The next request is read once this response is out */
+    if (conn->state == HTTP_CONN_WRITING) {
+        conn->readable = 1;
         return PROTON_OK;
     }
     
-    /* Append to buffer */
-    if (proton_buffer_append(conn->read_buf, buf, n) != PROTON_OK) {
-        proton_http_connection_close(conn);
-        return PROTON_ERROR;
+    int ret = read_header(conn);
+    if (ret != PROTON_OK) {
+        return ret == PROTON_AGAIN ? PROTON_OK : PROTON_DONE;
+    }
+    
+    /* HTTP/2 with prior knowledge starts with the client preface */
+    if (conn->requests == 0 && http_config && http_config->http2 &&
+        proton_http2_preface(conn->read_buf) == PROTON_OK) {
+        set_state(conn, HTTP_CONN_WAITING);
+        return proton_http2_start(conn);
     }
     
+    /* The header is in; the handler keeps its own time from here */
+    proton_timer_del(event_loop, &conn->timer);
+    
     /* Try to parse request */
-    int ret = proton_http_parse_request(conn->read_buf, conn->request);
-    if (ret == PROTON_AGAIN) {
-        /* Need more data */
-        return PROTON_OK;
+    ret = proton_http_parse_request(conn->read_buf, conn->request);
+    
+    /* Upgrade: h2c answers this request as stream 1 of an HTTP/2 connection */
+    if (ret == PROTON_OK && http_config && http_config->http2 && !conn->ssl &&
+        proton_http_get_header(conn->request, "Upgrade")) {
+        set_state(conn, HTTP_CONN_WAITING);
+        
+        int upgraded = proton_http2_upgrade(conn);
+        if (upgraded != PROTON_DECLINED) return upgraded;
+    }
+    
+    set_state(conn, HTTP_CONN_WRITING);
+    conn->request->parsed_usec = proton_time_usec();
+    
+    if (ret == PROTON_OK) {
+        PROTON_PROBE3(request__parsed, conn->fd, conn->request->method, conn->request->uri);
     }
     
     if (ret != PROTON_OK) {
-        /* Parse error */
+        /* Parse error; what follows cannot be trusted to start a request */
+        conn->keep_alive = 0;
         conn->response->status = HTTP_STATUS_BAD_REQUEST;
         proton_http_response_send(conn);
         return PROTON_OK;
@@ -139,19 +474,48 @@ static int http_read_handler(proton_event_t *ev) {
 static int http_write_handler(proton_event_t *ev) {
     proton_http_connection_t *conn = (proton_http_connection_t*)ev->data;
     
+    if (conn->h2) {
+        return proton_http2_write_handler(conn);
+    }
+    
+    if (conn->ws) {
+        return proton_ws_write_handler(conn);
+    }
+    
+    if (conn->ssl && !conn->ssl_handshaked) {
+        int ret = tls_handshake(conn);
+        if (ret != PROTON_OK) return ret == PROTON_AGAIN ? PROTON_OK : ret;
+        
+        /* The request may have come with the client's Finished */
+        return http_read_handler(conn->event);
+    }
+    
+    if (conn->write_hook) {
+        return conn->write_hook(conn);
+    }
+    
+    /* Nothing to do until a response has been queued */
+    if (!conn->response->headers_sent) {
+        return PROTON_OK;
+    }
+    
     /* Write data from write buffer */
     if (conn->write_buf && conn->write_buf->len > 0) {
-        ssize_t n = write(conn->fd, conn->write_buf->data, conn->write_buf->len);
+        ssize_t n = proton_http_send(conn, conn->write_buf->data, conn->write_buf->len);
         
         if (n < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return PROTON_OK;
             }
             proton_log(LOG_ERROR, "Write error: %s", strerror(errno));
+            proton_modules_log_request(conn);
             proton_http_connection_close(conn);
-            return PROTON_ERROR;
+            return PROTON_DONE;
         }
         
+        conn->bytes_sent += n;
+        proton_stats->bytes_out += n;
+        
         /* Remove written data */
         if ((size_t)n < conn->write_buf->len) {
             memmove(conn->write_buf->data, conn->write_buf->data + n, conn->write_buf->len - n);
@@ -162,11 +526,137 @@ static int http_write_handler(proton_event_t *ev) {
         conn->write_buf->len = 0;
     }
     
-    /* All data written */
-    if (conn->keep_alive) {
-        /* Reset for next request */
-        conn->read_buf->len = 0;
+    /* Then the part of the body left in a file; never on TLS or a stream */
+    while (conn->response->file_len > 0) {
+        proton_http_response_t *res = conn->response;
+        ssize_t n = sendfile(conn->fd, res->file_fd, &res->file_offset, res->file_len);
+        
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return PROTON_OK;
+        }
+        if (n <= 0) {
+            proton_log(LOG_ERROR, "sendfile failed: %s", n < 0 ? strerror(errno) : "file truncated");
+            proton_modules_log_request(conn);
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        conn->bytes_sent += n;
+        proton_stats->bytes_out += n;
+        res->file_len -= n;
+    }
+    
+    if (finish_request(conn) == PROTON_DONE) {
+        return PROTON_DONE;
+    }
+    
+    /* Pipelined requests, and data whose edge came while the response was written */
+    if (conn->read_buf->len > 0 || conn->readable) {
+        return http_read_handler(conn->event);
+    }
+    
+    return PROTON_OK;
+}
+
+/* slow_request_log: where the time of a slow request went */
+static void log_slow_request(proton_http_connection_t *conn, uint64_t now) {
+    proton_http_request_t *req = conn->request;
+    uint64_t parsed = req->parsed_usec ? req->parsed_usec : req->start_usec;
+    uint64_t handled = req->handler_usec ? req->handler_usec : now;
+    
+    proton_log(LOG_WARN, "Slow request: %s %s %d in %.1fms (read %.1fms, handler %.1fms, "
+               "write %.1fms), request %d on the connection, accepted %.1fms before",
+               proton_http_method_string(req->method), req->uri ? req->uri : "-",
+               conn->response->status, (now - req->start_usec) / 1000.0,
+               (parsed - req->start_usec) / 1000.0, (handled - parsed) / 1000.0,
+               (now - handled) / 1000.0, conn->requests + 1,
+               conn->accept_usec ? (req->start_usec - conn->accept_usec) / 1000.0 : 0.0);
+}
+
+/* The response is out: log and count it, for HTTP/1 and HTTP/2 alike */
+void proton_http_request_done(proton_http_connection_t *conn) {
+    uint64_t now = proton_time_usec();
+    uint64_t elapsed = now - conn->request->start_usec;
+    
+    PROTON_PROBE4(response__flushed, conn->fd, conn->response->status, conn->bytes_sent, elapsed);
+    
+    proton_modules_log_request(conn);
+    
+    if (http_config && http_config->slow_request_log &&
+        elapsed >= (uint64_t)http_config->slow_request_log * 1000) {
+        log_slow_request(conn, now);
+    }
+    
+    proton_histogram_record(histogram(conn, PROTON_HIST_TOTAL), elapsed);
+    
+    proton_stats->requests++;
+    int class = conn->response->status / 100;
+    if (class >= 1 && class <= 5) proton_stats->responses[class - 1]++;
+}
+
+/* Then get ready for the next request or close */
+/*
+ * Closing with unread input makes the kernel send a reset, which can
+ * destroy the response in the client's receive buffer: take what the
+ * client already sent, within reason, before the close.
+ */
+static void discard_input(proton_http_connection_t *conn) {
+    char buf[4096];
+    
+    /* TLS still has its close_notify to send */
+    if (!conn->ssl) shutdown(conn->fd, SHUT_WR);
+    
+    for (int i = 0; i < 16; i++) {
+        if (proton_http_recv(conn, buf, sizeof(buf)) <= 0) break;
+    }
+}
+
+int proton_http_body_unread(proton_http_connection_t *conn) {
+    proton_http_request_t *req = conn->request;
+    
+    /* A stream's body comes in its own frames */
+    if (conn->stream || req->body_taken) return 0;
+    if (req->chunked) return 1;
+    
+    return conn->read_buf->len - req->header_len < (uint64_t)req->content_length;
+}
+
+/* The module reads the body itself, and clears keep_alive if it stops short */
+void proton_http_take_body(proton_http_connection_t *conn, size_t in_buf) {
+    conn->request->body_taken = 1;
+    conn->request->body_end = conn->request->header_len + in_buf;
+}
+
+/* Bytes read past the body belong to the next request */
+int proton_http_unread(proton_http_connection_t *conn, const char *data, size_t len) {
+    conn->read_usec = event_loop->wake_usec;
+    return proton_buffer_append(conn->read_buf, data, len);
+}
+
+/* Where the next request starts in read_buf */
+static size_t request_end(proton_http_connection_t *conn) {
+    proton_http_request_t *req = conn->request;
+    size_t end = req->body_taken ? req->body_end : req->header_len + (size_t)req->content_length;
+    
+    return end < conn->read_buf->len ? end : conn->read_buf->len;
+}
+
+static int finish_request(proton_http_connection_t *conn) {
+    proton_http_request_done(conn);
+    conn->requests++;
+    set_state(conn, HTTP_CONN_WAITING);
+    
+    /* A prebuilt response may have promised keepalive regardless */
+    if (proton_http_body_unread(conn)) conn->keep_alive = 0;
+    
+    if (conn->keep_alive && !draining) {
+        /* Reset for next request; what was read past this one is kept */
+        size_t end = request_end(conn);
+        conn->read_buf->len -= end;
+        memmove(conn->read_buf->data, conn->read_buf->data + end, conn->read_buf->len);
+        
         conn->write_buf->len = 0;
+        conn->bytes_sent = 0;
         proton_pool_destroy(conn->pool);
         conn->pool = proton_pool_create(4096);
         
@@ -178,17 +668,64 @@ static int http_write_handler(proton_event_t *ev) {
             proton_http_response_destroy(conn->response);
         }
         conn->response = proton_http_response_create();
+        
+        /* A pipelined request is already coming in */
+        if (conn->read_buf->len > 0) {
+            conn->request->start_msec = proton_current_msec;
+            conn->request->start_usec = proton_time_usec();
+            conn->request->arrival_usec = conn->read_usec;
+            set_state(conn, HTTP_CONN_READING);
+            proton_timer_add(event_loop, &conn->timer, header_timeout());
+        } else {
+            idle_add(conn);
+            proton_timer_add(event_loop, &conn->timer, keepalive_timeout());
+        }
     } else {
         /* Close connection */
+        if (conn->readable) discard_input(conn);
         proton_http_connection_close(conn);
+        return PROTON_DONE;
     }
     
     return PROTON_OK;
 }
 
-int proton_http_handle_request(proton_http_connection_t *conn) {
-    /* Call module handlers */
-    int ret = proton_modules_handle_request(conn);
+/*
+ * Called by a module that finished a response asynchronously. Bytes of the
+ * next request may have arrived meanwhile without a new edge, so read them.
+ */
+int proton_http_request_finish(proton_http_connection_t *conn) {
+    conn->read_hook = NULL;
+    conn->write_hook = NULL;
+    conn->close_hook = NULL;
+    conn->module_ctx = NULL;
+    
+    if (finish_request(conn) == PROTON_DONE) {
+        return PROTON_DONE;
+    }
+    
+    return http_read_handler(conn->event);
+}
+
+/* Queue the response for whatever the module phases ended with */
+static int send_result(proton_http_connection_t *conn, int ret) {
+    /* The module owns the connection until it resumes or finishes the request */
+    if (ret == PROTON_MODULE_AGAIN) {
+        return PROTON_OK;
+    }
+    
+    conn->request->handler_usec = proton_time_usec();
+    
+    /* The module accepted a WebSocket; the 101 is queued */
+    if (conn->ws) {
+        set_state(conn, HTTP_CONN_WAITING);
+        return proton_ws_start(conn);
+    }
+    
+    /* Already queued whole, e.g. a prebuilt rejection */
+    if (conn->response->headers_sent) {
+        return PROTON_OK;
+    }
     
     if (ret == PROTON_MODULE_DECLINED) {
         /* No module handled it */
@@ -199,3 +736,126 @@ int proton_http_handle_request(proton_http_connection_t *conn) {
     /* Send response */
     return proton_http_response_send(conn);
 }
+
+/* HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only when asked */
+static int wants_keepalive(proton_http_request_t *req) {
+    const char *connection = proton_http_get_header(req, "Connection");
+    
+    if (req->version == HTTP_VERSION_11) {
+        return !connection || !proton_http_has_token(connection, "close");
+    }
+    
+    return connection && proton_http_has_token(connection, "keep-alive");
+}
+
+int proton_http_handle_request(proton_http_connection_t *conn) {
+    if (!conn->stream && !wants_keepalive(conn->request)) {
+        conn->keep_alive = 0;
+    }
+    
+    /* The last request allowed on this connection */
+    if (!conn->stream && http_config && conn->requests + 1 >= http_config->keepalive_requests) {
+        conn->keep_alive = 0;
+    }
+    
+    /* Let the client know this is the last response */
+    if (draining) {
+        conn->keep_alive = 0;
+    }
+    
+    /* Queued too long behind an overload: a cheap 503 instead of the handler */
+    if (proton_overload_shed(conn)) {
+        return send_result(conn, PROTON_MODULE_HANDLED);
+    }
+    
+    conn->request->location = proton_config_find_location(http_config, conn->request->uri);
+    
+    proton_histogram_record(histogram(conn, PROTON_HIST_READ),
+                            conn->request->parsed_usec - conn->request->start_usec);
+    
+    /* Call module handlers */
+    PROTON_PROBE2(handler__start, conn->fd, conn->request->uri);
+    int ret = proton_modules_handle_request(conn);
+    PROTON_PROBE3(handler__end, conn->fd, ret, conn->response->status);
+    
+    proton_histogram_record(histogram(conn, PROTON_HIST_HANDLER),
+                            proton_time_usec() - conn->request->parsed_usec);
+    
+    return send_result(conn, ret);
+}
+
+/* A parked request reads nothing, but notices a client that went away */
+static int suspended_read(proton_http_connection_t *conn) {
+    char c;
+    ssize_t n = recv(conn->fd, &c, 1, MSG_PEEK);
+    
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    
+    return PROTON_OK;
+}
+
+/*
+ * Park the request while a module waits for its events or timers. Nothing
+ * is read or written for the connection until proton_http_resume; cancel is
+ * called instead if the connection closes first.
+ */
+void proton_http_suspend(proton_http_connection_t *conn, void *ctx,
+                         void (*cancel)(proton_http_connection_t *conn)) {
+    conn->module_ctx = ctx;
+    conn->read_hook = suspended_read;
+    conn->write_hook = NULL;
+    conn->close_hook = cancel;
+}
+
+/* Continue the phases after the suspended handler, as if it had returned rc */
+int proton_http_resume(proton_http_connection_t *conn, int rc) {
+    conn->read_hook = NULL;
+    conn->write_hook = NULL;
+    conn->close_hook = NULL;
+    conn->module_ctx = NULL;
+    
+    if (draining) {
+        conn->keep_alive = 0;
+    }
+    
+    return send_result(conn, proton_modules_resume(conn, rc));
+}
+
+int proton_http_connection_count(void) {
+    return nconnections;
+}
+
+void proton_http_drain(void) {
+    draining = 1;
+    
+    proton_http_connection_t *conn = connections;
+    while (conn) {
+        proton_http_connection_t *next = conn->next;
+        if (conn->h2) {
+            /* GOAWAY; the streams already open are still served */
+            proton_http2_drain(conn);
+        } else if (conn->ws) {
+            /* Close frame; the connection goes when the client answers */
+            proton_ws_drain(conn);
+        } else if (conn->idle) {
+            proton_http_connection_close(conn);
+        }
+        conn = next;
+    }
+}
+
+int proton_http_close_idle(void) {
+    if (!idle_head) return PROTON_DECLINED;
+    
+    proton_http_connection_close(idle_head);
+    return PROTON_OK;
+}
+
+void proton_http_close_all_connections(void) {
+    while (connections) {
+        proton_http_connection_close(connections);
+    }
+}
@@ -0,0 +1,616 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proton.h"
+#include "http.h"
+#include "module.h"
+#include "cidr.h"
+
+/*
+ * Access log.
+ *
+ * Each worker formats entries into a single-producer/single-consumer ring
+ * buffer. A flusher thread owned by the worker drains the ring with one
+ * writev() per batch, either every flush interval or as soon as the ring is
+ * half full. The request path never touches the file descriptor and never
+ * takes a lock; if the flusher cannot keep up, entries are dropped and
+ * counted rather than stalling the event loop.
+ */
+
+#define ACCESS_LOG_LINE_MAX     4096
+#define ACCESS_LOG_MIN_BUFFER   (16 * 1024)
+
+#define DEFAULT_LOG_FORMAT \
+    "$remote_addr - $remote_user [$time_local] \"$request\" $status " \
+    "$body_bytes_sent \"$http_referer\" \"$http_user_agent\""
+
+/* Log format variables */
+enum {
+    LOG_VAR_LITERAL,
+    LOG_VAR_REMOTE_ADDR,
+    LOG_VAR_REMOTE_USER,
+    LOG_VAR_TIME_LOCAL,
+    LOG_VAR_TIME_ISO8601,
+    LOG_VAR_MSEC,
+    LOG_VAR_REQUEST,
+    LOG_VAR_REQUEST_METHOD,
+    LOG_VAR_URI,
+    LOG_VAR_ARGS,
+    LOG_VAR_STATUS,
+    LOG_VAR_BODY_BYTES_SENT,
+    LOG_VAR_BYTES_SENT,
+    LOG_VAR_REQUEST_TIME,
+    LOG_VAR_PID,
+    LOG_VAR_HTTP_HEADER,
+    LOG_VAR_GEO
+};
+
+static const struct {
+    const char *name;
+    int type;
+} log_vars[] = {
+    { "remote_addr",     LOG_VAR_REMOTE_ADDR },
+    { "remote_user",     LOG_VAR_REMOTE_USER },
+    { "time_local",      LOG_VAR_TIME_LOCAL },
+    { "time_iso8601",    LOG_VAR_TIME_ISO8601 },
+    { "msec",            LOG_VAR_MSEC },
+    { "request",         LOG_VAR_REQUEST },
+    { "request_method",  LOG_VAR_REQUEST_METHOD },
+    { "uri",             LOG_VAR_URI },
+    { "request_uri",     LOG_VAR_URI },
+    { "args",            LOG_VAR_ARGS },
+    { "query_string",    LOG_VAR_ARGS },
+    { "status",          LOG_VAR_STATUS },
+    { "body_bytes_sent", LOG_VAR_BODY_BYTES_SENT },
+    { "bytes_sent",      LOG_VAR_BYTES_SENT },
+    { "request_time",    LOG_VAR_REQUEST_TIME },
+    { "pid",             LOG_VAR_PID },
+    { NULL, 0 }
+};
+
+typedef struct {
+    int type;
+    char *data;     /* literal text or header name */
+    size_t len;     /* of data; for LOG_VAR_GEO, the geo's index */
+} log_op_t;
+
+typedef struct {
+    char *path;
+    int fd;
+    int efd;
+    int flush_msec;
+    
+    log_op_t *ops;
+    int nops;
+    
+    char *ring;
+    size_t size;
+    size_t mask;
+    _Atomic size_t head;        /* written by the worker */
+    _Atomic size_t tail;        /* written by the flusher */
+    
+    _Atomic int wake_pending;
+    _Atomic int reopen;
+    _Atomic int stop;
+    _Atomic unsigned long dropped;
+    
+    pthread_t thread;
+    int running;
+} access_log_t;
+
+static access_log_t *access_log = NULL;
+
+static void free_ops(log_op_t *ops, int nops) {
+    for (int i = 0; i < nops; i++) {
+        free(ops[i].data);
+    }
+    free(ops);
+}
+
+static char* copy_string(const char *s, size_t len) {
+    char *p = malloc(len + 1);
+    if (!p) return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/* Compile "$var literal $var" into a flat list of ops */
+static int compile_format(const char *fmt, log_op_t **out, int *nout) {
+    int cap = 16, n = 0;
+    log_op_t *ops = calloc(cap, sizeof(log_op_t));
+    if (!ops) return PROTON_ERROR;
+    
+    const char *p = fmt;
+    while (*p) {
+        if (n == cap) {
+            log_op_t *tmp = realloc(ops, 2 * cap * sizeof(log_op_t));
+            if (!tmp) goto failed;
+            memset(tmp + cap, 0, cap * sizeof(log_op_t));
+            ops = tmp;
+            cap *= 2;
+        }
+        
+        log_op_t *op = &ops[n];
+        
+        if (*p != '$') {
+            const char *start = p;
+            while (*p && *p != '$') p++;
+            op->type = LOG_VAR_LITERAL;
+            op->len = p - start;
+            op->data = copy_string(start, op->len);
+            if (!op->data) goto failed;
+            n++;
+            continue;
+        }
+        
+        const char *name = ++p;
+        while ((*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') || *p == '_') p++;
+        size_t len = p - name;
+        
+        if (len > 5 && strncmp(name, "http_", 5) == 0) {
+            /* $http_user_agent -> "user-agent" */
+            op->type = LOG_VAR_HTTP_HEADER;
+            op->len = len - 5;
+            op->data = copy_string(name + 5, op->len);
+            if (!op->data) goto failed;
+            for (char *c = op->data; *c; c++) {
+                if (*c == '_') *c = '-';
+            }
+            n++;
+            continue;
+        }
+        
+        op->type = LOG_VAR_LITERAL;
+        for (int i = 0; log_vars[i].name; i++) {
+            if (strlen(log_vars[i].name) == len && strncmp(log_vars[i].name, name, len) == 0) {
+                op->type = log_vars[i].type;
+                break;
+            }
+        }
+        
+        if (op->type == LOG_VAR_LITERAL) {
+            int geo = proton_geo_find(name, len);
+            if (geo >= 0) {
+                op->type = LOG_VAR_GEO;
+                op->len = geo;
+            }
+        }
+        
+        if (op->type == LOG_VAR_LITERAL) {
+            proton_log(LOG_ERROR, "Unknown variable \"$%.*s\" in log_format", (int)len, name);
+            goto failed;
+        }
+        n++;
+    }
+    
+    *out = ops;
+    *nout = n;
+    return PROTON_OK;
+
+failed:
+    free_ops(ops, n);
+    return PROTON_ERROR;
+}
+
+int proton_http_log_init(proton_config_t *config) {
+    proton_http_log_close();
+    
+    if (!config->access_log || strcmp(config->access_log, "off") == 0) {
+        return PROTON_OK;
+    }
+    
+    access_log_t *log = calloc(1, sizeof(access_log_t));
+    if (!log) return PROTON_ERROR;
+    
+    log->fd = -1;
+    log->efd = -1;
+    log->flush_msec = config->access_log_flush;
+    log->path = copy_string(config->access_log, strlen(config->access_log));
+    
+    const char *fmt = config->access_log_format ? config->access_log_format : DEFAULT_LOG_FORMAT;
+    if (!log->path || compile_format(fmt, &log->ops, &log->nops) != PROTON_OK) {
+        free(log->path);
+        free(log);
+        return PROTON_ERROR;
+    }
+    
+    /* Round the ring up to a power of two so positions can be masked */
+    size_t size = ACCESS_LOG_MIN_BUFFER;
+    while (size < config->access_log_buffer) size <<= 1;
+    log->size = size;
+    log->mask = size - 1;
+    
+    access_log = log;
+    return PROTON_OK;
+}
+
+static int open_log_file(const char *path) {
+    return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static void flush_ring(access_log_t *log) {
+    size_t tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&log->head, memory_order_acquire);
+    
+    while (tail != head) {
+        size_t off = tail & log->mask;
+        size_t len = head - tail;
+        struct iovec iov[2];
+        int iovcnt = 1;
+        
+        iov[0].iov_base = log->ring + off;
+        iov[0].iov_len = len;
+        if (off + len > log->size) {
+            iov[0].iov_len = log->size - off;
+            iov[1].iov_base = log->ring;
+            iov[1].iov_len = len - iov[0].iov_len;
+            iovcnt = 2;
+        }
+        
+        ssize_t n = writev(log->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            proton_log(LOG_ERROR, "Failed to write access log %s: %s", log->path, strerror(errno));
+            n = len; /* Drop the batch rather than spin */
+        }
+        
+        tail += n;
+        atomic_store_explicit(&log->tail, tail, memory_order_release);
+    }
+}
+
+static void* flush_thread(void *arg) {
+    access_log_t *log = arg;
+    struct pollfd pfd;
+    
+    pfd.fd = log->efd;
+    pfd.events = POLLIN;
+    
+    while (1) {
+        poll(&pfd, 1, log->flush_msec > 0 ? log->flush_msec : -1);
+        
+        uint64_t v;
+        if (read(log->efd, &v, sizeof(v)) == sizeof(v)) {
+            atomic_store(&log->wake_pending, 0);
+        }
+        
+        int stop = atomic_load(&log->stop);
+        
+        if (atomic_exchange(&log->reopen, 0)) {
+            int fd = open_log_file(log->path);
+            if (fd < 0) {
+                proton_log(LOG_ERROR, "Failed to reopen access log %s: %s", log->path, strerror(errno));
+            } else {
+                flush_ring(log);
+                close(log->fd);
+                log->fd = fd;
+            }
+        }
+        
+        flush_ring(log);
+        
+        unsigned long dropped = atomic_exchange(&log->dropped, 0);
+        if (dropped) {
+            proton_log(LOG_WARN, "Access log buffer full, %lu entries dropped", dropped);
+        }
+        
+        if (stop) break;
+    }
+    
+    return NULL;
+}
+
+int proton_http_log_open(void) {
+    access_log_t *log = access_log;
+    if (!log) return PROTON_OK;
+    
+    log->fd = open_log_file(log->path);
+    if (log->fd < 0) {
+        proton_log(LOG_ERROR, "Failed to open access log %s: %s", log->path, strerror(errno));
+        goto failed;
+    }
+    
+    log->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    log->ring = malloc(log->size);
+    if (log->efd < 0 || !log->ring) {
+        proton_log(LOG_ERROR, "Failed to allocate access log buffer");
+        goto failed;
+    }
+    
+    /* Fault the ring in now rather than on the request path */
+    memset(log->ring, 0, log->size);
+    
+    /* The flusher must never steal the worker's signals */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&log->thread, NULL, flush_thread, log);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    
+    if (err != 0) {
+        proton_log(LOG_ERROR, "Failed to start access log flusher: %s", strerror(err));
+        goto failed;
+    }
+    
+    log->running = 1;
+    return PROTON_OK;
+
+failed:
+    proton_http_log_close();
+    return PROTON_ERROR;
+}
+
+static void wake_flusher(access_log_t *log) {
+    if (!atomic_exchange_explicit(&log->wake_pending, 1, memory_order_relaxed)) {
+        uint64_t one = 1;
+        if (write(log->efd, &one, sizeof(one)) < 0) {
+            /* Counter is saturated, the flusher is already awake */
+        }
+    }
+}
+
+static void ring_write(access_log_t *log, const char *data, size_t len) {
+    size_t head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&log->tail, memory_order_acquire);
+    
+    if (log->size - (head - tail) < len) {
+        atomic_fetch_add_explicit(&log->dropped, 1, memory_order_relaxed);
+        wake_flusher(log);
+        return;
+    }
+    
+    size_t off = head & log->mask;
+    size_t first = log->size - off;
+    if (first > len) first = len;
+    
+    memcpy(log->ring + off, data, first);
+    memcpy(log->ring, data + first, len - first);
+    
+    atomic_store_explicit(&log->head, head + len, memory_order_release);
+    
+    if (head + len - tail >= log->size / 2) {
+        wake_flusher(log);
+    }
+}
+
+static char* log_copy(char *p, char *end, const char *s, size_t len) {
+    if (len > (size_t)(end - p)) len = end - p;
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static char* log_uint(char *p, char *end, uint64_t v) {
+    char tmp[20];
+    int n = 0;
+    
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    
+    if (n > end - p) return p;
+    while (n) *p++ = tmp[--n];
+    return p;
+}
+
+/* Copy a client-supplied string, escaping quotes, backslashes and controls */
+static char* log_escape(char *p, char *end, const char *s) {
+    static const char hex[] = "0123456789ABCDEF";
+    
+    while (*s && p < end) {
+        /* Copy runs of plain characters in one go */
+        const char *run = s;
+        while ((unsigned char)*s >= 0x20 && (unsigned char)*s < 0x7f && *s != '"' && *s != '\\') s++;
+        p = log_copy(p, end, run, s - run);
+        
+        unsigned char c = *s;
+        if (c == '\0') break;
+        if (end - p < 4) break;
+        
+        *p++ = '\\';
+        *p++ = 'x';
+        *p++ = hex[c >> 4];
+        *p++ = hex[c & 0xf];
+        s++;
+    }
+    
+    return p;
+}
+
+static char* log_addr(char *p, char *end, proton_http_connection_t *conn) {
+    if (conn->sockaddr.ss_family == AF_INET) {
+        const struct sockaddr_in *sin = (const struct sockaddr_in*)&conn->sockaddr;
+        const unsigned char *a = (const unsigned char*)&sin->sin_addr;
+        for (int i = 0; i < 4; i++) {
+            if (i) p = log_copy(p, end, ".", 1);
+            p = log_uint(p, end, a[i]);
+        }
+        return p;
+    }
+    
+    if (conn->sockaddr.ss_family == AF_INET6) {
+        char text[INET6_ADDRSTRLEN];
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6*)&conn->sockaddr;
+        if (inet_ntop(AF_INET6, &sin6->sin6_addr, text, sizeof(text))) {
+            return log_copy(p, end, text, strlen(text));
+        }
+    }
+    
+    if (conn->sockaddr.ss_family == AF_UNIX) {
+        return log_copy(p, end, "unix:", 5);
+    }
+    
+    return log_copy(p, end, "-", 1);
+}
+
+static char* log_str(char *p, char *end, const char *s) {
+    if (!s || *s == '\0') return log_copy(p, end, "-", 1);
+    return log_escape(p, end, s);
+}
+
+void proton_http_log_request(proton_http_connection_t *conn) {
+    access_log_t *log = access_log;
+    if (!log || !log->running) return;
+    
+    proton_http_request_t *req = conn->request;
+    proton_http_response_t *res = conn->response;
+    char line[ACCESS_LOG_LINE_MAX];
+    char *p = line;
+    char *end = line + sizeof(line) - 1;
+    uint64_t t;
+    
+    for (int i = 0; i < log->nops; i++) {
+        log_op_t *op = &log->ops[i];
+        
+        switch (op->type) {
+            case LOG_VAR_LITERAL:
+                p = log_copy(p, end, op->data, op->len);
+                break;
+            case LOG_VAR_REMOTE_ADDR:
+                p = log_addr(p, end, conn);
+                break;
+            case LOG_VAR_REMOTE_USER:
+                p = log_copy(p, end, "-", 1);
+                break;
+            case LOG_VAR_TIME_LOCAL:
+                p = log_copy(p, end, proton_cached_log_time, strlen(proton_cached_log_time));
+                break;
+            case LOG_VAR_TIME_ISO8601:
+                p = log_copy(p, end, proton_cached_iso8601_time, strlen(proton_cached_iso8601_time));
+                break;
+            case LOG_VAR_MSEC:
+                p = log_uint(p, end, proton_current_wall_msec / 1000);
+                p = log_copy(p, end, ".", 1);
+                t = proton_current_wall_msec % 1000;
+                p = log_copy(p, end, "00", t < 10 ? 2 : (t < 100 ? 1 : 0));
+                p = log_uint(p, end, t);
+                break;
+            case LOG_VAR_REQUEST:
+                p = log_str(p, end, req ? req->request_line : NULL);
+                break;
+            case LOG_VAR_REQUEST_METHOD:
+                p = log_str(p, end, req && req->uri ? proton_http_method_string(req->method) : NULL);
+                break;
+            case LOG_VAR_URI:
+                p = log_str(p, end, req ? req->uri : NULL);
+                break;
+            case LOG_VAR_ARGS:
+                p = log_str(p, end, req ? req->query_string : NULL);
+                break;
+            case LOG_VAR_STATUS:
+                p = log_uint(p, end, res ? res->status : 0);
+                break;
+            case LOG_VAR_BODY_BYTES_SENT:
+                p = log_uint(p, end, res && res->body ? res->body->len : 0);
+                break;
+            case LOG_VAR_BYTES_SENT:
+                p = log_uint(p, end, conn->bytes_sent);
+                break;
+            case LOG_VAR_REQUEST_TIME:
+                t = req && req->start_msec ? proton_current_msec - req->start_msec : 0;
+                p = log_uint(p, end, t / 1000);
+                p = log_copy(p, end, ".", 1);
+                t %= 1000;
+                p = log_copy(p, end, "00", t < 10 ? 2 : (t < 100 ? 1 : 0));
+                p = log_uint(p, end, t);
+                break;
+            case LOG_VAR_PID:
+                p = log_uint(p, end, proton_pid);
+                break;
+            case LOG_VAR_HTTP_HEADER:
+                p = log_str(p, end, req ? proton_http_get_header(req, op->data) : NULL);
+                break;
+            case LOG_VAR_GEO:
+                p = log_str(p, end, proton_geo_value((int)op->len, conn));
+                break;
+        }
+    }
+    
+    *p++ = '\n';
+    ring_write(log, line, p - line);
+}
+
+void proton_http_log_reopen(void) {
+    access_log_t *log = access_log;
+    if (!log || !log->running) return;
+    
+    atomic_store(&log->reopen, 1);
+    wake_flusher(log);
+}
+
+void proton_http_log_close(void) {
+    access_log_t *log = access_log;
+    if (!log) return;
+    
+    if (log->running) {
+        atomic_store(&log->stop, 1);
+        uint64_t one = 1;
+        if (write(log->efd, &one, sizeof(one)) < 0) {
+            /* Flusher wakes up on its flush interval anyway */
+        }
+        pthread_join(log->thread, NULL);
+    }
+    
+    if (log->fd >= 0) close(log->fd);
+    if (log->efd >= 0) close(log->efd);
+    
+    free_ops(log->ops, log->nops);
+    free(log->ring);
+    free(log->path);
+    free(log);
+    access_log = NULL;
+}
+
+/* Log phase handler; the format is compiled by the master, the file opened per worker */
+static int access_log_handler(proton_http_connection_t *conn) {
+    proton_http_log_request(conn);
+    return PROTON_MODULE_OK;
+}
+
+/* geo variables are built here, ahead of the format that refers to them */
+static int access_log_init(proton_config_t *config) {
+    if (proton_geos_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize geo variables");
+        return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+static void access_log_cleanup(void) {
+    proton_geos_cleanup();
+}
+
+/* A worker without its log file still serves */
+static int access_log_init_worker(proton_event_loop_t *loop) {
+    (void)loop;
+    proton_http_log_open();
+    return PROTON_OK;
+}
+
+static void access_log_exit_worker(proton_event_loop_t *loop) {
+    (void)loop;
+    proton_http_log_close();
+}
+
+proton_module_t mod_access_log = {
+    .name = "access_log",
+    .init = access_log_init,
+    .init_worker = access_log_init_worker,
+    .exit_worker = access_log_exit_worker,
+    .phases = { [PROTON_PHASE_LOG] = access_log_handler },
+    .cleanup = access_log_cleanup
+};
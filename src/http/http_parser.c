@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +23,9 @@ static int parse_method(const char *line, proton_http_request_t *req) {
     } else if (strncmp(line, "DELETE ", 7) == 0) {
         req->method = HTTP_DELETE;
         return 7;
+    } else if (strncmp(line, "MKCOL ", 6) == 0) {
+        req->method = HTTP_MKCOL;
+        return 6;
     }
     return -1;
 }
@@ -66,6 +70,12 @@ static int parse_version(const char *line, int offset, proton_http_request_t *re
 
 /* Parse request line: GET /path HTTP/1.1 */
 static int parse_request_line(const char *line, proton_http_request_t *req) {
+    /* Keep a copy of the raw line for the access log */
+    size_t len = strlen(line);
+    req->request_line = proton_pool_alloc(req->pool, len + 1);
+    if (!req->request_line) return PROTON_ERROR;
+    memcpy(req->request_line, line, len + 1);
+    
     int offset = parse_method(line, req);
     if (offset < 0) return PROTON_ERROR;
     
@@ -115,13 +125,57 @@ static int parse_header(const char *line, proton_http_request_t *req) {
     return PROTON_OK;
 }
 
+/*
+ * Body framing. Requests that could be read two ways, with both framings
+ * or conflicting lengths, are refused rather than guessed at: a proxy in
+ * front may have guessed differently.
+ */
+static int parse_framing(proton_http_request_t *req) {
+    const char *te = NULL;
+    int have_length = 0;
+    
+    for (proton_http_header_t *h = req->headers; h; h = h->next) {
+        if (strcasecmp(h->name, "Transfer-Encoding") == 0) {
+            if (te) return PROTON_ERROR;
+            te = h->value;
+        } else if (strcasecmp(h->name, "Content-Length") == 0) {
+            size_t len = strlen(h->value);
+            if (len == 0 || len > 18 || strspn(h->value, "0123456789") != len) {
+                return PROTON_ERROR;
+            }
+            
+            int64_t length = strtoll(h->value, NULL, 10);
+            if (have_length && length != req->content_length) return PROTON_ERROR;
+            
+            req->content_length = length;
+            have_length = 1;
+        }
+    }
+    
+    if (!te) return PROTON_OK;
+    if (have_length) return PROTON_ERROR;
+    
+    /* Chunked must be the last coding, or the end of the body is unknown */
+    size_t len = strlen(te);
+    if (len < 7 || strcasecmp(te + len - 7, "chunked") != 0 ||
+        (len > 7 && te[len - 8] != ',' && te[len - 8] != ' ' && te[len - 8] != '\t')) {
+        return PROTON_ERROR;
+    }
+    
+    req->chunked = 1;
+    return PROTON_OK;
+}
+
 int proton_http_parse_request(proton_buffer_t *buf, proton_http_request_t *req) {
     if (!buf || !req || !buf->data) return PROTON_ERROR;
     
-    /* Find end of headers (\r\n\r\n) */
-    char *headers_end = strstr(buf->data, "\r\n\r\n");
+    /* Find end of headers (\r\n\r\n); the buffer is not NUL-terminated */
+    char *headers_end = memmem(buf->data, buf->len, "\r\n\r\n", 4);
     if (!headers_end) return PROTON_AGAIN; /* Need more data */
     
+    /* Whatever follows belongs to the body */
+    req->header_len = headers_end + 4 - buf->data;
+    
     /* Create pool for request */
     if (!req->pool) {
         req->pool = proton_pool_create(4096);
@@ -156,9 +210,19 @@ int proton_http_parse_request(proton_buffer_t *buf, proton_http_request_t *req)
         line = line_end + 2; /* Skip \r\n */
     }
     
-    /* TODO: Parse body if Content-Length present */
-    
-    return PROTON_OK;
+    return parse_framing(req);
+}
+
+const char* proton_http_method_string(int method) {
+    switch (method) {
+        case HTTP_GET: return "GET";
+        case HTTP_POST: return "POST";
+        case HTTP_HEAD: return "HEAD";
+        case HTTP_PUT: return "PUT";
+        case HTTP_DELETE: return "DELETE";
+        case HTTP_MKCOL: return "MKCOL";
+        default: return "UNKNOWN";
+    }
 }
 
 const char* proton_http_get_header(proton_http_request_t *req, const char *name) {
@@ -172,3 +236,21 @@ const char* proton_http_get_header(proton_http_request_t *req, const char *name)
     
     return NULL;
 }
+
+/* Does a comma-separated header value list the token? */
+int proton_http_has_token(const char *value, const char *token) {
+    size_t len = strlen(token);
+    
+    while (value && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') value++;
+        const char *end = value;
+        while (*end && *end != ',') end++;
+        
+        const char *last = end;
+        while (last > value && (last[-1] == ' ' || last[-1] == '\t')) last--;
+        if ((size_t)(last - value) == len && strncasecmp(value, token, len) == 0) return 1;
+        
+        value = end;
+    }
+    return 0;
+}
@@ -1,20 +1,66 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "proton.h"
 #include "http.h"
+#include "http2.h"
 
 const char* proton_http_status_string(int status) {
     switch (status) {
+        case 101: return "Switching Protocols";
         case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
         case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
         case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 411: return "Length Required";
+        case 413: return "Content Too Large";
+        case 426: return "Upgrade Required";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
         case 500: return "Internal Server Error";
         case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 507: return "Insufficient Storage";
         default: return "Unknown";
     }
 }
 
+/* Content-Type by file extension */
+const char* proton_http_mime_type(const char *path) {
+    const char *ext = strrchr(path, '.');
+    if (!ext) return "application/octet-stream";
+    
+    ext++; /* Skip the dot */
+    
+    if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0) return "text/html";
+    if (strcmp(ext, "css") == 0) return "text/css";
+    if (strcmp(ext, "js") == 0) return "application/javascript";
+    if (strcmp(ext, "json") == 0) return "application/json";
+    if (strcmp(ext, "png") == 0) return "image/png";
+    if (strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0) return "image/jpeg";
+    if (strcmp(ext, "gif") == 0) return "image/gif";
+    if (strcmp(ext, "svg") == 0) return "image/svg+xml";
+    if (strcmp(ext, "txt") == 0) return "text/plain";
+    if (strcmp(ext, "xml") == 0) return "application/xml";
+    
+    return "application/octet-stream";
+}
+
 proton_http_response_t* proton_http_response_create(void) {
     proton_http_response_t *res = calloc(1, sizeof(proton_http_response_t));
     if (!res) return NULL;
@@ -69,9 +115,16 @@ int proton_http_response_write(proton_http_response_t *res, const char *data, si
     return proton_buffer_append(res->body, data, len);
 }
 
-int proton_http_response_send(proton_http_connection_t *conn) {
+/* Status line and headers; no Content-Length if content_length is negative */
+int proton_http_response_send_header(proton_http_connection_t *conn, int64_t content_length) {
     if (!conn || !conn->response) return PROTON_ERROR;
     
+    /* A stream's header goes out in HEADERS frames with the whole body */
+    if (conn->stream) return PROTON_ERROR;
+    
+    /* Body bytes still on the way would be taken for the next request */
+    if (proton_http_body_unread(conn)) conn->keep_alive = 0;
+    
     proton_http_response_t *res = conn->response;
     proton_buffer_t *buf = conn->write_buf;
     
@@ -86,10 +139,19 @@ int proton_http_response_send(proton_http_connection_t *conn) {
     proton_buffer_append(buf, PROTON_VERSION, strlen(PROTON_VERSION));
     proton_buffer_append(buf, "\r\n", 2);
     
-    /* Add Content-Length */
-    char content_length[64];
-    snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", res->body->len);
-    proton_buffer_append(buf, content_length, strlen(content_length));
+    /* Add Content-Length; a 204 must not have one */
+    if (content_length >= 0 && res->status != HTTP_STATUS_NO_CONTENT) {
+        char header[64];
+        snprintf(header, sizeof(header), "Content-Length: %lld\r\n", (long long)content_length);
+        proton_buffer_append(buf, header, strlen(header));
+    }
+    
+    /* Announce the close so the client does not reuse the connection */
+    if (!conn->keep_alive) {
+        proton_buffer_append(buf, "Connection: close\r\n", 19);
+    } else if (conn->request->version == HTTP_VERSION_10) {
+        proton_buffer_append(buf, "Connection: keep-alive\r\n", 24);
+    }
     
     /* Add custom headers */
     for (proton_http_header_t *h = res->headers; h; h = h->next) {
@@ -99,11 +161,33 @@ int proton_http_response_send(proton_http_connection_t *conn) {
         proton_buffer_append(buf, "\r\n", 2);
     }
     
+    if (res->raw_headers_len > 0) {
+        proton_buffer_append(buf, res->raw_headers, res->raw_headers_len);
+    }
+    
     /* End of headers */
     proton_buffer_append(buf, "\r\n", 2);
+    res->headers_sent = 1;
     
-    /* Add body */
-    if (res->body->len > 0) {
+    return PROTON_OK;
+}
+
+int proton_http_response_send(proton_http_connection_t *conn) {
+    if (!conn || !conn->response) return PROTON_ERROR;
+    
+    if (conn->stream) {
+        return proton_http2_send_response(conn);
+    }
+    
+    proton_http_response_t *res = conn->response;
+    proton_buffer_t *buf = conn->write_buf;
+    
+    proton_http_response_send_header(conn, res->body->len + res->file_len);
+    
+    /* HEAD and 304 get the length of the body they would have had */
+    if (conn->request->method == HTTP_HEAD || res->status == HTTP_STATUS_NOT_MODIFIED) {
+        res->file_len = 0;
+    } else if (res->body->len > 0) {
         proton_buffer_append(buf, res->body->data, res->body->len);
     }
     
@@ -116,6 +200,58 @@ int proton_http_response_send(proton_http_connection_t *conn) {
     return PROTON_OK;
 }
 
+/*
+ * Header lines formatted ahead of time, added one by one for HTTP/2,
+ * which encodes each header. Server is left to the HTTP/2 header.
+ */
+void proton_http_response_add_raw_headers(proton_http_response_t *res, const char *p, size_t len) {
+    const char *end = p + len;
+    char name[256], value[PROTON_HTTP_HEADER_MAX];
+    
+    while (p < end) {
+        const char *eol = memmem(p, end - p, "\r\n", 2);
+        const char *colon = memchr(p, ':', eol ? (size_t)(eol - p) : 0);
+        if (!eol || !colon) return;
+        
+        snprintf(name, sizeof(name), "%.*s", (int)(colon - p), p);
+        snprintf(value, sizeof(value), "%.*s", (int)(eol - colon - 2), colon + 2);
+        if (strcasecmp(name, "Server") != 0) proton_http_response_add_header(res, name, value);
+        p = eol + 2;
+    }
+}
+
+/* Queue a complete response built ahead of time, header and all */
+int proton_http_response_send_raw(proton_http_connection_t *conn, int status, const char *data, size_t len) {
+    if (!conn || !conn->response) return PROTON_ERROR;
+    
+    conn->response->status = status;
+    
+    /* On a stream the header lines past the status line (Retry-After, Content-Type) become HTTP/2 headers */
+    if (conn->stream) {
+        const char *body = memmem(data, len, "\r\n\r\n", 4);
+        size_t header_len = body ? (size_t)(body - data) + 4 : len;
+        const char *lines = memmem(data, header_len, "\r\n", 2);
+        
+        if (body && lines && lines < body) {
+            proton_http_response_add_raw_headers(conn->response, lines + 2, body + 2 - (lines + 2));
+        }
+        
+        conn->response->body->len = 0;
+        if (len > header_len) proton_http_response_write(conn->response, data + header_len, len - header_len);
+        return proton_http2_send_response(conn);
+    }
+    
+    if (proton_buffer_append(conn->write_buf, data, len) != PROTON_OK) return PROTON_ERROR;
+    conn->response->headers_sent = 1;
+    
+    extern proton_event_loop_t *event_loop;
+    if (event_loop) {
+        proton_event_add(event_loop, conn->event, PROTON_EVENT_READ | PROTON_EVENT_WRITE);
+    }
+    
+    return PROTON_OK;
+}
+
 void proton_http_response_destroy(proton_http_response_t *res) {
     if (!res) return;
     
@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+#include "limit.h"
+
+/*
+ * Shared-memory zones of limit_req_zone and limit_conn_zone. The master maps
+ * each zone before the workers fork, so all of them count against the same
+ * table. A zone is an open-addressed table of 16-byte nodes, one per key,
+ * found by the key's 64-bit hash within a short probe window. Workers change
+ * nodes with compare-and-swap only; nothing takes a lock. When the window of
+ * a key is full the key is not limited rather than refused.
+ *
+ * Each worker sweeps a slice of every zone once a second and frees the nodes
+ * of keys that have gone quiet. Zones with the same name, type, key and size
+ * keep their counters across a reload.
+ */
+
+extern proton_event_loop_t *event_loop;
+
+#define PROBE_WINDOW        8
+#define CLAIM_ATTEMPTS      4
+#define SWEEP_INTERVAL      1000        /* msec */
+#define SWEEP_MIN           1024        /* nodes per zone and sweep */
+#define IDLE_EXPIRE         10000       /* msec a key must be quiet to be freed */
+
+static proton_limit_t *zones = NULL;
+static int nzones = 0;
+
+/* Zones of the previous configuration, until the new one has taken theirs */
+static proton_limit_t *old_zones = NULL;
+static int nold_zones = 0;
+
+static int zones_ready = 0;     /* limit_req and limit_conn both set them up */
+
+static proton_timer_t sweep_timer;
+static int sweep_armed = 0;
+
+/* Prebuilt rejections: [status][keepalive] */
+#define REJECT_PAGES    3
+
+static char *reject_pages[REJECT_PAGES][2];
+static size_t reject_lens[REJECT_PAGES][2];
+static size_t reject_header_lens[REJECT_PAGES][2];
+
+static const char *reject_bodies[REJECT_PAGES] = {
+    "429 Too Many Requests\n",
+    "503 Service Unavailable\n",
+    "403 Forbidden\n"
+};
+
+static const int reject_statuses[REJECT_PAGES] = {
+    HTTP_STATUS_TOO_MANY_REQUESTS,
+    HTTP_STATUS_SERVICE_UNAVAILABLE,
+    HTTP_STATUS_FORBIDDEN
+};
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* FNV-1a spreads badly in the low bits; finish with a full avalanche */
+static uint64_t hash_finish(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h ? h : 1;
+}
+
+uint64_t proton_limit_hash(proton_limit_t *zone, proton_http_connection_t *conn) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    
+    if (zone->key_type == PROTON_LIMIT_KEY_HEADER) {
+        const char *value = proton_http_get_header(conn->request, zone->header);
+        if (!value) return 0;
+        return hash_finish(hash_bytes(h, value, strlen(value)));
+    }
+    
+    if (conn->sockaddr.ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)&conn->sockaddr;
+        h = hash_bytes(h, &sin->sin_addr, sizeof(sin->sin_addr));
+    } else if (conn->sockaddr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&conn->sockaddr;
+        h = hash_bytes(h, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+    }
+    
+    /* Other families (unix sockets) all share one key */
+    h = hash_bytes(h, &conn->sockaddr.ss_family, sizeof(conn->sockaddr.ss_family));
+    return hash_finish(h);
+}
+
+/* Is the node of a key idle long enough to be freed? */
+static int node_stale(proton_limit_t *zone, uint64_t state, uint64_t now) {
+    if (zone->type == PROTON_LIMIT_REQ) {
+        uint64_t last = state >> PROTON_LIMIT_EXCESS_BITS;
+        uint64_t excess = state & ((1ULL << PROTON_LIMIT_EXCESS_BITS) - 1);
+        uint64_t drained = last + excess * 1000 / zone->rate;
+        return now >= drained + IDLE_EXPIRE;
+    }
+    
+    uint64_t touched = (state >> 32) * 1000;
+    return (state & PROTON_LIMIT_COUNT_MASK) == 0 && now >= touched + IDLE_EXPIRE;
+}
+
+static void sweep_zone(proton_limit_t *zone) {
+    proton_limit_shm_t *shm = zone->shm;
+    uint64_t nodes = shm->mask + 1;
+    uint64_t batch = nodes / 64 > SWEEP_MIN ? nodes / 64 : SWEEP_MIN;
+    uint64_t now = proton_current_msec - shm->epoch;
+    
+    if (batch > nodes) batch = nodes;
+    uint64_t start = atomic_fetch_add(&shm->cursor, batch);
+    
+    for (uint64_t i = 0; i < batch; i++) {
+        proton_limit_node_t *node = &shm->nodes[(start + i) & shm->mask];
+        uint64_t key = atomic_load(&node->key);
+        uint64_t state = atomic_load(&node->state);
+        
+        if (key == 0 || state == PROTON_LIMIT_EXPIRING || !node_stale(zone, state, now)) continue;
+        
+        /* Fence off the state first so nobody updates a node losing its key */
+        if (!atomic_compare_exchange_strong(&node->state, &state, PROTON_LIMIT_EXPIRING)) continue;
+        atomic_compare_exchange_strong(&node->key, &key, 0);
+        atomic_store(&node->state, 0);
+    }
+}
+
+static void sweep_handler(proton_timer_t *timer) {
+    for (int i = 0; i < nzones; i++) {
+        sweep_zone(&zones[i]);
+    }
+    
+    proton_timer_add(event_loop, timer, SWEEP_INTERVAL);
+}
+
+proton_limit_node_t* proton_limit_lookup(proton_limit_t *zone, uint64_t hash) {
+    proton_limit_shm_t *shm = zone->shm;
+    
+    /* The first lookup in a worker starts its sweeps */
+    if (!sweep_armed && event_loop) {
+        proton_timer_init(&sweep_timer, sweep_handler, NULL);
+        proton_timer_add(event_loop, &sweep_timer, SWEEP_INTERVAL);
+        sweep_armed = 1;
+    }
+    
+    for (int attempt = 0; attempt < CLAIM_ATTEMPTS; attempt++) {
+        proton_limit_node_t *empty = NULL;
+        
+        for (uint64_t i = 0; i < PROBE_WINDOW; i++) {
+            proton_limit_node_t *node = &shm->nodes[(hash + i) & shm->mask];
+            uint64_t key = atomic_load(&node->key);
+            
+            if (key == hash) return node;
+            if (key == 0 && !empty) empty = node;
+        }
+        
+        if (!empty) break;
+        
+        /* Another worker may claim the same node first; look again then */
+        uint64_t expected = 0;
+        if (atomic_compare_exchange_strong(&empty->key, &expected, hash)) return empty;
+    }
+    
+    atomic_fetch_add(&shm->full, 1);
+    return NULL;
+}
+
+int proton_limit_reject(proton_http_connection_t *conn, int status) {
+    int which = status == HTTP_STATUS_TOO_MANY_REQUESTS ? 0 : (status == HTTP_STATUS_FORBIDDEN ? 2 : 1);
+    int keepalive = conn->keep_alive ? 1 : 0;
+    size_t len = reject_lens[which][keepalive];
+    
+    if (!reject_pages[which][keepalive]) return PROTON_ERROR;
+    
+    /* Body bytes still on the way would be taken for the next request */
+    if (proton_http_body_unread(conn)) {
+        keepalive = 0;
+        conn->keep_alive = 0;
+        len = reject_lens[which][0];
+    }
+    
+    if (conn->request->method == HTTP_HEAD) {
+        len = reject_header_lens[which][keepalive];
+    }
+    
+    return proton_http_response_send_raw(conn, status, reject_pages[which][keepalive], len);
+}
+
+static int build_reject_pages(void) {
+    for (int which = 0; which < REJECT_PAGES; which++) {
+        for (int keepalive = 0; keepalive < 2; keepalive++) {
+            if (reject_pages[which][keepalive]) continue;
+            
+            int status = reject_statuses[which];
+            const char *body = reject_bodies[which];
+            char header[256];
+            int n = snprintf(header, sizeof(header),
+                             "HTTP/1.1 %d %s\r\nServer: Proton/%s\r\nContent-Length: %zu\r\n%s\r\n",
+                             status, proton_http_status_string(status), PROTON_VERSION,
+                             strlen(body), keepalive ? "" : "Connection: close\r\n");
+            
+            char *page = malloc(n + strlen(body) + 1);
+            if (!page) return PROTON_ERROR;
+            memcpy(page, header, n);
+            strcpy(page + n, body);
+            
+            reject_pages[which][keepalive] = page;
+            reject_header_lens[which][keepalive] = n;
+            reject_lens[which][keepalive] = n + strlen(body);
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+/* $http_x_api_key is the X-Api-Key header */
+static int parse_key(proton_limit_t *zone, const char *key) {
+    if (strcmp(key, "$remote_addr") == 0 || strcmp(key, "$binary_remote_addr") == 0) {
+        zone->key_type = PROTON_LIMIT_KEY_ADDR;
+        return PROTON_OK;
+    }
+    
+    if (strncmp(key, "$http_", 6) != 0 || key[6] == '\0') return PROTON_ERROR;
+    
+    zone->key_type = PROTON_LIMIT_KEY_HEADER;
+    zone->header = strdup(key + 6);
+    if (!zone->header) return PROTON_ERROR;
+    
+    for (char *p = zone->header; *p; p++) {
+        if (*p == '_') *p = '-';
+    }
+    
+    return PROTON_OK;
+}
+
+/* Take over the table of a matching zone from before the reload */
+static proton_limit_shm_t* reuse_shm(proton_limit_zone_t *z, size_t shm_size) {
+    for (int i = 0; i < nold_zones; i++) {
+        proton_limit_t *old = &old_zones[i];
+        
+        if (old->shm && old->type == z->type && old->shm_size == shm_size &&
+            strcmp(old->name, z->name) == 0 && strcmp(old->key_source, z->key) == 0) {
+            proton_limit_shm_t *shm = old->shm;
+            old->shm = NULL;
+            return shm;
+        }
+    }
+    
+    return NULL;
+}
+
+static void free_zones(proton_limit_t *list, int n) {
+    for (int i = 0; i < n; i++) {
+        if (list[i].shm) munmap(list[i].shm, list[i].shm_size);
+        free(list[i].name);
+        free(list[i].header);
+        free(list[i].key_source);
+    }
+    
+    free(list);
+}
+
+int proton_limits_init(proton_config_t *config) {
+    if (zones_ready) return PROTON_OK;
+    zones_ready = 1;
+    
+    if (build_reject_pages() != PROTON_OK) return PROTON_ERROR;
+    
+    if (config->nlimit_zones > 0) {
+        zones = calloc(config->nlimit_zones, sizeof(proton_limit_t));
+        if (!zones) return PROTON_ERROR;
+    }
+    
+    for (int i = 0; i < config->nlimit_zones; i++) {
+        proton_limit_zone_t *z = &config->limit_zones[i];
+        proton_limit_t *zone = &zones[nzones++];
+        
+        for (int j = 0; j < i; j++) {
+            if (strcmp(config->limit_zones[j].name, z->name) == 0) {
+                proton_log(LOG_ERROR, "Duplicate limit zone \"%s\"", z->name);
+                return PROTON_ERROR;
+            }
+        }
+        
+        zone->name = strdup(z->name);
+        zone->key_source = strdup(z->key);
+        zone->type = z->type;
+        zone->rate = z->rate;
+        if (!zone->name || !zone->key_source) return PROTON_ERROR;
+        
+        if (parse_key(zone, z->key) != PROTON_OK) {
+            proton_log(LOG_ERROR, "Unsupported key %s in limit zone \"%s\"", z->key, z->name);
+            return PROTON_ERROR;
+        }
+        
+        /* Largest power of two of nodes that fits the size, at least 64 */
+        uint64_t nodes = 64;
+        while ((nodes * 2) * sizeof(proton_limit_node_t) + sizeof(proton_limit_shm_t) <= z->size) {
+            nodes *= 2;
+        }
+        zone->shm_size = sizeof(proton_limit_shm_t) + nodes * sizeof(proton_limit_node_t);
+        
+        zone->shm = reuse_shm(z, zone->shm_size);
+        if (zone->shm) continue;
+        
+        void *p = mmap(NULL, zone->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            proton_log(LOG_ERROR, "Failed to map limit zone \"%s\": %s", z->name, strerror(errno));
+            return PROTON_ERROR;
+        }
+        
+        zone->shm = p;
+        zone->shm->epoch = proton_current_msec;
+        zone->shm->mask = nodes - 1;
+    }
+    
+    /* Workers of the old generation keep their own mappings */
+    free_zones(old_zones, nold_zones);
+    old_zones = NULL;
+    nold_zones = 0;
+    
+    return PROTON_OK;
+}
+
+void proton_limits_cleanup(void) {
+    zones_ready = 0;
+    if (nzones == 0) return;
+    
+    /* Kept for the next init; whatever it does not take over is unmapped then */
+    proton_limit_t *list = realloc(old_zones, (nold_zones + nzones) * sizeof(proton_limit_t));
+    if (list) {
+        memcpy(list + nold_zones, zones, nzones * sizeof(proton_limit_t));
+        old_zones = list;
+        nold_zones += nzones;
+        free(zones);
+    } else {
+        free_zones(zones, nzones);
+    }
+    
+    zones = NULL;
+    nzones = 0;
+}
+
+proton_limit_t* proton_limit_get(const char *name, int type) {
+    for (int i = 0; i < nzones; i++) {
+        if (zones[i].type == type && strcmp(zones[i].name, name) == 0) {
+            return &zones[i];
+        }
+    }
+    
+    return NULL;
+}
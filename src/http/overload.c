@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+
+/*
+ * overload_shedding: a CoDel-style controller per worker. A request's
+ * queueing delay runs from its arrival to when its handler starts. The
+ * arrival is when the kernel received its first byte (SO_TIMESTAMPNS),
+ * or on TLS, where the records are read through OpenSSL, when the event
+ * loop woke up to it.
+ *
+ * A short burst passes, since some request in the interval gets through
+ * quickly. When even the smallest delay of a whole interval is over the
+ * target there is a standing queue: the worker is overloaded until an
+ * interval goes by with a request under the target, or with no requests
+ * at all. While overloaded, requests that waited longer than the target
+ * get a prebuilt 503 with Retry-After and the connection is closed, so
+ * the client reconnects, likely to another worker; the worker stops
+ * accepting meanwhile and leaves new connections to the others.
+ */
+
+extern proton_event_loop_t *event_loop;
+
+static uint64_t target_usec = 0;        /* 0: off */
+static uint64_t interval_msec = 0;
+static uint64_t interval_end = 0;       /* proton_current_msec */
+static uint64_t min_delay = UINT64_MAX;
+static int overloaded = 0;
+static uint64_t overload_logged = 0;
+
+static char *shed_page = NULL;
+static size_t shed_len = 0;
+static size_t shed_header_len = 0;
+
+int proton_overload_init(proton_config_t *config) {
+    if (!config->overload_target) return PROTON_OK;
+    
+    const char *body = "503 Service Unavailable\n";
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 503 %s\r\nServer: Proton/%s\r\nContent-Length: %zu\r\n"
+                     "Retry-After: %d\r\nConnection: close\r\n\r\n",
+                     proton_http_status_string(HTTP_STATUS_SERVICE_UNAVAILABLE), PROTON_VERSION,
+                     strlen(body), config->overload_retry_after);
+    
+    shed_page = malloc(n + strlen(body) + 1);
+    if (!shed_page) return PROTON_ERROR;
+    memcpy(shed_page, header, n);
+    strcpy(shed_page + n, body);
+    shed_header_len = n;
+    shed_len = n + strlen(body);
+    
+    target_usec = (uint64_t)config->overload_target * 1000;
+    interval_msec = config->overload_interval;
+    interval_end = proton_current_msec + interval_msec;
+    
+    return PROTON_OK;
+}
+
+int proton_overload_sample(uint64_t delay_usec) {
+    if (!target_usec) return 0;
+    
+    if (delay_usec < min_delay) min_delay = delay_usec;
+    return proton_overload_check();
+}
+
+/* Called every loop iteration as well, so that intervals end while idle */
+int proton_overload_check(void) {
+    if (!target_usec) return 0;
+    if (proton_current_msec < interval_end) return overloaded;
+    
+    int was = overloaded;
+    overloaded = min_delay != UINT64_MAX && min_delay > target_usec;
+    min_delay = UINT64_MAX;
+    interval_end = proton_current_msec + interval_msec;
+    
+    if (overloaded && !was && proton_current_msec - overload_logged >= 1000) {
+        overload_logged = proton_current_msec;
+        proton_log(LOG_WARN, "Worker overloaded, shedding requests queued over %llums",
+                   (unsigned long long)(target_usec / 1000));
+    }
+    
+    return overloaded;
+}
+
+int proton_overload_shed(proton_http_connection_t *conn) {
+    if (!target_usec) return 0;
+    
+    proton_http_request_t *req = conn->request;
+    uint64_t delay = req->parsed_usec > req->arrival_usec ? req->parsed_usec - req->arrival_usec : 0;
+    
+    if (!proton_overload_sample(delay) || delay <= target_usec) return 0;
+    
+    proton_stats->shed++;
+    if (!conn->stream) conn->keep_alive = 0;
+    
+    size_t len = conn->request->method == HTTP_HEAD ? shed_header_len : shed_len;
+    proton_http_response_send_raw(conn, HTTP_STATUS_SERVICE_UNAVAILABLE, shed_page, len);
+    return 1;
+}
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include "proton.h"
+#include "http.h"
+#include "tls.h"
+
+/*
+ * The master builds the SSL_CTX and maps one shared region before the
+ * workers fork: the session ticket keys, so a ticket issued by one worker
+ * resumes on any other, and the server-side session cache for clients that
+ * resume by session ID. The cache is a set-associative table of serialized
+ * sessions; each set has a spinlock that is only ever tried, so a busy set
+ * is a cache miss rather than a wait. A reload that keeps the cache size
+ * keeps the region, and with it the keys and the cached sessions.
+ *
+ * kTLS is asked for on every connection. Where the kernel and OpenSSL both
+ * support it, records are encrypted by the kernel after the handshake and
+ * SSL_write goes straight to the socket's TLS layer.
+ */
+
+#define CACHE_WAYS          8
+#define CACHE_SESSION_MAX   440         /* serialized session bytes per slot */
+#define CACHE_SPINS         64
+#define TICKET_KEYS_LEN     80          /* name, HMAC and AES keys */
+
+typedef struct {
+    time_t expire;                      /* 0: free */
+    uint16_t id_len;
+    uint16_t len;
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char data[CACHE_SESSION_MAX];
+} cache_slot_t;
+
+typedef struct {
+    atomic_int lock;
+    cache_slot_t slots[CACHE_WAYS];
+} cache_set_t;
+
+typedef struct {
+    size_t map_size;
+    size_t nsets;
+    unsigned char ticket_keys[TICKET_KEYS_LEN];
+    cache_set_t sets[];
+} tls_shm_t;
+
+static SSL_CTX *ssl_ctx = NULL;
+static tls_shm_t *shm = NULL;
+static int alpn_h2 = 0;
+static int ktls_reported = 0;
+
+static void log_ssl_error(int level, const char *what) {
+    unsigned long err = ERR_get_error();
+    char text[256];
+    
+    ERR_error_string_n(err, text, sizeof(text));
+    proton_log(level, "%s: %s", what, err ? text : strerror(errno));
+    ERR_clear_error();
+}
+
+/* Shared region */
+
+static cache_set_t* cache_set(const unsigned char *id, unsigned int id_len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    
+    for (unsigned int i = 0; i < id_len; i++) {
+        h ^= id[i];
+        h *= 0x100000001b3ULL;
+    }
+    return &shm->sets[h % shm->nsets];
+}
+
+static int set_lock(cache_set_t *set) {
+    for (int i = 0; i < CACHE_SPINS; i++) {
+        int unlocked = 0;
+        if (atomic_compare_exchange_weak_explicit(&set->lock, &unlocked, 1,
+                                                  memory_order_acquire, memory_order_relaxed)) {
+            return 1;
+        }
+        if (i >= CACHE_SPINS / 2) sched_yield();
+    }
+    return 0;
+}
+
+static void set_unlock(cache_set_t *set) {
+    atomic_store_explicit(&set->lock, 0, memory_order_release);
+}
+
+static cache_slot_t* set_find(cache_set_t *set, const unsigned char *id, unsigned int id_len) {
+    for (int i = 0; i < CACHE_WAYS; i++) {
+        cache_slot_t *slot = &set->slots[i];
+        if (slot->expire && slot->id_len == id_len && memcmp(slot->id, id, id_len) == 0) return slot;
+    }
+    return NULL;
+}
+
+static int session_new(SSL *ssl, SSL_SESSION *sess) {
+    unsigned char data[CACHE_SESSION_MAX];
+    unsigned int id_len;
+    (void)ssl;
+    
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    int len = i2d_SSL_SESSION(sess, NULL);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH || len <= 0 || len > CACHE_SESSION_MAX) return 0;
+    
+    unsigned char *p = data;
+    i2d_SSL_SESSION(sess, &p);
+    
+    cache_set_t *set = cache_set(id, id_len);
+    if (!set_lock(set)) return 0;
+    
+    /* The same session again, a free or expired slot, or else the oldest */
+    cache_slot_t *slot = set_find(set, id, id_len);
+    for (int i = 0; !slot && i < CACHE_WAYS; i++) {
+        if (set->slots[i].expire <= proton_current_sec) slot = &set->slots[i];
+    }
+    if (!slot) {
+        slot = &set->slots[0];
+        for (int i = 1; i < CACHE_WAYS; i++) {
+            if (set->slots[i].expire < slot->expire) slot = &set->slots[i];
+        }
+    }
+    
+    slot->expire = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+    slot->id_len = id_len;
+    slot->len = len;
+    memcpy(slot->id, id, id_len);
+    memcpy(slot->data, data, len);
+    set_unlock(set);
+    
+    /* OpenSSL keeps its reference; the cache holds a copy */
+    return 0;
+}
+
+static SSL_SESSION* session_get(SSL *ssl, const unsigned char *id, int id_len, int *copy) {
+    unsigned char data[CACHE_SESSION_MAX];
+    size_t len = 0;
+    (void)ssl;
+    
+    *copy = 0;
+    if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) return NULL;
+    
+    cache_set_t *set = cache_set(id, id_len);
+    if (!set_lock(set)) return NULL;
+    
+    cache_slot_t *slot = set_find(set, id, id_len);
+    if (slot && slot->expire > proton_current_sec) {
+        len = slot->len;
+        memcpy(data, slot->data, len);
+    }
+    set_unlock(set);
+    
+    if (len == 0) return NULL;
+    
+    const unsigned char *p = data;
+    return d2i_SSL_SESSION(NULL, &p, len);
+}
+
+static void session_remove(SSL_CTX *ctx, SSL_SESSION *sess) {
+    unsigned int id_len;
+    (void)ctx;
+    
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    if (id_len == 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH) return;
+    
+    cache_set_t *set = cache_set(id, id_len);
+    if (!set_lock(set)) return;
+    
+    cache_slot_t *slot = set_find(set, id, id_len);
+    if (slot) slot->expire = 0;
+    set_unlock(set);
+}
+
+static int map_shared(proton_config_t *config) {
+    size_t nsets = config->ssl_session_cache / sizeof(cache_set_t);
+    if (nsets == 0) nsets = 1;
+    
+    if (shm && shm->nsets == nsets) return PROTON_OK;
+    
+    size_t size = sizeof(tls_shm_t) + nsets * sizeof(cache_set_t);
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        proton_log(LOG_ERROR, "Cannot map %zu bytes for the TLS session cache: %s", size, strerror(errno));
+        return PROTON_ERROR;
+    }
+    
+    tls_shm_t *fresh = p;
+    fresh->map_size = size;
+    fresh->nsets = nsets;
+    
+    /* Tickets issued so far stay valid when only the cache size changes */
+    if (shm) {
+        memcpy(fresh->ticket_keys, shm->ticket_keys, TICKET_KEYS_LEN);
+        munmap(shm, shm->map_size);
+    } else if (RAND_bytes(fresh->ticket_keys, TICKET_KEYS_LEN) != 1) {
+        munmap(fresh, size);
+        log_ssl_error(LOG_ERROR, "Cannot generate session ticket keys");
+        return PROTON_ERROR;
+    }
+    
+    shm = fresh;
+    return PROTON_OK;
+}
+
+/* Context */
+
+static int alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg) {
+    static const unsigned char with_h2[] = "\x02h2\x08http/1.1";
+    static const unsigned char http11[] = "\x08http/1.1";
+    (void)ssl;
+    (void)arg;
+    
+    const unsigned char *protos = alpn_h2 ? with_h2 : http11;
+    unsigned int len = alpn_h2 ? sizeof(with_h2) - 1 : sizeof(http11) - 1;
+    
+    if (SSL_select_next_proto((unsigned char**)out, outlen, protos, len, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+static SSL_CTX* create_context(proton_config_t *config) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        log_ssl_error(LOG_ERROR, "SSL_CTX_new failed");
+        return NULL;
+    }
+    
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    
+    long options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF;
+#ifdef SSL_OP_ENABLE_KTLS
+    options |= SSL_OP_ENABLE_KTLS;
+#endif
+    if (!config->ssl_session_tickets) options |= SSL_OP_NO_TICKET;
+    SSL_CTX_set_options(ctx, options);
+    
+    /* Writes resume from our own buffers, which move as they drain */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                          SSL_MODE_RELEASE_BUFFERS);
+    
+    if (SSL_CTX_use_certificate_chain_file(ctx, config->ssl_certificate) != 1) {
+        log_ssl_error(LOG_ERROR, "Cannot load ssl_certificate");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    
+    if (SSL_CTX_use_PrivateKey_file(ctx, config->ssl_certificate_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1) {
+        log_ssl_error(LOG_ERROR, "Cannot load ssl_certificate_key");
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"proton", 6);
+    SSL_CTX_set_timeout(ctx, config->ssl_session_timeout / 1000);
+    
+    if (config->ssl_session_cache > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, session_new);
+        SSL_CTX_sess_set_get_cb(ctx, session_get);
+        SSL_CTX_sess_set_remove_cb(ctx, session_remove);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+    return ctx;
+}
+
+int proton_tls_init(proton_config_t *config) {
+    if (!config->listen_ssl) {
+        proton_tls_cleanup();
+        return PROTON_OK;
+    }
+    
+    SSL_CTX *ctx = create_context(config);
+    if (!ctx) return PROTON_ERROR;
+    
+    if (map_shared(config) != PROTON_OK) {
+        SSL_CTX_free(ctx);
+        return PROTON_ERROR;
+    }
+    
+    if (config->ssl_session_tickets &&
+        SSL_CTX_set_tlsext_ticket_keys(ctx, shm->ticket_keys, TICKET_KEYS_LEN) != 1) {
+        log_ssl_error(LOG_ERROR, "Cannot set session ticket keys");
+        SSL_CTX_free(ctx);
+        return PROTON_ERROR;
+    }
+    
+    if (ssl_ctx) SSL_CTX_free(ssl_ctx);
+    ssl_ctx = ctx;
+    alpn_h2 = config->http2;
+    
+    proton_log(LOG_INFO, "TLS enabled, session cache %zu sessions, tickets %s",
+               config->ssl_session_cache > 0 ? shm->nsets * CACHE_WAYS : 0,
+               config->ssl_session_tickets ? "on" : "off");
+    return PROTON_OK;
+}
+
+void proton_tls_cleanup(void) {
+    if (ssl_ctx) {
+        SSL_CTX_free(ssl_ctx);
+        ssl_ctx = NULL;
+    }
+    
+    if (shm) {
+        munmap(shm, shm->map_size);
+        shm = NULL;
+    }
+}
+
+/* Connections */
+
+int proton_tls_accept(proton_http_connection_t *conn) {
+    if (!ssl_ctx) return PROTON_ERROR;
+    
+    conn->ssl = SSL_new(ssl_ctx);
+    if (!conn->ssl) {
+        log_ssl_error(LOG_ERROR, "SSL_new failed");
+        return PROTON_ERROR;
+    }
+    
+    if (SSL_set_fd(conn->ssl, conn->fd) != 1) {
+        log_ssl_error(LOG_ERROR, "SSL_set_fd failed");
+        SSL_free(conn->ssl);
+        conn->ssl = NULL;
+        return PROTON_ERROR;
+    }
+    
+    SSL_set_accept_state(conn->ssl);
+    return PROTON_OK;
+}
+
+/* After a fatal error no close_notify may be sent */
+static void failed(proton_http_connection_t *conn, int err, const char *what) {
+    SSL_set_quiet_shutdown(conn->ssl, 1);
+    
+    if (err == SSL_ERROR_SSL) {
+        log_ssl_error(LOG_INFO, what);
+    } else {
+        ERR_clear_error();
+    }
+}
+
+int proton_tls_handshake(proton_http_connection_t *conn) {
+    ERR_clear_error();
+    
+    int ret = SSL_do_handshake(conn->ssl);
+    if (ret == 1) {
+        conn->ssl_handshaked = 1;
+        
+        if (!ktls_reported) {
+            ktls_reported = 1;
+#ifndef OPENSSL_NO_KTLS
+            int ktls = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+#else
+            int ktls = 0;
+#endif
+            proton_log(LOG_INFO, "Kernel TLS send offload %s", ktls ? "active" : "not available");
+        }
+        return PROTON_OK;
+    }
+    
+    int err = SSL_get_error(conn->ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return PROTON_AGAIN;
+    
+    failed(conn, err, "TLS handshake failed");
+    return PROTON_ERROR;
+}
+
+int proton_tls_alpn_h2(proton_http_connection_t *conn) {
+    const unsigned char *proto;
+    unsigned int len;
+    
+    SSL_get0_alpn_selected(conn->ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+ssize_t proton_tls_recv(proton_http_connection_t *conn, void *buf, size_t len) {
+    size_t n;
+    
+    ERR_clear_error();
+    if (SSL_read_ex(conn->ssl, buf, len, &n) == 1) return n;
+    
+    int err = SSL_get_error(conn->ssl, 0);
+    switch (err) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        failed(conn, err, "TLS read failed");
+        if (errno == 0) return 0;
+        return -1;
+    default:
+        failed(conn, err, "TLS read failed");
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+size_t proton_tls_pending(proton_http_connection_t *conn) {
+    int n = SSL_pending(conn->ssl);
+    return n > 0 ? (size_t)n : 0;
+}
+
+/*
+ * Partial writes return after each record. Keep going until the socket is
+ * full, as write() would, so the caller can wait for the next edge.
+ */
+ssize_t proton_tls_send(proton_http_connection_t *conn, const void *buf, size_t len) {
+    size_t total = 0;
+    size_t n;
+    
+    ERR_clear_error();
+    while (total < len && SSL_write_ex(conn->ssl, (const char*)buf + total, len - total, &n) == 1) {
+        total += n;
+    }
+    if (total == len) return total;
+    
+    int err = SSL_get_error(conn->ssl, 0);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        if (total > 0) return total;
+        errno = EAGAIN;
+        return -1;
+    }
+    
+    failed(conn, err, "TLS write failed");
+    if (err != SSL_ERROR_SYSCALL || errno == 0) errno = EPIPE;
+    return -1;
+}
+
+void proton_tls_close(proton_http_connection_t *conn) {
+    if (!conn->ssl) return;
+    
+    /* One non-blocking attempt; the socket closes right after either way */
+    if (conn->ssl_handshaked) {
+        ERR_clear_error();
+        SSL_shutdown(conn->ssl);
+        ERR_clear_error();
+    }
+    
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+}
@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+#include "upstream.h"
+
+/*
+ * Upstream server groups for the modules that talk to backends. Server
+ * names are resolved once at config time, before the workers fork. Each
+ * worker then has its own copy of the peer state (balancing, passive
+ * failure counts) and a LIFO pool of idle connections per group, so a
+ * request usually goes out on a connection that is already established.
+ */
+
+extern proton_event_loop_t *event_loop;
+
+#define IDLE_TIMEOUT        60000
+#define HASH_POINTS         100     /* ring points per unit of weight */
+
+/* Cached keepalive connection */
+struct proton_upstream_idle_s {
+    int fd;
+    int peer;
+    proton_event_t *event;
+    proton_timer_t timer;
+    proton_upstream_group_t *group;
+    proton_upstream_idle_t *prev;
+    proton_upstream_idle_t *next;
+};
+
+static proton_upstream_group_t **groups = NULL;
+static int ngroups = 0;
+static int groups_ready = 0;    /* proxy and fastcgi both set them up */
+
+static uint32_t fnv1a(uint32_t h, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* FNV-1a barely moves the high bits for keys that differ at the end */
+static uint32_t mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b) {
+    uint32_t x = ((const proton_upstream_point_t*)a)->hash;
+    uint32_t y = ((const proton_upstream_point_t*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static int build_ring(proton_upstream_group_t *group) {
+    int total = 0;
+    for (int i = 0; i < group->npeers; i++) {
+        total += group->peers[i].weight * HASH_POINTS;
+    }
+    
+    group->ring = malloc(total * sizeof(proton_upstream_point_t));
+    if (!group->ring) return PROTON_ERROR;
+    
+    for (int i = 0; i < group->npeers; i++) {
+        for (int j = 0; j < group->peers[i].weight * HASH_POINTS; j++) {
+            char key[128];
+            int len = snprintf(key, sizeof(key), "%s-%d", group->peers[i].name, j);
+            group->ring[group->nring].hash = mix(fnv1a(2166136261u, key, len));
+            group->ring[group->nring].peer = i;
+            group->nring++;
+        }
+    }
+    
+    qsort(group->ring, group->nring, sizeof(proton_upstream_point_t), point_cmp);
+    return PROTON_OK;
+}
+
+static int peer_usable(proton_upstream_conn_t *uc, int i, int ignore_down) {
+    proton_upstream_peer_t *peer = &uc->group->peers[i];
+    
+    if (uc->tried & (1ULL << i)) return 0;
+    if (!ignore_down && peer->max_fails && peer->down_until > proton_current_msec) return 0;
+    return 1;
+}
+
+/* Smooth weighted round-robin over the usable peers */
+static int pick_round_robin(proton_upstream_conn_t *uc, int ignore_down, int least_conn) {
+    proton_upstream_group_t *group = uc->group;
+    int best = -1;
+    int total = 0;
+    int min = -1;
+    
+    /* least_conn: only the peers with the fewest active requests per weight */
+    if (least_conn) {
+        for (int i = 0; i < group->npeers; i++) {
+            if (!peer_usable(uc, i, ignore_down)) continue;
+            if (min < 0 || group->peers[i].active * group->peers[min].weight <
+                           group->peers[min].active * group->peers[i].weight) {
+                min = i;
+            }
+        }
+    }
+    
+    for (int i = 0; i < group->npeers; i++) {
+        proton_upstream_peer_t *peer = &group->peers[i];
+        if (!peer_usable(uc, i, ignore_down)) continue;
+        if (min >= 0 && peer->active * group->peers[min].weight !=
+                        group->peers[min].active * peer->weight) continue;
+        
+        peer->current_weight += peer->weight;
+        total += peer->weight;
+        if (best < 0 || peer->current_weight > group->peers[best].current_weight) best = i;
+    }
+    
+    if (best >= 0) group->peers[best].current_weight -= total;
+    return best;
+}
+
+/* Consistent hash of the request URI */
+static int pick_hash(proton_upstream_conn_t *uc, proton_http_request_t *req, int ignore_down) {
+    proton_upstream_group_t *group = uc->group;
+    
+    uint32_t h = fnv1a(2166136261u, req->uri, strlen(req->uri));
+    if (req->query_string) {
+        h = fnv1a(h, "?", 1);
+        h = fnv1a(h, req->query_string, strlen(req->query_string));
+    }
+    h = mix(h);
+    
+    int lo = 0, hi = group->nring;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (group->ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    
+    /* Walk clockwise past peers that cannot be used */
+    for (int k = 0; k < group->nring; k++) {
+        int peer = group->ring[(lo + k) % group->nring].peer;
+        if (peer_usable(uc, peer, ignore_down)) return peer;
+    }
+    
+    return -1;
+}
+
+static int select_peer(proton_upstream_conn_t *uc, proton_http_request_t *req) {
+    for (int ignore_down = 0; ignore_down <= 1; ignore_down++) {
+        int peer;
+        
+        switch (uc->group->balance) {
+        case PROTON_BALANCE_HASH:
+            peer = pick_hash(uc, req, ignore_down);
+            break;
+        case PROTON_BALANCE_LEAST_CONN:
+            peer = pick_round_robin(uc, ignore_down, 1);
+            break;
+        default:
+            peer = pick_round_robin(uc, ignore_down, 0);
+            break;
+        }
+        
+        /* With every peer down, try them anyway rather than fail outright */
+        if (peer >= 0) return peer;
+    }
+    
+    return -1;
+}
+
+static void peer_failed(proton_upstream_peer_t *peer) {
+    if (peer->max_fails == 0) return;
+    
+    if (peer->fails == 0 || proton_current_msec - peer->fail_start > (uint64_t)peer->fail_timeout) {
+        peer->fails = 0;
+        peer->fail_start = proton_current_msec;
+    }
+    
+    if (++peer->fails >= peer->max_fails) {
+        peer->down_until = proton_current_msec + peer->fail_timeout;
+        peer->fails = 0;
+        proton_log(LOG_WARN, "Upstream server %s marked down for %dms", peer->name, peer->fail_timeout);
+    }
+}
+
+static void idle_unlink(proton_upstream_idle_t *idle) {
+    proton_upstream_group_t *group = idle->group;
+    
+    if (idle->prev) idle->prev->next = idle->next;
+    else group->idle = idle->next;
+    if (idle->next) idle->next->prev = idle->prev;
+    else group->idle_tail = idle->prev;
+    group->nidle--;
+    
+    proton_timer_del(event_loop, &idle->timer);
+}
+
+static void idle_close(proton_upstream_idle_t *idle) {
+    idle_unlink(idle);
+    proton_event_del(event_loop, idle->event);
+    proton_event_destroy(idle->event);
+    close(idle->fd);
+    free(idle);
+}
+
+/* Anything from an idle upstream is either a close or garbage */
+static int idle_read_handler(proton_event_t *ev) {
+    idle_close(ev->data);
+    return PROTON_DONE;
+}
+
+static void idle_timeout_handler(proton_timer_t *timer) {
+    idle_close(timer->data);
+}
+
+static int pool_put(proton_upstream_group_t *group, int peer, int fd, proton_event_t *ev) {
+    if (group->keepalive <= 0) return PROTON_ERROR;
+    
+    proton_upstream_idle_t *idle = calloc(1, sizeof(proton_upstream_idle_t));
+    if (!idle) return PROTON_ERROR;
+    
+    if (group->nidle >= group->keepalive) {
+        idle_close(group->idle_tail);
+    }
+    
+    idle->fd = fd;
+    idle->peer = peer;
+    idle->event = ev;
+    idle->group = group;
+    ev->data = idle;
+    ev->read_handler = idle_read_handler;
+    ev->write_handler = NULL;
+    proton_timer_init(&idle->timer, idle_timeout_handler, idle);
+    proton_timer_add(event_loop, &idle->timer, IDLE_TIMEOUT);
+    
+    idle->next = group->idle;
+    if (group->idle) group->idle->prev = idle;
+    else group->idle_tail = idle;
+    group->idle = idle;
+    group->nidle++;
+    
+    return PROTON_OK;
+}
+
+static proton_upstream_idle_t* pool_get(proton_upstream_group_t *group, int peer) {
+    for (proton_upstream_idle_t *idle = group->idle; idle; idle = idle->next) {
+        if (idle->peer == peer) {
+            idle_unlink(idle);
+            return idle;
+        }
+    }
+    
+    return NULL;
+}
+
+int proton_upstream_connect(proton_upstream_conn_t *uc, proton_http_request_t *req, int cached) {
+    proton_upstream_group_t *group = uc->group;
+    
+    while (1) {
+        int i = select_peer(uc, req);
+        if (i < 0) return PROTON_ERROR;
+        
+        proton_upstream_peer_t *peer = &group->peers[i];
+        uc->tried |= 1ULL << i;
+        uc->peer = i;
+        
+        proton_upstream_idle_t *idle = cached ? pool_get(group, i) : NULL;
+        if (idle) {
+            uc->fd = idle->fd;
+            uc->event = idle->event;
+            uc->connected = 1;
+            uc->reused = 1;
+            free(idle);
+        } else {
+            int fd = socket(peer->sockaddr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) {
+                proton_log(LOG_ERROR, "Failed to create upstream socket: %s", strerror(errno));
+                return PROTON_ERROR;
+            }
+            
+            if (peer->sockaddr.ss_family != AF_UNIX) {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+            
+            if (connect(fd, (struct sockaddr*)&peer->sockaddr, peer->socklen) < 0 &&
+                errno != EINPROGRESS) {
+                proton_log(LOG_WARN, "Failed to connect to upstream %s: %s", peer->name, strerror(errno));
+                close(fd);
+                peer_failed(peer);
+                continue;
+            }
+            
+            uc->event = proton_event_create(fd);
+            if (!uc->event) {
+                close(fd);
+                return PROTON_ERROR;
+            }
+            
+            uc->fd = fd;
+            uc->connected = 0;
+            uc->reused = 0;
+        }
+        
+        uc->event->data = uc->data;
+        uc->event->read_handler = uc->read_handler;
+        uc->event->write_handler = uc->write_handler;
+        peer->active++;
+        
+        /* Adding or re-arming reports the socket if it is already writable */
+        proton_event_add(event_loop, uc->event, PROTON_EVENT_READ | PROTON_EVENT_WRITE);
+        return PROTON_OK;
+    }
+}
+
+/* Outcome of a non-blocking connect, on the first event */
+int proton_upstream_test_connect(proton_upstream_conn_t *uc) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    
+    if (getsockopt(uc->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    
+    if (err) {
+        proton_log(LOG_WARN, "Failed to connect to upstream %s: %s",
+                   proton_upstream_peer_name(uc), strerror(err));
+        return PROTON_ERROR;
+    }
+    
+    uc->connected = 1;
+    return PROTON_OK;
+}
+
+void proton_upstream_free(proton_upstream_conn_t *uc, int state) {
+    if (uc->fd < 0) return;
+    
+    proton_upstream_peer_t *peer = &uc->group->peers[uc->peer];
+    peer->active--;
+    
+    if (state == PROTON_UPSTREAM_KEEP) {
+        peer->fails = 0;
+    } else if (state == PROTON_UPSTREAM_FAILED) {
+        peer_failed(peer);
+    } else if (state == PROTON_UPSTREAM_STALE) {
+        uc->tried &= ~(1ULL << uc->peer);
+    }
+    
+    if (state != PROTON_UPSTREAM_KEEP || pool_put(uc->group, uc->peer, uc->fd, uc->event) != PROTON_OK) {
+        proton_event_del(event_loop, uc->event);
+        proton_event_destroy(uc->event);
+        close(uc->fd);
+    }
+    
+    uc->fd = -1;
+    uc->event = NULL;
+}
+
+const char* proton_upstream_peer_name(proton_upstream_conn_t *uc) {
+    return uc->peer >= 0 ? uc->group->peers[uc->peer].name : uc->group->name;
+}
+
+/* "host:port", "[v6]:port" or "host" */
+static int split_address(const char *address, char *host, size_t size, char *port) {
+    const char *colon;
+    
+    if (address[0] == '[') {
+        const char *close = strchr(address, ']');
+        if (!close || (size_t)(close - address - 1) >= size) return PROTON_ERROR;
+        memcpy(host, address + 1, close - address - 1);
+        host[close - address - 1] = '\0';
+        colon = close[1] == ':' ? close + 1 : NULL;
+    } else {
+        colon = strrchr(address, ':');
+        size_t len = colon ? (size_t)(colon - address) : strlen(address);
+        if (len >= size) return PROTON_ERROR;
+        memcpy(host, address, len);
+        host[len] = '\0';
+    }
+    
+    snprintf(port, 8, "%s", colon ? colon + 1 : "80");
+    return PROTON_OK;
+}
+
+static void format_peer(proton_upstream_peer_t *peer) {
+    char host[INET6_ADDRSTRLEN] = "?";
+    
+    if (peer->sockaddr.ss_family == AF_UNIX) {
+        struct sockaddr_un *sun = (struct sockaddr_un*)&peer->sockaddr;
+        snprintf(peer->name, sizeof(peer->name), "unix:%s", sun->sun_path);
+    } else if (peer->sockaddr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&peer->sockaddr;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+        snprintf(peer->name, sizeof(peer->name), "[%s]:%d", host, ntohs(sin6->sin6_port));
+    } else {
+        struct sockaddr_in *sin = (struct sockaddr_in*)&peer->sockaddr;
+        inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+        snprintf(peer->name, sizeof(peer->name), "%s:%d", host, ntohs(sin->sin_port));
+    }
+}
+
+static proton_upstream_peer_t* add_peer(proton_upstream_group_t *group, proton_upstream_server_t *server,
+                                        const void *sockaddr, socklen_t socklen) {
+    if (group->npeers == PROTON_UPSTREAM_MAX_PEERS) {
+        proton_log(LOG_ERROR, "Too many servers in upstream \"%s\"", group->name);
+        return NULL;
+    }
+    
+    proton_upstream_peer_t *peers = realloc(group->peers, (group->npeers + 1) * sizeof(proton_upstream_peer_t));
+    if (!peers) return NULL;
+    group->peers = peers;
+    
+    proton_upstream_peer_t *peer = &peers[group->npeers++];
+    memset(peer, 0, sizeof(*peer));
+    memcpy(&peer->sockaddr, sockaddr, socklen);
+    peer->socklen = socklen;
+    peer->weight = server->weight;
+    peer->max_fails = server->max_fails;
+    peer->fail_timeout = server->fail_timeout;
+    format_peer(peer);
+    
+    return peer;
+}
+
+/* Every address a server name resolves to becomes a peer */
+static int add_server(proton_upstream_group_t *group, proton_upstream_server_t *server) {
+    if (strncmp(server->address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        
+        if (strlen(server->address + 5) >= sizeof(sun.sun_path)) {
+            proton_log(LOG_ERROR, "Unix socket path too long in upstream \"%s\"", server->address);
+            return PROTON_ERROR;
+        }
+        strcpy(sun.sun_path, server->address + 5);
+        
+        return add_peer(group, server, &sun, sizeof(sun)) ? PROTON_OK : PROTON_ERROR;
+    }
+    
+    char host[256], port[8];
+    if (split_address(server->address, host, sizeof(host), port) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Invalid upstream address \"%s\"", server->address);
+        return PROTON_ERROR;
+    }
+    
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        proton_log(LOG_ERROR, "Host not found in upstream \"%s\": %s", server->address, gai_strerror(err));
+        return PROTON_ERROR;
+    }
+    
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (!add_peer(group, server, ai->ai_addr, ai->ai_addrlen)) {
+            freeaddrinfo(res);
+            return PROTON_ERROR;
+        }
+    }
+    
+    freeaddrinfo(res);
+    return PROTON_OK;
+}
+
+static proton_upstream_group_t* create_group(const char *name, proton_upstream_server_t *servers,
+                                             int nservers, int balance, int keepalive) {
+    proton_upstream_group_t *group = calloc(1, sizeof(proton_upstream_group_t));
+    if (!group) return NULL;
+    
+    group->name = malloc(strlen(name) + 1);
+    if (group->name) strcpy(group->name, name);
+    group->balance = balance;
+    group->keepalive = keepalive;
+    
+    /* Registered first so that cleanup frees it on any error below */
+    proton_upstream_group_t **list = realloc(groups, (ngroups + 1) * sizeof(proton_upstream_group_t*));
+    if (!list || !group->name) {
+        free(group->name);
+        free(group);
+        return NULL;
+    }
+    groups = list;
+    groups[ngroups++] = group;
+    
+    if (nservers == 0) {
+        proton_log(LOG_ERROR, "No servers in upstream \"%s\"", name);
+        return NULL;
+    }
+    
+    for (int i = 0; i < nservers; i++) {
+        if (add_server(group, &servers[i]) != PROTON_OK) return NULL;
+    }
+    
+    if (balance == PROTON_BALANCE_HASH && build_ring(group) != PROTON_OK) return NULL;
+    
+    return group;
+}
+
+proton_upstream_group_t* proton_upstream_get(const char *target, int keepalive) {
+    for (int i = 0; i < ngroups; i++) {
+        if (strcmp(groups[i]->name, target) == 0) return groups[i];
+    }
+    
+    proton_upstream_server_t server = { (char*)target, 1, 1, 10000 };
+    return create_group(target, &server, 1, PROTON_BALANCE_ROUND_ROBIN, keepalive);
+}
+
+int proton_upstreams_init(proton_config_t *config) {
+    if (groups_ready) return PROTON_OK;
+    groups_ready = 1;
+    
+    for (int i = 0; i < config->nupstreams; i++) {
+        proton_upstream_t *u = &config->upstreams[i];
+        if (!create_group(u->name, u->servers, u->nservers, u->balance, u->keepalive)) {
+            return PROTON_ERROR;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+void proton_upstreams_cleanup(void) {
+    if (!groups_ready) return;
+    groups_ready = 0;
+    
+    for (int i = 0; i < ngroups; i++) {
+        proton_upstream_group_t *group = groups[i];
+        while (group->idle) idle_close(group->idle);
+        free(group->ring);
+        free(group->peers);
+        free(group->name);
+        free(group);
+    }
+    
+    free(groups);
+    groups = NULL;
+    ngroups = 0;
+}
@@ -0,0 +1,628 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+#include "module.h"
+#include "websocket.h"
+
+/*
+ * WebSocket framing. Frames are parsed where they were read: a worker-wide
+ * scratch buffer, unmasked in place and handed to the module from there.
+ * Only a frame cut short by the socket is copied, into a buffer of the
+ * connection's own that goes away once the frame is complete, and only
+ * fragmented messages are collected. Messages leave with writev straight
+ * from the module's data; what the socket does not take is queued in the
+ * write buffer, which is also freed when empty. An idle WebSocket thus
+ * holds no buffers, only its connection, request pool and this state.
+ */
+
+extern proton_event_loop_t *event_loop;
+
+#define WS_GUID         "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define READ_CHUNK      16384
+#define CLOSE_TIMEOUT   5000        /* msec to wait for the peer's close frame */
+
+struct proton_ws_s {
+    proton_http_connection_t *conn;
+    const proton_ws_handler_t *handler;
+    proton_buffer_t *in;            /* a partial frame, NULL between frames */
+    proton_buffer_t *message;       /* fragments so far, NULL between messages */
+    int message_opcode;             /* of the fragmented message, 0 if none */
+    int close_sent;
+    int close_received;
+    int fatal;                      /* close once the write buffer is out */
+    proton_timer_t timer;           /* waiting for the peer's close */
+};
+
+static char scratch[READ_CHUNK];
+
+/* XOR with the masking key, sixteen or eight bytes at a time */
+static void unmask(unsigned char *p, size_t len, const unsigned char *key) {
+    uint32_t k32;
+    size_t i = 0;
+    
+    memcpy(&k32, key, 4);
+
+#ifdef __SSE2__
+    __m128i k128 = _mm_set1_epi32((int)k32);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+        _mm_storeu_si128((__m128i*)(p + i), _mm_xor_si128(v, k128));
+    }
+#endif
+
+    uint64_t k64 = ((uint64_t)k32 << 32) | k32;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, p + i, 8);
+        v ^= k64;
+        memcpy(p + i, &v, 8);
+    }
+    
+    for (; i < len; i++) {
+        p[i] ^= key[i & 3];
+    }
+}
+
+static int utf8_valid(const unsigned char *p, size_t len) {
+    size_t i = 0;
+    
+    while (i < len) {
+        /* Skip ASCII a word at a time */
+        if (i + 8 <= len) {
+            uint64_t v;
+            memcpy(&v, p + i, 8);
+            if ((v & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+        
+        unsigned char c = p[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        
+        size_t n;
+        uint32_t cp;
+        if ((c & 0xe0) == 0xc0) { n = 1; cp = c & 0x1f; }
+        else if ((c & 0xf0) == 0xe0) { n = 2; cp = c & 0x0f; }
+        else if ((c & 0xf8) == 0xf0) { n = 3; cp = c & 0x07; }
+        else return 0;
+        
+        if (i + n >= len) return 0;
+        for (size_t k = 1; k <= n; k++) {
+            if ((p[i + k] & 0xc0) != 0x80) return 0;
+            cp = (cp << 6) | (p[i + k] & 0x3f);
+        }
+        
+        /* Overlong forms, surrogates and beyond U+10FFFF */
+        if ((n == 1 && cp < 0x80) || (n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) ||
+            cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+            return 0;
+        }
+        
+        i += n + 1;
+    }
+    
+    return 1;
+}
+
+static int reserve(proton_buffer_t *buf, size_t size) {
+    if (buf->capacity >= size) return PROTON_OK;
+    
+    size_t capacity = buf->capacity * 2;
+    if (capacity < size) capacity = size;
+    
+    char *data = realloc(buf->data, capacity);
+    if (!data) return PROTON_ERROR;
+    
+    buf->data = data;
+    buf->capacity = capacity;
+    return PROTON_OK;
+}
+
+/* Write path wakes up and takes care of the rest */
+static void schedule_write(proton_ws_t *ws) {
+    if (event_loop) {
+        proton_event_add(event_loop, ws->conn->event, PROTON_EVENT_READ | PROTON_EVENT_WRITE);
+    }
+}
+
+/* Frames */
+
+static int send_frame(proton_ws_t *ws, int opcode, const void *data, size_t len) {
+    proton_http_connection_t *conn = ws->conn;
+    unsigned char header[10];
+    size_t header_len = 2;
+    
+    header[0] = 0x80 | opcode;
+    if (len < 126) {
+        header[1] = len;
+    } else if (len <= 0xffff) {
+        header[1] = 126;
+        header[2] = len >> 8;
+        header[3] = len;
+        header_len = 4;
+    } else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++) header[2 + i] = (uint64_t)len >> (56 - 8 * i);
+        header_len = 10;
+    }
+    
+    /* Straight from the caller's data unless older frames are still queued */
+    size_t sent = 0;
+    if (!conn->write_buf || conn->write_buf->len == 0) {
+        struct iovec iov[2] = {
+            { header, header_len },
+            { (void*)data, len }
+        };
+        
+        ssize_t n = proton_http_sendv(conn, iov, len > 0 ? 2 : 1);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                ws->fatal = 1;
+                schedule_write(ws);
+                return PROTON_ERROR;
+            }
+            n = 0;
+        }
+        
+        sent = n;
+        conn->bytes_sent += n;
+        proton_stats->bytes_out += n;
+        if (sent == header_len + len) return PROTON_OK;
+    }
+    
+    if (!conn->write_buf) {
+        conn->write_buf = proton_buffer_create(header_len + len - sent);
+        if (!conn->write_buf) goto failed;
+    }
+    
+    if (sent < header_len &&
+        proton_buffer_append(conn->write_buf, (char*)header + sent, header_len - sent) != PROTON_OK) {
+        goto failed;
+    }
+    
+    size_t skip = sent > header_len ? sent - header_len : 0;
+    if (len > skip && proton_buffer_append(conn->write_buf, (const char*)data + skip, len - skip) != PROTON_OK) {
+        goto failed;
+    }
+    
+    schedule_write(ws);
+    return PROTON_OK;
+
+failed:
+    ws->fatal = 1;
+    schedule_write(ws);
+    return PROTON_ERROR;
+}
+
+static int send_close(proton_ws_t *ws, int status, const char *reason) {
+    unsigned char payload[125];
+    size_t len = 0;
+    
+    if (ws->close_sent) return PROTON_OK;
+    ws->close_sent = 1;
+    
+    if (status > 0) {
+        payload[0] = status >> 8;
+        payload[1] = status;
+        len = 2;
+        
+        if (reason) {
+            size_t reason_len = strlen(reason);
+            if (reason_len > sizeof(payload) - 2) reason_len = sizeof(payload) - 2;
+            memcpy(payload + 2, reason, reason_len);
+            len += reason_len;
+        }
+    }
+    
+    return send_frame(ws, PROTON_WS_CLOSE, payload, len);
+}
+
+/* Give up on the connection: tell the peer why and close after that */
+static int fail(proton_ws_t *ws, int status) {
+    send_close(ws, status, NULL);
+    ws->fatal = 1;
+    return PROTON_ERROR;
+}
+
+static int deliver(proton_ws_t *ws, int opcode, const char *data, size_t len) {
+    if (opcode == PROTON_WS_TEXT && !utf8_valid((const unsigned char*)data, len)) {
+        return fail(ws, PROTON_WS_INVALID_DATA);
+    }
+    
+    /* Nothing reaches the module once the closing handshake has begun */
+    if (ws->close_sent || !ws->handler->on_message) return PROTON_OK;
+    
+    if (ws->handler->on_message(ws->conn, opcode, data, len) != PROTON_OK) {
+        return fail(ws, PROTON_WS_INTERNAL_ERROR);
+    }
+    
+    return PROTON_OK;
+}
+
+static int on_close_frame(proton_ws_t *ws, const unsigned char *p, size_t len) {
+    int status = 0;
+    
+    if (len == 1) return fail(ws, PROTON_WS_PROTOCOL_ERROR);
+    
+    if (len >= 2) {
+        status = (p[0] << 8) | p[1];
+        
+        /* Codes a peer may send, and a reason in UTF-8 */
+        if (status < 1000 || status >= 5000 || status == 1004 || status == 1005 || status == 1006 ||
+            (status > 1011 && status < 3000) || !utf8_valid(p + 2, len - 2)) {
+            return fail(ws, PROTON_WS_PROTOCOL_ERROR);
+        }
+    }
+    
+    /* Echo the status, then close */
+    ws->close_received = 1;
+    send_close(ws, status, NULL);
+    ws->fatal = 1;
+    return PROTON_OK;
+}
+
+static int on_frame(proton_ws_t *ws, int fin, int opcode, char *data, size_t len) {
+    /* Control frames may come between the fragments of a message */
+    if (opcode & 0x8) {
+        if (!fin || len > 125) return fail(ws, PROTON_WS_PROTOCOL_ERROR);
+        
+        switch (opcode) {
+        case PROTON_WS_CLOSE:
+            return on_close_frame(ws, (unsigned char*)data, len);
+        case PROTON_WS_PING:
+            if (!ws->close_sent) send_frame(ws, PROTON_WS_PONG, data, len);
+            return PROTON_OK;
+        case PROTON_WS_PONG:
+            return PROTON_OK;
+        default:
+            return fail(ws, PROTON_WS_PROTOCOL_ERROR);
+        }
+    }
+    
+    if (opcode == PROTON_WS_CONTINUATION) {
+        if (!ws->message_opcode) return fail(ws, PROTON_WS_PROTOCOL_ERROR);
+    } else if (opcode == PROTON_WS_TEXT || opcode == PROTON_WS_BINARY) {
+        if (ws->message_opcode) return fail(ws, PROTON_WS_PROTOCOL_ERROR);
+        
+        /* A message in one frame, as almost all are, is passed where it lies */
+        if (fin) return deliver(ws, opcode, data, len);
+        ws->message_opcode = opcode;
+    } else {
+        return fail(ws, PROTON_WS_PROTOCOL_ERROR);
+    }
+    
+    if (!ws->message) {
+        ws->message = proton_buffer_create(len > 4096 ? len : 4096);
+        if (!ws->message) return fail(ws, PROTON_WS_INTERNAL_ERROR);
+    }
+    
+    if (ws->message->len + len > PROTON_WS_MAX_MESSAGE) {
+        return fail(ws, PROTON_WS_MESSAGE_TOO_BIG);
+    }
+    
+    if (len > 0 && proton_buffer_append(ws->message, data, len) != PROTON_OK) {
+        return fail(ws, PROTON_WS_INTERNAL_ERROR);
+    }
+    
+    if (!fin) return PROTON_OK;
+    
+    opcode = ws->message_opcode;
+    ws->message_opcode = 0;
+    
+    int ret = deliver(ws, opcode, ws->message->data, ws->message->len);
+    proton_buffer_destroy(ws->message);
+    ws->message = NULL;
+    return ret;
+}
+
+/* Handle the complete frames in data; returns the bytes used */
+static size_t process_frames(proton_ws_t *ws, char *data, size_t len) {
+    size_t pos = 0;
+    
+    while (!ws->fatal) {
+        unsigned char *p = (unsigned char*)data + pos;
+        size_t avail = len - pos;
+        if (avail < 2) break;
+        
+        /* No extensions are negotiated, and clients must mask */
+        if ((p[0] & 0x70) || !(p[1] & 0x80)) {
+            fail(ws, PROTON_WS_PROTOCOL_ERROR);
+            break;
+        }
+        
+        size_t header_len = 2;
+        uint64_t payload_len = p[1] & 0x7f;
+        
+        if (payload_len == 126) {
+            if (avail < 4) break;
+            payload_len = (p[2] << 8) | p[3];
+            header_len = 4;
+        } else if (payload_len == 127) {
+            if (avail < 10) break;
+            payload_len = 0;
+            for (int i = 0; i < 8; i++) payload_len = (payload_len << 8) | p[2 + i];
+            header_len = 10;
+        }
+        
+        if (payload_len > PROTON_WS_MAX_MESSAGE) {
+            fail(ws, PROTON_WS_MESSAGE_TOO_BIG);
+            break;
+        }
+        
+        if (avail < header_len + 4 + payload_len) break;
+        
+        unsigned char *payload = p + header_len + 4;
+        unmask(payload, payload_len, p + header_len);
+        pos += header_len + 4 + payload_len;
+        
+        if (on_frame(ws, p[0] & 0x80, p[0] & 0x0f, (char*)payload, payload_len) != PROTON_OK) break;
+    }
+    
+    return pos;
+}
+
+/* Process what was read and keep a partial frame for later */
+static int consume(proton_ws_t *ws, char *data, size_t len) {
+    size_t used = process_frames(ws, data, len);
+    size_t rest = len - used;
+    
+    if (ws->fatal) rest = 0;
+    
+    if (ws->in) {
+        if (rest == 0) {
+            proton_buffer_destroy(ws->in);
+            ws->in = NULL;
+        } else {
+            memmove(ws->in->data, data + used, rest);
+            ws->in->len = rest;
+        }
+        return PROTON_OK;
+    }
+    
+    if (rest == 0) return PROTON_OK;
+    
+    ws->in = proton_buffer_create(rest > 4096 ? rest : 4096);
+    if (!ws->in || proton_buffer_append(ws->in, data + used, rest) != PROTON_OK) {
+        return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+static int flush(proton_ws_t *ws) {
+    proton_http_connection_t *conn = ws->conn;
+    proton_buffer_t *out = conn->write_buf;
+    
+    while (out && out->len > 0) {
+        ssize_t n = proton_http_send(conn, out->data, out->len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROTON_OK;
+            if (errno == EINTR) continue;
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        conn->bytes_sent += n;
+        proton_stats->bytes_out += n;
+        if ((size_t)n < out->len) memmove(out->data, out->data + n, out->len - n);
+        out->len -= n;
+    }
+    
+    if (out) {
+        proton_buffer_destroy(out);
+        conn->write_buf = NULL;
+    }
+    
+    if (ws->fatal) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    
+    return PROTON_OK;
+}
+
+static void close_timeout_handler(proton_timer_t *timer) {
+    proton_ws_t *ws = timer->data;
+    proton_http_connection_close(ws->conn);
+}
+
+/* Entry points */
+
+int proton_ws_is_upgrade(proton_http_request_t *req) {
+    return req->version == HTTP_VERSION_11 && req->method == HTTP_GET &&
+           proton_http_has_token(proton_http_get_header(req, "Upgrade"), "websocket") &&
+           proton_http_has_token(proton_http_get_header(req, "Connection"), "upgrade");
+}
+
+int proton_ws_accept(proton_http_connection_t *conn, const proton_ws_handler_t *handler, void *data) {
+    proton_http_request_t *req = conn->request;
+    proton_http_response_t *res = conn->response;
+    
+    if (conn->stream || !proton_ws_is_upgrade(req)) return PROTON_MODULE_DECLINED;
+    
+    const char *version = proton_http_get_header(req, "Sec-WebSocket-Version");
+    if (!version || strcmp(version, "13") != 0) {
+        res->status = HTTP_STATUS_UPGRADE_REQUIRED;
+        proton_http_response_add_header(res, "Sec-WebSocket-Version", "13");
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    /* The key is 16 bytes in base64, and the handshake has no body */
+    const char *key = proton_http_get_header(req, "Sec-WebSocket-Key");
+    const char *length = proton_http_get_header(req, "Content-Length");
+    if (!key || strlen(key) != 24 || proton_http_get_header(req, "Transfer-Encoding") ||
+        (length && strtoull(length, NULL, 10) > 0)) {
+        res->status = HTTP_STATUS_BAD_REQUEST;
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    char concat[24 + sizeof(WS_GUID)];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    unsigned char accept[32];
+    
+    memcpy(concat, key, 24);
+    memcpy(concat + 24, WS_GUID, sizeof(WS_GUID));
+    SHA1((unsigned char*)concat, 24 + sizeof(WS_GUID) - 1, digest);
+    EVP_EncodeBlock(accept, digest, sizeof(digest));
+    
+    proton_ws_t *ws = calloc(1, sizeof(proton_ws_t));
+    if (!ws) return PROTON_MODULE_ERROR;
+    
+    char head[256];
+    int len = snprintf(head, sizeof(head),
+                       "HTTP/1.1 101 Switching Protocols\r\n"
+                       "Upgrade: websocket\r\n"
+                       "Connection: Upgrade\r\n"
+                       "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    
+    if (proton_buffer_append(conn->write_buf, head, len) != PROTON_OK) {
+        free(ws);
+        return PROTON_MODULE_ERROR;
+    }
+    
+    ws->conn = conn;
+    ws->handler = handler;
+    proton_timer_init(&ws->timer, close_timeout_handler, ws);
+    
+    conn->ws = ws;
+    conn->module_ctx = data;
+    conn->keep_alive = 0;
+    conn->bytes_sent = len;
+    res->status = HTTP_STATUS_SWITCHING_PROTOCOLS;
+    res->headers_sent = 1;
+    
+    return PROTON_MODULE_HANDLED;
+}
+
+/* The request is over as far as HTTP goes: log it and let go of its buffers */
+int proton_ws_start(proton_http_connection_t *conn) {
+    proton_ws_t *ws = conn->ws;
+    proton_buffer_t *in = conn->read_buf;
+    size_t header_len = conn->request->header_len;
+    
+    proton_http_request_done(conn);
+    conn->requests++;
+    
+    proton_http_response_destroy(conn->response);
+    conn->response = NULL;
+    conn->read_buf = NULL;
+    
+    /* Frames the client sent right behind the handshake */
+    int ret = PROTON_OK;
+    if (in->len > header_len) {
+        ret = consume(ws, in->data + header_len, in->len - header_len);
+    }
+    proton_buffer_destroy(in);
+    
+    if (ret != PROTON_OK) {
+        proton_http_connection_close(conn);
+        return PROTON_DONE;
+    }
+    
+    schedule_write(ws);
+    return proton_ws_read_handler(conn);
+}
+
+int proton_ws_read_handler(proton_http_connection_t *conn) {
+    proton_ws_t *ws = conn->ws;
+    
+    while (!ws->fatal) {
+        char *data = scratch;
+        size_t have = 0;
+        size_t room = sizeof(scratch);
+        
+        /* The rest of a partial frame goes behind it */
+        if (ws->in) {
+            if (reserve(ws->in, ws->in->len + READ_CHUNK) != PROTON_OK) {
+                proton_http_connection_close(conn);
+                return PROTON_DONE;
+            }
+            data = ws->in->data;
+            have = ws->in->len;
+            room = ws->in->capacity - have;
+        }
+        
+        ssize_t n = proton_http_recv(conn, data + have, room);
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        if (n == 0) {
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        proton_stats->bytes_in += n;
+        if (consume(ws, data, have + n) != PROTON_OK) {
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+    }
+    
+    return flush(ws);
+}
+
+int proton_ws_write_handler(proton_http_connection_t *conn) {
+    return flush(conn->ws);
+}
+
+int proton_ws_send(proton_http_connection_t *conn, int opcode, const void *data, size_t len) {
+    proton_ws_t *ws = conn->ws;
+    
+    if (!ws || ws->close_sent || ws->fatal) return PROTON_ERROR;
+    
+    if (opcode != PROTON_WS_TEXT && opcode != PROTON_WS_BINARY &&
+        opcode != PROTON_WS_PING && opcode != PROTON_WS_PONG) {
+        return PROTON_ERROR;
+    }
+    if ((opcode & 0x8) && len > 125) return PROTON_ERROR;
+    
+    return send_frame(ws, opcode, data, len);
+}
+
+int proton_ws_close(proton_http_connection_t *conn, int status, const char *reason) {
+    proton_ws_t *ws = conn->ws;
+    
+    if (!ws || ws->close_sent) return PROTON_OK;
+    
+    proton_timer_add(event_loop, &ws->timer, CLOSE_TIMEOUT);
+    return send_close(ws, status, reason);
+}
+
+void proton_ws_drain(proton_http_connection_t *conn) {
+    proton_ws_close(conn, PROTON_WS_GOING_AWAY, NULL);
+    flush(conn->ws);
+}
+
+void proton_ws_destroy(proton_http_connection_t *conn) {
+    proton_ws_t *ws = conn->ws;
+    if (!ws) return;
+    
+    proton_timer_del(event_loop, &ws->timer);
+    
+    if (ws->handler->on_close) {
+        ws->handler->on_close(conn);
+    }
+    
+    proton_buffer_destroy(ws->in);
+    proton_buffer_destroy(ws->message);
+    free(ws);
+    conn->ws = NULL;
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proton.h"
+#include "http.h"
+#include "module.h"
+#include "limit.h"
+#include "cidr.h"
+
+/*
+ * allow / deny: the first rule covering the client address decides, and a
+ * client no rule covers is allowed. Each location's rules are compiled
+ * into a trie per address family at config time, so a lookup costs the
+ * same with five rules as with a blocklist of a million:
+ *
+ *   location /admin {
+ *       allow 10.0.0.0/8;
+ *       allow 2001:db8::/32;
+ *       deny all;
+ *   }
+ *
+ * "unix:" rules are for clients of unix: listeners; "all" covers them too.
+ */
+
+static proton_cidr_set_t *location_sets = NULL;
+static int nlocation_sets = 0;
+
+static int mod_access_handler(proton_http_connection_t *conn) {
+    proton_location_t *loc = conn->request->location;
+    
+    if (!loc || loc->index >= nlocation_sets) return PROTON_MODULE_DECLINED;
+    
+    if (proton_cidr_set_lookup(&location_sets[loc->index], conn) == 1) {
+        proton_log(LOG_INFO, "access forbidden by rule in location %s", loc->prefix);
+        proton_limit_reject(conn, HTTP_STATUS_FORBIDDEN);
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    return PROTON_MODULE_DECLINED;
+}
+
+static void mod_access_cleanup(void) {
+    for (int i = 0; i < nlocation_sets; i++) {
+        proton_cidr_set_destroy(&location_sets[i]);
+    }
+    free(location_sets);
+    location_sets = NULL;
+    nlocation_sets = 0;
+}
+
+static int mod_access_init(proton_config_t *config) {
+    if (config->nlocations == 0) return PROTON_OK;
+    
+    location_sets = calloc(config->nlocations, sizeof(proton_cidr_set_t));
+    if (!location_sets) return PROTON_ERROR;
+    nlocation_sets = config->nlocations;
+    
+    for (int i = 0; i < config->nlocations; i++) {
+        proton_location_t *loc = &config->locations[i];
+        proton_cidr_set_t *set = &location_sets[i];
+        
+        set->unix_value = PROTON_CIDR_NONE;
+        if (loc->naccess_rules == 0) continue;
+        
+        if (proton_cidr_set_build(set, loc->access_rules, loc->naccess_rules, PROTON_CIDR_FIRST) != PROTON_OK) {
+            proton_log(LOG_ERROR, "Failed to build access rules of location %s", loc->prefix);
+            mod_access_cleanup();
+            return PROTON_ERROR;
+        }
+        
+        proton_log(LOG_INFO, "Location %s: %d access rules, %zu bytes", loc->prefix, loc->naccess_rules,
+                   proton_cidr_memory(set->v4) + proton_cidr_memory(set->v6));
+    }
+    
+    return PROTON_OK;
+}
+
+static int mod_access_applies(proton_location_t *loc, int phase) {
+    (void)phase;
+    return loc && loc->naccess_rules > 0;
+}
+
+proton_module_t mod_access = {
+    .name = "access",
+    .init = mod_access_init,
+    .phases = { [PROTON_PHASE_ACCESS] = mod_access_handler },
+    .applies = mod_access_applies,
+    .cleanup = mod_access_cleanup
+};
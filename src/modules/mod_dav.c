@@ -0,0 +1,554 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+#include "module.h"
+
+/*
+ * WebDAV-lite: PUT, DELETE and MKCOL under the document root, for pushing
+ * files to the server.
+ *
+ *   location /artifacts/ {
+ *       dav_methods PUT DELETE MKCOL;
+ *       dav_max_size 8g;
+ *   }
+ *
+ * A PUT body goes to a temporary file next to its target, which is synced
+ * and renamed over the target once complete: readers see the old file or
+ * the new one, never a part of either. Without TLS the body is moved with
+ * splice from the socket through a pipe into the file and is never copied
+ * to user space. Written ranges are handed to writeback as the upload goes
+ * and dropped from the page cache once on disk, so a multi-gigabyte upload
+ * neither fills memory with dirty pages nor leaves much for the final
+ * fsync. An HTTP/2 stream has its body in memory already and it is
+ * written out in one go. GET and HEAD in the location are served by the
+ * static module.
+ */
+
+extern proton_event_loop_t *event_loop;
+extern proton_module_t mod_dav;
+
+#define DAV_PIPE_SIZE       (1024 * 1024)
+#define DAV_BUFFER_SIZE     65536               /* bodies read through TLS */
+#define DAV_FLUSH_SIZE      (8 * 1024 * 1024)   /* writeback is started per this much */
+#define DAV_BODY_TIMEOUT    60000               /* msec without body bytes */
+
+/* Each worker's pipe for splice; empty between calls */
+typedef struct {
+    int fds[2];
+    int size;
+} dav_pipe_t;
+
+typedef struct {
+    proton_http_connection_t *conn;
+    proton_timer_t timer;
+    int fd;
+    char *path;
+    char *temp;                 /* unlinked unless renamed over path */
+    int existed;
+    int64_t remaining;
+    off_t offset;
+    off_t synced;               /* before this the file is on its way to disk */
+    off_t flushed;              /* start of the range not yet handed to writeback */
+    dav_pipe_t *pipe;           /* NULL on TLS or if splice is not supported */
+} dav_ctx_t;
+
+static char *document_root = NULL;
+
+static void set_status(proton_http_response_t *res, int status) {
+    res->status = status;
+    
+    if (status >= 400) {
+        char body[64];
+        int len = snprintf(body, sizeof(body), "%d %s\n", status, proton_http_status_string(status));
+        proton_http_response_write(res, body, len);
+    }
+}
+
+static int errno_status(int err) {
+    switch (err) {
+        case ENOENT: return HTTP_STATUS_NOT_FOUND;
+        case EACCES: case EPERM: case EROFS: return HTTP_STATUS_FORBIDDEN;
+        case ENOTDIR: case EEXIST: case ENOTEMPTY: case EISDIR: return HTTP_STATUS_CONFLICT;
+        case ENOSPC: case EDQUOT: case EFBIG: return HTTP_STATUS_INSUFFICIENT_STORAGE;
+        default: return HTTP_STATUS_INTERNAL_ERROR;
+    }
+}
+
+/* The file the URI names; NULL if it could leave the document root */
+static char* target_path(proton_http_request_t *req) {
+    size_t len = strlen(document_root) + strlen(req->uri) + 1;
+    char *path = proton_pool_alloc(req->pool, len);
+    
+    if (!path || strstr(req->uri, "..")) return NULL;
+    snprintf(path, len, "%s%s", document_root, req->uri);
+    return path;
+}
+
+/* A rename is durable once the directory holding the entry is synced */
+static void sync_parent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char dir[4096];
+    
+    if (!slash || (size_t)(slash - path) >= sizeof(dir)) return;
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    
+    int fd = open(slash == path ? "/" : dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+static void dav_free(dav_ctx_t *ctx) {
+    proton_timer_del(event_loop, &ctx->timer);
+    if (ctx->fd >= 0) close(ctx->fd);
+    if (ctx->temp) unlink(ctx->temp);
+    free(ctx->temp);
+    free(ctx);
+}
+
+static void dav_close_hook(proton_http_connection_t *conn) {
+    dav_free(conn->module_ctx);
+    conn->module_ctx = NULL;
+}
+
+static void clear_hooks(proton_http_connection_t *conn) {
+    conn->read_hook = NULL;
+    conn->write_hook = NULL;
+    conn->close_hook = NULL;
+    conn->module_ctx = NULL;
+}
+
+/* The upload ended, one way or the other, after the handler had returned */
+static int dav_respond(dav_ctx_t *ctx, int status) {
+    proton_http_connection_t *conn = ctx->conn;
+    
+    /* Unread body bytes would be taken for the next request */
+    if (ctx->remaining > 0) conn->keep_alive = 0;
+    
+    dav_free(ctx);
+    clear_hooks(conn);
+    
+    set_status(conn->response, status);
+    proton_http_response_send(conn);
+    return PROTON_DONE;
+}
+
+static void dav_timeout_handler(proton_timer_t *timer) {
+    dav_ctx_t *ctx = timer->data;
+    
+    proton_log(LOG_WARN, "Client timed out sending the body of PUT %s", ctx->conn->request->uri);
+    proton_http_connection_close(ctx->conn);
+}
+
+/*
+ * Start writeback of each DAV_FLUSH_SIZE written, and drop the window
+ * before from the cache; its writeback started a window ago, so waiting
+ * for it rarely blocks.
+ */
+static void flush_written(dav_ctx_t *ctx) {
+    if (ctx->offset - ctx->flushed < DAV_FLUSH_SIZE) return;
+    
+    sync_file_range(ctx->fd, ctx->flushed, ctx->offset - ctx->flushed, SYNC_FILE_RANGE_WRITE);
+    
+    if (ctx->flushed > ctx->synced) {
+        sync_file_range(ctx->fd, ctx->synced, ctx->flushed - ctx->synced,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(ctx->fd, ctx->synced, ctx->flushed - ctx->synced, POSIX_FADV_DONTNEED);
+    }
+    
+    ctx->synced = ctx->flushed;
+    ctx->flushed = ctx->offset;
+}
+
+static int write_all(dav_ctx_t *ctx, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = pwrite(ctx->fd, data, len, ctx->offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return PROTON_ERROR;
+        }
+        
+        data += n;
+        len -= n;
+        ctx->offset += n;
+    }
+    
+    return PROTON_OK;
+}
+
+/* A pipe left with bytes in it is no use to the next upload */
+static void pipe_close(dav_pipe_t *p) {
+    if (p->fds[0] >= 0) close(p->fds[0]);
+    if (p->fds[1] >= 0) close(p->fds[1]);
+    p->fds[0] = p->fds[1] = -1;
+}
+
+static int pipe_open(dav_pipe_t *p) {
+    if (pipe2(p->fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        p->fds[0] = p->fds[1] = -1;
+        return PROTON_ERROR;
+    }
+    
+    /* Beyond /proc/sys/fs/pipe-max-size only root may go; keep the default then */
+    fcntl(p->fds[1], F_SETPIPE_SZ, DAV_PIPE_SIZE);
+    p->size = fcntl(p->fds[1], F_GETPIPE_SZ);
+    if (p->size <= 0) p->size = 65536;
+    
+    return PROTON_OK;
+}
+
+/*
+ * Move what the socket has of the body into the file. Returns the bytes
+ * moved, 0 at end of stream, or -1 with errno set; *file_error tells a
+ * failed write to the file from a failed read.
+ */
+static ssize_t splice_body(dav_ctx_t *ctx, int *file_error) {
+    dav_pipe_t *p = ctx->pipe;
+    size_t want = ctx->remaining < p->size ? (size_t)ctx->remaining : (size_t)p->size;
+    
+    ssize_t n = splice(ctx->conn->fd, NULL, p->fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n <= 0) return n;
+    
+    for (ssize_t left = n; left > 0; ) {
+        loff_t offset = ctx->offset;
+        ssize_t m = splice(p->fds[0], NULL, ctx->fd, &offset, left, SPLICE_F_MOVE);
+        
+        if (m < 0 && errno == EINTR) continue;
+        if (m <= 0) {
+            if (m == 0) errno = EIO;
+            *file_error = 1;
+            int err = errno;
+            pipe_close(p);
+            if (pipe_open(p) != PROTON_OK) ctx->pipe = NULL;
+            errno = err;
+            return -1;
+        }
+        
+        ctx->offset += m;
+        left -= m;
+    }
+    
+    return n;
+}
+
+static ssize_t copy_body(dav_ctx_t *ctx, int *file_error) {
+    char buf[DAV_BUFFER_SIZE];
+    size_t want = ctx->remaining < (int64_t)sizeof(buf) ? (size_t)ctx->remaining : sizeof(buf);
+    
+    ssize_t n = proton_http_recv(ctx->conn, buf, want);
+    if (n <= 0) return n;
+    
+    if (write_all(ctx, buf, n) != PROTON_OK) {
+        *file_error = 1;
+        return -1;
+    }
+    
+    return n;
+}
+
+/* The whole body is in the temporary file: put it in place */
+static int put_finish(dav_ctx_t *ctx) {
+    if (fsync(ctx->fd) < 0) {
+        proton_log(LOG_ERROR, "fsync %s failed: %s", ctx->temp, strerror(errno));
+        return errno_status(errno);
+    }
+    
+    close(ctx->fd);
+    ctx->fd = -1;
+    
+    if (rename(ctx->temp, ctx->path) < 0) {
+        proton_log(LOG_ERROR, "rename %s to %s failed: %s", ctx->temp, ctx->path, strerror(errno));
+        return errno_status(errno);
+    }
+    
+    free(ctx->temp);
+    ctx->temp = NULL;
+    sync_parent(ctx->path);
+    
+    proton_log(LOG_DEBUG, "Stored %s (%lld bytes)", ctx->path, (long long)ctx->offset);
+    return ctx->existed ? HTTP_STATUS_NO_CONTENT : HTTP_STATUS_CREATED;
+}
+
+static int dav_body_read(proton_http_connection_t *conn) {
+    dav_ctx_t *ctx = conn->module_ctx;
+    
+    while (ctx->remaining > 0) {
+        int file_error = 0;
+        ssize_t n = ctx->pipe ? splice_body(ctx, &file_error) : copy_body(ctx, &file_error);
+        
+        if (n < 0) {
+            if (file_error) {
+                proton_log(LOG_ERROR, "Writing %s failed: %s", ctx->temp, strerror(errno));
+                return dav_respond(ctx, errno_status(errno));
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            
+            /* The socket cannot be spliced from; read it instead */
+            if (errno == EINVAL && ctx->pipe) {
+                ctx->pipe = NULL;
+                continue;
+            }
+        }
+        
+        /* The client went away in the middle of its body */
+        if (n <= 0) {
+            proton_http_connection_close(conn);
+            return PROTON_DONE;
+        }
+        
+        proton_stats->bytes_in += n;
+        ctx->remaining -= n;
+        flush_written(ctx);
+    }
+    
+    if (ctx->remaining > 0) {
+        proton_timer_add(event_loop, &ctx->timer, DAV_BODY_TIMEOUT);
+        return PROTON_OK;
+    }
+    
+    return dav_respond(ctx, put_finish(ctx));
+}
+
+/* Answer a PUT before its body was read; the connection cannot be kept */
+static int put_refused(proton_http_connection_t *conn, dav_ctx_t *ctx, int status) {
+    if (ctx) dav_free(ctx);
+    conn->keep_alive = 0;
+    set_status(conn->response, status);
+    return PROTON_MODULE_HANDLED;
+}
+
+static int dav_put(proton_http_connection_t *conn, proton_location_t *loc) {
+    proton_http_request_t *req = conn->request;
+    
+    /*
+     * Only a body of known length can be checked against the limit up
+     * front. A stream's body is all there, whatever it announced.
+     */
+    if (!conn->stream && (req->chunked || !proton_http_get_header(req, "Content-Length"))) {
+        return put_refused(conn, NULL, HTTP_STATUS_LENGTH_REQUIRED);
+    }
+    
+    int64_t length = conn->stream ? (int64_t)req->body_len : req->content_length;
+    
+    if (loc->dav_max_size > 0 && length > loc->dav_max_size) {
+        proton_log(LOG_WARN, "PUT %s of %lld bytes is over dav_max_size", req->uri, (long long)length);
+        return put_refused(conn, NULL, HTTP_STATUS_PAYLOAD_TOO_LARGE);
+    }
+    
+    char *path = target_path(req);
+    if (!path) return put_refused(conn, NULL, HTTP_STATUS_BAD_REQUEST);
+    
+    /* A collection cannot be PUT */
+    size_t len = strlen(path);
+    struct stat st;
+    int existed = stat(path, &st) == 0;
+    if (path[len - 1] == '/' || (existed && S_ISDIR(st.st_mode))) {
+        return put_refused(conn, NULL, HTTP_STATUS_CONFLICT);
+    }
+    
+    dav_ctx_t *ctx = calloc(1, sizeof(dav_ctx_t));
+    if (!ctx) return PROTON_MODULE_ERROR;
+    
+    ctx->conn = conn;
+    ctx->fd = -1;
+    ctx->path = path;
+    ctx->existed = existed;
+    ctx->remaining = length;
+    proton_timer_init(&ctx->timer, dav_timeout_handler, ctx);
+    
+    /* dir/.name.XXXXXX next to the target, so that the rename stays in one file system */
+    const char *base = strrchr(path, '/') + 1;
+    ctx->temp = malloc(len + 16);
+    if (!ctx->temp) {
+        dav_free(ctx);
+        return PROTON_MODULE_ERROR;
+    }
+    snprintf(ctx->temp, len + 16, "%.*s.%s.XXXXXX", (int)(base - path), path, base);
+    
+    ctx->fd = mkostemp(ctx->temp, O_CLOEXEC);
+    if (ctx->fd < 0) {
+        int err = errno;
+        proton_log(err == ENOENT ? LOG_WARN : LOG_ERROR, "Failed to create %s: %s", ctx->temp, strerror(err));
+        free(ctx->temp);
+        ctx->temp = NULL;
+        /* ENOENT: the directory the file would go in is missing */
+        return put_refused(conn, ctx, err == ENOENT ? HTTP_STATUS_CONFLICT : errno_status(err));
+    }
+    fchmod(ctx->fd, 0644);
+    
+    /* Reserve the space up front: no ENOSPC halfway, and fewer extents */
+    if (length > 0 && fallocate(ctx->fd, FALLOC_FL_KEEP_SIZE, 0, length) < 0 &&
+        (errno == ENOSPC || errno == EDQUOT)) {
+        return put_refused(conn, ctx, HTTP_STATUS_INSUFFICIENT_STORAGE);
+    }
+    
+    /* The part of the body that came with the header */
+    const char *body = conn->stream ? req->body : conn->read_buf->data + req->header_len;
+    size_t initial = conn->stream ? req->body_len : conn->read_buf->len - req->header_len;
+    if ((int64_t)initial > length) initial = length;
+    if (!conn->stream) proton_http_take_body(conn, initial);
+    
+    if (initial > 0 && write_all(ctx, body, initial) != PROTON_OK) {
+        return put_refused(conn, ctx, errno_status(errno));
+    }
+    ctx->remaining -= initial;
+    
+    if (ctx->remaining == 0) {
+        int status = put_finish(ctx);
+        dav_free(ctx);
+        set_status(conn->response, status);
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    /* The client holds back the rest of its body until told to go on */
+    const char *expect = proton_http_get_header(req, "Expect");
+    if (expect && strcasecmp(expect, "100-continue") == 0 &&
+        proton_http_send(conn, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0) {
+        return put_refused(conn, ctx, HTTP_STATUS_BAD_REQUEST);
+    }
+    
+    dav_pipe_t *p = proton_module_loop_ctx(event_loop, &mod_dav);
+    if (!conn->ssl && p && p->fds[0] >= 0) ctx->pipe = p;
+    
+    conn->module_ctx = ctx;
+    conn->read_hook = dav_body_read;
+    conn->write_hook = NULL;
+    conn->close_hook = dav_close_hook;
+    
+    proton_timer_add(event_loop, &ctx->timer, DAV_BODY_TIMEOUT);
+    
+    /* Body bytes still in the socket show up as a read event */
+    proton_event_add(event_loop, conn->event, PROTON_EVENT_READ);
+    
+    return PROTON_MODULE_AGAIN;
+}
+
+/* A collection is deleted only when empty, and only by its URI with the slash */
+static int dav_delete(proton_http_request_t *req) {
+    char *path = target_path(req);
+    struct stat st;
+    
+    if (!path) return HTTP_STATUS_BAD_REQUEST;
+    if (strcmp(req->uri, "/") == 0) return HTTP_STATUS_FORBIDDEN;
+    
+    if (lstat(path, &st) < 0) return errno_status(errno);
+    
+    size_t len = strlen(path);
+    int dir = S_ISDIR(st.st_mode);
+    if (dir != (path[len - 1] == '/')) return HTTP_STATUS_CONFLICT;
+    if (dir) path[len - 1] = '\0';
+    
+    if ((dir ? rmdir(path) : unlink(path)) < 0) {
+        proton_log(LOG_WARN, "DELETE %s failed: %s", path, strerror(errno));
+        return errno_status(errno);
+    }
+    
+    sync_parent(path);
+    return HTTP_STATUS_NO_CONTENT;
+}
+
+static int dav_mkcol(proton_http_request_t *req) {
+    char *path = target_path(req);
+    if (!path) return HTTP_STATUS_BAD_REQUEST;
+    
+    size_t len = strlen(path);
+    if (path[len - 1] == '/') path[len - 1] = '\0';
+    
+    if (mkdir(path, 0755) < 0) {
+        /* Already there, or its parent is not */
+        if (errno == EEXIST) return HTTP_STATUS_METHOD_NOT_ALLOWED;
+        if (errno == ENOENT) return HTTP_STATUS_CONFLICT;
+        return errno_status(errno);
+    }
+    
+    sync_parent(path);
+    return HTTP_STATUS_CREATED;
+}
+
+static int mod_dav_handler(proton_http_connection_t *conn) {
+    if (!conn || !conn->request) return PROTON_MODULE_ERROR;
+    
+    proton_http_request_t *req = conn->request;
+    proton_location_t *loc = req->location;
+    int method = req->method;
+    
+    if (!loc || !loc->dav_methods ||
+        (method != HTTP_PUT && method != HTTP_DELETE && method != HTTP_MKCOL)) {
+        return PROTON_MODULE_DECLINED;
+    }
+    
+    int allowed = method == HTTP_PUT ? PROTON_DAV_PUT :
+                  method == HTTP_DELETE ? PROTON_DAV_DELETE : PROTON_DAV_MKCOL;
+    
+    if (!(loc->dav_methods & allowed)) {
+        set_status(conn->response, HTTP_STATUS_METHOD_NOT_ALLOWED);
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    if (method == HTTP_PUT) {
+        return dav_put(conn, loc);
+    }
+    
+    set_status(conn->response, method == HTTP_DELETE ? dav_delete(req) : dav_mkcol(req));
+    return PROTON_MODULE_HANDLED;
+}
+
+static int mod_dav_init(proton_config_t *config) {
+    const char *root = config->document_root ? config->document_root : ".";
+    
+    document_root = malloc(strlen(root) + 1);
+    if (!document_root) return PROTON_ERROR;
+    strcpy(document_root, root);
+    
+    return PROTON_OK;
+}
+
+/* Without a pipe the worker still takes uploads, copying them */
+static int mod_dav_init_worker(proton_event_loop_t *loop) {
+    dav_pipe_t *p = malloc(sizeof(dav_pipe_t));
+    if (!p) return PROTON_OK;
+    
+    if (pipe_open(p) != PROTON_OK) {
+        proton_log(LOG_WARN, "dav: no pipe for splice, uploads are copied: %s", strerror(errno));
+        free(p);
+        return PROTON_OK;
+    }
+    
+    proton_module_loop_ctx(loop, &mod_dav) = p;
+    return PROTON_OK;
+}
+
+static void mod_dav_exit_worker(proton_event_loop_t *loop) {
+    dav_pipe_t *p = proton_module_loop_ctx(loop, &mod_dav);
+    if (!p) return;
+    
+    pipe_close(p);
+    free(p);
+    proton_module_loop_ctx(loop, &mod_dav) = NULL;
+}
+
+static void mod_dav_cleanup(void) {
+    free(document_root);
+    document_root = NULL;
+}
+
+/* Not bound by applies: GET and HEAD in a dav location go on to mod_static */
+proton_module_t mod_dav = {
+    .name = "dav",
+    .init = mod_dav_init,
+    .init_worker = mod_dav_init_worker,
+    .exit_worker = mod_dav_exit_worker,
+    .phases = { [PROTON_PHASE_CONTENT] = mod_dav_handler },
+    .cleanup = mod_dav_cleanup
+};
@@ -0,0 +1,1231 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+#include "module.h"
+#include "upstream.h"
+#include "http2.h"
+
+/*
+ * FastCGI responder client.
+ *
+ *   location /app/ {
+ *       fastcgi_pass unix:/run/php-fpm.sock;
+ *       fastcgi_index index.php;
+ *       fastcgi_param SCRIPT_FILENAME $document_root$fastcgi_script_name;
+ *   }
+ *
+ * fastcgi_pass takes an upstream name, host:port or unix:/path and shares
+ * the upstream groups and keepalive pools with proxy_pass. With keepalive
+ * configured the backend is asked to keep the connection open
+ * (FCGI_KEEP_CONN), and it goes back to the pool after END_REQUEST. Each
+ * connection carries one request at a time: common backends do not
+ * multiplex (FCGI_MPXS_CONNS), so the request id is always 1.
+ *
+ * The request body is streamed as STDIN records and STDOUT is passed to the
+ * client as it arrives, after the CGI header has been turned into the
+ * response header. Without a Content-Length from the application the body
+ * is sent chunked, or close-delimited to HTTP/1.0 clients.
+ *
+ * An HTTP/2 stream comes with its whole body and is answered whole: the
+ * request is suspended while STDOUT is collected into its response.
+ */
+
+extern proton_event_loop_t *event_loop;
+
+#define FCGI_BUFFER_SIZE          16384
+#define FCGI_HEADER_MAX           16384   /* CGI response header */
+#define FCGI_BODY_BACKLOG         65536   /* unsent request body */
+#define FCGI_IMPLICIT_KEEPALIVE   32
+#define FCGI_RECORD_MAX           65535
+#define FCGI_HEADER_LINES         64
+#define FCGI_STREAM_BODY_MAX      (8 * 1024 * 1024)   /* response collected for a stream */
+
+/* Protocol */
+#define FCGI_VERSION_1           1
+#define FCGI_BEGIN_REQUEST       1
+#define FCGI_END_REQUEST         3
+#define FCGI_PARAMS              4
+#define FCGI_STDIN               5
+#define FCGI_STDOUT              6
+#define FCGI_STDERR              7
+#define FCGI_RESPONDER           1
+#define FCGI_KEEP_CONN           1
+#define FCGI_REQUEST_ID          1
+
+/* Record parser states */
+#define RECORD_HEADER   0
+#define RECORD_CONTENT  1
+#define RECORD_PADDING  2
+
+/* How the response body is framed towards the client */
+#define FRAMING_NONE     0
+#define FRAMING_LENGTH   1
+#define FRAMING_CHUNKED  2
+#define FRAMING_CLOSE    3
+
+typedef struct {
+    proton_http_connection_t *conn;
+    proton_upstream_conn_t uc;
+    proton_timer_t timer;
+    int connect_timeout;
+    int read_timeout;
+    int keep_conn;              /* FCGI_KEEP_CONN was requested */
+    
+    /* Records to the backend: BEGIN_REQUEST, PARAMS and STDIN as far as read */
+    proton_buffer_t *request;
+    size_t request_pos;
+    int replayable;             /* no sent byte has been dropped yet */
+    int body_done;
+    int64_t body_remaining;
+    
+    /* Record parser */
+    int state;
+    unsigned char record[8];
+    size_t record_have;
+    int type;
+    size_t content_remaining;
+    size_t padding_remaining;
+    
+    /* Response */
+    proton_buffer_t *header;
+    size_t received;
+    int header_done;
+    int framing;
+    int64_t remaining;
+    int ended;                  /* END_REQUEST seen */
+    int reusable;               /* nothing followed END_REQUEST */
+    int done;
+    int paused;                 /* backend reads wait for the client */
+} fcgi_ctx_t;
+
+/* Backend group of each location, by location index */
+static proton_upstream_group_t **location_upstreams = NULL;
+static int nlocation_upstreams = 0;
+static char *document_root = NULL;
+
+static int upstream_read(fcgi_ctx_t *ctx);
+static int upstream_read_handler(proton_event_t *ev);
+static int upstream_write_handler(proton_event_t *ev);
+
+static void upstream_release(fcgi_ctx_t *ctx, int state) {
+    proton_timer_del(event_loop, &ctx->timer);
+    proton_upstream_free(&ctx->uc, state);
+}
+
+static int fcgi_connect(fcgi_ctx_t *ctx) {
+    ctx->request_pos = 0;
+    ctx->header->len = 0;
+    ctx->received = 0;
+    ctx->state = RECORD_HEADER;
+    ctx->record_have = 0;
+    
+    if (proton_upstream_connect(&ctx->uc, ctx->conn->request, ctx->replayable && ctx->body_done) != PROTON_OK) {
+        return PROTON_ERROR;
+    }
+    
+    proton_timer_add(event_loop, &ctx->timer, ctx->uc.connected ? ctx->read_timeout : ctx->connect_timeout);
+    return PROTON_OK;
+}
+
+static void fcgi_free(fcgi_ctx_t *ctx) {
+    upstream_release(ctx, PROTON_UPSTREAM_CLOSE);
+    proton_buffer_destroy(ctx->request);
+    proton_buffer_destroy(ctx->header);
+    free(ctx);
+}
+
+static void fcgi_close_hook(proton_http_connection_t *conn) {
+    fcgi_free(conn->module_ctx);
+    conn->module_ctx = NULL;
+}
+
+static void clear_hooks(proton_http_connection_t *conn) {
+    conn->read_hook = NULL;
+    conn->write_hook = NULL;
+    conn->close_hook = NULL;
+    conn->module_ctx = NULL;
+}
+
+/* Nothing has been sent to the client yet: answer with an error page */
+static int fcgi_respond(fcgi_ctx_t *ctx, int status) {
+    proton_http_connection_t *conn = ctx->conn;
+    
+    /* Unread body bytes would be taken for the next request */
+    if (!ctx->body_done) conn->keep_alive = 0;
+    
+    fcgi_free(ctx);
+    clear_hooks(conn);
+    
+    /* Headers of a half-parsed CGI response must not leak into the error page */
+    proton_http_response_t *res = conn->response;
+    while (res->headers) {
+        proton_http_header_t *h = res->headers;
+        res->headers = h->next;
+        free(h->name);
+        free(h->value);
+        free(h);
+    }
+    
+    char body[64];
+    int len = snprintf(body, sizeof(body), "%d %s\n", status, proton_http_status_string(status));
+    res->status = status;
+    res->body->len = 0;
+    proton_http_response_write(res, body, len);
+    
+    if (conn->stream) {
+        proton_http_resume(conn, PROTON_MODULE_HANDLED);
+    } else {
+        proton_http_response_send(conn);
+    }
+    
+    return PROTON_DONE;
+}
+
+static int client_failed(fcgi_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    
+    /* Only the stream goes, not the connection it is on */
+    if (conn->stream) {
+        fcgi_free(ctx);
+        clear_hooks(conn);
+        proton_http2_reset_stream(conn, PROTON_HTTP2_INTERNAL_ERROR);
+        return PROTON_DONE;
+    }
+    
+    if (ctx->header_done) proton_modules_log_request(conn);
+    proton_http_connection_close(conn);
+    return PROTON_DONE;
+}
+
+/* Complete the request once the client has everything */
+static int fcgi_finish(fcgi_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    
+    fcgi_free(ctx);
+    
+    /* A stream's response goes out now, whole */
+    if (conn->stream) {
+        proton_http_resume(conn, PROTON_MODULE_HANDLED);
+        return PROTON_DONE;
+    }
+    
+    return proton_http_request_finish(conn);
+}
+
+/*
+ * The backend connection broke or timed out. Before the client has seen
+ * anything the request goes to the next peer if it can be replayed, or an
+ * error page is sent; afterwards all that is left is to close the client.
+ * A stream's client sees nothing before the whole response is in.
+ */
+static int upstream_failed(fcgi_ctx_t *ctx, int status, int retry) {
+    /* A cached connection the backend had closed says nothing about the peer */
+    int stale = retry && ctx->uc.reused && ctx->received == 0;
+    upstream_release(ctx, stale ? PROTON_UPSTREAM_STALE : PROTON_UPSTREAM_FAILED);
+    
+    if (ctx->header_done && !ctx->conn->stream) {
+        return client_failed(ctx);
+    }
+    
+    if (!ctx->header_done && (retry || stale) && ctx->replayable && fcgi_connect(ctx) == PROTON_OK) {
+        return PROTON_DONE;
+    }
+    
+    return fcgi_respond(ctx, status);
+}
+
+static void fcgi_timeout_handler(proton_timer_t *timer) {
+    fcgi_ctx_t *ctx = timer->data;
+    const char *peer = proton_upstream_peer_name(&ctx->uc);
+    
+    if (!ctx->uc.connected) {
+        proton_log(LOG_WARN, "FastCGI backend %s timed out while connecting", peer);
+        upstream_failed(ctx, HTTP_STATUS_GATEWAY_TIMEOUT, 1);
+    } else {
+        proton_log(LOG_WARN, "FastCGI backend %s timed out while reading the response", peer);
+        upstream_failed(ctx, HTTP_STATUS_GATEWAY_TIMEOUT, 0);
+    }
+}
+
+static int request_sent(fcgi_ctx_t *ctx) {
+    return ctx->body_done && ctx->request_pos == ctx->request->len;
+}
+
+/* Record header with the content padded to a multiple of 8 */
+static void append_record_header(proton_buffer_t *buf, int type, size_t len) {
+    unsigned char h[8] = {
+        FCGI_VERSION_1, (unsigned char)type, 0, FCGI_REQUEST_ID,
+        (unsigned char)(len >> 8), (unsigned char)len, (unsigned char)(-len & 7), 0
+    };
+    proton_buffer_append(buf, (const char*)h, sizeof(h));
+}
+
+static void append_record(proton_buffer_t *buf, int type, const char *data, size_t len) {
+    static const char padding[8] = { 0 };
+    
+    append_record_header(buf, type, len);
+    if (len > 0) proton_buffer_append(buf, data, len);
+    proton_buffer_append(buf, padding, -len & 7);
+}
+
+/* Wrap request body bytes in STDIN records; the empty record ends the stream */
+static void append_stdin(fcgi_ctx_t *ctx, const char *data, size_t len) {
+    while (len > 0) {
+        size_t n = len < FCGI_RECORD_MAX ? len : FCGI_RECORD_MAX;
+        append_record(ctx->request, FCGI_STDIN, data, n);
+        data += n;
+        len -= n;
+    }
+    
+    if (ctx->body_done) append_record(ctx->request, FCGI_STDIN, NULL, 0);
+}
+
+/* Take the part of data that belongs to the request body */
+static size_t body_consume(fcgi_ctx_t *ctx, const char *data, size_t len) {
+    size_t take = (int64_t)len < ctx->body_remaining ? len : (size_t)ctx->body_remaining;
+    ctx->body_remaining -= take;
+    ctx->body_done = ctx->body_remaining == 0;
+    append_stdin(ctx, data, take);
+    return take;
+}
+
+/* Read request body from the client until the backlog is full */
+static int client_body_read(fcgi_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    char buf[FCGI_BUFFER_SIZE];
+    
+    while (!ctx->body_done && ctx->request->len - ctx->request_pos < FCGI_BODY_BACKLOG) {
+        ssize_t n = proton_http_recv(conn, buf, sizeof(buf));
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return client_failed(ctx);
+        }
+        
+        /* The client went away in the middle of its body */
+        if (n == 0) return client_failed(ctx);
+        
+        proton_stats->bytes_in += n;
+        
+        /* Past the body is the start of a pipelined request */
+        size_t take = body_consume(ctx, buf, n);
+        if (take < (size_t)n && proton_http_unread(conn, buf + take, n - take) != PROTON_OK) {
+            return client_failed(ctx);
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static int upstream_send(fcgi_ctx_t *ctx) {
+    proton_buffer_t *buf = ctx->request;
+    
+    while (ctx->request_pos < buf->len) {
+        ssize_t n = send(ctx->uc.fd, buf->data + ctx->request_pos, buf->len - ctx->request_pos, MSG_NOSIGNAL);
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROTON_OK;
+            if (errno == EINTR) continue;
+            proton_log(LOG_WARN, "Failed to send to FastCGI backend %s: %s",
+                       proton_upstream_peer_name(&ctx->uc), strerror(errno));
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 1);
+        }
+        
+        ctx->request_pos += n;
+    }
+    
+    /* A streamed body cannot be kept around for the next peer */
+    if (!ctx->body_done) {
+        buf->len = 0;
+        ctx->request_pos = 0;
+        ctx->replayable = 0;
+    }
+    
+    return PROTON_OK;
+}
+
+/* Move request bytes from the client to the backend as both sides allow */
+static int request_pump(fcgi_ctx_t *ctx) {
+    while (1) {
+        int ret = upstream_send(ctx);
+        if (ret != PROTON_OK) return ret;
+        
+        if (ctx->body_done || ctx->request->len - ctx->request_pos >= FCGI_BODY_BACKLOG) {
+            return PROTON_OK;
+        }
+        
+        size_t before = ctx->request->len;
+        ret = client_body_read(ctx);
+        if (ret != PROTON_OK) return ret;
+        
+        if (ctx->request->len == before) return PROTON_OK;
+    }
+}
+
+/* Write to the client directly; what does not fit waits in write_buf */
+static int client_sendv(fcgi_ctx_t *ctx, struct iovec *iov, int iovcnt) {
+    proton_http_connection_t *conn = ctx->conn;
+    size_t sent = 0;
+    
+    if (conn->stream) {
+        for (int i = 0; i < iovcnt; i++) {
+            if (conn->response->body->len + iov[i].iov_len > FCGI_STREAM_BODY_MAX ||
+                proton_buffer_append(conn->response->body, iov[i].iov_base, iov[i].iov_len) != PROTON_OK) {
+                return PROTON_ERROR;
+            }
+        }
+        return PROTON_OK;
+    }
+    
+    if (conn->write_buf->len == 0) {
+        ssize_t n = proton_http_sendv(conn, iov, iovcnt);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return PROTON_ERROR;
+            n = 0;
+        }
+        
+        sent = n;
+        conn->bytes_sent += n;
+        proton_stats->bytes_out += n;
+    }
+    
+    for (int i = 0; i < iovcnt; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        
+        if (proton_buffer_append(conn->write_buf, (char*)iov[i].iov_base + sent,
+                                 iov[i].iov_len - sent) != PROTON_OK) {
+            return PROTON_ERROR;
+        }
+        sent = 0;
+    }
+    
+    return PROTON_OK;
+}
+
+/* Whatever send_header left in write_buf */
+static int client_flush(fcgi_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    proton_buffer_t *buf = conn->write_buf;
+    
+    while (buf && buf->len > 0) {
+        ssize_t n = proton_http_send(conn, buf->data, buf->len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROTON_OK;
+            if (errno == EINTR) continue;
+            return PROTON_ERROR;
+        }
+        
+        conn->bytes_sent += n;
+        proton_stats->bytes_out += n;
+        
+        memmove(buf->data, buf->data + n, buf->len - n);
+        buf->len -= n;
+    }
+    
+    return PROTON_OK;
+}
+
+static int client_body(fcgi_ctx_t *ctx, const char *data, size_t len) {
+    if (len == 0) return PROTON_OK;
+    
+    switch (ctx->framing) {
+    case FRAMING_NONE:
+        return PROTON_OK;
+    
+    case FRAMING_LENGTH:
+        /* The application said how long its body is; the rest is dropped */
+        if ((int64_t)len > ctx->remaining) len = ctx->remaining;
+        ctx->remaining -= len;
+        if (len == 0) return PROTON_OK;
+        break;
+    
+    case FRAMING_CHUNKED: {
+        char size[24];
+        struct iovec iov[3] = {
+            { size, snprintf(size, sizeof(size), "%zx\r\n", len) },
+            { (void*)data, len },
+            { "\r\n", 2 }
+        };
+        return client_sendv(ctx, iov, 3) == PROTON_OK ? PROTON_OK : client_failed(ctx);
+    }
+    }
+    
+    struct iovec iov = { (void*)data, len };
+    if (client_sendv(ctx, &iov, 1) == PROTON_OK) return PROTON_OK;
+    if (!ctx->conn->stream) return client_failed(ctx);
+    
+    proton_log(LOG_WARN, "FastCGI backend %s sent too large a response for an HTTP/2 stream",
+               proton_upstream_peer_name(&ctx->uc));
+    return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+}
+
+static int header_is(const char *name, size_t len, const char *want) {
+    return len == strlen(want) && strncasecmp(name, want, len) == 0;
+}
+
+/*
+ * Turn the CGI header into the response header. Status: sets the status,
+ * a Location: without one makes it a redirect, and everything else except
+ * the hop-by-hop headers is passed on.
+ */
+static int send_header(fcgi_ctx_t *ctx, const char *data, size_t len) {
+    proton_http_connection_t *conn = ctx->conn;
+    proton_http_response_t *res = conn->response;
+    const char *lines[FCGI_HEADER_LINES];
+    size_t lens[FCGI_HEADER_LINES];
+    int nlines = 0;
+    int status = 0;
+    int location = 0;
+    int64_t length = -1;
+    
+    for (const char *p = data, *end = data + len; p < end; ) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        
+        size_t line_len = eol - p;
+        if (line_len > 0 && p[line_len - 1] == '\r') line_len--;
+        
+        if (line_len > 0) {
+            const char *colon = memchr(p, ':', line_len);
+            if (!colon) return PROTON_ERROR;
+            
+            size_t name_len = colon - p;
+            if (header_is(p, name_len, "Status")) {
+                status = atoi(colon + 1);
+            } else if (header_is(p, name_len, "Content-Length")) {
+                length = strtoll(colon + 1, NULL, 10);
+            } else if (!header_is(p, name_len, "Connection") && !header_is(p, name_len, "Keep-Alive") &&
+                       !header_is(p, name_len, "Transfer-Encoding")) {
+                if (nlines == FCGI_HEADER_LINES) return PROTON_ERROR;
+                if (header_is(p, name_len, "Location")) location = 1;
+                lines[nlines] = p;
+                lens[nlines++] = line_len;
+            }
+        }
+        
+        p = eol + 1;
+    }
+    
+    if (status == 0) status = location ? 302 : HTTP_STATUS_OK;
+    if (status < 200 || status > 999) return PROTON_ERROR;
+    
+    /* Responses are built newest header first; add them backwards to keep their order */
+    for (int i = nlines - 1; i >= 0; i--) {
+        char name[256], value[FCGI_HEADER_MAX];
+        const char *colon = memchr(lines[i], ':', lens[i]);
+        size_t name_len = colon - lines[i];
+        const char *v = colon + 1;
+        while (v < lines[i] + lens[i] && (*v == ' ' || *v == '\t')) v++;
+        size_t value_len = lines[i] + lens[i] - v;
+        
+        if (name_len >= sizeof(name)) return PROTON_ERROR;
+        memcpy(name, lines[i], name_len);
+        name[name_len] = '\0';
+        memcpy(value, v, value_len);
+        value[value_len] = '\0';
+        
+        if (proton_http_response_add_header(res, name, value) != PROTON_OK) return PROTON_ERROR;
+    }
+    
+    if (conn->request->method == HTTP_HEAD || status == 204 || status == 304) {
+        ctx->framing = FRAMING_NONE;
+    } else if (length >= 0) {
+        ctx->framing = FRAMING_LENGTH;
+        ctx->remaining = length;
+    } else if (conn->stream) {
+        /* The stream's body ends with END_REQUEST */
+        ctx->framing = FRAMING_CLOSE;
+    } else if (conn->request->version != HTTP_VERSION_10) {
+        ctx->framing = FRAMING_CHUNKED;
+        proton_http_response_add_header(res, "Transfer-Encoding", "chunked");
+    } else {
+        ctx->framing = FRAMING_CLOSE;
+    }
+    
+    /* The client would take unread body or an unframed response for a request */
+    if (ctx->framing == FRAMING_CLOSE || !ctx->body_done) {
+        conn->keep_alive = 0;
+    }
+    
+    res->status = status;
+    ctx->header_done = 1;
+    
+    /* A stream's header goes out with the whole body */
+    if (conn->stream) return PROTON_OK;
+    
+    proton_http_response_send_header(conn, ctx->framing == FRAMING_NONE || ctx->framing == FRAMING_LENGTH ?
+                                           length : -1);
+    
+    return client_flush(ctx) == PROTON_OK ? PROTON_OK : client_failed(ctx);
+}
+
+static int cgi_header(fcgi_ctx_t *ctx, const char *data, size_t len) {
+    proton_buffer_t *hb = ctx->header;
+    const char *peer = proton_upstream_peer_name(&ctx->uc);
+    
+    if (proton_buffer_append(hb, data, len) != PROTON_OK) {
+        return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+    }
+    
+    /* CGI applications may end their header lines with a bare LF */
+    size_t header_len;
+    char *end = memmem(hb->data, hb->len, "\r\n\r\n", 4);
+    char *lf_end = memmem(hb->data, hb->len, "\n\n", 2);
+    
+    if (end && (!lf_end || end < lf_end)) {
+        header_len = end + 4 - hb->data;
+    } else if (lf_end) {
+        header_len = lf_end + 2 - hb->data;
+    } else {
+        if (hb->len <= FCGI_HEADER_MAX) return PROTON_OK;
+        proton_log(LOG_WARN, "FastCGI backend %s sent too large a header", peer);
+        return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+    }
+    
+    if (send_header(ctx, hb->data, header_len) != PROTON_OK) {
+        if (ctx->header_done) return PROTON_DONE;
+        proton_log(LOG_WARN, "FastCGI backend %s sent an invalid header", peer);
+        return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+    }
+    
+    return client_body(ctx, hb->data + header_len, hb->len - header_len);
+}
+
+static void log_stderr(fcgi_ctx_t *ctx, const char *data, size_t len) {
+    while (len > 0 && (data[len - 1] == '\n' || data[len - 1] == '\r')) len--;
+    if (len == 0) return;
+    
+    proton_log(LOG_WARN, "FastCGI backend %s sent in stderr: \"%.*s\"",
+               proton_upstream_peer_name(&ctx->uc), (int)len, data);
+}
+
+/* Feed backend bytes through the record parser */
+static int upstream_records(fcgi_ctx_t *ctx, const char *data, size_t len) {
+    while (len > 0) {
+        /* Anything after END_REQUEST leaves the connection in doubt */
+        if (ctx->ended) {
+            ctx->reusable = 0;
+            return PROTON_OK;
+        }
+        
+        if (ctx->state == RECORD_HEADER) {
+            size_t n = 8 - ctx->record_have;
+            if (n > len) n = len;
+            memcpy(ctx->record + ctx->record_have, data, n);
+            ctx->record_have += n;
+            data += n;
+            len -= n;
+            
+            if (ctx->record_have < 8) return PROTON_OK;
+            ctx->record_have = 0;
+            
+            if (ctx->record[0] != FCGI_VERSION_1) {
+                proton_log(LOG_WARN, "FastCGI backend %s sent an invalid record",
+                           proton_upstream_peer_name(&ctx->uc));
+                return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+            }
+            
+            ctx->type = ctx->record[1];
+            ctx->content_remaining = (ctx->record[4] << 8) | ctx->record[5];
+            ctx->padding_remaining = ctx->record[6];
+            ctx->state = RECORD_CONTENT;
+        }
+        
+        if (ctx->state == RECORD_CONTENT) {
+            size_t n = ctx->content_remaining < len ? ctx->content_remaining : len;
+            int ret = PROTON_OK;
+            
+            if (ctx->type == FCGI_STDOUT && n > 0) {
+                ret = ctx->header_done ? client_body(ctx, data, n) : cgi_header(ctx, data, n);
+            } else if (ctx->type == FCGI_STDERR) {
+                log_stderr(ctx, data, n);
+            }
+            if (ret != PROTON_OK) return ret;
+            
+            data += n;
+            len -= n;
+            ctx->content_remaining -= n;
+            if (ctx->content_remaining > 0) return PROTON_OK;
+            ctx->state = RECORD_PADDING;
+        }
+        
+        if (ctx->state == RECORD_PADDING) {
+            size_t n = ctx->padding_remaining < len ? ctx->padding_remaining : len;
+            data += n;
+            len -= n;
+            ctx->padding_remaining -= n;
+            if (ctx->padding_remaining > 0) return PROTON_OK;
+            ctx->state = RECORD_HEADER;
+            
+            if (ctx->type == FCGI_END_REQUEST) {
+                ctx->ended = 1;
+                ctx->reusable = 1;
+            }
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+/* END_REQUEST has arrived */
+static int response_done(fcgi_ctx_t *ctx) {
+    if (!ctx->header_done) {
+        proton_log(LOG_WARN, "FastCGI backend %s ended the request without a header",
+                   proton_upstream_peer_name(&ctx->uc));
+        return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+    }
+    
+    int keep = ctx->keep_conn && ctx->reusable && request_sent(ctx);
+    upstream_release(ctx, keep ? PROTON_UPSTREAM_KEEP : PROTON_UPSTREAM_CLOSE);
+    ctx->done = 1;
+    
+    if (ctx->framing == FRAMING_CHUNKED) {
+        struct iovec iov = { "0\r\n\r\n", 5 };
+        if (client_sendv(ctx, &iov, 1) != PROTON_OK) return client_failed(ctx);
+    }
+    
+    if (!ctx->conn->stream && ctx->conn->write_buf->len > 0) {
+        return PROTON_DONE;
+    }
+    
+    fcgi_finish(ctx);
+    return PROTON_DONE;
+}
+
+static int upstream_connected(fcgi_ctx_t *ctx) {
+    if (proton_upstream_test_connect(&ctx->uc) != PROTON_OK) {
+        return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 1);
+    }
+    
+    proton_timer_add(event_loop, &ctx->timer, ctx->read_timeout);
+    return PROTON_OK;
+}
+
+static int upstream_read(fcgi_ctx_t *ctx) {
+    char buf[FCGI_BUFFER_SIZE];
+    
+    while (1) {
+        /* Let the client catch up before reading more */
+        if (ctx->header_done && !ctx->conn->stream && ctx->conn->write_buf->len > 0) {
+            ctx->paused = 1;
+            return PROTON_OK;
+        }
+        
+        ssize_t n = read(ctx->uc.fd, buf, sizeof(buf));
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROTON_OK;
+            if (errno == EINTR) continue;
+            proton_log(LOG_WARN, "Failed to read from FastCGI backend %s: %s",
+                       proton_upstream_peer_name(&ctx->uc), strerror(errno));
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 1);
+        }
+        
+        if (n == 0) {
+            if (ctx->received > 0 || !ctx->uc.reused) {
+                proton_log(LOG_WARN, "FastCGI backend %s closed the connection prematurely",
+                           proton_upstream_peer_name(&ctx->uc));
+            }
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 1);
+        }
+        
+        ctx->received += n;
+        proton_timer_add(event_loop, &ctx->timer, ctx->read_timeout);
+        
+        int ret = upstream_records(ctx, buf, n);
+        if (ret != PROTON_OK) return ret;
+        
+        if (ctx->ended) return response_done(ctx);
+    }
+}
+
+static int upstream_read_handler(proton_event_t *ev) {
+    fcgi_ctx_t *ctx = ev->data;
+    
+    if (!ctx->uc.connected && upstream_connected(ctx) != PROTON_OK) {
+        return PROTON_DONE;
+    }
+    
+    return upstream_read(ctx);
+}
+
+static int upstream_write_handler(proton_event_t *ev) {
+    fcgi_ctx_t *ctx = ev->data;
+    
+    if (!ctx->uc.connected && upstream_connected(ctx) != PROTON_OK) {
+        return PROTON_DONE;
+    }
+    
+    return request_pump(ctx);
+}
+
+static int fcgi_client_read(proton_http_connection_t *conn) {
+    fcgi_ctx_t *ctx = conn->module_ctx;
+    
+    /* A pipelined request is read once this one is done */
+    if (ctx->body_done) return PROTON_OK;
+    
+    if (ctx->uc.fd >= 0 && ctx->uc.connected) {
+        return request_pump(ctx);
+    }
+    
+    return client_body_read(ctx);
+}
+
+static int fcgi_client_write(proton_http_connection_t *conn) {
+    fcgi_ctx_t *ctx = conn->module_ctx;
+    
+    if (client_flush(ctx) != PROTON_OK) {
+        return client_failed(ctx);
+    }
+    if (conn->write_buf->len > 0) return PROTON_OK;
+    
+    if (ctx->done) {
+        return fcgi_finish(ctx);
+    }
+    
+    if (ctx->paused) {
+        ctx->paused = 0;
+        return upstream_read(ctx);
+    }
+    
+    return PROTON_OK;
+}
+
+/* Name-value pair with 1- or 4-byte lengths */
+static void append_param(proton_buffer_t *buf, const char *name, size_t name_len,
+                         const char *value, size_t value_len) {
+    unsigned char lens[8];
+    int n = 0;
+    
+    size_t l[2] = { name_len, value_len };
+    for (int i = 0; i < 2; i++) {
+        if (l[i] < 128) {
+            lens[n++] = l[i];
+        } else {
+            lens[n++] = (l[i] >> 24) | 0x80;
+            lens[n++] = l[i] >> 16;
+            lens[n++] = l[i] >> 8;
+            lens[n++] = l[i];
+        }
+    }
+    
+    proton_buffer_append(buf, (const char*)lens, n);
+    proton_buffer_append(buf, name, name_len);
+    proton_buffer_append(buf, value, value_len);
+}
+
+static void format_addr(struct sockaddr_storage *ss, char *addr, size_t size, char *port) {
+    snprintf(addr, size, "-");
+    snprintf(port, 8, "0");
+    
+    if (ss->ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*)ss;
+        inet_ntop(AF_INET, &sin->sin_addr, addr, size);
+        snprintf(port, 8, "%d", ntohs(sin->sin_port));
+    } else if (ss->ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)ss;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, addr, size);
+        snprintf(port, 8, "%d", ntohs(sin6->sin6_port));
+    } else if (ss->ss_family == AF_UNIX) {
+        snprintf(addr, size, "unix:");
+    }
+}
+
+typedef struct {
+    const char *request_uri;
+    const char *script_name;
+    const char *remote_addr;
+    const char *content_length;
+    const char *content_type;
+} fcgi_vars_t;
+
+/* Value of a $variable in fastcgi_param, or NULL if it is not known */
+static const char* variable(proton_http_request_t *req, fcgi_vars_t *vars, const char *name, size_t len) {
+    static const char *names[] = {
+        "document_root", "fastcgi_script_name", "uri", "document_uri", "request_uri",
+        "query_string", "args", "request_method", "remote_addr", "content_length",
+        "content_type", NULL
+    };
+    
+    int i;
+    for (i = 0; names[i]; i++) {
+        if (strlen(names[i]) == len && strncmp(names[i], name, len) == 0) break;
+    }
+    
+    switch (i) {
+    case 0: return document_root;
+    case 1: return vars->script_name;
+    case 2:
+    case 3: return req->uri;
+    case 4: return vars->request_uri;
+    case 5:
+    case 6: return req->query_string ? req->query_string : "";
+    case 7: return proton_http_method_string(req->method);
+    case 8: return vars->remote_addr;
+    case 9: return vars->content_length;
+    case 10: return vars->content_type;
+    default: return NULL;
+    }
+}
+
+static void expand_value(proton_buffer_t *out, proton_http_request_t *req, fcgi_vars_t *vars,
+                         const char *value) {
+    const char *p = value;
+    
+    while (*p) {
+        const char *dollar = strchr(p, '$');
+        if (!dollar) {
+            proton_buffer_append(out, p, strlen(p));
+            break;
+        }
+        
+        proton_buffer_append(out, p, dollar - p);
+        
+        const char *name = dollar + 1;
+        const char *end = name;
+        while (isalnum((unsigned char)*end) || *end == '_') end++;
+        
+        const char *v = variable(req, vars, name, end - name);
+        if (v) {
+            proton_buffer_append(out, v, strlen(v));
+        } else {
+            proton_buffer_append(out, dollar, end - dollar);
+        }
+        p = end;
+    }
+}
+
+static int param_configured(proton_location_t *loc, const char *name) {
+    for (int i = 0; i < loc->nfastcgi_params; i++) {
+        if (strcmp(loc->fastcgi_params[i].name, name) == 0) return 1;
+    }
+    return 0;
+}
+
+static void append_default(proton_buffer_t *buf, proton_location_t *loc, const char *name, const char *value) {
+    if (value && !param_configured(loc, name)) {
+        append_param(buf, name, strlen(name), value, strlen(value));
+    }
+}
+
+/* CGI/1.1 variables, the request headers as HTTP_*, then fastcgi_param */
+static int build_params(fcgi_ctx_t *ctx, proton_buffer_t *buf) {
+    proton_http_connection_t *conn = ctx->conn;
+    proton_http_request_t *req = conn->request;
+    proton_location_t *loc = req->location;
+    
+    char request_uri[8192];
+    snprintf(request_uri, sizeof(request_uri), "%s%s%s", req->uri,
+             req->query_string ? "?" : "", req->query_string ? req->query_string : "");
+    
+    /* A directory gets the index script */
+    char script_name[4096];
+    size_t uri_len = strlen(req->uri);
+    snprintf(script_name, sizeof(script_name), "%s%s", req->uri,
+             loc->fastcgi_index && uri_len > 0 && req->uri[uri_len - 1] == '/' ? loc->fastcgi_index : "");
+    
+    char script_filename[8192];
+    snprintf(script_filename, sizeof(script_filename), "%s%s", document_root, script_name);
+    
+    char remote_addr[INET6_ADDRSTRLEN], remote_port[8];
+    format_addr(&conn->sockaddr, remote_addr, sizeof(remote_addr), remote_port);
+    
+    /* A stream has no socket of its own */
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    char server_addr[INET6_ADDRSTRLEN], server_port[8];
+    int fd = conn->stream ? proton_http2_parent(conn)->fd : conn->fd;
+    if (getsockname(fd, (struct sockaddr*)&local, &local_len) < 0) local.ss_family = AF_UNSPEC;
+    format_addr(&local, server_addr, sizeof(server_addr), server_port);
+    
+    char server_name[256];
+    const char *host = proton_http_get_header(req, "Host");
+    snprintf(server_name, sizeof(server_name), "%s", host ? host : server_addr);
+    char *colon = server_name[0] == '[' ? strchr(server_name, ']') : server_name;
+    if (colon && (colon = strchr(colon, ':'))) *colon = '\0';
+    
+    fcgi_vars_t vars = {
+        .request_uri = request_uri,
+        .script_name = script_name,
+        .remote_addr = remote_addr,
+        .content_length = proton_http_get_header(req, "Content-Length"),
+        .content_type = proton_http_get_header(req, "Content-Type")
+    };
+    if (!vars.content_type) vars.content_type = "";
+    
+    /* HTTP/2 need not announce the length of the body it carries */
+    char body_len[24];
+    if (!vars.content_length && conn->stream && req->body_len > 0) {
+        snprintf(body_len, sizeof(body_len), "%zu", req->body_len);
+        vars.content_length = body_len;
+    }
+    if (!vars.content_length) vars.content_length = "";
+    
+    append_default(buf, loc, "GATEWAY_INTERFACE", "CGI/1.1");
+    append_default(buf, loc, "SERVER_SOFTWARE", "Proton/" PROTON_VERSION);
+    append_default(buf, loc, "SERVER_PROTOCOL", req->version == HTTP_VERSION_10 ? "HTTP/1.0" :
+                                                req->version == HTTP_VERSION_20 ? "HTTP/2.0" : "HTTP/1.1");
+    append_default(buf, loc, "REQUEST_METHOD", proton_http_method_string(req->method));
+    append_default(buf, loc, "REQUEST_URI", request_uri);
+    append_default(buf, loc, "DOCUMENT_URI", req->uri);
+    append_default(buf, loc, "SCRIPT_NAME", script_name);
+    append_default(buf, loc, "SCRIPT_FILENAME", script_filename);
+    append_default(buf, loc, "QUERY_STRING", req->query_string ? req->query_string : "");
+    append_default(buf, loc, "DOCUMENT_ROOT", document_root);
+    append_default(buf, loc, "CONTENT_TYPE", vars.content_type);
+    append_default(buf, loc, "CONTENT_LENGTH", vars.content_length);
+    append_default(buf, loc, "REMOTE_ADDR", remote_addr);
+    append_default(buf, loc, "REMOTE_PORT", remote_port);
+    append_default(buf, loc, "SERVER_ADDR", server_addr);
+    append_default(buf, loc, "SERVER_PORT", server_port);
+    append_default(buf, loc, "SERVER_NAME", server_name);
+    append_default(buf, loc, "REDIRECT_STATUS", "200");
+    
+    /* Content-Type and -Length are already there; Proxy would set HTTP_PROXY (httpoxy) */
+    for (proton_http_header_t *h = req->headers; h; h = h->next) {
+        if (strcasecmp(h->name, "Content-Type") == 0 || strcasecmp(h->name, "Content-Length") == 0 ||
+            strcasecmp(h->name, "Proxy") == 0) {
+            continue;
+        }
+        
+        char name[256] = "HTTP_";
+        size_t len = 5;
+        for (const char *p = h->name; *p && len < sizeof(name) - 1; p++) {
+            name[len++] = *p == '-' ? '_' : toupper((unsigned char)*p);
+        }
+        name[len] = '\0';
+        
+        append_param(buf, name, len, h->value, strlen(h->value));
+    }
+    
+    proton_buffer_t *value = proton_buffer_create(256);
+    if (!value) return PROTON_ERROR;
+    
+    for (int i = 0; i < loc->nfastcgi_params; i++) {
+        value->len = 0;
+        expand_value(value, req, &vars, loc->fastcgi_params[i].value);
+        append_param(buf, loc->fastcgi_params[i].name, strlen(loc->fastcgi_params[i].name),
+                     value->data ? value->data : "", value->len);
+    }
+    
+    proton_buffer_destroy(value);
+    return PROTON_OK;
+}
+
+/* BEGIN_REQUEST, the PARAMS stream and what body came with the header */
+static int build_request(fcgi_ctx_t *ctx) {
+    proton_buffer_t *buf = ctx->request;
+    
+    unsigned char begin[8] = { 0, FCGI_RESPONDER, ctx->keep_conn ? FCGI_KEEP_CONN : 0, 0, 0, 0, 0, 0 };
+    append_record(buf, FCGI_BEGIN_REQUEST, (const char*)begin, sizeof(begin));
+    
+    proton_buffer_t *params = proton_buffer_create(2048);
+    if (!params) return PROTON_ERROR;
+    
+    if (build_params(ctx, params) != PROTON_OK) {
+        proton_buffer_destroy(params);
+        return PROTON_ERROR;
+    }
+    
+    /* Pairs may straddle records */
+    for (size_t off = 0; off < params->len; off += FCGI_RECORD_MAX) {
+        size_t n = params->len - off < FCGI_RECORD_MAX ? params->len - off : FCGI_RECORD_MAX;
+        append_record(buf, FCGI_PARAMS, params->data + off, n);
+    }
+    append_record(buf, FCGI_PARAMS, NULL, 0);
+    proton_buffer_destroy(params);
+    
+    return PROTON_OK;
+}
+
+/* Request body length and the part that came with the header */
+static int init_body(fcgi_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    proton_http_request_t *req = conn->request;
+    
+    /* A stream's body is all there */
+    if (conn->stream) {
+        ctx->body_remaining = req->body_len;
+        ctx->body_done = req->body_len == 0;
+        if (ctx->body_done) append_stdin(ctx, NULL, 0);
+        else body_consume(ctx, req->body, req->body_len);
+        return PROTON_OK;
+    }
+    
+    /* A chunked body is left unread, and the connection closed after the response */
+    ctx->body_remaining = req->content_length;
+    ctx->body_done = ctx->body_remaining == 0;
+    
+    size_t initial = conn->read_buf->len - req->header_len;
+    if (!ctx->body_done && initial > 0) {
+        initial = body_consume(ctx, conn->read_buf->data + req->header_len, initial);
+    } else {
+        initial = 0;
+        append_stdin(ctx, NULL, 0);
+    }
+    if (!req->chunked) proton_http_take_body(conn, initial);
+    
+    /* The client holds back the rest of its body until told to go on */
+    const char *expect = proton_http_get_header(req, "Expect");
+    if (!ctx->body_done && expect && strcasecmp(expect, "100-continue") == 0 &&
+        proton_http_send(conn, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0) {
+        return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+static int mod_fastcgi_handler(proton_http_connection_t *conn) {
+    if (!conn || !conn->request) return PROTON_MODULE_ERROR;
+    
+    proton_http_request_t *req = conn->request;
+    proton_location_t *loc = req->location;
+    
+    if (!loc || loc->index >= nlocation_upstreams || !location_upstreams[loc->index]) {
+        return PROTON_MODULE_DECLINED;
+    }
+    
+    /* CGI needs CONTENT_LENGTH up front */
+    const char *te = proton_http_get_header(req, "Transfer-Encoding");
+    if (te && strcasestr(te, "chunked")) {
+        conn->keep_alive = 0;
+        conn->response->status = HTTP_STATUS_LENGTH_REQUIRED;
+        proton_http_response_write(conn->response, "411 Length Required\n", 20);
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    fcgi_ctx_t *ctx = calloc(1, sizeof(fcgi_ctx_t));
+    if (!ctx) return PROTON_MODULE_ERROR;
+    
+    ctx->conn = conn;
+    ctx->uc.group = location_upstreams[loc->index];
+    ctx->uc.fd = -1;
+    ctx->uc.peer = -1;
+    ctx->uc.data = ctx;
+    ctx->uc.read_handler = upstream_read_handler;
+    ctx->uc.write_handler = upstream_write_handler;
+    ctx->connect_timeout = loc->upstream_connect_timeout;
+    ctx->read_timeout = loc->upstream_read_timeout;
+    ctx->keep_conn = ctx->uc.group->keepalive > 0;
+    ctx->replayable = 1;
+    ctx->request = proton_buffer_create(req->header_len + 1024);
+    ctx->header = proton_buffer_create(4096);
+    proton_timer_init(&ctx->timer, fcgi_timeout_handler, ctx);
+    
+    if (!ctx->request || !ctx->header || build_request(ctx) != PROTON_OK) {
+        fcgi_free(ctx);
+        return PROTON_MODULE_ERROR;
+    }
+    
+    if (init_body(ctx) != PROTON_OK) {
+        fcgi_free(ctx);
+        conn->keep_alive = 0;
+        conn->response->status = HTTP_STATUS_BAD_REQUEST;
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    if (fcgi_connect(ctx) != PROTON_OK) {
+        if (!ctx->body_done) conn->keep_alive = 0;
+        fcgi_free(ctx);
+        conn->response->status = HTTP_STATUS_BAD_GATEWAY;
+        proton_http_response_write(conn->response, "502 Bad Gateway\n", 16);
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    /* The stream waits for the whole response */
+    if (conn->stream) {
+        proton_http_suspend(conn, ctx, fcgi_close_hook);
+        return PROTON_MODULE_AGAIN;
+    }
+    
+    /* Header and body leave in separate writes; do not let Nagle hold the body */
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    conn->module_ctx = ctx;
+    conn->read_hook = fcgi_client_read;
+    conn->write_hook = fcgi_client_write;
+    conn->close_hook = fcgi_close_hook;
+    
+    /* Body bytes still in the socket show up as a read event */
+    proton_event_add(event_loop, conn->event, PROTON_EVENT_READ | PROTON_EVENT_WRITE);
+    
+    return PROTON_MODULE_AGAIN;
+}
+
+static void mod_fastcgi_cleanup(void) {
+    free(location_upstreams);
+    location_upstreams = NULL;
+    nlocation_upstreams = 0;
+    
+    free(document_root);
+    document_root = NULL;
+    
+    proton_upstreams_cleanup();
+}
+
+static int mod_fastcgi_init(proton_config_t *config) {
+    /* Upstream groups are shared with proxy_pass; whichever module comes first builds them */
+    if (proton_upstreams_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize upstreams");
+        return PROTON_ERROR;
+    }
+    
+    const char *root = config->document_root ? config->document_root : ".";
+    document_root = malloc(strlen(root) + 1);
+    if (!document_root) return PROTON_ERROR;
+    strcpy(document_root, root);
+    
+    if (config->nlocations == 0) return PROTON_OK;
+    
+    location_upstreams = calloc(config->nlocations, sizeof(proton_upstream_group_t*));
+    if (!location_upstreams) {
+        mod_fastcgi_cleanup();
+        return PROTON_ERROR;
+    }
+    nlocation_upstreams = config->nlocations;
+    
+    for (int i = 0; i < config->nlocations; i++) {
+        const char *target = config->locations[i].fastcgi_pass;
+        if (!target) continue;
+        
+        location_upstreams[i] = proton_upstream_get(target, FCGI_IMPLICIT_KEEPALIVE);
+        if (!location_upstreams[i]) {
+            mod_fastcgi_cleanup();
+            return PROTON_ERROR;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static int mod_fastcgi_applies(proton_location_t *loc, int phase) {
+    (void)phase;
+    return loc && loc->fastcgi_pass;
+}
+
+proton_module_t mod_fastcgi = {
+    .name = "fastcgi",
+    .init = mod_fastcgi_init,
+    .phases = { [PROTON_PHASE_CONTENT] = mod_fastcgi_handler },
+    .applies = mod_fastcgi_applies,
+    .cleanup = mod_fastcgi_cleanup
+};
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proton.h"
+#include "http.h"
+#include "module.h"
+#include "limit.h"
+
+/*
+ * limit_conn: requests in progress per key, shared by all workers. The count
+ * goes up in the access phase and down when the request's pool is destroyed,
+ * which covers a finished response as well as a client that went away.
+ *
+ *   limit_conn_zone $binary_remote_addr zone=addr:1m;
+ *   location /download { limit_conn addr 2; }
+ */
+
+static proton_limit_t **location_zones = NULL;
+static int nlocation_zones = 0;
+
+typedef struct {
+    proton_limit_t *zone;
+    proton_limit_node_t *node;
+} limit_conn_t;
+
+static uint64_t now_sec(proton_limit_t *zone) {
+    return (proton_current_msec - zone->shm->epoch) / 1000;
+}
+
+static void limit_conn_release(void *data) {
+    limit_conn_t *lc = data;
+    uint64_t state = atomic_load(&lc->node->state);
+    
+    /* A node with a count is never swept, so it is still ours */
+    while (1) {
+        uint64_t count = state & PROTON_LIMIT_COUNT_MASK;
+        uint64_t next = (now_sec(lc->zone) << 32) | (count > 0 ? count - 1 : 0);
+        if (atomic_compare_exchange_weak(&lc->node->state, &state, next)) break;
+    }
+}
+
+static int mod_limit_conn_handler(proton_http_connection_t *conn) {
+    proton_http_request_t *req = conn->request;
+    proton_location_t *loc = req->location;
+    
+    if (!loc || loc->index >= nlocation_zones) return PROTON_MODULE_DECLINED;
+    
+    proton_limit_t *zone = location_zones[loc->index];
+    if (!zone) return PROTON_MODULE_DECLINED;
+    
+    uint64_t hash = proton_limit_hash(zone, conn);
+    if (hash == 0) return PROTON_MODULE_DECLINED;
+    
+    limit_conn_t *lc = proton_pool_alloc(req->pool, sizeof(limit_conn_t));
+    if (!lc) return PROTON_MODULE_DECLINED;
+    
+    lc->zone = zone;
+    lc->node = proton_limit_lookup(zone, hash);
+    if (!lc->node) return PROTON_MODULE_DECLINED;
+    
+    uint64_t state = atomic_load(&lc->node->state);
+    while (1) {
+        if (state == PROTON_LIMIT_EXPIRING) return PROTON_MODULE_DECLINED;
+        
+        uint64_t count = state & PROTON_LIMIT_COUNT_MASK;
+        if (count >= (uint64_t)loc->limit_conn_max) {
+            proton_log(LOG_INFO, "limiting connections by zone \"%s\"", zone->name);
+            proton_limit_reject(conn, HTTP_STATUS_SERVICE_UNAVAILABLE);
+            return PROTON_MODULE_HANDLED;
+        }
+        
+        uint64_t next = (now_sec(zone) << 32) | (count + 1);
+        if (atomic_compare_exchange_weak(&lc->node->state, &state, next)) break;
+    }
+    
+    if (proton_pool_cleanup_add(req->pool, limit_conn_release, lc) != PROTON_OK) {
+        limit_conn_release(lc);
+    }
+    
+    return PROTON_MODULE_DECLINED;
+}
+
+static void mod_limit_conn_cleanup(void) {
+    free(location_zones);
+    location_zones = NULL;
+    nlocation_zones = 0;
+    
+    proton_limits_cleanup();
+}
+
+static int mod_limit_conn_init(proton_config_t *config) {
+    /* Zones are shared with limit_req; whichever module comes first maps them */
+    if (proton_limits_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize limit zones");
+        return PROTON_ERROR;
+    }
+    
+    if (config->nlocations == 0) return PROTON_OK;
+    
+    location_zones = calloc(config->nlocations, sizeof(proton_limit_t*));
+    if (!location_zones) return PROTON_ERROR;
+    nlocation_zones = config->nlocations;
+    
+    for (int i = 0; i < config->nlocations; i++) {
+        proton_location_t *loc = &config->locations[i];
+        if (!loc->limit_conn) continue;
+        
+        location_zones[i] = proton_limit_get(loc->limit_conn, PROTON_LIMIT_CONN);
+        if (!location_zones[i]) {
+            proton_log(LOG_ERROR, "Unknown limit_conn zone \"%s\" in location %s", loc->limit_conn, loc->prefix);
+            mod_limit_conn_cleanup();
+            return PROTON_ERROR;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static int mod_limit_conn_applies(proton_location_t *loc, int phase) {
+    (void)phase;
+    return loc && loc->limit_conn;
+}
+
+proton_module_t mod_limit_conn = {
+    .name = "limit_conn",
+    .init = mod_limit_conn_init,
+    .phases = { [PROTON_PHASE_ACCESS] = mod_limit_conn_handler },
+    .applies = mod_limit_conn_applies,
+    .cleanup = mod_limit_conn_cleanup
+};
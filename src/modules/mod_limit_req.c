@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+#include "module.h"
+#include "limit.h"
+
+/*
+ * limit_req: request rate per key, shared by all workers. A leaky bucket as
+ * in nginx: every request adds one to the key's excess, which drains at the
+ * zone's rate. Requests beyond the burst get 429. Within the burst they are
+ * held back until the bucket has drained to them, unless nodelay is set.
+ *
+ *   limit_req_zone $binary_remote_addr zone=one:1m rate=10r/s;
+ *   location /api { limit_req zone=one burst=20 nodelay; }
+ */
+
+extern proton_event_loop_t *event_loop;
+
+#define EXCESS_MASK     ((1ULL << PROTON_LIMIT_EXCESS_BITS) - 1)
+#define ELAPSED_MAX     86400000ULL     /* msec; any longer drains the bucket anyway */
+
+static proton_limit_t **location_zones = NULL;
+static int nlocation_zones = 0;
+
+/* A request held back until its turn */
+typedef struct {
+    proton_http_connection_t *conn;
+    proton_timer_t timer;
+} limit_delay_t;
+
+static void delay_cancel(proton_http_connection_t *conn) {
+    limit_delay_t *delay = conn->module_ctx;
+    proton_timer_del(event_loop, &delay->timer);
+}
+
+/* Its turn: go on with the handlers after limit_req */
+static void delay_expired(proton_timer_t *timer) {
+    limit_delay_t *delay = timer->data;
+    proton_http_resume(delay->conn, PROTON_MODULE_DECLINED);
+}
+
+static int delay_request(proton_http_connection_t *conn, uint64_t msec) {
+    limit_delay_t *delay = proton_pool_alloc(conn->request->pool, sizeof(limit_delay_t));
+    if (!delay) return PROTON_MODULE_DECLINED;
+    
+    delay->conn = conn;
+    proton_timer_init(&delay->timer, delay_expired, delay);
+    if (proton_timer_add(event_loop, &delay->timer, msec) != PROTON_OK) {
+        return PROTON_MODULE_DECLINED;
+    }
+    
+    proton_http_suspend(conn, delay, delay_cancel);
+    return PROTON_MODULE_AGAIN;
+}
+
+static int mod_limit_req_handler(proton_http_connection_t *conn) {
+    proton_http_request_t *req = conn->request;
+    proton_location_t *loc = req->location;
+    
+    if (!loc || loc->index >= nlocation_zones) return PROTON_MODULE_DECLINED;
+    
+    proton_limit_t *zone = location_zones[loc->index];
+    if (!zone) return PROTON_MODULE_DECLINED;
+    
+    uint64_t hash = proton_limit_hash(zone, conn);
+    if (hash == 0) return PROTON_MODULE_DECLINED;
+    
+    proton_limit_node_t *node = proton_limit_lookup(zone, hash);
+    if (!node) return PROTON_MODULE_DECLINED;
+    
+    uint64_t now = proton_current_msec - zone->shm->epoch;
+    int64_t burst = (int64_t)loc->limit_req_burst * 1000;
+    int64_t excess;
+    
+    while (1) {
+        uint64_t state = atomic_load(&node->state);
+        if (state == PROTON_LIMIT_EXPIRING) return PROTON_MODULE_DECLINED;
+        
+        uint64_t last = state >> PROTON_LIMIT_EXCESS_BITS;
+        excess = 0;
+        
+        /* A key seen before drains for the time since its last request */
+        if (state != 0) {
+            uint64_t elapsed = now > last ? now - last : 0;
+            if (elapsed > ELAPSED_MAX) elapsed = ELAPSED_MAX;
+            
+            excess = (int64_t)(state & EXCESS_MASK) - (int64_t)(zone->rate * elapsed / 1000) + 1000;
+            if (excess < 0) excess = 0;
+        }
+        
+        if (excess > burst) {
+            proton_log(LOG_INFO, "limiting requests, excess %lld.%03lld by zone \"%s\"",
+                       (long long)(excess / 1000), (long long)(excess % 1000), zone->name);
+            proton_limit_reject(conn, HTTP_STATUS_TOO_MANY_REQUESTS);
+            return PROTON_MODULE_HANDLED;
+        }
+        
+        uint64_t next = ((now > last ? now : last) << PROTON_LIMIT_EXCESS_BITS) | (uint64_t)excess;
+        if (atomic_compare_exchange_weak(&node->state, &state, next)) break;
+    }
+    
+    if (excess == 0 || loc->limit_req_nodelay) return PROTON_MODULE_DECLINED;
+    
+    uint64_t msec = (uint64_t)excess * 1000 / zone->rate;
+    if (msec == 0) return PROTON_MODULE_DECLINED;
+    
+    return delay_request(conn, msec);
+}
+
+static void mod_limit_req_cleanup(void) {
+    free(location_zones);
+    location_zones = NULL;
+    nlocation_zones = 0;
+    
+    proton_limits_cleanup();
+}
+
+static int mod_limit_req_init(proton_config_t *config) {
+    /* Zones are shared with limit_conn; whichever module comes first maps them */
+    if (proton_limits_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize limit zones");
+        return PROTON_ERROR;
+    }
+    
+    if (config->nlocations == 0) return PROTON_OK;
+    
+    location_zones = calloc(config->nlocations, sizeof(proton_limit_t*));
+    if (!location_zones) return PROTON_ERROR;
+    nlocation_zones = config->nlocations;
+    
+    for (int i = 0; i < config->nlocations; i++) {
+        proton_location_t *loc = &config->locations[i];
+        if (!loc->limit_req) continue;
+        
+        location_zones[i] = proton_limit_get(loc->limit_req, PROTON_LIMIT_REQ);
+        if (!location_zones[i]) {
+            proton_log(LOG_ERROR, "Unknown limit_req zone \"%s\" in location %s", loc->limit_req, loc->prefix);
+            mod_limit_req_cleanup();
+            return PROTON_ERROR;
+        }
+        
+        if (loc->limit_req_burst > PROTON_LIMIT_BURST_MAX) {
+            proton_log(LOG_ERROR, "limit_req burst in location %s exceeds %d", loc->prefix, PROTON_LIMIT_BURST_MAX);
+            mod_limit_req_cleanup();
+            return PROTON_ERROR;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static int mod_limit_req_applies(proton_location_t *loc, int phase) {
+    (void)phase;
+    return loc && loc->limit_req;
+}
+
+proton_module_t mod_limit_req = {
+    .name = "limit_req",
+    .init = mod_limit_req_init,
+    .phases = { [PROTON_PHASE_ACCESS] = mod_limit_req_handler },
+    .applies = mod_limit_req_applies,
+    .cleanup = mod_limit_req_cleanup
+};
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "proton.h"
+#include "http.h"
+#include "module.h"
+
+/*
+ * Prometheus text exposition of the scoreboard counters and the latency
+ * histograms, merged over all workers on every scrape.
+ *
+ *   location = /metrics { metrics; }
+ */
+
+/*
+ * Location prefixes for the histogram labels, by location index. The
+ * histograms sit in a shared table of fixed size that outlives reloads, so
+ * locations past the first PROTON_METRICS_OTHER - 1 share the last slot,
+ * labelled "other".
+ */
+static char **labels = NULL;
+static int nlabels = 0;
+
+static const char *hist_names[PROTON_HIST_MAX] = {
+    "proton_request_read_seconds",
+    "proton_request_handler_seconds",
+    "proton_request_duration_seconds"
+};
+
+static const char *hist_help[PROTON_HIST_MAX] = {
+    "Time from accept or first byte until the request was parsed.",
+    "Time spent in module handlers.",
+    "Time from request start until the last byte was written."
+};
+
+static void emit(proton_http_response_t *res, const char *fmt, ...) {
+    char buf[512];
+    va_list args;
+    
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    
+    if (len > 0) {
+        proton_http_response_write(res, buf, (size_t)len < sizeof(buf) ? (size_t)len : sizeof(buf) - 1);
+    }
+}
+
+static void emit_metric(proton_http_response_t *res, const char *name, const char *type,
+                        const char *help, unsigned long long value) {
+    emit(res, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
+
+static const char* location_label(int index) {
+    if (index == 0) return "none";
+    if (index >= PROTON_METRICS_OTHER || index > nlabels || !labels[index - 1]) return "other";
+    return labels[index - 1];
+}
+
+/* A prefix as a label value: backslash, double quote and newline escaped */
+static char* escape_label(const char *prefix) {
+    char *label = malloc(2 * strlen(prefix) + 1);
+    if (!label) return NULL;
+    
+    char *p = label;
+    for (; *prefix; prefix++) {
+        if (*prefix == '\\' || *prefix == '"' || *prefix == '\n') *p++ = '\\';
+        *p++ = *prefix == '\n' ? 'n' : *prefix;
+    }
+    *p = '\0';
+    
+    return label;
+}
+
+/* Buckets are exported at power-of-two boundaries to keep series counts low */
+static void emit_histogram(proton_http_response_t *res, proton_metrics_t *m, int which) {
+    emit(res, "# HELP %s %s\n# TYPE %s histogram\n", hist_names[which], hist_help[which], hist_names[which]);
+    
+    for (int l = 0; l < PROTON_METRICS_LOCATIONS; l++) {
+        proton_histogram_t *h = &m->hist[l][which];
+        if (h->count == 0) continue;
+        
+        const char *label = location_label(l);
+        uint64_t cumulative = 0;
+        
+        for (int b = 0; b < PROTON_HIST_BUCKETS - 1; b++) {
+            cumulative += h->buckets[b];
+            if ((b + 1) % 4 != 0) continue;
+            
+            emit(res, "%s_bucket{location=\"%s\",le=\"%.6f\"} %llu\n", hist_names[which], label,
+                 proton_histogram_bucket_upper(b) / 1e6, (unsigned long long)cumulative);
+        }
+        
+        emit(res, "%s_bucket{location=\"%s\",le=\"+Inf\"} %llu\n", hist_names[which], label,
+             (unsigned long long)h->count);
+        emit(res, "%s_sum{location=\"%s\"} %.6f\n", hist_names[which], label, h->sum / 1e6);
+        emit(res, "%s_count{location=\"%s\"} %llu\n", hist_names[which], label,
+             (unsigned long long)h->count);
+    }
+}
+
+static int mod_metrics_init(proton_config_t *config) {
+    if (config->nlocations == 0) return PROTON_OK;
+    
+    nlabels = config->nlocations;
+    if (nlabels >= PROTON_METRICS_OTHER) {
+        nlabels = PROTON_METRICS_OTHER - 1;
+        proton_log(LOG_WARN, "Latency histograms of the %d locations after %s are merged as location=\"other\"",
+                   config->nlocations - nlabels, config->locations[nlabels - 1].prefix);
+    }
+    
+    labels = calloc(nlabels, sizeof(char*));
+    if (!labels) {
+        nlabels = 0;
+        return PROTON_ERROR;
+    }
+    
+    for (int i = 0; i < nlabels; i++) {
+        labels[i] = escape_label(config->locations[i].prefix);
+    }
+    
+    return PROTON_OK;
+}
+
+static void mod_metrics_cleanup(void) {
+    for (int i = 0; i < nlabels; i++) {
+        free(labels[i]);
+    }
+    free(labels);
+    labels = NULL;
+    nlabels = 0;
+}
+
+static int mod_metrics_handler(proton_http_connection_t *conn) {
+    if (!conn || !conn->request) return PROTON_MODULE_ERROR;
+    
+    proton_http_request_t *req = conn->request;
+    proton_http_response_t *res = conn->response;
+    
+    if (req->method != HTTP_GET && req->method != HTTP_HEAD) {
+        return PROTON_MODULE_DECLINED;
+    }
+    
+    res->status = HTTP_STATUS_OK;
+    proton_http_response_add_header(res, "Content-Type", "text/plain; version=0.0.4");
+    proton_http_response_add_header(res, "Cache-Control", "no-cache");
+    
+    if (req->method == HTTP_HEAD) {
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    proton_stats_t total;
+    int workers = proton_scoreboard_collect(&total);
+    int64_t waiting = total.active - total.reading - total.writing;
+    if (waiting < 0) waiting = 0;
+    
+    emit_metric(res, "proton_connections_accepted_total", "counter",
+                "Accepted client connections.", total.accepted);
+    emit_metric(res, "proton_connections_handled_total", "counter",
+                "Handled client connections.", total.handled);
+    emit_metric(res, "proton_requests_total", "counter",
+                "Completed requests.", total.requests);
+    emit_metric(res, "proton_requests_shed_total", "counter",
+                "Requests answered 503 by overload_shedding.", total.shed);
+    emit_metric(res, "proton_received_bytes_total", "counter",
+                "Bytes read from clients.", total.bytes_in);
+    emit_metric(res, "proton_sent_bytes_total", "counter",
+                "Bytes written to clients.", total.bytes_out);
+    
+    emit(res, "# HELP proton_responses_total Responses by status class.\n"
+              "# TYPE proton_responses_total counter\n");
+    for (int i = 0; i < 5; i++) {
+        emit(res, "proton_responses_total{class=\"%dxx\"} %llu\n", i + 1,
+             (unsigned long long)total.responses[i]);
+    }
+    
+    emit(res, "# HELP proton_connections Open client connections by state.\n"
+              "# TYPE proton_connections gauge\n");
+    emit(res, "proton_connections{state=\"active\"} %lld\n", (long long)total.active);
+    emit(res, "proton_connections{state=\"reading\"} %lld\n", (long long)total.reading);
+    emit(res, "proton_connections{state=\"writing\"} %lld\n", (long long)total.writing);
+    emit(res, "proton_connections{state=\"waiting\"} %lld\n", (long long)waiting);
+    
+    emit_metric(res, "proton_workers", "gauge", "Running worker processes.", workers);
+    emit_metric(res, "proton_worker_respawns_total", "counter",
+                "Workers respawned after an unexpected exit.", proton_scoreboard->respawns);
+    
+    /* Large enough that it should not live on the stack */
+    proton_metrics_t *m = malloc(sizeof(proton_metrics_t));
+    if (m) {
+        proton_metrics_collect(m);
+        for (int k = 0; k < PROTON_HIST_MAX; k++) {
+            emit_histogram(res, m, k);
+        }
+        free(m);
+    }
+    
+    return PROTON_MODULE_HANDLED;
+}
+
+static int mod_metrics_applies(proton_location_t *loc, int phase) {
+    (void)phase;
+    return loc && loc->metrics;
+}
+
+proton_module_t mod_metrics = {
+    .name = "metrics",
+    .init = mod_metrics_init,
+    .phases = { [PROTON_PHASE_CONTENT] = mod_metrics_handler },
+    .applies = mod_metrics_applies,
+    .cleanup = mod_metrics_cleanup
+};
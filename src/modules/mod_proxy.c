@@ -0,0 +1,1040 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "proton.h"
+#include "event.h"
+#include "http.h"
+#include "module.h"
+#include "upstream.h"
+#include "http2.h"
+
+/*
+ * Reverse proxy.
+ *
+ *   upstream app {
+ *       least_conn;
+ *       server 10.0.0.1:8080 weight=2 max_fails=3 fail_timeout=10s;
+ *       server 10.0.0.2:8080;
+ *       keepalive 32;
+ *   }
+ *
+ *   location /api/ { proxy_pass http://app; }
+ *
+ * Server names are resolved once at config time (see upstream.c). Each
+ * worker keeps its own peer state and a LIFO pool of idle upstream
+ * connections per upstream, so a request usually goes out on a connection
+ * that is already established.
+ * Request and response bodies are streamed; reading from one side stops
+ * while the other side has a backlog. A failed request is retried on the
+ * next peer as long as none of its bytes had to be dropped and nothing has
+ * reached the client yet.
+ *
+ * An HTTP/2 stream comes with its whole body and is answered whole: the
+ * request is suspended while the upstream response is collected, without
+ * its chunked coding, into the stream's response.
+ */
+
+extern proton_event_loop_t *event_loop;
+
+#define PROXY_BUFFER_SIZE         16384
+#define PROXY_HEADER_MAX          16384   /* upstream response header */
+#define PROXY_BODY_BACKLOG        65536   /* unsent request body */
+#define PROXY_IMPLICIT_KEEPALIVE  32
+#define PROXY_STREAM_BODY_MAX     (8 * 1024 * 1024)   /* response collected for a stream */
+
+/* How the end of the upstream response is found */
+#define FRAMING_NONE     0
+#define FRAMING_LENGTH   1
+#define FRAMING_CHUNKED  2
+#define FRAMING_CLOSE    3
+
+/* Chunked transfer coding scanner states */
+#define CHUNK_SIZE          0
+#define CHUNK_EXT           1
+#define CHUNK_SIZE_LF       2
+#define CHUNK_DATA          3
+#define CHUNK_DATA_CR       4
+#define CHUNK_DATA_LF       5
+#define CHUNK_TRAILER       6
+#define CHUNK_TRAILER_LINE  7
+#define CHUNK_LAST_LF       8
+#define CHUNK_DONE          9
+
+typedef struct {
+    int state;
+    uint64_t size;
+} chunk_scan_t;
+
+typedef struct {
+    proton_http_connection_t *conn;
+    proton_upstream_conn_t uc;
+    proton_timer_t timer;
+    int connect_timeout;
+    int read_timeout;
+    
+    /* Request to the upstream: header and body as far as read */
+    proton_buffer_t *request;
+    size_t request_pos;
+    int replayable;             /* no sent byte has been dropped yet */
+    int body_done;
+    int body_chunked;
+    int64_t body_remaining;
+    chunk_scan_t body_scan;
+    
+    /* Response */
+    proton_buffer_t *header;
+    size_t received;
+    int header_done;
+    int framing;
+    int64_t remaining;
+    chunk_scan_t scan;
+    int keepalive;
+    int done;
+    int paused;                 /* upstream reads wait for the client */
+} proxy_ctx_t;
+
+/* Upstream of each location, by location index */
+static proton_upstream_group_t **location_upstreams = NULL;
+static int nlocation_upstreams = 0;
+
+static int upstream_read(proxy_ctx_t *ctx);
+static int upstream_read_handler(proton_event_t *ev);
+static int upstream_write_handler(proton_event_t *ev);
+
+/*
+ * Consume chunked data up to the end of the message. The bytes themselves
+ * are passed through unchanged; the chunk data alone also goes to decoded
+ * if given. Returns how many bytes belong to the message, or -1 if the
+ * coding is malformed.
+ */
+static ssize_t chunk_scan(chunk_scan_t *s, const char *data, size_t len, proton_buffer_t *decoded) {
+    size_t i = 0;
+    
+    while (i < len && s->state != CHUNK_DONE) {
+        char ch = data[i];
+        
+        switch (s->state) {
+        case CHUNK_SIZE:
+            if (isxdigit((unsigned char)ch)) {
+                if (s->size >> 56) return -1;
+                int d = ch <= '9' ? ch - '0' : (ch | 0x20) - 'a' + 10;
+                s->size = s->size * 16 + d;
+            } else if (ch == ';' || ch == ' ' || ch == '\t') {
+                s->state = CHUNK_EXT;
+            } else if (ch == '\r') {
+                s->state = CHUNK_SIZE_LF;
+            } else {
+                return -1;
+            }
+            break;
+        
+        case CHUNK_EXT:
+            if (ch == '\r') s->state = CHUNK_SIZE_LF;
+            break;
+        
+        case CHUNK_SIZE_LF:
+            if (ch != '\n') return -1;
+            s->state = s->size ? CHUNK_DATA : CHUNK_TRAILER;
+            break;
+        
+        case CHUNK_DATA: {
+            size_t n = len - i;
+            if (n > s->size) n = s->size;
+            if (decoded && proton_buffer_append(decoded, data + i, n) != PROTON_OK) return -1;
+            s->size -= n;
+            i += n;
+            if (s->size == 0) s->state = CHUNK_DATA_CR;
+            continue;
+        }
+        
+        case CHUNK_DATA_CR:
+            if (ch != '\r') return -1;
+            s->state = CHUNK_DATA_LF;
+            break;
+        
+        case CHUNK_DATA_LF:
+            if (ch != '\n') return -1;
+            s->state = CHUNK_SIZE;
+            break;
+        
+        case CHUNK_TRAILER:
+            s->state = ch == '\r' ? CHUNK_LAST_LF : CHUNK_TRAILER_LINE;
+            break;
+        
+        case CHUNK_TRAILER_LINE:
+            if (ch == '\n') s->state = CHUNK_TRAILER;
+            break;
+        
+        case CHUNK_LAST_LF:
+            if (ch != '\n') return -1;
+            s->state = CHUNK_DONE;
+            break;
+        }
+
+        i++;
+    }
+
+    return i;
+}
+
+static void upstream_release(proxy_ctx_t *ctx, int state) {
+    proton_timer_del(event_loop, &ctx->timer);
+    proton_upstream_free(&ctx->uc, state);
+}
+
+static int proxy_connect(proxy_ctx_t *ctx) {
+    ctx->request_pos = 0;
+    ctx->header->len = 0;
+    ctx->received = 0;
+
+    /* Only a request that can be replayed in full risks a stale connection */
+    if (proton_upstream_connect(&ctx->uc, ctx->conn->request, ctx->replayable && ctx->body_done) != PROTON_OK) {
+        return PROTON_ERROR;
+    }
+
+    proton_timer_add(event_loop, &ctx->timer, ctx->uc.connected ? ctx->read_timeout : ctx->connect_timeout);
+    return PROTON_OK;
+}
+
+static void proxy_free(proxy_ctx_t *ctx) {
+    upstream_release(ctx, PROTON_UPSTREAM_CLOSE);
+    proton_buffer_destroy(ctx->request);
+    proton_buffer_destroy(ctx->header);
+    free(ctx);
+}
+
+static void proxy_close_hook(proton_http_connection_t *conn) {
+    proxy_free(conn->module_ctx);
+    conn->module_ctx = NULL;
+}
+
+static void clear_hooks(proton_http_connection_t *conn) {
+    conn->read_hook = NULL;
+    conn->write_hook = NULL;
+    conn->close_hook = NULL;
+    conn->module_ctx = NULL;
+}
+
+/* Nothing has been sent to the client yet: answer with an error page */
+static int proxy_respond(proxy_ctx_t *ctx, int status) {
+    proton_http_connection_t *conn = ctx->conn;
+    proton_http_response_t *res = conn->response;
+    
+    /* Unread body bytes would be taken for the next request */
+    if (!ctx->body_done) conn->keep_alive = 0;
+    
+    proxy_free(ctx);
+    clear_hooks(conn);
+    
+    /* A stream may have collected part of the upstream response */
+    while (res->headers) {
+        proton_http_header_t *h = res->headers;
+        res->headers = h->next;
+        free(h->name);
+        free(h->value);
+        free(h);
+    }
+    
+    char body[64];
+    int len = snprintf(body, sizeof(body), "%d %s\n", status, proton_http_status_string(status));
+    res->status = status;
+    res->body->len = 0;
+    proton_http_response_write(res, body, len);
+    
+    if (conn->stream) {
+        proton_http_resume(conn, PROTON_MODULE_HANDLED);
+    } else {
+        proton_http_response_send(conn);
+    }
+    
+    return PROTON_DONE;
+}
+
+static int client_failed(proxy_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    
+    /* Only the stream goes, not the connection it is on */
+    if (conn->stream) {
+        proxy_free(ctx);
+        clear_hooks(conn);
+        proton_http2_reset_stream(conn, PROTON_HTTP2_INTERNAL_ERROR);
+        return PROTON_DONE;
+    }
+    
+    if (ctx->header_done) proton_modules_log_request(conn);
+    proton_http_connection_close(conn);
+    return PROTON_DONE;
+}
+
+/* Complete the request once the client has everything */
+static int proxy_finish(proxy_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    
+    proxy_free(ctx);
+    
+    /* A stream's response goes out now, whole */
+    if (conn->stream) {
+        proton_http_resume(conn, PROTON_MODULE_HANDLED);
+        return PROTON_DONE;
+    }
+    
+    return proton_http_request_finish(conn);
+}
+
+/*
+ * The upstream connection broke or timed out. Before the client has seen
+ * anything the request goes to the next peer if it can be replayed, or an
+ * error page is sent; afterwards all that is left is to close the client.
+ * A stream's client sees nothing before the whole response is in.
+ */
+static int upstream_failed(proxy_ctx_t *ctx, int status, int retry) {
+    /* A cached connection the upstream had closed says nothing about the peer */
+    int stale = retry && ctx->uc.reused && ctx->received == 0;
+    upstream_release(ctx, stale ? PROTON_UPSTREAM_STALE : PROTON_UPSTREAM_FAILED);
+    
+    if (ctx->header_done && !ctx->conn->stream) {
+        return client_failed(ctx);
+    }
+    
+    if (!ctx->header_done && (retry || stale) && ctx->replayable && proxy_connect(ctx) == PROTON_OK) {
+        return PROTON_DONE;
+    }
+    
+    return proxy_respond(ctx, status);
+}
+
+static void proxy_timeout_handler(proton_timer_t *timer) {
+    proxy_ctx_t *ctx = timer->data;
+    const char *peer = proton_upstream_peer_name(&ctx->uc);
+    
+    if (!ctx->uc.connected) {
+        proton_log(LOG_WARN, "Upstream %s timed out while connecting", peer);
+        upstream_failed(ctx, HTTP_STATUS_GATEWAY_TIMEOUT, 1);
+    } else {
+        proton_log(LOG_WARN, "Upstream %s timed out while reading the response", peer);
+        upstream_failed(ctx, HTTP_STATUS_GATEWAY_TIMEOUT, 0);
+    }
+}
+
+static int request_sent(proxy_ctx_t *ctx) {
+    return ctx->body_done && ctx->request_pos == ctx->request->len;
+}
+
+/* Append the part of data that belongs to the request body; -1 if malformed */
+static ssize_t body_consume(proxy_ctx_t *ctx, const char *data, size_t len) {
+    ssize_t take;
+    
+    if (ctx->body_chunked) {
+        take = chunk_scan(&ctx->body_scan, data, len, NULL);
+        if (take < 0) return -1;
+        ctx->body_done = ctx->body_scan.state == CHUNK_DONE;
+    } else {
+        take = (int64_t)len < ctx->body_remaining ? (ssize_t)len : (ssize_t)ctx->body_remaining;
+        ctx->body_remaining -= take;
+        ctx->body_done = ctx->body_remaining == 0;
+    }
+    
+    if (take > 0 && proton_buffer_append(ctx->request, data, take) != PROTON_OK) return -1;
+    return take;
+}
+
+/* Read request body from the client until the backlog is full */
+static int client_body_read(proxy_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    char buf[PROXY_BUFFER_SIZE];
+    
+    while (!ctx->body_done && ctx->request->len - ctx->request_pos < PROXY_BODY_BACKLOG) {
+        ssize_t n = proton_http_recv(conn, buf, sizeof(buf));
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            return client_failed(ctx);
+        }
+        
+        /* The client went away in the middle of its body */
+        if (n == 0) return client_failed(ctx);
+        
+        proton_stats->bytes_in += n;
+        
+        ssize_t take = body_consume(ctx, buf, n);
+        if (take < 0) {
+            proton_log(LOG_WARN, "Invalid request body from client");
+            return client_failed(ctx);
+        }
+        
+        /* The start of a pipelined request */
+        if (take < n && proton_http_unread(conn, buf + take, n - take) != PROTON_OK) {
+            return client_failed(ctx);
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static int upstream_send(proxy_ctx_t *ctx) {
+    proton_buffer_t *buf = ctx->request;
+    
+    while (ctx->request_pos < buf->len) {
+        ssize_t n = send(ctx->uc.fd, buf->data + ctx->request_pos, buf->len - ctx->request_pos, MSG_NOSIGNAL);
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROTON_OK;
+            if (errno == EINTR) continue;
+            proton_log(LOG_WARN, "Failed to send to upstream %s: %s",
+                       proton_upstream_peer_name(&ctx->uc), strerror(errno));
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 1);
+        }
+        
+        ctx->request_pos += n;
+    }
+    
+    /* A streamed body cannot be kept around for the next peer */
+    if (!ctx->body_done) {
+        buf->len = 0;
+        ctx->request_pos = 0;
+        ctx->replayable = 0;
+    }
+    
+    return PROTON_OK;
+}
+
+/* Move request bytes from the client to the upstream as both sides allow */
+static int request_pump(proxy_ctx_t *ctx) {
+    while (1) {
+        int ret = upstream_send(ctx);
+        if (ret != PROTON_OK) return ret;
+        
+        if (ctx->body_done || ctx->request->len - ctx->request_pos >= PROXY_BODY_BACKLOG) {
+            return PROTON_OK;
+        }
+        
+        size_t before = ctx->request->len;
+        ret = client_body_read(ctx);
+        if (ret != PROTON_OK) return ret;
+        
+        if (ctx->request->len == before) return PROTON_OK;
+    }
+}
+
+/* Write to the client directly; what does not fit waits in write_buf */
+static int client_send(proxy_ctx_t *ctx, const char *data, size_t len) {
+    proton_http_connection_t *conn = ctx->conn;
+    size_t sent = 0;
+    
+    if (conn->stream) {
+        if (conn->response->body->len + len > PROXY_STREAM_BODY_MAX) return PROTON_ERROR;
+        return proton_http_response_write(conn->response, data, len);
+    }
+    
+    if (conn->write_buf->len == 0) {
+        ssize_t n = proton_http_send(conn, data, len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return PROTON_ERROR;
+            n = 0;
+        }
+        
+        sent = n;
+        conn->bytes_sent += n;
+        proton_stats->bytes_out += n;
+    }
+    
+    if (sent < len && proton_buffer_append(conn->write_buf, data + sent, len - sent) != PROTON_OK) {
+        return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+static int header_is(const char *name, size_t len, const char *want) {
+    return len == strlen(want) && strncasecmp(name, want, len) == 0;
+}
+
+static int value_has(const char *value, size_t len, const char *token) {
+    char buf[256];
+    if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    return strcasestr(buf, token) != NULL;
+}
+
+/* Forward the upstream response header and work out how the body ends */
+static int send_header(proxy_ctx_t *ctx, size_t header_len) {
+    proton_http_connection_t *conn = ctx->conn;
+    const char *p = ctx->header->data;
+    const char *end = p + header_len - 2;
+    
+    /* HTTP/1.x SSS reason */
+    const char *eol = memmem(p, end - p + 2, "\r\n", 2);
+    if (eol - p < 12 || strncmp(p, "HTTP/1.", 7) != 0) return PROTON_ERROR;
+    
+    int minor = p[7] - '0';
+    int status = atoi(p + 9);
+    if (status < 200 || status > 999) return PROTON_ERROR;
+    
+    proton_buffer_t *out = proton_buffer_create(header_len + 64);
+    if (!out) return PROTON_ERROR;
+    
+    proton_buffer_append(out, "HTTP/1.1", 8);
+    proton_buffer_append(out, p + 8, eol - p - 8 + 2);
+    size_t status_len = out->len;
+    
+    int chunked = 0;
+    int64_t length = -1;
+    ctx->keepalive = minor >= 1;
+    
+    for (p = eol + 2; p < end; p = eol + 2) {
+        eol = memmem(p, end - p + 2, "\r\n", 2);
+        
+        const char *colon = memchr(p, ':', eol - p);
+        if (!colon) continue;
+        
+        size_t name_len = colon - p;
+        const char *value = colon + 1;
+        while (value < eol && (*value == ' ' || *value == '\t')) value++;
+        size_t value_len = eol - value;
+        
+        /* Hop-by-hop headers stay on this hop */
+        if (header_is(p, name_len, "Connection")) {
+            if (value_has(value, value_len, "close")) ctx->keepalive = 0;
+            else if (value_has(value, value_len, "keep-alive")) ctx->keepalive = 1;
+            continue;
+        }
+        if (header_is(p, name_len, "Keep-Alive") || header_is(p, name_len, "Proxy-Connection") ||
+            header_is(p, name_len, "Upgrade") || header_is(p, name_len, "TE")) {
+            continue;
+        }
+        
+        if (header_is(p, name_len, "Transfer-Encoding")) {
+            chunked = value_has(value, value_len, "chunked");
+        } else if (header_is(p, name_len, "Content-Length")) {
+            length = strtoll(value, NULL, 10);
+        }
+        
+        proton_buffer_append(out, p, eol - p + 2);
+    }
+    
+    if (conn->request->method == HTTP_HEAD || status == 204 || status == 304) {
+        ctx->framing = FRAMING_NONE;
+    } else if (chunked) {
+        ctx->framing = FRAMING_CHUNKED;
+    } else if (length >= 0) {
+        ctx->framing = FRAMING_LENGTH;
+        ctx->remaining = length;
+    } else {
+        ctx->framing = FRAMING_CLOSE;
+        ctx->keepalive = 0;
+    }
+    
+    /* The client would take unread body or an unframed response for a request */
+    if (ctx->framing == FRAMING_CLOSE || !ctx->body_done) {
+        conn->keep_alive = 0;
+    }
+    
+    conn->response->status = status;
+    ctx->header_done = 1;
+    ctx->done = ctx->framing == FRAMING_NONE || (ctx->framing == FRAMING_LENGTH && length == 0);
+    
+    /* A stream's header goes out with the whole body */
+    if (conn->stream) {
+        proton_http_response_add_raw_headers(conn->response, out->data + status_len, out->len - status_len);
+        proton_buffer_destroy(out);
+        return PROTON_OK;
+    }
+    
+    if (!conn->keep_alive) {
+        proton_buffer_append(out, "Connection: close\r\n", 19);
+    }
+    proton_buffer_append(out, "\r\n", 2);
+    conn->response->headers_sent = 1;
+    
+    int ret = client_send(ctx, out->data, out->len);
+    proton_buffer_destroy(out);
+    
+    return ret == PROTON_OK ? PROTON_OK : client_failed(ctx);
+}
+
+static int stream_too_large(proxy_ctx_t *ctx) {
+    proton_log(LOG_WARN, "Upstream %s sent too large a response for an HTTP/2 stream",
+               proton_upstream_peer_name(&ctx->uc));
+    return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+}
+
+static int upstream_body(proxy_ctx_t *ctx, const char *data, size_t len) {
+    size_t take = len;
+    
+    switch (ctx->framing) {
+    case FRAMING_NONE:
+        take = 0;
+        break;
+    
+    case FRAMING_LENGTH:
+        if ((int64_t)take > ctx->remaining) take = ctx->remaining;
+        ctx->remaining -= take;
+        ctx->done = ctx->remaining == 0;
+        break;
+    
+    case FRAMING_CHUNKED: {
+        /* A stream takes the chunk data alone, straight into its response */
+        proton_buffer_t *decoded = ctx->conn->stream ? ctx->conn->response->body : NULL;
+        ssize_t n = chunk_scan(&ctx->scan, data, len, decoded);
+        if (n < 0) {
+            proton_log(LOG_WARN, "Upstream %s sent invalid chunked response",
+                       proton_upstream_peer_name(&ctx->uc));
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+        }
+        take = n;
+        ctx->done = ctx->scan.state == CHUNK_DONE;
+        break;
+    }
+    }
+    
+    /* Bytes past the end of the response: do not trust this connection again */
+    if (take < len) ctx->keepalive = 0;
+    
+    if (ctx->framing == FRAMING_CHUNKED && ctx->conn->stream) {
+        return ctx->conn->response->body->len > PROXY_STREAM_BODY_MAX ? stream_too_large(ctx) : PROTON_OK;
+    }
+    
+    if (take > 0 && client_send(ctx, data, take) != PROTON_OK) {
+        return ctx->conn->stream ? stream_too_large(ctx) : client_failed(ctx);
+    }
+    
+    return PROTON_OK;
+}
+
+static int upstream_header(proxy_ctx_t *ctx, const char *data, size_t len) {
+    proton_buffer_t *hb = ctx->header;
+    const char *peer = proton_upstream_peer_name(&ctx->uc);
+    
+    if (proton_buffer_append(hb, data, len) != PROTON_OK) {
+        return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+    }
+    
+    while (1) {
+        char *end = memmem(hb->data, hb->len, "\r\n\r\n", 4);
+        if (!end) {
+            if (hb->len <= PROXY_HEADER_MAX) return PROTON_OK;
+            proton_log(LOG_WARN, "Upstream %s sent too large a header", peer);
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+        }
+        
+        size_t header_len = end + 4 - hb->data;
+        
+        /* Interim responses are not passed on */
+        if (hb->len > 12 && hb->data[9] == '1' && strncmp(hb->data + 9, "101", 3) != 0) {
+            memmove(hb->data, hb->data + header_len, hb->len - header_len);
+            hb->len -= header_len;
+            continue;
+        }
+        
+        if (ctx->header_done == 0 && send_header(ctx, header_len) != PROTON_OK) {
+            if (ctx->header_done) return PROTON_DONE;
+            proton_log(LOG_WARN, "Upstream %s sent an invalid header", peer);
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 0);
+        }
+        
+        if (hb->len > header_len) {
+            return upstream_body(ctx, hb->data + header_len, hb->len - header_len);
+        }
+        
+        return PROTON_OK;
+    }
+}
+
+/* The whole response has been read from the upstream */
+static int response_done(proxy_ctx_t *ctx) {
+    upstream_release(ctx, ctx->keepalive && request_sent(ctx) ? PROTON_UPSTREAM_KEEP : PROTON_UPSTREAM_CLOSE);
+    
+    if (!ctx->conn->stream && ctx->conn->write_buf->len > 0) {
+        return PROTON_DONE;
+    }
+    
+    proxy_finish(ctx);
+    return PROTON_DONE;
+}
+
+static int upstream_connected(proxy_ctx_t *ctx) {
+    if (proton_upstream_test_connect(&ctx->uc) != PROTON_OK) {
+        return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 1);
+    }
+    
+    proton_timer_add(event_loop, &ctx->timer, ctx->read_timeout);
+    return PROTON_OK;
+}
+
+static int upstream_read(proxy_ctx_t *ctx) {
+    char buf[PROXY_BUFFER_SIZE];
+    
+    while (1) {
+        /* Let the client catch up before reading more */
+        if (ctx->header_done && !ctx->conn->stream && ctx->conn->write_buf->len > 0) {
+            ctx->paused = 1;
+            return PROTON_OK;
+        }
+        
+        ssize_t n = read(ctx->uc.fd, buf, sizeof(buf));
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROTON_OK;
+            if (errno == EINTR) continue;
+            proton_log(LOG_WARN, "Failed to read from upstream %s: %s",
+                       proton_upstream_peer_name(&ctx->uc), strerror(errno));
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 1);
+        }
+        
+        if (n == 0) {
+            if (ctx->header_done && ctx->framing == FRAMING_CLOSE) {
+                ctx->keepalive = 0;
+                return response_done(ctx);
+            }
+            
+            if (ctx->received > 0 || !ctx->uc.reused) {
+                proton_log(LOG_WARN, "Upstream %s closed the connection prematurely",
+                           proton_upstream_peer_name(&ctx->uc));
+            }
+            return upstream_failed(ctx, HTTP_STATUS_BAD_GATEWAY, 1);
+        }
+        
+        ctx->received += n;
+        proton_timer_add(event_loop, &ctx->timer, ctx->read_timeout);
+        
+        int ret = ctx->header_done ? upstream_body(ctx, buf, n) : upstream_header(ctx, buf, n);
+        if (ret != PROTON_OK) return ret;
+        
+        if (ctx->done) return response_done(ctx);
+    }
+}
+
+static int upstream_read_handler(proton_event_t *ev) {
+    proxy_ctx_t *ctx = ev->data;
+    
+    if (!ctx->uc.connected && upstream_connected(ctx) != PROTON_OK) {
+        return PROTON_DONE;
+    }
+    
+    return upstream_read(ctx);
+}
+
+static int upstream_write_handler(proton_event_t *ev) {
+    proxy_ctx_t *ctx = ev->data;
+    
+    if (!ctx->uc.connected && upstream_connected(ctx) != PROTON_OK) {
+        return PROTON_DONE;
+    }
+    
+    return request_pump(ctx);
+}
+
+static int proxy_client_read(proton_http_connection_t *conn) {
+    proxy_ctx_t *ctx = conn->module_ctx;
+    
+    /* A pipelined request is read once this one is done */
+    if (ctx->body_done) return PROTON_OK;
+    
+    if (ctx->uc.fd >= 0 && ctx->uc.connected) {
+        return request_pump(ctx);
+    }
+    
+    return client_body_read(ctx);
+}
+
+static int proxy_client_write(proton_http_connection_t *conn) {
+    proxy_ctx_t *ctx = conn->module_ctx;
+    proton_buffer_t *buf = conn->write_buf;
+    
+    if (buf->len > 0) {
+        ssize_t n = proton_http_send(conn, buf->data, buf->len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return PROTON_OK;
+            return client_failed(ctx);
+        }
+        
+        conn->bytes_sent += n;
+        proton_stats->bytes_out += n;
+        
+        if ((size_t)n < buf->len) {
+            memmove(buf->data, buf->data + n, buf->len - n);
+            buf->len -= n;
+            return PROTON_OK;
+        }
+        buf->len = 0;
+    }
+    
+    if (ctx->done && ctx->uc.fd < 0) {
+        return proxy_finish(ctx);
+    }
+    
+    if (ctx->paused) {
+        ctx->paused = 0;
+        return upstream_read(ctx);
+    }
+    
+    return PROTON_OK;
+}
+
+static void format_client_addr(proton_http_connection_t *conn, char *text, size_t size) {
+    snprintf(text, size, "-");
+    
+    if (conn->sockaddr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((struct sockaddr_in*)&conn->sockaddr)->sin_addr, text, size);
+    } else if (conn->sockaddr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((struct sockaddr_in6*)&conn->sockaddr)->sin6_addr, text, size);
+    } else if (conn->sockaddr.ss_family == AF_UNIX) {
+        snprintf(text, size, "unix:");
+    }
+}
+
+static void append_str(proton_buffer_t *buf, const char *s) {
+    proton_buffer_append(buf, s, strlen(s));
+}
+
+static void append_header(proton_buffer_t *buf, const char *name, const char *value) {
+    append_str(buf, name);
+    proton_buffer_append(buf, ": ", 2);
+    append_str(buf, value);
+    proton_buffer_append(buf, "\r\n", 2);
+}
+
+static int skip_request_header(const char *name) {
+    static const char *skip[] = {
+        "Host", "Connection", "Keep-Alive", "Proxy-Connection", "Upgrade", "TE",
+        "Expect", "X-Real-IP", "X-Forwarded-For", NULL
+    };
+    
+    for (int i = 0; skip[i]; i++) {
+        if (strcasecmp(name, skip[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static int build_request(proxy_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    proton_http_request_t *req = conn->request;
+    proton_buffer_t *buf = ctx->request;
+    
+    append_str(buf, proton_http_method_string(req->method));
+    proton_buffer_append(buf, " ", 1);
+    append_str(buf, req->uri);
+    if (req->query_string) {
+        proton_buffer_append(buf, "?", 1);
+        append_str(buf, req->query_string);
+    }
+    
+    /* An HTTP/1.0 client cannot take a chunked response */
+    append_str(buf, req->version == HTTP_VERSION_10 ? " HTTP/1.0\r\n" : " HTTP/1.1\r\n");
+    
+    const char *host = proton_http_get_header(req, "Host");
+    append_header(buf, "Host", host ? host : ctx->uc.group->name);
+    
+    /* The parser keeps headers newest first; send them in their original order */
+    int count = 0;
+    for (proton_http_header_t *h = req->headers; h; h = h->next) count++;
+    
+    proton_http_header_t **headers = malloc((count + 1) * sizeof(proton_http_header_t*));
+    if (!headers) return PROTON_ERROR;
+    
+    int n = 0;
+    for (proton_http_header_t *h = req->headers; h; h = h->next) headers[n++] = h;
+    
+    while (n-- > 0) {
+        if (!skip_request_header(headers[n]->name)) {
+            append_header(buf, headers[n]->name, headers[n]->value);
+        }
+    }
+    free(headers);
+    
+    char addr[INET6_ADDRSTRLEN];
+    format_client_addr(conn, addr, sizeof(addr));
+    append_header(buf, "X-Real-IP", addr);
+    
+    const char *forwarded = proton_http_get_header(req, "X-Forwarded-For");
+    if (forwarded) {
+        append_str(buf, "X-Forwarded-For: ");
+        append_str(buf, forwarded);
+        proton_buffer_append(buf, ", ", 2);
+        append_str(buf, addr);
+        proton_buffer_append(buf, "\r\n", 2);
+    } else {
+        append_header(buf, "X-Forwarded-For", addr);
+    }
+    
+    if (ctx->uc.group->keepalive <= 0) {
+        append_str(buf, "Connection: close\r\n");
+    } else if (req->version == HTTP_VERSION_10) {
+        append_str(buf, "Connection: keep-alive\r\n");
+    }
+    
+    /* HTTP/2 ends a body with the stream; HTTP/1.1 needs its length */
+    if (conn->stream && req->body_len > 0 && !proton_http_get_header(req, "Content-Length")) {
+        char length[64];
+        snprintf(length, sizeof(length), "%zu", req->body_len);
+        append_header(buf, "Content-Length", length);
+    }
+    
+    proton_buffer_append(buf, "\r\n", 2);
+    return PROTON_OK;
+}
+
+/* Body framing of the client request and the part that came with the header */
+static int init_body(proxy_ctx_t *ctx) {
+    proton_http_connection_t *conn = ctx->conn;
+    proton_http_request_t *req = conn->request;
+    
+    /* A stream's body is all there */
+    if (conn->stream) {
+        ctx->body_done = 1;
+        if (req->body_len > 0 && proton_buffer_append(ctx->request, req->body, req->body_len) != PROTON_OK) {
+            return PROTON_ERROR;
+        }
+        return PROTON_OK;
+    }
+    
+    ctx->body_chunked = req->chunked;
+    ctx->body_remaining = req->content_length;
+    ctx->body_done = !ctx->body_chunked && ctx->body_remaining == 0;
+    
+    ssize_t initial = conn->read_buf->len - req->header_len;
+    if (!ctx->body_done && initial > 0) {
+        initial = body_consume(ctx, conn->read_buf->data + req->header_len, initial);
+        if (initial < 0) return PROTON_ERROR;
+    } else {
+        initial = 0;
+    }
+    proton_http_take_body(conn, initial);
+    
+    /* The client holds back the rest of its body until told to go on */
+    const char *expect = proton_http_get_header(req, "Expect");
+    if (!ctx->body_done && expect && strcasecmp(expect, "100-continue") == 0 &&
+        proton_http_send(conn, "HTTP/1.1 100 Continue\r\n\r\n", 25) < 0) {
+        return PROTON_ERROR;
+    }
+    
+    return PROTON_OK;
+}
+
+static int mod_proxy_handler(proton_http_connection_t *conn) {
+    if (!conn || !conn->request) return PROTON_MODULE_ERROR;
+    
+    proton_http_request_t *req = conn->request;
+    proton_location_t *loc = req->location;
+    
+    if (!loc || loc->index >= nlocation_upstreams || !location_upstreams[loc->index]) {
+        return PROTON_MODULE_DECLINED;
+    }
+    
+    proxy_ctx_t *ctx = calloc(1, sizeof(proxy_ctx_t));
+    if (!ctx) return PROTON_MODULE_ERROR;
+    
+    ctx->conn = conn;
+    ctx->uc.group = location_upstreams[loc->index];
+    ctx->uc.fd = -1;
+    ctx->uc.peer = -1;
+    ctx->uc.data = ctx;
+    ctx->uc.read_handler = upstream_read_handler;
+    ctx->uc.write_handler = upstream_write_handler;
+    ctx->connect_timeout = loc->upstream_connect_timeout;
+    ctx->read_timeout = loc->upstream_read_timeout;
+    ctx->replayable = 1;
+    ctx->request = proton_buffer_create(req->header_len + 256);
+    ctx->header = proton_buffer_create(4096);
+    proton_timer_init(&ctx->timer, proxy_timeout_handler, ctx);
+    
+    if (!ctx->request || !ctx->header || build_request(ctx) != PROTON_OK) {
+        proxy_free(ctx);
+        return PROTON_MODULE_ERROR;
+    }
+    
+    if (init_body(ctx) != PROTON_OK) {
+        proxy_free(ctx);
+        conn->keep_alive = 0;
+        conn->response->status = HTTP_STATUS_BAD_REQUEST;
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    if (proxy_connect(ctx) != PROTON_OK) {
+        if (!ctx->body_done) conn->keep_alive = 0;
+        proxy_free(ctx);
+        conn->response->status = HTTP_STATUS_BAD_GATEWAY;
+        proton_http_response_write(conn->response, "502 Bad Gateway\n", 16);
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    /* The stream waits for the whole response */
+    if (conn->stream) {
+        proton_http_suspend(conn, ctx, proxy_close_hook);
+        return PROTON_MODULE_AGAIN;
+    }
+    
+    /* Header and body leave in separate writes; do not let Nagle hold the body */
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    
+    conn->module_ctx = ctx;
+    conn->read_hook = proxy_client_read;
+    conn->write_hook = proxy_client_write;
+    conn->close_hook = proxy_close_hook;
+    
+    /* Body bytes still in the socket show up as a read event */
+    proton_event_add(event_loop, conn->event, PROTON_EVENT_READ | PROTON_EVENT_WRITE);
+
+    return PROTON_MODULE_AGAIN;
+}
+
+static void mod_proxy_cleanup(void) {
+    free(location_upstreams);
+    location_upstreams = NULL;
+    nlocation_upstreams = 0;
+    
+    proton_upstreams_cleanup();
+}
+
+static int mod_proxy_init(proton_config_t *config) {
+    /* Upstream groups are shared with fastcgi_pass; whichever module comes first builds them */
+    if (proton_upstreams_init(config) != PROTON_OK) {
+        proton_log(LOG_ERROR, "Failed to initialize upstreams");
+        return PROTON_ERROR;
+    }
+    
+    if (config->nlocations == 0) return PROTON_OK;
+    
+    location_upstreams = calloc(config->nlocations, sizeof(proton_upstream_group_t*));
+    if (!location_upstreams) return PROTON_ERROR;
+    nlocation_upstreams = config->nlocations;
+    
+    for (int i = 0; i < config->nlocations; i++) {
+        const char *target = config->locations[i].proxy_pass;
+        if (!target) continue;
+        
+        /* proxy_pass to a plain address gets a group of its own */
+        location_upstreams[i] = proton_upstream_get(target, PROXY_IMPLICIT_KEEPALIVE);
+        if (!location_upstreams[i]) {
+            mod_proxy_cleanup();
+            return PROTON_ERROR;
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static int mod_proxy_applies(proton_location_t *loc, int phase) {
+    (void)phase;
+    return loc && loc->proxy_pass;
+}
+
+proton_module_t mod_proxy = {
+    .name = "proxy",
+    .init = mod_proxy_init,
+    .phases = { [PROTON_PHASE_CONTENT] = mod_proxy_handler },
+    .applies = mod_proxy_applies,
+    .cleanup = mod_proxy_cleanup
+};
@@ -1,37 +1,157 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include "proton.h"
 #include "http.h"
 #include "module.h"
+#include "bundle.h"
+
+/*
+ * Bodies up to this size are copied from the bundle into the response so
+ * that they go out with the header in one write; larger ones are sent
+ * with sendfile from their offset in the bundle
+ */
+#define BUNDLE_COPY_MAX     16384
 
 static char *document_root = NULL;
 
-static const char* get_mime_type(const char *path) {
-    const char *ext = strrchr(path, '.');
-    if (!ext) return "application/octet-stream";
-    
-    ext++; /* Skip the dot */
-    
-    if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0) return "text/html";
-    if (strcmp(ext, "css") == 0) return "text/css";
-    if (strcmp(ext, "js") == 0) return "application/javascript";
-    if (strcmp(ext, "json") == 0) return "application/json";
-    if (strcmp(ext, "png") == 0) return "image/png";
-    if (strcmp(ext, "jpg") == 0 || strcmp(ext, "jpeg") == 0) return "image/jpeg";
-    if (strcmp(ext, "gif") == 0) return "image/gif";
-    if (strcmp(ext, "svg") == 0) return "image/svg+xml";
-    if (strcmp(ext, "txt") == 0) return "text/plain";
-    if (strcmp(ext, "xml") == 0) return "application/xml";
-    
-    return "application/octet-stream";
+/* static_bundle, mapped in the master and shared by the workers */
+static const char *bundle = NULL;
+static size_t bundle_size = 0;
+static int bundle_fd = -1;
+
+static int bundle_open(const char *path) {
+    struct stat st;
+    
+    bundle_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (bundle_fd < 0 || fstat(bundle_fd, &st) < 0) {
+        proton_log(LOG_ERROR, "Cannot open static_bundle %s: %s", path, strerror(errno));
+        return PROTON_ERROR;
+    }
+    
+    if ((size_t)st.st_size < sizeof(proton_bundle_header_t)) {
+        proton_log(LOG_ERROR, "%s is not a static bundle", path);
+        return PROTON_ERROR;
+    }
+    
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, bundle_fd, 0);
+    if (map == MAP_FAILED) {
+        proton_log(LOG_ERROR, "Cannot map static_bundle %s: %s", path, strerror(errno));
+        return PROTON_ERROR;
+    }
+    bundle = map;
+    bundle_size = st.st_size;
+    
+    const proton_bundle_header_t *h = proton_bundle_check(bundle, bundle_size);
+    if (!h) {
+        proton_log(LOG_ERROR, "%s is not a static bundle of version %d or is damaged",
+                   path, PROTON_BUNDLE_VERSION);
+        return PROTON_ERROR;
+    }
+    
+    proton_log(LOG_INFO, "Static file module serving %u entries from %s", h->nentries, path);
+    return PROTON_OK;
+}
+
+static void bundle_close(void) {
+    if (bundle) munmap((void*)bundle, bundle_size);
+    if (bundle_fd >= 0) close(bundle_fd);
+    bundle = NULL;
+    bundle_size = 0;
+    bundle_fd = -1;
+}
+
+/* gzip in Accept-Encoding, unless with q=0 */
+static int accepts_gzip(proton_http_request_t *req) {
+    const char *p = proton_http_get_header(req, "Accept-Encoding");
+    
+    while (p && *p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *name = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t len = p - name;
+        
+        const char *end = strchr(p, ',');
+        if (!end) end = p + strlen(p);
+        
+        if (len == 4 && strncasecmp(name, "gzip", 4) == 0) {
+            const char *q = memmem(p, end - p, "q=", 2);
+            return !q || strtod(q + 2, NULL) > 0;
+        }
+        
+        p = end;
+    }
+    
+    return 0;
+}
+
+/* If-None-Match with the entry's ETag, or * */
+static int etag_matches(proton_http_request_t *req, const proton_bundle_entry_t *e) {
+    const char *p = proton_http_get_header(req, "If-None-Match");
+    const char *etag = bundle + e->etag;
+    
+    if (!p) return 0;
+    if (strcmp(p, "*") == 0) return 1;
+    
+    while ((p = strchr(p, '"')) != NULL) {
+        const char *end = strchr(p + 1, '"');
+        if (!end) return 0;
+        if ((size_t)(end + 1 - p) == e->etag_len && memcmp(p, etag, e->etag_len) == 0) return 1;
+        p = end + 1;
+    }
+    
+    return 0;
+}
+
+static int serve_bundle(proton_http_connection_t *conn) {
+    proton_http_request_t *req = conn->request;
+    proton_http_response_t *res = conn->response;
+    
+    const proton_bundle_entry_t *e = proton_bundle_lookup(bundle, bundle_size, req->uri, strlen(req->uri));
+    if (!e) return PROTON_MODULE_DECLINED;
+    
+    int gzip = e->gzip_len > 0 && accepts_gzip(req);
+    uint64_t data = gzip ? e->gzip : e->data;
+    uint64_t len = gzip ? e->gzip_len : e->data_len;
+    
+    res->status = etag_matches(req, e) ? HTTP_STATUS_NOT_MODIFIED : HTTP_STATUS_OK;
+    const char *headers = bundle + e->headers + (gzip ? e->headers_len : 0);
+    size_t headers_len = gzip ? e->gzip_headers_len : e->headers_len;
+    int body = req->method == HTTP_GET && res->status == HTTP_STATUS_OK;
+    
+    if (conn->stream) {
+        proton_http_response_add_raw_headers(res, headers, headers_len);
+        if (!body) res->file_len = len;
+        else if (len > 0) proton_http_response_write(res, bundle + data, len);
+        return PROTON_MODULE_HANDLED;
+    }
+    
+    res->raw_headers = headers;
+    res->raw_headers_len = headers_len;
+    
+    /* HEAD and 304 only need the length; sendfile cannot go through TLS */
+    if (!body || (len > BUNDLE_COPY_MAX && !conn->ssl)) {
+        res->file_fd = bundle_fd;
+        res->file_offset = data;
+        res->file_len = len;
+    } else if (len > 0) {
+        proton_http_response_write(res, bundle + data, len);
+    }
+    
+    return PROTON_MODULE_HANDLED;
 }
 
 static int mod_static_init(proton_config_t *config) {
+    if (config->static_bundle) {
+        return bundle_open(config->static_bundle);
+    }
+    
     if (config->document_root) {
         size_t len = strlen(config->document_root);
         document_root = malloc(len + 1);
@@ -56,6 +176,10 @@ static int mod_static_handler(proton_http_connection_t *conn) {
         return PROTON_MODULE_DECLINED;
     }
     
+    if (bundle) {
+        return serve_bundle(conn);
+    }
+    
     /* Build file path */
     char filepath[4096];
     snprintf(filepath, sizeof(filepath), "%s%s", document_root, req->uri);
@@ -96,7 +220,7 @@ static int mod_static_handler(proton_http_connection_t *conn) {
     
     /* Set response headers */
     res->status = HTTP_STATUS_OK;
-    proton_http_response_add_header(res, "Content-Type", get_mime_type(filepath));
+    proton_http_response_add_header(res, "Content-Type", proton_http_mime_type(filepath));
     
     /* Read and send file */
     if (req->method == HTTP_GET) {
@@ -110,12 +234,14 @@ static int mod_static_handler(proton_http_connection_t *conn) {
     
     close(fd);
     
-    proton_log(LOG_INFO, "Served static file: %s (%ld bytes)", filepath, st.st_size);
+    proton_log(LOG_DEBUG, "Served static file: %s (%ld bytes)", filepath, st.st_size);
     
     return PROTON_MODULE_HANDLED;
 }
 
 static void mod_static_cleanup(void) {
+    bundle_close();
+    
     if (document_root) {
         free(document_root);
         document_root = NULL;
@@ -125,6 +251,6 @@ static void mod_static_cleanup(void) {
 proton_module_t mod_static = {
     .name = "static",
     .init = mod_static_init,
-    .handler = mod_static_handler,
+    .phases = { [PROTON_PHASE_CONTENT] = mod_static_handler },
     .cleanup = mod_static_cleanup
 };
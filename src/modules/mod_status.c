@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <string.h>
+#include "proton.h"
+#include "http.h"
+#include "module.h"
+#include "websocket.h"
+
+/*
+ * stub_status: aggregated scoreboard counters of all workers.
+ *
+ *   location = /status { stub_status; }
+ *
+ * A WebSocket to the same location gets the counters pushed every second,
+ * and right away for any message it sends.
+ */
+
+#define PUSH_INTERVAL   1000    /* msec */
+
+extern proton_event_loop_t *event_loop;
+
+/* WebSocket subscribers of this worker */
+typedef struct subscriber_s {
+    proton_http_connection_t *conn;
+    struct subscriber_s *prev;
+    struct subscriber_s *next;
+} subscriber_t;
+
+static subscriber_t *subscribers = NULL;
+static proton_timer_t push_timer;
+
+static int status_text(char *buf, size_t size) {
+    proton_stats_t total;
+    int workers = proton_scoreboard_collect(&total);
+    
+    /* Connections not reading or writing are idle keepalives */
+    int64_t waiting = total.active - total.reading - total.writing;
+    if (waiting < 0) waiting = 0;
+    
+    return snprintf(buf, size,
+        "Active connections: %lld \n"
+        "server accepts handled requests\n"
+        " %llu %llu %llu \n"
+        "Reading: %lld Writing: %lld Waiting: %lld \n"
+        "Bytes: in %llu out %llu\n"
+        "Responses: 1xx %llu 2xx %llu 3xx %llu 4xx %llu 5xx %llu\n"
+        "Workers: %d respawns %llu uptime %lld\n",
+        (long long)total.active,
+        (unsigned long long)total.accepted, (unsigned long long)total.handled,
+        (unsigned long long)total.requests,
+        (long long)total.reading, (long long)total.writing, (long long)waiting,
+        (unsigned long long)total.bytes_in, (unsigned long long)total.bytes_out,
+        (unsigned long long)total.responses[0], (unsigned long long)total.responses[1],
+        (unsigned long long)total.responses[2], (unsigned long long)total.responses[3],
+        (unsigned long long)total.responses[4],
+        workers, (unsigned long long)proton_scoreboard->respawns,
+        (long long)(proton_current_sec - proton_scoreboard->start_sec));
+}
+
+static void push_status(proton_http_connection_t *conn) {
+    char buf[1024];
+    int len = status_text(buf, sizeof(buf));
+    proton_ws_send(conn, PROTON_WS_TEXT, buf, len);
+}
+
+/* One timer for all subscribers, armed while there are any */
+static void push_timer_handler(proton_timer_t *timer) {
+    for (subscriber_t *sub = subscribers; sub; sub = sub->next) {
+        push_status(sub->conn);
+    }
+    
+    proton_timer_add(event_loop, timer, PUSH_INTERVAL);
+}
+
+static int ws_message(proton_http_connection_t *conn, int opcode, const char *data, size_t len) {
+    (void)opcode;
+    (void)data;
+    (void)len;
+    
+    push_status(conn);
+    return PROTON_OK;
+}
+
+static void ws_close(proton_http_connection_t *conn) {
+    subscriber_t *sub = conn->module_ctx;
+    
+    if (sub->prev) sub->prev->next = sub->next;
+    else subscribers = sub->next;
+    if (sub->next) sub->next->prev = sub->prev;
+    
+    if (!subscribers) {
+        proton_timer_del(event_loop, &push_timer);
+    }
+}
+
+static const proton_ws_handler_t ws_handler = {
+    .on_message = ws_message,
+    .on_close = ws_close
+};
+
+static int subscribe(proton_http_connection_t *conn) {
+    subscriber_t *sub = proton_pool_alloc(conn->pool, sizeof(subscriber_t));
+    if (!sub) return PROTON_MODULE_ERROR;
+    
+    int ret = proton_ws_accept(conn, &ws_handler, sub);
+    if (!conn->ws) return ret;
+    
+    sub->conn = conn;
+    sub->prev = NULL;
+    sub->next = subscribers;
+    if (subscribers) subscribers->prev = sub;
+    subscribers = sub;
+    
+    if (!sub->next) {
+        proton_timer_init(&push_timer, push_timer_handler, NULL);
+        proton_timer_add(event_loop, &push_timer, PUSH_INTERVAL);
+    }
+    
+    return ret;
+}
+
+static int mod_status_handler(proton_http_connection_t *conn) {
+    if (!conn || !conn->request) return PROTON_MODULE_ERROR;
+    
+    proton_http_request_t *req = conn->request;
+    proton_http_response_t *res = conn->response;
+    
+    if (req->method != HTTP_GET && req->method != HTTP_HEAD) {
+        return PROTON_MODULE_DECLINED;
+    }
+    
+    if (proton_ws_is_upgrade(req) && !conn->stream) {
+        return subscribe(conn);
+    }
+    
+    char buf[1024];
+    int len = status_text(buf, sizeof(buf));
+    
+    res->status = HTTP_STATUS_OK;
+    proton_http_response_add_header(res, "Content-Type", "text/plain");
+    proton_http_response_add_header(res, "Cache-Control", "no-cache");
+    
+    if (req->method == HTTP_GET) {
+        proton_http_response_write(res, buf, len);
+    }
+    
+    return PROTON_MODULE_HANDLED;
+}
+
+static int mod_status_applies(proton_location_t *loc, int phase) {
+    (void)phase;
+    return loc && loc->stub_status;
+}
+
+proton_module_t mod_status = {
+    .name = "status",
+    .init = NULL,
+    .phases = { [PROTON_PHASE_CONTENT] = mod_status_handler },
+    .applies = mod_status_applies,
+    .cleanup = NULL
+};
@@ -1,17 +1,132 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "proton.h"
 #include "module.h"
 
 /* External module declarations */
+extern proton_module_t mod_status;
+extern proton_module_t mod_metrics;
+extern proton_module_t mod_access;
+extern proton_module_t mod_limit_req;
+extern proton_module_t mod_limit_conn;
+extern proton_module_t mod_proxy;
+extern proton_module_t mod_fastcgi;
+extern proton_module_t mod_dav;
 extern proton_module_t mod_static;
+extern proton_module_t mod_access_log;
 
 /* Module registry */
 proton_module_t *proton_modules[] = {
+    &mod_status,
+    &mod_metrics,
+    &mod_access,
+    &mod_limit_req,
+    &mod_limit_conn,
+    &mod_proxy,
+    &mod_fastcgi,
+    &mod_dav,
     &mod_static,
+    &mod_access_log,
     NULL
 };
 
+static int nmodules = 0;
+static int nworker_modules = 0;    /* whose init_worker has run */
+
+/* Modules whose handlers run in each phase of one location */
+typedef struct {
+    proton_module_t **modules[PROTON_PHASE_MAX];
+    int nmodules[PROTON_PHASE_MAX];
+} phase_table_t;
+
+/* Built at config time; index 0 serves requests outside every location */
+static phase_table_t *phase_tables = NULL;
+static int nphase_tables = 0;
+
+static int module_applies(proton_module_t *mod, proton_location_t *loc, int phase) {
+    return mod->applies && mod->applies(loc, phase);
+}
+
+static int build_phase(phase_table_t *table, proton_location_t *loc, int phase) {
+    int count = 0;
+    while (proton_modules[count]) count++;
+    
+    proton_module_t **list = calloc(count + 1, sizeof(proton_module_t*));
+    if (!list) return PROTON_ERROR;
+    
+    int n = 0;
+    
+    /* A content handler bound to the location replaces the generic ones */
+    if (phase == PROTON_PHASE_CONTENT) {
+        for (int i = 0; i < count; i++) {
+            proton_module_t *mod = proton_modules[i];
+            if (mod->phases[phase] && module_applies(mod, loc, phase)) list[n++] = mod;
+        }
+    }
+    
+    int claimed = n > 0;
+    
+    for (int i = 0; i < count; i++) {
+        proton_module_t *mod = proton_modules[i];
+        if (!mod->phases[phase]) continue;
+        
+        if (mod->applies) {
+            if (phase == PROTON_PHASE_CONTENT || !mod->applies(loc, phase)) continue;
+        } else if (phase == PROTON_PHASE_CONTENT && claimed) {
+            continue;
+        }
+        
+        list[n++] = mod;
+    }
+    
+    table->modules[phase] = list;
+    table->nmodules[phase] = n;
+    return PROTON_OK;
+}
+
+static void free_phase_tables(void) {
+    for (int i = 0; i < nphase_tables; i++) {
+        for (int phase = 0; phase < PROTON_PHASE_MAX; phase++) {
+            free(phase_tables[i].modules[phase]);
+        }
+    }
+    
+    free(phase_tables);
+    phase_tables = NULL;
+    nphase_tables = 0;
+}
+
+static int build_phase_tables(proton_config_t *config) {
+    phase_tables = calloc(config->nlocations + 1, sizeof(phase_table_t));
+    if (!phase_tables) return PROTON_ERROR;
+    nphase_tables = config->nlocations + 1;
+    
+    for (int i = 0; i < nphase_tables; i++) {
+        proton_location_t *loc = i > 0 ? &config->locations[i - 1] : NULL;
+        
+        for (int phase = 0; phase < PROTON_PHASE_MAX; phase++) {
+            if (build_phase(&phase_tables[i], loc, phase) != PROTON_OK) {
+                free_phase_tables();
+                return PROTON_ERROR;
+            }
+        }
+    }
+    
+    return PROTON_OK;
+}
+
+static phase_table_t* phase_table(proton_http_request_t *req) {
+    if (!phase_tables) return NULL;
+    
+    int index = req->location ? req->location->index + 1 : 0;
+    return index < nphase_tables ? &phase_tables[index] : &phase_tables[0];
+}
+
 int proton_modules_init(proton_config_t *config) {
+    for (nmodules = 0; proton_modules[nmodules] != NULL; nmodules++) {
+        proton_modules[nmodules]->index = nmodules;
+    }
+    
     for (int i = 0; proton_modules[i] != NULL; i++) {
         proton_module_t *mod = proton_modules[i];
         
@@ -25,33 +140,123 @@ int proton_modules_init(proton_config_t *config) {
         }
     }
     
+    return build_phase_tables(config);
+}
+
+int proton_modules_init_worker(proton_event_loop_t *loop) {
+    loop->module_ctx = calloc(nmodules, sizeof(void*));
+    if (!loop->module_ctx) return PROTON_ERROR;
+    
+    for (nworker_modules = 0; nworker_modules < nmodules; nworker_modules++) {
+        proton_module_t *mod = proton_modules[nworker_modules];
+        
+        if (mod->init_worker && mod->init_worker(loop) != PROTON_OK) {
+            proton_log(LOG_ERROR, "Failed to initialize module %s in the worker", mod->name);
+            proton_modules_exit_worker(loop);
+            return PROTON_ERROR;
+        }
+    }
+    
     return PROTON_OK;
 }
 
-int proton_modules_handle_request(proton_http_connection_t *conn) {
-    for (int i = 0; proton_modules[i] != NULL; i++) {
+/* In reverse, for the modules whose init_worker ran */
+void proton_modules_exit_worker(proton_event_loop_t *loop) {
+    while (nworker_modules > 0) {
+        proton_module_t *mod = proton_modules[--nworker_modules];
+        if (mod->exit_worker) mod->exit_worker(loop);
+    }
+    
+    free(loop->module_ctx);
+    loop->module_ctx = NULL;
+}
+
+void* proton_module_conn_ctx(proton_http_connection_t *conn, proton_module_t *mod) {
+    return conn->ctx ? conn->ctx[mod->index] : NULL;
+}
+
+/* The slots are allocated when a module first sets one */
+int proton_module_set_conn_ctx(proton_http_connection_t *conn, proton_module_t *mod, void *ctx) {
+    if (!conn->ctx) {
+        if (!ctx) return PROTON_OK;
+        conn->ctx = calloc(nmodules, sizeof(void*));
+        if (!conn->ctx) return PROTON_ERROR;
+    }
+    
+    conn->ctx[mod->index] = ctx;
+    return PROTON_OK;
+}
+
+void proton_modules_free_conn_ctx(proton_http_connection_t *conn) {
+    if (!conn->ctx) return;
+    
+    for (int i = 0; i < nmodules; i++) {
         proton_module_t *mod = proton_modules[i];
-        
-        if (mod->handler) {
-            int ret = mod->handler(conn);
+        if (conn->ctx[i] && mod->free_conn_ctx) mod->free_conn_ctx(conn, conn->ctx[i]);
+    }
+    
+    free(conn->ctx);
+    conn->ctx = NULL;
+}
+
+/* Run the phases up to and including content, from where the request stands */
+static int run_phases(proton_http_connection_t *conn) {
+    proton_http_request_t *req = conn->request;
+    phase_table_t *table = phase_table(req);
+    if (!table) return PROTON_MODULE_DECLINED;
+    
+    for (; req->phase < PROTON_PHASE_LOG; req->phase++, req->phase_index = 0) {
+        for (; req->phase_index < table->nmodules[req->phase]; req->phase_index++) {
+            proton_module_t *mod = table->modules[req->phase][req->phase_index];
+            int ret = mod->phases[req->phase](conn);
             
-            if (ret == PROTON_MODULE_HANDLED) {
-                return PROTON_MODULE_HANDLED;
-            }
+            if (ret == PROTON_MODULE_DECLINED) continue;
+            if (ret == PROTON_MODULE_OK) break;
             
             if (ret == PROTON_MODULE_ERROR) {
                 proton_log(LOG_ERROR, "Module %s returned error", mod->name);
-                return PROTON_MODULE_ERROR;
             }
-            
-            /* PROTON_MODULE_DECLINED - continue to next module */
+            return ret;
         }
     }
     
     return PROTON_MODULE_DECLINED;
 }
 
+int proton_modules_handle_request(proton_http_connection_t *conn) {
+    conn->request->phase = 0;
+    conn->request->phase_index = 0;
+    return run_phases(conn);
+}
+
+/* Go on after the handler that suspended the request, as if it had returned rc */
+int proton_modules_resume(proton_http_connection_t *conn, int rc) {
+    proton_http_request_t *req = conn->request;
+    
+    if (rc == PROTON_MODULE_DECLINED) {
+        req->phase_index++;
+    } else if (rc == PROTON_MODULE_OK) {
+        req->phase++;
+        req->phase_index = 0;
+    } else {
+        return rc;
+    }
+    
+    return run_phases(conn);
+}
+
+void proton_modules_log_request(proton_http_connection_t *conn) {
+    phase_table_t *table = phase_table(conn->request);
+    if (!table) return;
+    
+    for (int i = 0; i < table->nmodules[PROTON_PHASE_LOG]; i++) {
+        table->modules[PROTON_PHASE_LOG][i]->phases[PROTON_PHASE_LOG](conn);
+    }
+}
+
 void proton_modules_cleanup(void) {
+    free_phase_tables();
+    
     for (int i = 0; proton_modules[i] != NULL; i++) {
         proton_module_t *mod = proton_modules[i];
         
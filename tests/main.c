@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include "proton.h"
+#include "test.h"
+
+/*
+ *   unit-tests                    run every suite
+ *   unit-tests -p proton-pack     with the packer for the bundle suite
+ *   unit-tests -f cidr            only suites whose name contains cidr
+ */
+
+/* What proton.c defines for the server */
+volatile sig_atomic_t proton_quit = 0;
+volatile sig_atomic_t proton_reload = 0;
+volatile sig_atomic_t proton_reopen = 0;
+volatile sig_atomic_t proton_shutdown = 0;
+volatile sig_atomic_t proton_upgrade = 0;
+pid_t proton_pid;
+const char *proton_config_file = "proton.conf";
+char **proton_argv;
+
+int test_checks = 0;
+int test_failures = 0;
+
+static const char *pack = NULL;
+
+static void run_bundle(void) {
+    test_bundle(pack);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} suites[] = {
+    { "parser", test_parser },
+    { "hpack",  test_hpack },
+    { "cidr",   test_cidr },
+    { "bundle", run_bundle },
+};
+
+#define NSUITES (sizeof(suites) / sizeof(suites[0]))
+
+int main(int argc, char **argv) {
+    const char *filter = NULL;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "p:f:h")) != -1) {
+        switch (opt) {
+            case 'p': pack = optarg; break;
+            case 'f': filter = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-p proton-pack] [-f filter]\n", argv[0]);
+                return 1;
+        }
+    }
+    
+    proton_pid = getpid();
+    
+    /* Errors the tests provoke on purpose would mix with the report */
+    proton_log_init(NULL, LOG_ERROR + 1);
+    
+    for (size_t i = 0; i < NSUITES; i++) {
+        if (filter && !strstr(suites[i].name, filter)) continue;
+        
+        int checks = test_checks, failures = test_failures;
+        suites[i].run();
+        printf("%-8s %4d checks, %d failed\n", suites[i].name,
+               test_checks - checks, test_failures - failures);
+    }
+    
+    if (test_failures > 0) {
+        printf("FAILED: %d of %d checks\n", test_failures, test_checks);
+        return 1;
+    }
+    
+    printf("All %d checks passed\n", test_checks);
+    return 0;
+}
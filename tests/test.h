@@ -0,0 +1,29 @@
+#ifndef PROTON_TEST_H
+#define PROTON_TEST_H
+
+#include <stdio.h>
+
+/*
+ * Unit tests, linked against the server's objects and run by "make test".
+ * A failed CHECK is reported with its line and the suite goes on, so one
+ * run shows every failure.
+ */
+
+extern int test_checks;
+extern int test_failures;
+
+#define CHECK(cond) do { \
+        test_checks++; \
+        if (!(cond)) { \
+            test_failures++; \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while (0)
+
+/* The suites, one per file */
+void test_parser(void);
+void test_hpack(void);
+void test_cidr(void);
+void test_bundle(const char *pack);
+
+#endif /* PROTON_TEST_H */
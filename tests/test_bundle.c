@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bundle.h"
+#include "proton.h"
+#include "test.h"
+
+/* Lookups in a bundle packed by proton-pack from a small tree, and in damaged copies of it */
+
+static const struct {
+    const char *file;
+    const char *content;
+} files[] = {
+    { "index.html",         "<html>home</html>\n" },
+    { "css/app.css",        "body { margin: 0 }\n" },
+    { "js/app.3f9c2b.js",   "console.log('proton');\n" },
+    { "docs/index.html",    "<html>docs</html>\n" },
+    { "docs/guide.txt",     NULL },     /* large and compressible, for a gzip variant */
+    { "empty",              "" },
+};
+
+#define NFILES (sizeof(files) / sizeof(files[0]))
+
+static char guide[8192];
+
+static const char* content(size_t i) {
+    return files[i].content ? files[i].content : guide;
+}
+
+static int write_tree(const char *dir) {
+    char path[512];
+    
+    for (size_t i = 0; i < NFILES; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i].file);
+        
+        char *slash = strrchr(path, '/');
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+        
+        FILE *fp = fopen(path, "w");
+        if (!fp) return -1;
+        fputs(content(i), fp);
+        fclose(fp);
+    }
+    return 0;
+}
+
+static char* read_file(const char *path, size_t *size) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+    
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+    
+    char *data = malloc(*size ? *size : 1);
+    if (data && fread(data, 1, *size, fp) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+static const proton_bundle_entry_t* find(const char *bundle, size_t size, const char *path) {
+    return proton_bundle_lookup(bundle, size, path, strlen(path));
+}
+
+static int serves(const char *bundle, size_t size, const char *path, const char *expected) {
+    const proton_bundle_entry_t *e = find(bundle, size, path);
+    return e && e->data_len == strlen(expected) && memcmp(bundle + e->data, expected, e->data_len) == 0 &&
+           e->path_len == strlen(path) && memcmp(bundle + e->path, path, e->path_len) == 0;
+}
+
+static void test_lookup(const char *bundle, size_t size) {
+    for (size_t i = 0; i < NFILES; i++) {
+        char path[256];
+        snprintf(path, sizeof(path), "/%s", files[i].file);
+        CHECK(serves(bundle, size, path, content(i)));
+    }
+    
+    /* Directories get their index.html */
+    CHECK(serves(bundle, size, "/", files[0].content));
+    CHECK(serves(bundle, size, "/docs/", files[3].content));
+    
+    static const char *missing[] = {
+        "", "/docs", "/index.htm", "/css/app.css/", "/CSS/app.css", "/css/", "/js/app.js",
+        "/index.html?x", "/../index.html", NULL
+    };
+    for (int i = 0; missing[i]; i++) {
+        CHECK(find(bundle, size, missing[i]) == NULL);
+    }
+    
+    /* Whatever slot a path lands on, only its own entry is returned */
+    int wrong = 0;
+    for (int i = 0; i < 10000; i++) {
+        char path[32];
+        snprintf(path, sizeof(path), "/f%d.html", i);
+        if (find(bundle, size, path)) wrong++;
+    }
+    CHECK(wrong == 0);
+    
+    const proton_bundle_entry_t *e = find(bundle, size, "/docs/guide.txt");
+    CHECK(e && e->gzip_len > 0 && e->gzip_len < e->data_len);
+    CHECK(e && e->etag_len > 2 && bundle[e->etag] == '"');
+    CHECK(e && e->headers_len > 0 && memmem(bundle + e->headers, e->headers_len, "text/plain", 10));
+    
+    e = find(bundle, size, "/index.html");
+    CHECK(e && e->gzip_len == 0);
+}
+
+static void test_damaged(const char *bundle, size_t size) {
+    char *copy = malloc(size);
+    if (!copy) return;
+    proton_bundle_header_t *h = (proton_bundle_header_t*)copy;
+    
+    memcpy(copy, bundle, size);
+    CHECK(proton_bundle_check(copy, size - 1) == NULL);
+    CHECK(proton_bundle_check(copy, sizeof(proton_bundle_header_t) - 1) == NULL);
+    
+    copy[0] ^= 1;
+    CHECK(proton_bundle_check(copy, size) == NULL);
+    
+    memcpy(copy, bundle, size);
+    h->version++;
+    CHECK(proton_bundle_check(copy, size) == NULL);
+    
+    memcpy(copy, bundle, size);
+    h->nentries = size;
+    CHECK(proton_bundle_check(copy, size) == NULL);
+    
+    memcpy(copy, bundle, size);
+    h->slots = size - 4;
+    CHECK(proton_bundle_check(copy, size) == NULL);
+    
+    memcpy(copy, bundle, size);
+    h->nbuckets = 0;
+    CHECK(proton_bundle_check(copy, size) == NULL);
+    
+    /* An entry pointing outside the file is not returned */
+    memcpy(copy, bundle, size);
+    proton_bundle_entry_t *e = (proton_bundle_entry_t*)find(copy, size, "/css/app.css");
+    CHECK(e != NULL);
+    if (e) {
+        e->data_len = size;
+        CHECK(find(copy, size, "/css/app.css") == NULL);
+        CHECK(find(copy, size, "/index.html") != NULL);
+    }
+    
+    free(copy);
+}
+
+void test_bundle(const char *pack) {
+    if (!pack) {
+        printf("bundle: no proton-pack given (-p), skipped\n");
+        return;
+    }
+    
+    for (size_t i = 0; i + 1 < sizeof(guide); i++) {
+        guide[i] = "Proton serves static files from a bundle.\n"[i % 42];
+    }
+    
+    char dir[] = "/tmp/proton-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        CHECK(!"mkdtemp");
+        return;
+    }
+    
+    char tree[64], out[64], cmd[512];
+    snprintf(tree, sizeof(tree), "%s/tree", dir);
+    snprintf(out, sizeof(out), "%s/site.bundle", dir);
+    mkdir(tree, 0755);
+    
+    CHECK(write_tree(tree) == 0);
+    snprintf(cmd, sizeof(cmd), "%s -z %s %s > /dev/null", pack, tree, out);
+    CHECK(system(cmd) == 0);
+    
+    size_t size = 0;
+    char *bundle = read_file(out, &size);
+    CHECK(bundle != NULL);
+    
+    const proton_bundle_header_t *h = bundle ? proton_bundle_check(bundle, size) : NULL;
+    CHECK(h != NULL);
+    if (h) {
+        /* Every file, plus / and /docs/ */
+        CHECK(h->nentries == NFILES + 2);
+        test_lookup(bundle, size);
+        test_damaged(bundle, size);
+    }
+    
+    free(bundle);
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) fprintf(stderr, "Cannot remove %s\n", dir);
+}
@@ -0,0 +1,304 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proton.h"
+#include "http.h"
+#include "cidr.h"
+#include "test.h"
+
+/* Prefix parsing, trie lookups checked against a scan of the rules, and geo variables */
+
+static uint64_t rng = 0x2545f4914f6cdd1dULL;
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static proton_cidr_rule_t rule(const char *text, uint16_t value) {
+    proton_cidr_rule_t r;
+    memset(&r, 0, sizeof(r));
+    if (proton_cidr_parse(text, &r) != PROTON_OK) abort();
+    r.value = value;
+    return r;
+}
+
+static uint16_t lookup4(const proton_cidr_t *table, const char *text) {
+    uint8_t addr[4];
+    inet_pton(AF_INET, text, addr);
+    return proton_cidr_lookup(table, addr);
+}
+
+static uint16_t lookup6(const proton_cidr_t *table, const char *text) {
+    uint8_t addr[16];
+    inet_pton(AF_INET6, text, addr);
+    return proton_cidr_lookup(table, addr);
+}
+
+static void test_parse(void) {
+    proton_cidr_rule_t r;
+    static const uint8_t net[4] = { 192, 168, 0, 0 };
+    
+    CHECK(proton_cidr_parse("192.168.0.0/16", &r) == PROTON_OK);
+    CHECK(r.family == AF_INET && r.len == 16 && memcmp(r.addr, net, 4) == 0);
+    
+    /* Host bits are dropped */
+    CHECK(proton_cidr_parse("192.168.7.9/16", &r) == PROTON_OK);
+    CHECK(r.len == 16 && memcmp(r.addr, net, 4) == 0);
+    CHECK(proton_cidr_parse("10.1.2.3", &r) == PROTON_OK);
+    CHECK(r.family == AF_INET && r.len == 32 && r.addr[3] == 3);
+    CHECK(proton_cidr_parse("0.0.0.0/0", &r) == PROTON_OK);
+    CHECK(r.len == 0);
+    
+    CHECK(proton_cidr_parse("2001:db8::/32", &r) == PROTON_OK);
+    CHECK(r.family == AF_INET6 && r.len == 32 && r.addr[0] == 0x20 && r.addr[3] == 0xb8);
+    CHECK(proton_cidr_parse("2001:db8::1", &r) == PROTON_OK);
+    CHECK(r.len == 128 && r.addr[15] == 1);
+    CHECK(proton_cidr_parse("2001:db8:ffff::/33", &r) == PROTON_OK);
+    CHECK(r.addr[4] == 0x80 && r.addr[5] == 0);
+    
+    static const char *bad[] = {
+        "", "/8", "10.0.0.0/", "10.0.0.0/33", "10.0.0.0/-1", "10.0.0.0/8x", "10.0.0.256",
+        "2001:db8::/129", "example.com", "10.0.0.0/ 8", NULL
+    };
+    for (int i = 0; bad[i]; i++) {
+        CHECK(proton_cidr_parse(bad[i], &r) == PROTON_ERROR);
+    }
+}
+
+/* allow / deny take the first rule covering the address, geo the most specific */
+static void test_modes(void) {
+    proton_cidr_rule_t rules[] = {
+        rule("10.0.0.0/8", 1),
+        rule("10.1.0.0/16", 2),
+        rule("10.1.2.0/24", 3),
+        rule("10.1.2.0/24", 4),
+        rule("192.168.1.1", 5),
+    };
+    int n = sizeof(rules) / sizeof(rules[0]);
+    
+    proton_cidr_t *first = proton_cidr_build(rules, n, AF_INET, PROTON_CIDR_FIRST);
+    proton_cidr_t *longest = proton_cidr_build(rules, n, AF_INET, PROTON_CIDR_LONGEST);
+    CHECK(first && longest);
+    if (!first || !longest) return;
+    
+    CHECK(lookup4(first, "10.1.2.3") == 1);
+    CHECK(lookup4(longest, "10.1.2.3") == 4);
+    CHECK(lookup4(longest, "10.1.3.3") == 2);
+    CHECK(lookup4(longest, "10.200.0.1") == 1);
+    CHECK(lookup4(longest, "192.168.1.1") == 5);
+    CHECK(lookup4(longest, "192.168.1.2") == PROTON_CIDR_NONE);
+    CHECK(lookup4(first, "11.0.0.0") == PROTON_CIDR_NONE);
+    CHECK(lookup4(first, "9.255.255.255") == PROTON_CIDR_NONE);
+    
+    proton_cidr_destroy(first);
+    proton_cidr_destroy(longest);
+    
+    /* A /0 covers everything; rules of the other family are left out */
+    proton_cidr_rule_t mixed[] = {
+        rule("2001:db8::/32", 7),
+        rule("0.0.0.0/0", 8),
+        rule("2001:db8:1::/48", 9),
+    };
+    
+    proton_cidr_t *v4 = proton_cidr_build(mixed, 3, AF_INET, PROTON_CIDR_LONGEST);
+    proton_cidr_t *v6 = proton_cidr_build(mixed, 3, AF_INET6, PROTON_CIDR_LONGEST);
+    CHECK(v4 && v6);
+    if (!v4 || !v6) return;
+    
+    CHECK(lookup4(v4, "203.0.113.9") == 8);
+    CHECK(lookup6(v6, "2001:db8:1::1") == 9);
+    CHECK(lookup6(v6, "2001:db8:2::1") == 7);
+    CHECK(lookup6(v6, "2001:db9::1") == PROTON_CIDR_NONE);
+    
+    proton_cidr_destroy(v4);
+    proton_cidr_destroy(v6);
+}
+
+static int covers(const proton_cidr_rule_t *r, const uint8_t *addr) {
+    int bits = r->len;
+    int i = 0;
+    
+    for (; bits >= 8; bits -= 8, i++) {
+        if (r->addr[i] != addr[i]) return 0;
+    }
+    return bits == 0 || ((r->addr[i] ^ addr[i]) & (0xff << (8 - bits))) == 0;
+}
+
+static uint16_t scan(const proton_cidr_rule_t *rules, int nrules, const uint8_t *addr, int mode) {
+    uint16_t value = PROTON_CIDR_NONE;
+    int best = -1;
+    
+    for (int i = 0; i < nrules; i++) {
+        if (!covers(&rules[i], addr)) continue;
+        if (mode == PROTON_CIDR_FIRST) return rules[i].value;
+        if (rules[i].len >= best) {
+            best = rules[i].len;
+            value = rules[i].value;
+        }
+    }
+    return value;
+}
+
+/* Random prefixes, with lengths on both sides of the direct-indexed bits */
+static void test_random(int family, int mode) {
+    int size = family == AF_INET ? 4 : 16;
+    int nrules = 3000;
+    proton_cidr_rule_t *rules = calloc(nrules, sizeof(proton_cidr_rule_t));
+    if (!rules) return;
+    
+    for (int i = 0; i < nrules; i++) {
+        proton_cidr_rule_t *r = &rules[i];
+        uint64_t a = next_random(), b = next_random();
+        memcpy(r->addr, &a, 8);
+        memcpy(r->addr + 8, &b, 8);
+        
+        /* A few top bytes, so that prefixes nest and overlap */
+        r->addr[0] = 10 + next_random() % 4;
+        if (family == AF_INET6) r->addr[1] = 0;
+        
+        r->family = family;
+        r->len = next_random() % (size * 8 + 1);
+        r->value = i;
+        
+        for (int j = 0; j < 16; j++) {
+            int keep = r->len - 8 * j;
+            if (keep <= 0) r->addr[j] = 0;
+            else if (keep < 8) r->addr[j] &= 0xff << (8 - keep);
+        }
+    }
+    
+    proton_cidr_t *table = proton_cidr_build(rules, nrules, family, mode);
+    CHECK(table != NULL);
+    
+    int mismatches = 0;
+    for (int i = 0; table && i < 20000; i++) {
+        uint8_t addr[16];
+        uint64_t a = next_random(), b = next_random();
+        memcpy(addr, &a, 8);
+        memcpy(addr + 8, &b, 8);
+        
+        /* Most of them inside some rule's prefix */
+        if (i % 4 != 0) {
+            const proton_cidr_rule_t *r = &rules[next_random() % nrules];
+            int bits = r->len, j = 0;
+            for (; bits >= 8; bits -= 8, j++) addr[j] = r->addr[j];
+            if (bits > 0) addr[j] = (r->addr[j] & (0xff << (8 - bits))) | (addr[j] & (0xff >> bits));
+        }
+        
+        if (proton_cidr_lookup(table, addr) != scan(rules, nrules, addr, mode)) mismatches++;
+    }
+    CHECK(mismatches == 0);
+    
+    proton_cidr_destroy(table);
+    free(rules);
+}
+
+static void test_set(void) {
+    proton_cidr_rule_t rules[] = {
+        rule("127.0.0.0/8", 1),
+        rule("::1", 2),
+    };
+    proton_cidr_rule_t unix_rule = { .family = AF_UNIX, .value = 3 };
+    proton_cidr_rule_t all[3] = { rules[0], rules[1], unix_rule };
+    
+    proton_cidr_set_t set;
+    CHECK(proton_cidr_set_build(&set, all, 3, PROTON_CIDR_FIRST) == PROTON_OK);
+    
+    proton_http_connection_t conn;
+    memset(&conn, 0, sizeof(conn));
+    
+    struct sockaddr_in *sin = (struct sockaddr_in*)&conn.sockaddr;
+    sin->sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &sin->sin_addr);
+    CHECK(proton_cidr_set_lookup(&set, &conn) == 1);
+    inet_pton(AF_INET, "128.0.0.1", &sin->sin_addr);
+    CHECK(proton_cidr_set_lookup(&set, &conn) == PROTON_CIDR_NONE);
+    
+    /* IPv4-mapped clients of a dual-stack listener are looked up as IPv4 */
+    memset(&conn.sockaddr, 0, sizeof(conn.sockaddr));
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&conn.sockaddr;
+    sin6->sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "::ffff:127.0.0.1", &sin6->sin6_addr);
+    CHECK(proton_cidr_set_lookup(&set, &conn) == 1);
+    inet_pton(AF_INET6, "::1", &sin6->sin6_addr);
+    CHECK(proton_cidr_set_lookup(&set, &conn) == 2);
+    inet_pton(AF_INET6, "::2", &sin6->sin6_addr);
+    CHECK(proton_cidr_set_lookup(&set, &conn) == PROTON_CIDR_NONE);
+    
+    memset(&conn.sockaddr, 0, sizeof(conn.sockaddr));
+    conn.sockaddr.ss_family = AF_UNIX;
+    CHECK(proton_cidr_set_lookup(&set, &conn) == 3);
+    
+    proton_cidr_set_destroy(&set);
+    
+    /* Without IPv6 rules there is no IPv6 table, and nothing matches */
+    CHECK(proton_cidr_set_build(&set, rules, 1, PROTON_CIDR_FIRST) == PROTON_OK);
+    CHECK(set.v4 != NULL && set.v6 == NULL && set.unix_value == PROTON_CIDR_NONE);
+    conn.sockaddr.ss_family = AF_INET6;
+    CHECK(proton_cidr_set_lookup(&set, &conn) == PROTON_CIDR_NONE);
+    proton_cidr_set_destroy(&set);
+}
+
+static void test_geo(void) {
+    proton_cidr_rule_t office[] = { rule("10.0.0.0/8", 1), rule("10.9.0.0/16", 2), rule("::1", 3) };
+    proton_cidr_rule_t dc[] = { rule("127.0.0.0/8", 1) };
+    char *office_values[] = { "external", "internal", "lab", "localhost" };
+    char *dc_values[] = { "", "loopback" };
+    
+    proton_geo_t geos[] = {
+        { "network", office_values, 4, office, 3 },
+        { "dc", dc_values, 2, dc, 1 },
+    };
+    proton_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.geos = geos;
+    config.ngeos = 2;
+    
+    CHECK(proton_geos_init(&config) == PROTON_OK);
+    
+    int network = proton_geo_find("network", 7);
+    int dcs = proton_geo_find("dc", 2);
+    CHECK(network >= 0 && dcs >= 0 && network != dcs);
+    CHECK(proton_geo_find("net", 3) < 0);
+    CHECK(proton_geo_find("networks", 8) < 0);
+    
+    proton_http_connection_t conn;
+    memset(&conn, 0, sizeof(conn));
+    struct sockaddr_in *sin = (struct sockaddr_in*)&conn.sockaddr;
+    sin->sin_family = AF_INET;
+    
+    inet_pton(AF_INET, "10.9.1.1", &sin->sin_addr);
+    CHECK(strcmp(proton_geo_value(network, &conn), "lab") == 0);
+    CHECK(strcmp(proton_geo_value(dcs, &conn), "") == 0);
+    inet_pton(AF_INET, "10.1.1.1", &sin->sin_addr);
+    CHECK(strcmp(proton_geo_value(network, &conn), "internal") == 0);
+    inet_pton(AF_INET, "127.0.0.1", &sin->sin_addr);
+    CHECK(strcmp(proton_geo_value(network, &conn), "external") == 0);
+    CHECK(strcmp(proton_geo_value(dcs, &conn), "loopback") == 0);
+    CHECK(proton_geo_value(5, &conn) == NULL);
+    
+    proton_geos_cleanup();
+    CHECK(proton_geo_find("network", 7) < 0);
+    
+    /* Two blocks defining one variable are refused */
+    geos[1].name = "network";
+    CHECK(proton_geos_init(&config) == PROTON_ERROR);
+    proton_geos_cleanup();
+}
+
+void test_cidr(void) {
+    test_parse();
+    test_modes();
+    test_random(AF_INET, PROTON_CIDR_FIRST);
+    test_random(AF_INET, PROTON_CIDR_LONGEST);
+    test_random(AF_INET6, PROTON_CIDR_FIRST);
+    test_random(AF_INET6, PROTON_CIDR_LONGEST);
+    test_set();
+    test_geo();
+}
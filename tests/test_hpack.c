@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include "proton.h"
+#include "hpack.h"
+#include "test.h"
+
+/* HPACK decoding against the examples of RFC 7541 appendix C, and the encoder against the decoder */
+
+#define MAX_HEADERS     16
+
+typedef struct {
+    int n;
+    char lines[MAX_HEADERS][512];       /* "name: value" */
+} headers_t;
+
+static int collect(void *data, const char *name, size_t name_len, const char *value, size_t value_len) {
+    headers_t *h = data;
+    if (h->n == MAX_HEADERS) return PROTON_ERROR;
+    
+    snprintf(h->lines[h->n++], sizeof(h->lines[0]), "%.*s: %.*s",
+             (int)name_len, name, (int)value_len, value);
+    return PROTON_OK;
+}
+
+/* "8286 8441 ..." into bytes */
+static size_t unhex(const char *hex, unsigned char *out) {
+    size_t n = 0;
+    
+    while (*hex) {
+        if (*hex == ' ') {
+            hex++;
+            continue;
+        }
+        
+        unsigned int byte;
+        sscanf(hex, "%2x", &byte);
+        out[n++] = byte;
+        hex += 2;
+    }
+    return n;
+}
+
+static int decodes(proton_hpack_t *hp, const char *hex, headers_t *h) {
+    unsigned char block[256];
+    size_t len = unhex(hex, block);
+    
+    memset(h, 0, sizeof(*h));
+    return proton_hpack_decode(hp, block, len, collect, h);
+}
+
+static int has_lines(const headers_t *h, const char **lines) {
+    int n = 0;
+    for (; lines[n]; n++) {
+        if (n >= h->n || strcmp(h->lines[n], lines[n]) != 0) return 0;
+    }
+    return n == h->n;
+}
+
+/* C.3 and C.4: the same three requests, sharing one dynamic table, plain and Huffman coded */
+static void test_rfc_requests(const char *const blocks[3]) {
+    static const char *first[] = {
+        ":method: GET", ":scheme: http", ":path: /", ":authority: www.example.com", NULL
+    };
+    static const char *second[] = {
+        ":method: GET", ":scheme: http", ":path: /", ":authority: www.example.com",
+        "cache-control: no-cache", NULL
+    };
+    static const char *third[] = {
+        ":method: GET", ":scheme: https", ":path: /index.html", ":authority: www.example.com",
+        "custom-key: custom-value", NULL
+    };
+    
+    proton_hpack_t hp;
+    headers_t h;
+    proton_hpack_init(&hp, PROTON_HPACK_TABLE_SIZE);
+    
+    CHECK(decodes(&hp, blocks[0], &h) == PROTON_OK);
+    CHECK(has_lines(&h, first));
+    CHECK(hp.count == 1 && hp.size == 57);
+    
+    CHECK(decodes(&hp, blocks[1], &h) == PROTON_OK);
+    CHECK(has_lines(&h, second));
+    CHECK(hp.count == 2 && hp.size == 110);
+    
+    CHECK(decodes(&hp, blocks[2], &h) == PROTON_OK);
+    CHECK(has_lines(&h, third));
+    CHECK(hp.count == 3 && hp.size == 164);
+    
+    proton_hpack_free(&hp);
+}
+
+static void test_rfc_examples(void) {
+    static const char *const plain[3] = {
+        "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+        "8286 84be 5808 6e6f 2d63 6163 6865",
+        "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+    };
+    static const char *const huffman[3] = {
+        "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+        "8286 84be 5886 a8eb 1064 9cbf",
+        "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+    };
+    
+    test_rfc_requests(plain);
+    test_rfc_requests(huffman);
+}
+
+/* Each of these is a COMPRESSION_ERROR */
+static void test_malformed(void) {
+    static const char *blocks[] = {
+        "80",                   /* index 0 */
+        "be",                   /* index 62 with an empty dynamic table */
+        "ff 80 80 80 80 10",    /* index that overflows */
+        "41 05 61 62",          /* literal cut short */
+        "40 81 ff",             /* Huffman string that is all EOS padding */
+        "3f e2 1f",             /* table size update to 4097, over the limit */
+        "82 20",                /* table size update after a header */
+        NULL
+    };
+    
+    for (int i = 0; blocks[i]; i++) {
+        proton_hpack_t hp;
+        headers_t h;
+        proton_hpack_init(&hp, PROTON_HPACK_TABLE_SIZE);
+        CHECK(decodes(&hp, blocks[i], &h) == PROTON_ERROR);
+        proton_hpack_free(&hp);
+    }
+}
+
+/* Blocks from the encoder decode to what went in, and both tables stay in step */
+static void test_round_trip(void) {
+    static const char *response[][2] = {
+        { ":status", "200" },
+        { "content-type", "text/html; charset=utf-8" },
+        { "content-length", "5120" },
+        { "cache-control", "max-age=3600" },
+        { "server", "proton" },
+        { "x-request-id", "7c9e6679-7425-40de-944b-e07fc1f90ae7" },
+        { "etag", "\"5f2a-18c3e7b1a40\"" },
+        { "x-custom", "" },
+    };
+    int nresponse = sizeof(response) / sizeof(response[0]);
+    
+    proton_hpack_t enc, dec;
+    proton_hpack_init(&enc, PROTON_HPACK_TABLE_SIZE);
+    proton_hpack_init(&dec, PROTON_HPACK_TABLE_SIZE);
+    proton_buffer_t *out = proton_buffer_create(1024);
+    size_t first_len = 0;
+    
+    for (int round = 0; round < 6; round++) {
+        /* The peer shrinks the table, then lets it grow back */
+        if (round == 3) proton_hpack_set_limit(&enc, 64);
+        if (round == 5) proton_hpack_set_limit(&enc, 65536);
+        
+        out->len = 0;
+        CHECK(proton_hpack_encode_begin(&enc, out) == PROTON_OK);
+        for (int i = 0; i < nresponse; i++) {
+            CHECK(proton_hpack_encode(&enc, out, response[i][0], strlen(response[i][0]),
+                                      response[i][1], strlen(response[i][1])) == PROTON_OK);
+        }
+        if (round == 0) first_len = out->len;
+        
+        headers_t h;
+        memset(&h, 0, sizeof(h));
+        CHECK(proton_hpack_decode(&dec, (unsigned char*)out->data, out->len, collect, &h) == PROTON_OK);
+        CHECK(h.n == nresponse);
+        for (int i = 0; i < nresponse && i < h.n; i++) {
+            char line[128];
+            snprintf(line, sizeof(line), "%s: %s", response[i][0], response[i][1]);
+            CHECK(strcmp(h.lines[i], line) == 0);
+        }
+        
+        CHECK(enc.size == dec.size);
+        CHECK(enc.count == dec.count);
+        CHECK(dec.size <= dec.max_size);
+        
+        /* Repeats come out of the dynamic table */
+        if (round == 1) CHECK(out->len < first_len / 2);
+    }
+    
+    /* Never more than the default, whatever the peer allows */
+    CHECK(enc.max_size == PROTON_HPACK_TABLE_SIZE);
+    
+    proton_buffer_destroy(out);
+    proton_hpack_free(&enc);
+    proton_hpack_free(&dec);
+}
+
+/* An entry larger than the table empties it instead of being added */
+static void test_eviction(void) {
+    proton_hpack_t hp;
+    headers_t h;
+    proton_hpack_init(&hp, 256);
+    
+    char big[300];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    
+    proton_hpack_t enc;
+    proton_hpack_init(&enc, 256);
+    proton_buffer_t *out = proton_buffer_create(1024);
+    memset(&h, 0, sizeof(h));
+    
+    CHECK(proton_hpack_encode(&enc, out, "x-small", 7, "1", 1) == PROTON_OK);
+    CHECK(proton_hpack_decode(&hp, (unsigned char*)out->data, out->len, collect, &h) == PROTON_OK);
+    CHECK(hp.count == 1);
+    
+    out->len = 0;
+    memset(&h, 0, sizeof(h));
+    CHECK(proton_hpack_encode(&enc, out, "x-big", 5, big, strlen(big)) == PROTON_OK);
+    CHECK(proton_hpack_decode(&hp, (unsigned char*)out->data, out->len, collect, &h) == PROTON_OK);
+    CHECK(h.n == 1 && strlen(h.lines[0]) == 7 + strlen(big));
+    CHECK(hp.count == enc.count);
+    CHECK(hp.size == enc.size);
+    CHECK(hp.size <= 256);
+    
+    proton_buffer_destroy(out);
+    proton_hpack_free(&enc);
+    proton_hpack_free(&hp);
+}
+
+void test_hpack(void) {
+    test_rfc_examples();
+    test_malformed();
+    test_round_trip();
+    test_eviction();
+}
@@ -0,0 +1,136 @@
+#include <string.h>
+#include "proton.h"
+#include "http.h"
+#include "test.h"
+
+/* Request line, headers and body framing of proton_http_parse_request */
+
+static proton_buffer_t *buf;
+static proton_http_request_t req;
+
+/* The parser writes into the buffer, so each request gets a fresh copy */
+static int parse(const char *text) {
+    if (req.pool) proton_pool_destroy(req.pool);
+    memset(&req, 0, sizeof(req));
+    
+    buf->len = 0;
+    proton_buffer_append(buf, text, strlen(text));
+    return proton_http_parse_request(buf, &req);
+}
+
+static void test_request_line(void) {
+    CHECK(parse("GET /search?q=proton&page=2 HTTP/1.1\r\nHost: example.com\r\n\r\n") == PROTON_OK);
+    CHECK(req.method == HTTP_GET);
+    CHECK(req.version == HTTP_VERSION_11);
+    CHECK(strcmp(req.uri, "/search") == 0);
+    CHECK(req.query_string && strcmp(req.query_string, "q=proton&page=2") == 0);
+    CHECK(strcmp(req.request_line, "GET /search?q=proton&page=2 HTTP/1.1") == 0);
+    
+    CHECK(parse("HEAD / HTTP/1.0\r\n\r\n") == PROTON_OK);
+    CHECK(req.method == HTTP_HEAD);
+    CHECK(req.version == HTTP_VERSION_10);
+    CHECK(req.query_string == NULL);
+    CHECK(req.headers == NULL);
+    
+    CHECK(parse("MKCOL /dav/dir/ HTTP/1.1\r\n\r\n") == PROTON_OK);
+    CHECK(req.method == HTTP_MKCOL);
+    
+    CHECK(parse("BREW /pot HTTP/1.1\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("get / HTTP/1.1\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("GET / HTTP/2.0\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("GET /\r\n\r\n") == PROTON_ERROR);
+}
+
+static void test_headers(void) {
+    CHECK(parse("GET / HTTP/1.1\r\n"
+                "Host: example.com\r\n"
+                "X-Padded: \t spaced out \t\r\n"
+                "X-Empty:\r\n"
+                "Accept: */*\r\n"
+                "\r\n") == PROTON_OK);
+    
+    CHECK(strcmp(proton_http_get_header(&req, "host"), "example.com") == 0);
+    CHECK(strcmp(proton_http_get_header(&req, "HOST"), "example.com") == 0);
+    CHECK(strcmp(proton_http_get_header(&req, "X-Padded"), "spaced out") == 0);
+    CHECK(strcmp(proton_http_get_header(&req, "X-Empty"), "") == 0);
+    CHECK(strcmp(proton_http_get_header(&req, "Accept"), "*/*") == 0);
+    CHECK(proton_http_get_header(&req, "Cookie") == NULL);
+    
+    CHECK(parse("GET / HTTP/1.1\r\nNo colon here\r\n\r\n") == PROTON_ERROR);
+}
+
+/* Until the blank line the request is incomplete; what follows is not its header */
+static void test_incomplete_and_pipelined(void) {
+    CHECK(parse("GET / HTTP/1.1\r\nHost: exam") == PROTON_AGAIN);
+    CHECK(parse("GET / HTTP/1.1\r\nHost: example.com\r\n") == PROTON_AGAIN);
+    CHECK(parse("") == PROTON_AGAIN);
+    
+    const char *first = "GET /a HTTP/1.1\r\nHost: example.com\r\n\r\n";
+    char two[256];
+    snprintf(two, sizeof(two), "%sGET /b HTTP/1.1\r\nHost: example.com\r\n\r\n", first);
+    
+    CHECK(parse(two) == PROTON_OK);
+    CHECK(strcmp(req.uri, "/a") == 0);
+    CHECK(req.header_len == strlen(first));
+    CHECK(memcmp(buf->data + req.header_len, "GET /b ", 7) == 0);
+    
+    CHECK(parse("POST /up HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello") == PROTON_OK);
+    CHECK(buf->len - req.header_len == 5);
+    CHECK(memcmp(buf->data + req.header_len, "hello", 5) == 0);
+}
+
+static void test_framing(void) {
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 42\r\n\r\n") == PROTON_OK);
+    CHECK(req.content_length == 42);
+    CHECK(!req.chunked);
+    
+    CHECK(parse("GET / HTTP/1.1\r\n\r\n") == PROTON_OK);
+    CHECK(req.content_length == 0);
+    
+    /* Repeated equal lengths are one length; different ones are refused */
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 7\r\nContent-Length: 7\r\n\r\n") == PROTON_OK);
+    CHECK(req.content_length == 7);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 7\r\nContent-Length: 8\r\n\r\n") == PROTON_ERROR);
+    
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: +5\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 5x\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length:\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 9999999999999999999\r\n\r\n") == PROTON_ERROR);
+    
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") == PROTON_OK);
+    CHECK(req.chunked);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, Chunked\r\n\r\n") == PROTON_OK);
+    CHECK(req.chunked);
+    
+    /* Anything a proxy in front could read with a different length */
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked, gzip\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: xchunked\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: identity\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 5\r\n\r\n") == PROTON_ERROR);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n") ==
+          PROTON_ERROR);
+}
+
+static void test_has_token(void) {
+    CHECK(proton_http_has_token("keep-alive, Upgrade", "upgrade"));
+    CHECK(proton_http_has_token("close", "close"));
+    CHECK(proton_http_has_token(" gzip ,\tchunked\t", "chunked"));
+    CHECK(!proton_http_has_token("upgrade-insecure-requests", "upgrade"));
+    CHECK(!proton_http_has_token("", "close"));
+    CHECK(!proton_http_has_token(NULL, "close"));
+}
+
+void test_parser(void) {
+    buf = proton_buffer_create(4096);
+    
+    test_request_line();
+    test_headers();
+    test_incomplete_and_pipelined();
+    test_framing();
+    test_has_token();
+    
+    if (req.pool) proton_pool_destroy(req.pool);
+    memset(&req, 0, sizeof(req));
+    proton_buffer_destroy(buf);
+}
@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# Benchmark build/proton serving public/ on loopback. Prints one JSON
+# object per scenario, tagged with the commit, so runs can be compared:
+#
+#   tools/bench.sh > before.json; git checkout ...; tools/bench.sh > after.json
+#
+# Environment: DURATION (seconds, 10), THREADS (2), CONNECTIONS (64),
+# RATE for the open workload (10000), WORKERS (proton workers, 1),
+# PORT (18999). proton-bench fails the run if its request and response
+# counts disagree; the pipeline scenario also fails if any request is lost.
+
+set -e
+cd "$(dirname "$0")/.."
+
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-2}
+CONNECTIONS=${CONNECTIONS:-64}
+RATE=${RATE:-10000}
+WORKERS=${WORKERS:-1}
+PORT=${PORT:-18999}
+
+BENCH=build/proton-bench
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+DIR=$(mktemp -d)
+
+if [ ! -x build/proton ] || [ ! -x $BENCH ]; then
+    echo "Build first: make release && make bench" >&2
+    exit 1
+fi
+
+cat > $DIR/proton.conf <<EOF
+worker_processes $WORKERS;
+error_log stderr;
+events {
+    worker_connections 16384;
+}
+http {
+    access_log /dev/null;
+    keepalive_requests 100000000;
+    server {
+        listen 127.0.0.1:$PORT backlog=4096;
+        listen unix:$DIR/proton.sock backlog=4096;
+        root $PWD/public;
+        location / {
+            index index.html;
+        }
+    }
+}
+EOF
+
+cat > $DIR/mix <<EOF
+# weight path
+8 /
+4 /index.html
+1 /missing
+EOF
+
+build/proton -c $DIR/proton.conf > $DIR/proton.log 2>&1 &
+PROTON=$!
+trap 'kill -QUIT $PROTON 2>/dev/null; wait $PROTON 2>/dev/null; rm -rf $DIR' EXIT
+
+for i in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null && break
+    sleep 0.1
+done
+
+run() {
+    local name=$1
+    shift
+    local result
+    result=$($BENCH -j -t $THREADS -d $DURATION "$@")
+    echo "{\"scenario\":\"$name\",\"commit\":\"$COMMIT\",\"result\":$result}"
+}
+
+run keepalive       -c $CONNECTIONS 127.0.0.1:$PORT /
+run close           -c $CONNECTIONS -n 127.0.0.1:$PORT /
+
+# Nothing pipelined may go unanswered on connections that stay open
+pipeline=$(run pipeline -c $THREADS -p 16 127.0.0.1:$PORT /)
+echo "$pipeline"
+case "$pipeline" in
+    *'"lost":0}'*) ;;
+    *) echo "pipeline: requests lost" >&2; exit 1 ;;
+esac
+
+run mix             -c $CONNECTIONS -m $DIR/mix 127.0.0.1:$PORT
+run unix            -c $CONNECTIONS unix:$DIR/proton.sock /
+run open            -c $CONNECTIONS -R $RATE 127.0.0.1:$PORT /
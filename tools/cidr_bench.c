@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "proton.h"
+#include "cidr.h"
+
+/*
+ * Build time, size and lookup speed of the allow / deny tries on a
+ * generated prefix list, a million prefixes per family by default with
+ * lengths spread roughly like a routing table's. Half the addresses looked
+ * up are inside some prefix and half are random.
+ *
+ *   cidr-bench                 1M IPv4 and 1M IPv6 prefixes
+ *   cidr-bench -n 100000 -c 2000
+ *
+ * -c compares that many lookups against a scan of the rule list.
+ */
+
+#define LOOKUPS     (1 << 20)
+#define RUNS        5
+#define V6_BLOCKS   32768
+
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int random_len(int family) {
+    int r = next_random() % 100;
+    
+    if (family == AF_INET) {
+        if (r < 60) return 24;
+        if (r < 85) return 20 + r % 4;
+        if (r < 95) return 16 + r % 4;
+        return r % 2 ? 8 + r % 8 : 25 + r % 8;
+    }
+    
+    if (r < 50) return 48;
+    if (r < 75) return 32 + r % 16;
+    return 49 + r % 16;
+}
+
+static void random_rule(proton_cidr_rule_t *rule, int family) {
+    uint64_t a = next_random(), b = next_random();
+    int len = random_len(family);
+    
+    memset(rule, 0, sizeof(*rule));
+    memcpy(rule->addr, &a, 8);
+    memcpy(rule->addr + 8, &b, 8);
+    
+    /* IPv6 prefixes are more specifics of a few thousand /32s in 2000::/3 */
+    if (family == AF_INET6) {
+        uint32_t block = 0x20000000u | (uint32_t)(next_random() % V6_BLOCKS) * 4099 % 0x20000000u;
+        rule->addr[0] = block >> 24;
+        rule->addr[1] = block >> 16;
+        rule->addr[2] = block >> 8;
+        rule->addr[3] = block;
+    }
+    rule->family = family;
+    rule->len = len;
+    rule->value = next_random() & 1;
+    
+    for (int i = 0; i < 16; i++) {
+        int keep = len - 8 * i;
+        if (keep <= 0) rule->addr[i] = 0;
+        else if (keep < 8) rule->addr[i] &= 0xff << (8 - keep);
+    }
+}
+
+static int covers(const proton_cidr_rule_t *rule, const uint8_t *addr) {
+    int bits = rule->len;
+    int i = 0;
+    
+    for (; bits >= 8; bits -= 8, i++) {
+        if (rule->addr[i] != addr[i]) return 0;
+    }
+    return bits == 0 || ((rule->addr[i] ^ addr[i]) & (0xff << (8 - bits))) == 0;
+}
+
+/* What the trie should answer: the first rule covering the address */
+static uint16_t scan(const proton_cidr_rule_t *rules, int nrules, const uint8_t *addr) {
+    for (int i = 0; i < nrules; i++) {
+        if (covers(&rules[i], addr)) return rules[i].value;
+    }
+    return PROTON_CIDR_NONE;
+}
+
+static int run(int family, int nrules, int ncheck) {
+    int size = family == AF_INET ? 4 : 16;
+    proton_cidr_rule_t *rules = malloc(nrules * sizeof(proton_cidr_rule_t));
+    uint8_t *addrs = malloc((size_t)LOOKUPS * size);
+    if (!rules || !addrs) return 1;
+    
+    for (int i = 0; i < nrules; i++) {
+        random_rule(&rules[i], family);
+    }
+    
+    /* Odd addresses are inside a rule's prefix, even ones anywhere */
+    for (int i = 0; i < LOOKUPS; i++) {
+        uint8_t *addr = addrs + (size_t)i * size;
+        uint64_t a = next_random(), b = next_random();
+        uint8_t random[16];
+        memcpy(random, &a, 8);
+        memcpy(random + 8, &b, 8);
+        memcpy(addr, random, size);
+        if (!(i & 1)) continue;
+        
+        const proton_cidr_rule_t *rule = &rules[next_random() % nrules];
+        for (int j = 0; j < size; j++) {
+            int keep = rule->len - 8 * j;
+            uint8_t mask = keep >= 8 ? 0xff : (keep <= 0 ? 0 : 0xff << (8 - keep));
+            addr[j] = (rule->addr[j] & mask) | (random[j] & ~mask);
+        }
+    }
+    
+    uint64_t start = now_ns();
+    proton_cidr_t *table = proton_cidr_build(rules, nrules, family, PROTON_CIDR_FIRST);
+    uint64_t built = now_ns() - start;
+    if (!table) {
+        fprintf(stderr, "build failed\n");
+        return 1;
+    }
+    
+    uint64_t best = UINT64_MAX;
+    uint64_t denied = 0;
+    for (int r = 0; r < RUNS; r++) {
+        denied = 0;
+        start = now_ns();
+        for (int i = 0; i < LOOKUPS; i++) {
+            denied += proton_cidr_lookup(table, addrs + (size_t)i * size) == 1;
+        }
+        uint64_t t = now_ns() - start;
+        if (t < best) best = t;
+    }
+    
+    printf("%s: %d prefixes, built in %.0f ms, %.1f MB, %.1f ns/lookup, %.1f%% denied\n",
+           family == AF_INET ? "ipv4" : "ipv6", nrules, built / 1e6,
+           proton_cidr_memory(table) / 1048576.0, (double)best / LOOKUPS, 100.0 * denied / LOOKUPS);
+    
+    int failed = 0;
+    for (int i = 0; i < ncheck && i < LOOKUPS; i++) {
+        const uint8_t *addr = addrs + (size_t)i * size;
+        uint16_t want = scan(rules, nrules, addr);
+        uint16_t got = proton_cidr_lookup(table, addr);
+        if (want != got) {
+            fprintf(stderr, "lookup %d: got %u, want %u\n", i, got, want);
+            failed = 1;
+            break;
+        }
+    }
+    if (ncheck > 0 && !failed) printf("%s: %d lookups match a scan of the rules\n",
+                                      family == AF_INET ? "ipv4" : "ipv6", ncheck);
+    
+    proton_cidr_destroy(table);
+    free(addrs);
+    free(rules);
+    return failed;
+}
+
+int main(int argc, char **argv) {
+    int nrules = 1000000;
+    int ncheck = 0;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+            case 'n': nrules = atoi(optarg); break;
+            case 'c': ncheck = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n prefixes] [-c checked lookups]\n", argv[0]);
+                return 2;
+        }
+    }
+    
+    if (nrules <= 0) return 2;
+    
+    return run(AF_INET, nrules, ncheck) || run(AF_INET6, nrules, ncheck);
+}
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+/*
+ * Minimal FastCGI responder for trying out fastcgi_pass without a PHP
+ * installation. One process per connection; honours FCGI_KEEP_CONN.
+ *
+ *   fcgi_responder 127.0.0.1:9000
+ *   fcgi_responder unix:/tmp/fcgi.sock
+ *
+ * The response depends on the script name:
+ *
+ *   .../status/NNN   replies with Status: NNN
+ *   .../redirect     replies with Location: only
+ *   .../length       sends Content-Length
+ *   .../big          sends 4 MB of output in several STDOUT records
+ *   .../stderr       writes a line to STDERR as well
+ *   anything else    echoes the parameters and the size of the body
+ */
+
+#define FCGI_BEGIN_REQUEST  1
+#define FCGI_END_REQUEST    3
+#define FCGI_PARAMS         4
+#define FCGI_STDIN          5
+#define FCGI_STDOUT         6
+#define FCGI_STDERR         7
+#define FCGI_KEEP_CONN      1
+
+typedef struct {
+    int type;
+    int id;
+    unsigned char *data;
+    size_t len;
+} record_t;
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} str_t;
+
+static void str_append(str_t *s, const void *data, size_t len) {
+    if (s->len + len > s->cap) {
+        s->cap = (s->len + len) * 2;
+        s->buf = realloc(s->buf, s->cap);
+        if (!s->buf) exit(1);
+    }
+    memcpy(s->buf + s->len, data, len);
+    s->len += len;
+}
+
+static void str_puts(str_t *s, const char *text) {
+    str_append(s, text, strlen(text));
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    size_t have = 0;
+    while (have < len) {
+        ssize_t n = read(fd, (char*)buf + have, len - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        have += n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, (const char*)buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static int read_record(int fd, record_t *r) {
+    unsigned char h[8];
+    if (read_full(fd, h, 8) < 0) return -1;
+    
+    r->type = h[1];
+    r->id = (h[2] << 8) | h[3];
+    r->len = (h[4] << 8) | h[5];
+    
+    unsigned char *data = malloc(r->len + h[6] + 1);
+    if (!data || read_full(fd, data, r->len + h[6]) < 0) {
+        free(data);
+        return -1;
+    }
+    r->data = data;
+    return 0;
+}
+
+static int write_record(int fd, int type, int id, const void *data, size_t len) {
+    while (1) {
+        size_t n = len > 65535 ? 65535 : len;
+        unsigned char h[8] = { 1, type, id >> 8, id, n >> 8, n, 0, 0 };
+        
+        if (write_full(fd, h, 8) < 0 || write_full(fd, data, n) < 0) return -1;
+        
+        data = (const char*)data + n;
+        len -= n;
+        if (len == 0) return 0;
+    }
+}
+
+static size_t pair_len(const unsigned char **p) {
+    if (**p < 128) return *(*p)++;
+    size_t len = ((size_t)((*p)[0] & 0x7f) << 24) | ((*p)[1] << 16) | ((*p)[2] << 8) | (*p)[3];
+    *p += 4;
+    return len;
+}
+
+static const char* param(str_t *params, const char *name) {
+    const unsigned char *p = (const unsigned char*)params->buf;
+    const unsigned char *end = p + params->len;
+    
+    while (p < end) {
+        size_t nl = pair_len(&p);
+        size_t vl = pair_len(&p);
+        if (nl == strlen(name) && memcmp(p, name, nl) == 0) {
+            static char value[4096];
+            snprintf(value, sizeof(value), "%.*s", (int)vl, p + nl);
+            return value;
+        }
+        p += nl + vl;
+    }
+    return "";
+}
+
+static int respond(int fd, int id, str_t *params, size_t body_len) {
+    char script[4096];
+    snprintf(script, sizeof(script), "%s", param(params, "SCRIPT_NAME"));
+    const char *status = strstr(script, "/status/");
+    str_t out = { 0 };
+    char line[8192];
+    int n;
+    
+    if (status) {
+        n = snprintf(line, sizeof(line), "Status: %s\r\nContent-Type: text/plain\r\n\r\nstatus %s\n",
+                     status + 8, status + 8);
+        str_append(&out, line, n);
+    } else if (strstr(script, "/redirect")) {
+        str_puts(&out, "Location: /elsewhere\r\n\r\n");
+    } else if (strstr(script, "/length")) {
+        str_puts(&out, "Content-Type: text/plain\r\nContent-Length: 6\r\n\r\nlength");
+    } else if (strstr(script, "/big")) {
+        str_puts(&out, "Content-Type: application/octet-stream\n\n");
+        for (int i = 0; i < 4 * 1024 * 1024 / 64; i++) {
+            n = snprintf(line, sizeof(line), "%063d\n", i);
+            str_append(&out, line, n);
+        }
+    } else {
+        str_puts(&out, "Content-Type: text/plain\r\nX-Responder: fcgi\r\n\r\n");
+        
+        const char *names[] = {
+            "REQUEST_METHOD", "REQUEST_URI", "SCRIPT_NAME", "SCRIPT_FILENAME", "QUERY_STRING",
+            "CONTENT_LENGTH", "REMOTE_ADDR", "SERVER_NAME", "HTTP_HOST", "HTTP_X_TEST", "APP_ENV", NULL
+        };
+        for (int i = 0; names[i]; i++) {
+            n = snprintf(line, sizeof(line), "%s=%s\n", names[i], param(params, names[i]));
+            str_append(&out, line, n);
+        }
+        n = snprintf(line, sizeof(line), "body=%zu pid=%d\n", body_len, (int)getpid());
+        str_append(&out, line, n);
+    }
+    
+    if (strstr(script, "/stderr")) {
+        write_record(fd, FCGI_STDERR, id, "something went wrong\n", 21);
+    }
+    
+    /* Uneven pieces so that the client sees records split anywhere */
+    size_t off = 0, piece = 1000;
+    while (off < out.len) {
+        size_t len = out.len - off < piece ? out.len - off : piece;
+        if (write_record(fd, FCGI_STDOUT, id, out.buf + off, len) < 0) {
+            free(out.buf);
+            return -1;
+        }
+        off += len;
+        piece = piece * 3 % 70000 + 1;
+    }
+    free(out.buf);
+    
+    unsigned char end[8] = { 0 };
+    if (write_record(fd, FCGI_STDOUT, id, NULL, 0) < 0) return -1;
+    return write_record(fd, FCGI_END_REQUEST, id, end, 8);
+}
+
+static void serve(int fd) {
+    while (1) {
+        str_t params = { 0 };
+        size_t body_len = 0;
+        int keep = 0, id = 0;
+        int stdin_done = 0;
+        record_t r;
+        
+        while (!stdin_done) {
+            if (read_record(fd, &r) < 0) {
+                free(params.buf);
+                return;
+            }
+            
+            if (r.type == FCGI_BEGIN_REQUEST && r.len >= 8) {
+                id = r.id;
+                keep = r.data[2] & FCGI_KEEP_CONN;
+            } else if (r.type == FCGI_PARAMS) {
+                str_append(&params, r.data, r.len);
+            } else if (r.type == FCGI_STDIN) {
+                body_len += r.len;
+                stdin_done = r.len == 0;
+            }
+            free(r.data);
+        }
+        
+        int ret = respond(fd, id, &params, body_len);
+        free(params.buf);
+        if (ret < 0 || !keep) return;
+    }
+}
+
+static int listen_on(const char *address) {
+    int fd;
+    
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", address + 5);
+        unlink(sun.sun_path);
+        
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0) return -1;
+    } else {
+        const char *colon = strrchr(address, ':');
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(atoi(colon ? colon + 1 : address));
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        
+        int one = 1;
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) return -1;
+    }
+    
+    return listen(fd, 128) < 0 ? -1 : fd;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s host:port | unix:/path\n", argv[0]);
+        return 1;
+    }
+    
+    int lfd = listen_on(argv[1]);
+    if (lfd < 0) {
+        perror("listen");
+        return 1;
+    }
+    
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) continue;
+        
+        if (fork() == 0) {
+            close(lfd);
+            serve(fd);
+            _exit(0);
+        }
+        close(fd);
+    }
+}
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# Training workload for "make pgo": runs the instrumented build/proton
+# against public/ on loopback so that the profile covers the paths that
+# matter in production: static files with and without keepalive,
+# pipelining, 404s, malformed requests, stub_status, metrics and the
+# access log. The workers write their profile when they exit.
+#
+# Environment: SECONDS_PER_RUN (5), PORT (18998).
+
+set -e
+cd "$(dirname "$0")/.."
+
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-5}
+PORT=${PORT:-18998}
+BENCH=build/proton-bench
+DIR=$(mktemp -d)
+
+cat > $DIR/proton.conf <<EOF
+worker_processes 2;
+error_log stderr;
+events {
+    worker_connections 4096;
+}
+http {
+    log_format main '\$remote_addr [\$time_local] "\$request" \$status \$body_bytes_sent \$request_time';
+    access_log $DIR/access.log main buffer=64k flush=1s;
+    server {
+        listen 127.0.0.1:$PORT backlog=4096;
+        root $PWD/public;
+        location = /status {
+            stub_status;
+        }
+        location = /metrics {
+            metrics;
+        }
+        location / {
+            index index.html;
+        }
+    }
+}
+EOF
+
+build/proton -c $DIR/proton.conf > $DIR/proton.log 2>&1 &
+PROTON=$!
+trap 'kill -QUIT $PROTON 2>/dev/null; wait $PROTON 2>/dev/null; rm -rf $DIR' EXIT
+
+for i in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null && break
+    sleep 0.1
+done
+
+ADDR=127.0.0.1:$PORT
+run() {
+    echo "pgo-train: $*"
+    $BENCH -t 2 -d $SECONDS_PER_RUN "$@" > /dev/null
+}
+
+run -c 64 $ADDR / /index.html=4
+run -c 16 -n $ADDR /
+run -c 4 -p 16 $ADDR /
+run -c 16 $ADDR /index.html=8 /missing=2 /static/../../etc/passwd /status /metrics
+run -c 16 -H 'Accept-Encoding: gzip, deflate, br' -H 'Cookie: session=0123456789abcdef' $ADDR /
+
+# Malformed and unusual requests, one connection each
+for i in $(seq 50); do
+    for request in 'GARBAGE\r\n\r\n' 'GET / HTTP/1.0\r\n\r\n' 'GET /x%zz HTTP/1.1\r\nConnection: close\r\n\r\n' \
+                   'HEAD / HTTP/1.1\r\nHost: a\r\nConnection: close\r\n\r\n' \
+                   'POST / HTTP/1.1\r\nHost: a\r\nConnection: close\r\nContent-Length: 5\r\n\r\nhello' \
+                   'GET / HTTP/1.1\r\nHost: a\r\nIf-Modified-Since: Mon, 01 Jan 2035 00:00:00 GMT\r\nConnection: close\r\n\r\n'; do
+        (exec 3<>/dev/tcp/127.0.0.1/$PORT && printf "$request" >&3 && timeout 1 cat <&3 > /dev/null) 2>/dev/null || true
+    done
+done
+
+echo "pgo-train: done"
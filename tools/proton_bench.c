@@ -0,0 +1,862 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * HTTP/1.1 load generator. Each thread runs its own epoll loop over its
+ * share of the connections.
+ *
+ *   proton-bench -t 2 -c 64 -d 10 127.0.0.1:8080 /
+ *   proton-bench -R 20000 -c 64 -p 4 unix:/run/proton/proton.sock /a /b=3
+ *
+ * Without -R the workload is closed: each connection keeps -p requests in
+ * flight and sends the next as soon as a response is in. With -R the
+ * workload is open: requests are due at a fixed rate whether or not the
+ * server keeps up, and latency is measured from when a request was due
+ * rather than when it could be sent, so a stall counts against every
+ * request it held up (coordinated omission correction).
+ *
+ * Paths may carry a weight (/a=3); -m reads "weight path" lines instead.
+ * -n sends Connection: close and opens a connection per request. -j
+ * prints one JSON object for scripts; see tools/bench.sh.
+ */
+
+#define MAX_PATHS       256
+#define MAX_HEADERS     32
+#define MAX_PIPELINE    256
+#define READ_SIZE       65536
+
+/* Log-linear latency histogram in microseconds, under 1% error */
+#define SUB_BITS        7
+#define SUB_COUNT       (1 << SUB_BITS)
+#define MAX_SHIFT       33
+#define HIST_SIZE       ((MAX_SHIFT + 2) * SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HIST_SIZE];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+typedef struct {
+    char *request;          /* the whole request, built once */
+    size_t len;
+    int weight;
+} path_t;
+
+enum { PARSE_HEAD, PARSE_BODY, PARSE_CHUNK_SIZE, PARSE_CHUNK_DATA, PARSE_TRAILER, PARSE_UNTIL_CLOSE };
+
+typedef struct {
+    int fd;
+    int connecting;
+    int closing;            /* the response said Connection: close */
+    
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int want_write;
+    
+    char in[READ_SIZE];
+    size_t in_len;
+    int parse;
+    int status;
+    uint64_t body_left;
+    
+    /* Requests in flight, oldest first: when due and when written */
+    uint64_t due[MAX_PIPELINE];
+    uint64_t sent[MAX_PIPELINE];
+    int head;
+    int inflight;
+    
+    uint64_t next_due;      /* open workload: the next request's due time */
+} bench_conn_t;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    int epfd;
+    bench_conn_t *conns;
+    int nconns;
+    uint64_t interval;      /* open workload: nsec between requests per connection */
+    uint32_t rng;
+    
+    histogram_t hist;
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t status[6];     /* 1xx..5xx, then anything else */
+    uint64_t connect_errors;
+    uint64_t read_errors;
+    uint64_t timeouts;
+    uint64_t lost;          /* in flight when the connection closed */
+    uint64_t reconnects;
+    
+    /* Every request queued is answered, lost, timed out or left in flight at the end */
+    uint64_t sent;
+    uint64_t answered;
+    uint64_t outstanding;
+} bench_thread_t;
+
+static struct {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char host[256];
+    int threads;
+    int connections;
+    int duration;
+    double rate;
+    int pipeline;
+    int keepalive;
+    int timeout;            /* msec */
+    int json;
+    const char *headers[MAX_HEADERS];
+    int nheaders;
+    path_t paths[MAX_PATHS];
+    int npaths;
+    int total_weight;
+} opts = {
+    .threads = 1,
+    .connections = 10,
+    .duration = 10,
+    .pipeline = 1,
+    .keepalive = 1,
+    .timeout = 5000,
+};
+
+static uint64_t start_ns;
+static uint64_t end_ns;
+static volatile sig_atomic_t stop;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < SUB_COUNT) return (int)v;
+    
+    int shift = 63 - __builtin_clzll(v) - SUB_BITS;
+    if (shift > MAX_SHIFT) return HIST_SIZE - 1;
+    return shift * SUB_COUNT + (int)(v >> shift);
+}
+
+/* The highest value that lands in the bucket */
+static uint64_t hist_value(int index) {
+    if (index < 2 * SUB_COUNT) return index;
+    
+    int shift = index / SUB_COUNT - 1;
+    return ((uint64_t)(index - shift * SUB_COUNT) << shift) + ((1ULL << shift) - 1);
+}
+
+static void hist_record(histogram_t *h, uint64_t usec) {
+    h->counts[hist_index(usec)]++;
+    h->total++;
+    h->sum += usec;
+    if (usec > h->max) h->max = usec;
+}
+
+static void hist_merge(histogram_t *to, const histogram_t *from) {
+    for (int i = 0; i < HIST_SIZE; i++) to->counts[i] += from->counts[i];
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->max > to->max) to->max = from->max;
+}
+
+static uint64_t hist_percentile(const histogram_t *h, double p) {
+    if (h->total == 0) return 0;
+    
+    uint64_t want = (uint64_t)(p / 100.0 * h->total + 0.5);
+    if (want < 1) want = 1;
+    
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen >= want) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static int add_path(const char *path, int weight) {
+    if (opts.npaths == MAX_PATHS || weight <= 0 || path[0] != '/') return -1;
+    
+    char buf[8192];
+    int n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\n", path, opts.host);
+    for (int i = 0; i < opts.nheaders && n < (int)sizeof(buf); i++) {
+        n += snprintf(buf + n, sizeof(buf) - n, "%s\r\n", opts.headers[i]);
+    }
+    if (n < (int)sizeof(buf)) {
+        n += snprintf(buf + n, sizeof(buf) - n, "%s\r\n", opts.keepalive ? "" : "Connection: close\r\n");
+    }
+    if (n >= (int)sizeof(buf)) return -1;
+    
+    path_t *p = &opts.paths[opts.npaths++];
+    p->request = strdup(buf);
+    p->len = n;
+    p->weight = weight;
+    opts.total_weight += weight;
+    return 0;
+}
+
+/* "/path" or "/path=weight" */
+static int add_path_arg(char *arg) {
+    char *eq = strrchr(arg, '=');
+    int weight = 1;
+    
+    if (eq && eq > strrchr(arg, '/')) {
+        *eq = '\0';
+        weight = atoi(eq + 1);
+    }
+    return add_path(arg, weight);
+}
+
+static int load_mix(const char *file) {
+    FILE *fp = fopen(file, "r");
+    if (!fp) return -1;
+    
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        char path[4096];
+        int weight;
+        if (line[0] == '#' || sscanf(line, "%d %4095s", &weight, path) != 2) continue;
+        if (add_path(path, weight) < 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    
+    fclose(fp);
+    return 0;
+}
+
+/* host:port, [v6]:port or unix:/path */
+static int resolve(const char *address) {
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un *sun = (struct sockaddr_un*)&opts.addr;
+        sun->sun_family = AF_UNIX;
+        if (strlen(address + 5) >= sizeof(sun->sun_path)) return -1;
+        strcpy(sun->sun_path, address + 5);
+        opts.addrlen = sizeof(struct sockaddr_un);
+        snprintf(opts.host, sizeof(opts.host), "localhost");
+        return 0;
+    }
+    
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (!colon || colon == address || (size_t)(colon - address) >= sizeof(host)) return -1;
+    
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    snprintf(opts.host, sizeof(opts.host), "%s", address);
+    
+    char *name = host;
+    if (host[0] == '[') {
+        name++;
+        char *close = strchr(name, ']');
+        if (close) *close = '\0';
+    }
+    
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(name, colon + 1, &hints, &res) != 0) return -1;
+    memcpy(&opts.addr, res->ai_addr, res->ai_addrlen);
+    opts.addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static const path_t* pick_path(bench_thread_t *t) {
+    if (opts.npaths == 1) return &opts.paths[0];
+    
+    /* xorshift32 */
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 17;
+    t->rng ^= t->rng << 5;
+    
+    int r = t->rng % opts.total_weight;
+    for (int i = 0; i < opts.npaths; i++) {
+        r -= opts.paths[i].weight;
+        if (r < 0) return &opts.paths[i];
+    }
+    return &opts.paths[0];
+}
+
+static void set_events(bench_thread_t *t, bench_conn_t *c, int op) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | (c->connecting || c->out_len ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+    c->want_write = (ev.events & EPOLLOUT) != 0;
+    epoll_ctl(t->epfd, op, c->fd, &ev);
+}
+
+static int open_conn(bench_thread_t *t, bench_conn_t *c) {
+    c->fd = socket(opts.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        t->connect_errors++;
+        return -1;
+    }
+    
+    if (opts.addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    
+    c->connecting = 1;
+    if (connect(c->fd, (struct sockaddr*)&opts.addr, opts.addrlen) < 0 && errno != EINPROGRESS) {
+        t->connect_errors++;
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    
+    c->closing = 0;
+    c->out_len = 0;
+    c->in_len = 0;
+    c->parse = PARSE_HEAD;
+    c->head = 0;
+    c->inflight = 0;
+    set_events(t, c, EPOLL_CTL_ADD);
+    return 0;
+}
+
+/* Requests still in flight are counted in unanswered; in an open workload they are sent again */
+static void close_conn(bench_thread_t *t, bench_conn_t *c, uint64_t *unanswered, int reopen) {
+    if (c->fd >= 0) {
+        epoll_ctl(t->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    
+    if (c->inflight > 0 && opts.rate > 0 && c->due[c->head] < c->next_due) {
+        c->next_due = c->due[c->head];
+    }
+    *unanswered += c->inflight;
+    c->inflight = 0;
+    
+    if (reopen && !stop) {
+        t->reconnects++;
+        open_conn(t, c);
+    }
+}
+
+static int queue_request(bench_thread_t *t, bench_conn_t *c, uint64_t due) {
+    const path_t *p = pick_path(t);
+    
+    if (c->out_len + p->len > c->out_cap) {
+        size_t cap = (c->out_len + p->len) * 2;
+        char *out = realloc(c->out, cap);
+        if (!out) return -1;
+        c->out = out;
+        c->out_cap = cap;
+    }
+    
+    memcpy(c->out + c->out_len, p->request, p->len);
+    c->out_len += p->len;
+    
+    int slot = (c->head + c->inflight) % MAX_PIPELINE;
+    c->due[slot] = due;
+    c->sent[slot] = now_ns();
+    c->inflight++;
+    t->sent++;
+    return 0;
+}
+
+static void flush_conn(bench_thread_t *t, bench_conn_t *c) {
+    while (c->out_len > 0) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) break;
+            t->read_errors++;
+            close_conn(t, c, &t->lost, 1);
+            return;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+    
+    if (c->want_write != (c->out_len > 0)) set_events(t, c, EPOLL_CTL_MOD);
+}
+
+/* Fill the pipeline: up to -p requests, and in an open workload only those due */
+static void send_requests(bench_thread_t *t, bench_conn_t *c, uint64_t now) {
+    if (c->fd < 0 || c->connecting || c->closing) return;
+    
+    int depth = opts.keepalive ? opts.pipeline : 1;
+    int queued = 0;
+    
+    while (c->inflight < depth) {
+        uint64_t due = now;
+        if (opts.rate > 0) {
+            if (c->next_due > now) break;
+            due = c->next_due;
+            c->next_due += t->interval;
+        }
+        if (queue_request(t, c, due) < 0) break;
+        queued = 1;
+    }
+    
+    if (queued) flush_conn(t, c);
+}
+
+static void response_done(bench_thread_t *t, bench_conn_t *c, int status) {
+    uint64_t now = now_ns();
+    
+    if (c->inflight == 0) return;
+    t->answered++;
+    
+    if (now <= end_ns) {
+        uint64_t due = c->due[c->head];
+        hist_record(&t->hist, now > due ? (now - due) / 1000 : 0);
+        t->requests++;
+        t->status[status >= 100 && status < 600 ? status / 100 - 1 : 5]++;
+    }
+    
+    c->head = (c->head + 1) % MAX_PIPELINE;
+    c->inflight--;
+}
+
+static uint64_t header_value(const char *head, size_t len, const char *name) {
+    size_t nlen = strlen(name);
+    
+    for (const char *p = head; p && p < head + len; ) {
+        const char *eol = memmem(p, head + len - p, "\r\n", 2);
+        if (!eol) break;
+        if ((size_t)(eol - p) > nlen && strncasecmp(p, name, nlen) == 0) {
+            return strtoull(p + nlen, NULL, 10);
+        }
+        p = eol + 2;
+    }
+    return UINT64_MAX;
+}
+
+static int header_has(const char *head, size_t len, const char *line) {
+    size_t llen = strlen(line);
+    
+    for (const char *p = head; p + llen <= head + len; p++) {
+        p = memmem(p, head + len - p, "\r\n", 2);
+        if (!p || p + 2 + llen > head + len) return 0;
+        if (strncasecmp(p + 2, line, llen) == 0) return 1;
+    }
+    return 0;
+}
+
+/* Parse as many responses as the buffer holds; bodies are skipped, not kept */
+static int parse_responses(bench_thread_t *t, bench_conn_t *c) {
+    size_t pos = 0;
+    
+    while (pos < c->in_len) {
+        char *data = c->in + pos;
+        size_t avail = c->in_len - pos;
+        
+        if (c->parse == PARSE_HEAD) {
+            char *end = memmem(data, avail, "\r\n\r\n", 4);
+            if (!end) {
+                if (avail == sizeof(c->in)) return -1;
+                break;
+            }
+            
+            size_t hlen = end - data + 4;
+            if (avail < 12 || strncmp(data, "HTTP/1.", 7) != 0) return -1;
+            c->status = atoi(data + 9);
+            
+            if (header_has(data, hlen, "Connection: close")) c->closing = 1;
+            
+            uint64_t length = header_value(data, hlen, "Content-Length:");
+            if (header_has(data, hlen, "Transfer-Encoding: chunked")) {
+                c->parse = PARSE_CHUNK_SIZE;
+            } else if (length != UINT64_MAX) {
+                c->body_left = length;
+                c->parse = PARSE_BODY;
+            } else if (c->status == 204 || c->status == 304 || c->status < 200) {
+                c->body_left = 0;
+                c->parse = PARSE_BODY;
+            } else {
+                c->parse = PARSE_UNTIL_CLOSE;
+            }
+            pos += hlen;
+            
+            if (c->parse == PARSE_BODY && c->body_left == 0) {
+                c->parse = PARSE_HEAD;
+                response_done(t, c, c->status);
+            }
+        } else if (c->parse == PARSE_BODY || c->parse == PARSE_CHUNK_DATA) {
+            size_t n = avail < c->body_left ? avail : c->body_left;
+            pos += n;
+            c->body_left -= n;
+            
+            if (c->body_left == 0) {
+                if (c->parse == PARSE_CHUNK_DATA) {
+                    c->parse = PARSE_CHUNK_SIZE;
+                } else {
+                    c->parse = PARSE_HEAD;
+                    response_done(t, c, c->status);
+                }
+            }
+        } else if (c->parse == PARSE_CHUNK_SIZE || c->parse == PARSE_TRAILER) {
+            char *eol = memmem(data, avail, "\r\n", 2);
+            if (!eol) break;
+            
+            if (c->parse == PARSE_TRAILER) {
+                if (eol == data) {
+                    c->parse = PARSE_HEAD;
+                    response_done(t, c, c->status);
+                }
+            } else {
+                uint64_t size = strtoull(data, NULL, 16);
+                if (size == 0) {
+                    c->parse = PARSE_TRAILER;
+                } else {
+                    c->body_left = size + 2;
+                    c->parse = PARSE_CHUNK_DATA;
+                }
+            }
+            pos = eol + 2 - c->in;
+        } else {
+            /* Body delimited by the close */
+            pos = c->in_len;
+        }
+    }
+    
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return 0;
+}
+
+static void handle_read(bench_thread_t *t, bench_conn_t *c) {
+    while (c->fd >= 0) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EINTR) return;
+            t->read_errors++;
+            close_conn(t, c, &t->lost, 1);
+            return;
+        }
+        
+        if (n == 0) {
+            if (c->parse == PARSE_UNTIL_CLOSE) {
+                c->parse = PARSE_HEAD;
+                response_done(t, c, c->status);
+            }
+            /* Requests pipelined behind an announced close are lost, not failed reads */
+            if (c->inflight > 0 && !c->closing) t->read_errors++;
+            close_conn(t, c, &t->lost, 1);
+            return;
+        }
+        
+        t->bytes += n;
+        c->in_len += n;
+        
+        if (parse_responses(t, c) < 0) {
+            t->read_errors++;
+            close_conn(t, c, &t->lost, 1);
+            return;
+        }
+        
+        if (c->inflight == 0 && c->closing) {
+            close_conn(t, c, &t->lost, 1);
+            return;
+        }
+    }
+}
+
+static void handle_event(bench_thread_t *t, bench_conn_t *c, uint32_t events) {
+    if (c->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        
+        if (err || (events & (EPOLLERR | EPOLLHUP))) {
+            t->connect_errors++;
+            close_conn(t, c, &t->lost, 0);
+            return;
+        }
+        
+        c->connecting = 0;
+        set_events(t, c, EPOLL_CTL_MOD);
+        send_requests(t, c, now_ns());
+        return;
+    }
+    
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) handle_read(t, c);
+    if (c->fd >= 0 && (events & EPOLLOUT)) flush_conn(t, c);
+}
+
+/* Close connections whose oldest request has waited longer than -T, and retry failed connects */
+static void check_conns(bench_thread_t *t) {
+    uint64_t now = now_ns();
+    
+    for (int i = 0; i < t->nconns; i++) {
+        bench_conn_t *c = &t->conns[i];
+        
+        if (c->fd < 0) {
+            if (!stop) open_conn(t, c);
+            continue;
+        }
+        
+        if (c->inflight > 0 && now - c->sent[c->head] > (uint64_t)opts.timeout * 1000000) {
+            close_conn(t, c, &t->timeouts, 1);
+        }
+    }
+}
+
+static void* thread_main(void *arg) {
+    bench_thread_t *t = arg;
+    struct epoll_event events[256];
+    uint64_t last_check = now_ns();
+    
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (t->epfd < 0) return NULL;
+    
+    for (int i = 0; i < t->nconns; i++) {
+        bench_conn_t *c = &t->conns[i];
+        c->fd = -1;
+        
+        /* Spread the connections' schedules over one interval */
+        c->next_due = start_ns + t->interval * (i * opts.threads + t->id) / opts.connections;
+        open_conn(t, c);
+    }
+    
+    while (!stop) {
+        uint64_t now = now_ns();
+        if (now >= end_ns) break;
+        
+        int timeout = 100;
+        if (opts.rate > 0) {
+            int depth = opts.keepalive ? opts.pipeline : 1;
+            uint64_t next = end_ns;
+            for (int i = 0; i < t->nconns; i++) {
+                bench_conn_t *c = &t->conns[i];
+                if (c->fd >= 0 && !c->connecting && !c->closing && c->inflight < depth &&
+                    c->next_due < next) {
+                    next = c->next_due;
+                }
+            }
+            timeout = next > now ? (int)((next - now) / 1000000) : 0;
+            if (timeout > 100) timeout = 100;
+        }
+        
+        int n = epoll_wait(t->epfd, events, 256, timeout);
+        if (n < 0 && errno != EINTR) break;
+        
+        for (int i = 0; i < n; i++) {
+            handle_event(t, events[i].data.ptr, events[i].events);
+        }
+        
+        now = now_ns();
+        for (int i = 0; i < t->nconns; i++) {
+            send_requests(t, &t->conns[i], now);
+        }
+        
+        if (now - last_check > 100000000) {
+            last_check = now;
+            check_conns(t);
+        }
+    }
+    
+    for (int i = 0; i < t->nconns; i++) {
+        if (t->conns[i].fd >= 0) close(t->conns[i].fd);
+        t->outstanding += t->conns[i].inflight;
+        free(t->conns[i].out);
+    }
+    close(t->epfd);
+    return NULL;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options] host:port | unix:/path [path[=weight]...]\n"
+            "  -t N      threads (1)\n"
+            "  -c N      connections, spread over the threads (10)\n"
+            "  -d SEC    duration (10)\n"
+            "  -R RATE   open workload at RATE requests/s; default is closed\n"
+            "  -p N      requests in flight per connection (1)\n"
+            "  -n        no keepalive: Connection: close, one request per connection\n"
+            "  -m FILE   request mix, \"weight path\" per line\n"
+            "  -H LINE   extra request header, may be repeated\n"
+            "  -T MSEC   response timeout (5000)\n"
+            "  -j        print the results as JSON\n", name);
+}
+
+static void report(bench_thread_t *threads, double elapsed) {
+    histogram_t *h = calloc(1, sizeof(histogram_t));
+    uint64_t requests = 0, bytes = 0, status[6] = { 0 };
+    uint64_t connect_errors = 0, read_errors = 0, timeouts = 0, lost = 0, reconnects = 0;
+    
+    if (!h) return;
+    
+    for (int i = 0; i < opts.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        hist_merge(h, &t->hist);
+        requests += t->requests;
+        bytes += t->bytes;
+        for (int s = 0; s < 6; s++) status[s] += t->status[s];
+        connect_errors += t->connect_errors;
+        read_errors += t->read_errors;
+        timeouts += t->timeouts;
+        lost += t->lost;
+        reconnects += t->reconnects;
+    }
+    
+    double rps = requests / elapsed;
+    double mean = h->total ? (double)h->sum / h->total : 0;
+    uint64_t non2xx = requests - status[1];
+    
+    if (opts.json) {
+        printf("{\"threads\":%d,\"connections\":%d,\"duration\":%.3f,\"rate\":%.0f,"
+               "\"pipeline\":%d,\"keepalive\":%s,\"requests\":%llu,\"bytes\":%llu,"
+               "\"rps\":%.1f,\"mbps\":%.2f,\"latency_us\":{\"mean\":%.1f,\"p50\":%llu,"
+               "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+               "\"non_2xx\":%llu,\"errors\":{\"connect\":%llu,\"read\":%llu,\"timeout\":%llu,\"lost\":%llu},"
+               "\"reconnects\":%llu}\n",
+               opts.threads, opts.connections, elapsed, opts.rate, opts.pipeline,
+               opts.keepalive ? "true" : "false", (unsigned long long)requests,
+               (unsigned long long)bytes, rps, bytes / elapsed / 1e6, mean,
+               (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+               (unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+               (unsigned long long)h->max, (unsigned long long)non2xx,
+               (unsigned long long)connect_errors, (unsigned long long)read_errors,
+               (unsigned long long)timeouts, (unsigned long long)lost, (unsigned long long)reconnects);
+        free(h);
+        return;
+    }
+    
+    printf("%d threads, %d connections, %.1fs, %s workload%s, pipeline %d\n",
+           opts.threads, opts.connections, elapsed, opts.rate > 0 ? "open" : "closed",
+           opts.keepalive ? "" : " without keepalive", opts.pipeline);
+    printf("  requests    %llu (%.1f/s)\n", (unsigned long long)requests, rps);
+    printf("  transfer    %.2f MB/s\n", bytes / elapsed / 1e6);
+    printf("  latency     mean %.0fus  p50 %lluus  p90 %lluus  p99 %lluus  p99.9 %lluus  max %lluus\n",
+           mean, (unsigned long long)hist_percentile(h, 50), (unsigned long long)hist_percentile(h, 90),
+           (unsigned long long)hist_percentile(h, 99), (unsigned long long)hist_percentile(h, 99.9),
+           (unsigned long long)h->max);
+    printf("  responses   1xx %llu  2xx %llu  3xx %llu  4xx %llu  5xx %llu  other %llu\n",
+           (unsigned long long)status[0], (unsigned long long)status[1], (unsigned long long)status[2],
+           (unsigned long long)status[3], (unsigned long long)status[4], (unsigned long long)status[5]);
+    printf("  errors      connect %llu  read %llu  timeout %llu  lost %llu  (reconnects %llu)\n",
+           (unsigned long long)connect_errors, (unsigned long long)read_errors,
+           (unsigned long long)timeouts, (unsigned long long)lost, (unsigned long long)reconnects);
+    free(h);
+}
+
+int main(int argc, char **argv) {
+    const char *mix = NULL;
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "t:c:d:R:p:nm:H:T:jh")) != -1) {
+        switch (opt) {
+            case 't': opts.threads = atoi(optarg); break;
+            case 'c': opts.connections = atoi(optarg); break;
+            case 'd': opts.duration = atoi(optarg); break;
+            case 'R': opts.rate = atof(optarg); break;
+            case 'p': opts.pipeline = atoi(optarg); break;
+            case 'n': opts.keepalive = 0; break;
+            case 'm': mix = optarg; break;
+            case 'H':
+                if (opts.nheaders < MAX_HEADERS) opts.headers[opts.nheaders++] = optarg;
+                break;
+            case 'T': opts.timeout = atoi(optarg); break;
+            case 'j': opts.json = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    
+    if (optind >= argc || opts.threads < 1 || opts.connections < opts.threads ||
+        opts.duration < 1 || opts.pipeline < 1 || opts.pipeline > MAX_PIPELINE ||
+        opts.rate < 0 || opts.timeout < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    if (resolve(argv[optind]) < 0) {
+        fprintf(stderr, "Cannot resolve %s\n", argv[optind]);
+        return 1;
+    }
+    
+    for (int i = optind + 1; i < argc; i++) {
+        if (add_path_arg(argv[i]) < 0) {
+            fprintf(stderr, "Invalid path %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (mix && load_mix(mix) < 0) {
+        fprintf(stderr, "Cannot read request mix %s\n", mix);
+        return 1;
+    }
+    if (opts.npaths == 0) add_path("/", 1);
+    
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    
+    bench_thread_t *threads = calloc(opts.threads, sizeof(bench_thread_t));
+    if (!threads) return 1;
+    
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t)opts.duration * 1000000000ULL;
+    
+    for (int i = 0; i < opts.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        t->id = i;
+        t->rng = 0x9e3779b9u * (i + 1);
+        t->nconns = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+        t->conns = calloc(t->nconns, sizeof(bench_conn_t));
+        if (!t->conns) return 1;
+        
+        /* Each connection's share of the rate */
+        if (opts.rate > 0) t->interval = (uint64_t)(1e9 * opts.connections / opts.rate);
+        
+        if (pthread_create(&t->tid, NULL, thread_main, t) != 0) {
+            fprintf(stderr, "Failed to start thread %d\n", i);
+            return 1;
+        }
+    }
+    
+    for (int i = 0; i < opts.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+    
+    uint64_t finished = now_ns();
+    if (finished > end_ns) finished = end_ns;
+    report(threads, (finished - start_ns) / 1e9);
+    
+    /* A response that matched no request, or a request that vanished, means the counts above are wrong */
+    uint64_t sent = 0, accounted = 0;
+    for (int i = 0; i < opts.threads; i++) {
+        bench_thread_t *t = &threads[i];
+        sent += t->sent;
+        accounted += t->answered + t->lost + t->timeouts + t->outstanding;
+    }
+    
+    for (int i = 0; i < opts.threads; i++) free(threads[i].conns);
+    free(threads);
+    
+    if (sent != accounted) {
+        fprintf(stderr, "%llu requests sent, %llu answered, lost or in flight\n",
+                (unsigned long long)sent, (unsigned long long)accounted);
+        return 1;
+    }
+    return 0;
+}
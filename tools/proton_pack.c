@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "http.h"
+#include "bundle.h"
+
+/*
+ * Packs a directory tree into one static_bundle file for mod_static:
+ *
+ *   proton-pack -z public/ /var/lib/proton/site.bundle
+ *
+ * Every regular file becomes an entry under its path from the top of the
+ * tree, and each index.html is also the entry of its directory ("/docs/").
+ * The response headers (Content-Type, a content-hash ETag, Last-Modified)
+ * are formatted here once. With -z, files that gzip well get a gzip
+ * variant, served to clients that accept it. The bundle is written next to
+ * the output and renamed over it, so a running server can be pointed at
+ * the new one with a reload while the old one is still being served.
+ */
+
+/* What proton.c defines for the server, linked for proton_http_mime_type */
+volatile sig_atomic_t proton_quit = 0;
+volatile sig_atomic_t proton_reload = 0;
+volatile sig_atomic_t proton_reopen = 0;
+volatile sig_atomic_t proton_shutdown = 0;
+volatile sig_atomic_t proton_upgrade = 0;
+pid_t proton_pid;
+const char *proton_config_file = "proton.conf";
+char **proton_argv;
+
+#define MAX_SEED        (1 << 20)
+#define GZIP_MIN        256     /* smaller files are not worth a variant */
+
+typedef struct {
+    char *path;             /* URL path */
+    char *file;             /* on disk; NULL for a directory's index.html */
+    int target;             /* the entry a directory index shares, or -1 */
+    time_t mtime;
+    char etag[24];
+    uint32_t bucket;
+    proton_bundle_entry_t e;
+} item_t;
+
+static item_t *items = NULL;
+static size_t nitems = 0;
+static size_t items_cap = 0;
+static size_t root_len = 0;
+static int gzip_level = 0;
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options] directory bundle\n"
+            "  -z        add gzip variants where they save at least 10%%\n"
+            "  -l LEVEL  gzip level for -z (9)\n", name);
+}
+
+static item_t* add_item(const char *path, const char *file, time_t mtime) {
+    if (nitems == items_cap) {
+        items_cap = items_cap ? items_cap * 2 : 1024;
+        item_t *grown = realloc(items, items_cap * sizeof(item_t));
+        if (!grown) return NULL;
+        items = grown;
+    }
+    
+    item_t *it = &items[nitems++];
+    memset(it, 0, sizeof(*it));
+    it->path = strdup(path);
+    it->file = file ? strdup(file) : NULL;
+    it->target = -1;
+    it->mtime = mtime;
+    
+    if (!it->path || (file && !it->file)) return NULL;
+    return it;
+}
+
+static int walk(const char *fpath, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+    
+    const char *path = fpath + root_len;
+    if (!add_item(path, fpath, st->st_mtime)) return -1;
+    
+    /* The directory itself serves its index.html */
+    const char *base = strrchr(path, '/');
+    if (strcmp(base, "/index.html") == 0) {
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%.*s", (int)(base - path + 1), path);
+        item_t *alias = add_item(dir, NULL, st->st_mtime);
+        if (!alias) return -1;
+        alias->target = nitems - 2;
+    }
+    
+    return 0;
+}
+
+static int by_bucket_size(const void *a, const void *b, void *sizes) {
+    uint32_t sa = ((uint32_t*)sizes)[*(const uint32_t*)a];
+    uint32_t sb = ((uint32_t*)sizes)[*(const uint32_t*)b];
+    if (sa != sb) return sa > sb ? -1 : 1;
+    return *(const uint32_t*)a < *(const uint32_t*)b ? -1 : 1;
+}
+
+/* Hash and displace: the largest buckets pick their seeds first */
+static int build_index(uint32_t nbuckets, uint32_t nslots, uint32_t *seeds, uint32_t *slots) {
+    uint32_t *sizes = calloc(nbuckets, sizeof(uint32_t));
+    uint32_t *order = malloc(nbuckets * sizeof(uint32_t));
+    uint32_t *first = malloc((nbuckets + 1) * sizeof(uint32_t));
+    uint32_t *members = malloc(nitems * sizeof(uint32_t));
+    uint32_t *taken = calloc(nslots, sizeof(uint32_t));
+    int ret = 0;
+    
+    if (!sizes || !order || !first || !members || !taken) {
+        ret = -1;
+        goto done;
+    }
+    
+    for (size_t i = 0; i < nitems; i++) {
+        items[i].bucket = proton_bundle_hash(items[i].path, strlen(items[i].path), 0) % nbuckets;
+        sizes[items[i].bucket]++;
+    }
+    
+    first[0] = 0;
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        first[b + 1] = first[b] + sizes[b];
+        order[b] = b;
+    }
+    
+    uint32_t *fill = calloc(nbuckets, sizeof(uint32_t));
+    if (!fill) {
+        ret = -1;
+        goto done;
+    }
+    for (size_t i = 0; i < nitems; i++) {
+        uint32_t b = items[i].bucket;
+        members[first[b] + fill[b]++] = i;
+    }
+    free(fill);
+    
+    qsort_r(order, nbuckets, sizeof(uint32_t), by_bucket_size, sizes);
+    
+    for (uint32_t s = 0; s < nslots; s++) {
+        slots[s] = PROTON_BUNDLE_EMPTY;
+    }
+    
+    /* taken[] holds the attempt that last claimed a slot, so no clearing */
+    uint32_t attempt = 0;
+    for (uint32_t k = 0; k < nbuckets && sizes[order[k]] > 0; k++) {
+        uint32_t b = order[k];
+        uint32_t seed;
+        
+        for (seed = 1; seed < MAX_SEED; seed++) {
+            attempt++;
+            uint32_t m;
+            
+            for (m = first[b]; m < first[b + 1]; m++) {
+                item_t *it = &items[members[m]];
+                uint32_t s = proton_bundle_hash(it->path, strlen(it->path), seed) % nslots;
+                if (slots[s] != PROTON_BUNDLE_EMPTY || taken[s] == attempt) break;
+                taken[s] = attempt;
+            }
+            
+            if (m == first[b + 1]) break;
+        }
+        
+        if (seed == MAX_SEED) {
+            ret = -1;
+            goto done;
+        }
+        
+        seeds[b] = seed;
+        for (uint32_t m = first[b]; m < first[b + 1]; m++) {
+            item_t *it = &items[members[m]];
+            slots[proton_bundle_hash(it->path, strlen(it->path), seed) % nslots] = members[m];
+        }
+    }
+
+done:
+    free(sizes);
+    free(order);
+    free(first);
+    free(members);
+    free(taken);
+    return ret;
+}
+
+static char* read_file(const char *file, size_t *len) {
+    FILE *fp = fopen(file, "rb");
+    if (!fp) return NULL;
+    
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0) {
+        fclose(fp);
+        return NULL;
+    }
+    
+    char *data = malloc(st.st_size ? st.st_size : 1);
+    if (data && fread(data, 1, st.st_size, fp) != (size_t)st.st_size) {
+        free(data);
+        data = NULL;
+    }
+    
+    fclose(fp);
+    *len = st.st_size;
+    return data;
+}
+
+static char* gzip_data(const char *data, size_t len, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    
+    /* windowBits 31: a gzip wrapper rather than zlib's */
+    if (deflateInit2(&zs, gzip_level, Z_DEFLATED, 31, 9, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    
+    size_t cap = deflateBound(&zs, len);
+    char *out = malloc(cap);
+    if (!out) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    
+    zs.next_in = (unsigned char*)data;
+    zs.avail_in = len;
+    zs.next_out = (unsigned char*)out;
+    zs.avail_out = cap;
+    
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+static int write_at(FILE *out, uint64_t *offset, const void *data, size_t len) {
+    *offset = ftello(out);
+    return len == 0 || fwrite(data, 1, len, out) == len ? 0 : -1;
+}
+
+/* The contents of a file and its gzip variant */
+static int pack_file(FILE *out, item_t *it) {
+    size_t len;
+    char *data = read_file(it->file, &len);
+    if (!data) {
+        fprintf(stderr, "Cannot read %s: %s\n", it->file, strerror(errno));
+        return -1;
+    }
+    
+    it->e.data_len = len;
+    int ret = write_at(out, &it->e.data, data, len);
+    
+    /* Same content, same ETag, whatever the mtime after a deploy */
+    snprintf(it->etag, sizeof(it->etag), "\"%016llx\"",
+             (unsigned long long)proton_bundle_hash(data, len, 0));
+    
+    if (ret == 0 && gzip_level && len >= GZIP_MIN) {
+        size_t gz_len;
+        char *gz = gzip_data(data, len, &gz_len);
+        
+        if (gz && gz_len < len - len / 10) {
+            it->e.gzip_len = gz_len;
+            ret = write_at(out, &it->e.gzip, gz, gz_len);
+        }
+        free(gz);
+    }
+    
+    free(data);
+    return ret;
+}
+
+/* Path, ETag and both header blocks of an entry; type is the file's name */
+static int pack_strings(FILE *out, item_t *it, const char *type) {
+    char modified[64];
+    struct tm tm;
+    gmtime_r(&it->mtime, &tm);
+    strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    
+    /* The gzip block is the same lines and Content-Encoding, right after */
+    char headers[2048];
+    int n = snprintf(headers, sizeof(headers) / 2,
+                     "Content-Type: %s\r\nETag: %s\r\nLast-Modified: %s\r\n%s",
+                     proton_http_mime_type(type), it->etag, modified,
+                     it->e.gzip_len ? "Vary: Accept-Encoding\r\n" : "");
+    int gzip_n = 0;
+    if (it->e.gzip_len) {
+        memcpy(headers + n, headers, n);
+        gzip_n = n + snprintf(headers + 2 * n, sizeof(headers) - 2 * n, "Content-Encoding: gzip\r\n");
+    }
+    
+    it->e.path_len = strlen(it->path);
+    it->e.etag_len = strlen(it->etag);
+    it->e.headers_len = n;
+    it->e.gzip_headers_len = gzip_n;
+    
+    if (write_at(out, &it->e.path, it->path, it->e.path_len) < 0) return -1;
+    if (write_at(out, &it->e.etag, it->etag, it->e.etag_len) < 0) return -1;
+    return write_at(out, &it->e.headers, headers, n + gzip_n);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    int level = 9;
+    
+    while ((opt = getopt(argc, argv, "zl:h")) != -1) {
+        switch (opt) {
+            case 'z': gzip_level = -1; break;
+            case 'l': level = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    
+    if (argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (gzip_level) gzip_level = level < 1 || level > 9 ? 9 : level;
+    
+    char *root = argv[optind];
+    const char *output = argv[optind + 1];
+    
+    root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/') root[--root_len] = '\0';
+    
+    if (nftw(root, walk, 64, 0) != 0) {
+        fprintf(stderr, "Cannot read %s: %s\n", root, strerror(errno));
+        return 1;
+    }
+    if (nitems == 0) {
+        fprintf(stderr, "No files under %s\n", root);
+        return 1;
+    }
+    
+    /* Slots to spare keep the seed search short */
+    proton_bundle_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PROTON_BUNDLE_MAGIC, 8);
+    header.version = PROTON_BUNDLE_VERSION;
+    header.nentries = nitems;
+    header.nbuckets = nitems / 4 + 1;
+    header.nslots = nitems + nitems / 8 + 1;
+    
+    uint32_t *seeds = calloc(header.nbuckets, sizeof(uint32_t));
+    uint32_t *slots = calloc(header.nslots, sizeof(uint32_t));
+    if (!seeds || !slots || build_index(header.nbuckets, header.nslots, seeds, slots) < 0) {
+        fprintf(stderr, "Cannot build the path index\n");
+        return 1;
+    }
+    
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", output);
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        fprintf(stderr, "Cannot create %s: %s\n", tmp, strerror(errno));
+        return 1;
+    }
+    
+    int failed = fwrite(&header, sizeof(header), 1, out) != 1;
+    uint64_t bytes = 0, gzip_bytes = 0;
+    
+    for (size_t i = 0; i < nitems && !failed; i++) {
+        if (items[i].target >= 0) continue;
+        failed = pack_file(out, &items[i]) < 0;
+        bytes += items[i].e.data_len;
+        gzip_bytes += items[i].e.gzip_len;
+    }
+    
+    for (size_t i = 0; i < nitems && !failed; i++) {
+        item_t *it = &items[i];
+        const char *type = it->path;
+        if (it->target >= 0) {
+            it->e = items[it->target].e;
+            memcpy(it->etag, items[it->target].etag, sizeof(it->etag));
+            type = items[it->target].path;
+        }
+        failed = pack_strings(out, it, type) < 0;
+    }
+    
+    if (!failed) failed = write_at(out, &header.seeds, seeds, header.nbuckets * sizeof(uint32_t)) < 0;
+    if (!failed) failed = write_at(out, &header.slots, slots, header.nslots * sizeof(uint32_t)) < 0;
+    free(seeds);
+    free(slots);
+    
+    header.entries = ftello(out);
+    for (size_t i = 0; i < nitems && !failed; i++) {
+        failed = fwrite(&items[i].e, sizeof(proton_bundle_entry_t), 1, out) != 1;
+    }
+    
+    header.size = ftello(out);
+    if (!failed) failed = fseeko(out, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, out) != 1;
+    if (fclose(out) != 0) failed = 1;
+    
+    if (failed || rename(tmp, output) < 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", output, strerror(errno));
+        unlink(tmp);
+        return 1;
+    }
+    
+    printf("%s: %zu entries, %llu bytes, %llu in gzip variants, %llu total\n", output, nitems,
+           (unsigned long long)bytes, (unsigned long long)gzip_bytes, (unsigned long long)header.size);
+    return 0;
+}